@@ -12,7 +12,7 @@
 #include <thread>
 #include <memory>
 #include "ps/internal/message.h"
-#include "ps/internal/threadsafe_queue.h"
+#include "ps/internal/mpmc_queue.h"
 namespace ps {
 /**
  * \brief The object for communication.
@@ -44,6 +44,12 @@ class Customer {
    */
   ~Customer();
 
+  /**
+   * \brief stop the receiving thread, no message is handled once it returns.
+   * the destructor calls it if it was not
+   */
+  void Stop();
+
   /**
    * \brief return the globally unique application id
    */
@@ -69,9 +75,23 @@ class Customer {
    */
   void WaitRequest(int timestamp);
 
+  /**
+   * \brief return whether the request is finished, without blocking. threadsafe
+   * \param timestamp the timestamp of the request
+   */
+  bool TestRequest(int timestamp);
+
+  /**
+   * \brief wait until one of the requests is finished. threadsafe
+   * \param timestamps the timestamps of the requests, not empty
+   * \return the timestamp of a finished one
+   */
+  int WaitAnyRequest(const std::vector<int>& timestamps);
+
   /**
    * \brief return the number of responses received for the request. threadsafe
    * \param timestamp the timestamp of the request
+   * \return -1 if the request finished so long ago that its slot is reused
    */
   int NumResponse(int timestamp);
 
@@ -89,6 +109,35 @@ class Customer {
   }
 
  private:
+  /** \brief a thread blocked in WaitRequest or WaitAnyRequest */
+  struct Waiter {
+    std::condition_variable cond;
+    int finished = -1;
+  };
+
+  /** \brief the responses of a request, in tracker_ at timestamp & mask */
+  struct Request {
+    int timestamp = -1;
+    int expected = 0;
+    int responses = 0;
+    /** only the threads waiting for this request are woken */
+    std::vector<Waiter*> waiters;
+
+    bool finished() const { return responses >= expected; }
+  };
+
+  /**
+   * \brief the slot of a pending or recently finished request, nullptr if it
+   * was reused, i.e. the request finished. tracker_mu_ is held
+   */
+  Request* FindRequest(int timestamp);
+
+  /** \brief count the responses and wake the waiters. tracker_mu_ is held */
+  void AddResponseLocked(int timestamp, int num);
+
+  /** \brief double the ring until the pending requests fit. tracker_mu_ is held */
+  void GrowTracker();
+
   /**
    * \brief the thread function
    */
@@ -99,12 +148,13 @@ class Customer {
   int customer_id_;
 
   RecvHandle recv_handle_;
-  ThreadsafeQueue<Message> recv_queue_;
+  MPMCQueue<Message> recv_queue_;
   std::unique_ptr<std::thread> recv_thread_;
 
   std::mutex tracker_mu_;
-  std::condition_variable tracker_cond_;
-  std::vector<std::pair<int, int>> tracker_;
+  /** a ring indexed by timestamp, the slot of a finished request is reused */
+  std::vector<Request> tracker_;
+  int next_timestamp_ = 0;
 
   DISALLOW_COPY_AND_ASSIGN(Customer);
 };
@@ -0,0 +1,301 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_INTERNAL_KV_STORE_H_
+#define PS_INTERNAL_KV_STORE_H_
+#include <string.h>
+#include <algorithm>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "ps/base.h"
+#include "ps/internal/reduce.h"
+#include "ps/sarray.h"
+namespace ps {
+
+/**
+ * \brief the values of a server, pushes add into them. a run of consecutive
+ * keys with the same value length, as a worker slices by key range, lives in
+ * one dense array and is added and copied as a whole, the other keys in an
+ * open-addressing hash. a single value of 4 bytes or less lives in the slot
+ * of its key, the others in an arena. a key keeps the length of its first
+ * push. not threadsafe
+ */
+template <typename Val>
+class KVStore {
+ public:
+  KVStore() { slots_.resize(kInitSlots); }
+
+  /**
+   * \brief add vals to the values of keys
+   * \param lens the length of the value of each key, empty for one each
+   */
+  void Push(const SArray<Key>& keys, const SArray<Val>& vals,
+            const SArray<int>& lens) {
+    size_t n = keys.size();
+    if (lens.empty()) {
+      CHECK_EQ(vals.size(), n);
+    } else {
+      CHECK_EQ(lens.size(), n);
+    }
+    size_t pos = 0;
+    for (size_t i = 0; i < n;) {
+      int len = lens.empty() ? 1 : lens[i];
+      size_t j = RunEnd(keys, lens, i);
+      Val* dense = Dense(keys[i], keys[j - 1] + 1, len, true);
+      if (dense) {
+        size_t size = (j - i) * len;
+        CHECK_LE(pos + size, vals.size());
+        Add(dense, vals.data() + pos, size);
+        pos += size;
+      } else {
+        for (; i < j; ++i) {
+          CHECK_LE(pos + len, vals.size());
+          Add(Insert(keys[i], len), vals.data() + pos, len);
+          pos += len;
+        }
+      }
+      i = j;
+    }
+    CHECK_EQ(pos, vals.size()) << "the lens do not match the vals";
+  }
+
+  /**
+   * \brief the values of keys, a key never pushed has a single 0
+   * \param lens filled unless all values are single
+   */
+  void Pull(const SArray<Key>& keys, SArray<Val>* vals, SArray<int>* lens) {
+    size_t n = keys.size();
+    auto& parts = pull_parts_;
+    parts.clear();
+    SArray<int> pulled_lens(n);
+    bool single = true;
+    size_t total = 0;
+    for (size_t i = 0; i < n;) {
+      size_t j = RunEnd(keys, SArray<int>(), i);
+      const Val* dense =
+          dense_len_ ? Dense(keys[i], keys[j - 1] + 1, dense_len_, false)
+                     : nullptr;
+      if (dense) {
+        parts.emplace_back(dense, (j - i) * dense_len_);
+        std::fill(pulled_lens.begin() + i, pulled_lens.begin() + j, dense_len_);
+        total += parts.back().second;
+        single &= dense_len_ == 1;
+        i = j;
+        continue;
+      }
+      for (; i < j; ++i) {
+        int len = 1;
+        const Val* value = Find(keys[i], &len);
+        parts.emplace_back(value, len);
+        pulled_lens[i] = len;
+        total += len;
+        single &= len == 1;
+      }
+    }
+    vals->resize(total);
+    Val* p = vals->data();
+    for (const auto& part : parts) {
+      if (part.first && part.second == 1) {
+        *p = *part.first;
+      } else if (part.first) {
+        memcpy(p, part.first, part.second * sizeof(Val));
+      } else {
+        memset(p, 0, part.second * sizeof(Val));
+      }
+      p += part.second;
+    }
+    if (single) {
+      lens->clear();
+    } else {
+      *lens = pulled_lens;
+    }
+  }
+
+ private:
+  // a single value lives in its slot, a lookup then misses once
+  static const bool kInline = sizeof(Val) <= sizeof(uint32_t);
+
+  /**
+   * \brief a key of the hash, len 0 for an empty slot. 16 bytes, the table
+   * is most of the misses of a lookup
+   */
+  struct Slot {
+    Key key;
+    uint32_t len;
+    union {
+      // of the value in arena_
+      uint32_t offset;
+      typename std::conditional<kInline, Val, uint32_t>::type value;
+    };
+  };
+
+  static const size_t kInitSlots = 1024;
+  // an add of this many values is worth the threads of Reduce
+  static const size_t kReduceValues = 1 << 14;
+  // a dense array grows up to this many values
+  static const size_t kMaxDenseValues = static_cast<size_t>(1) << 31;
+
+  /** \brief the end of the run of consecutive keys with the same len from i */
+  static size_t RunEnd(const SArray<Key>& keys, const SArray<int>& lens,
+                       size_t i) {
+    size_t j = i + 1;
+    while (j < keys.size() && keys[j] == keys[j - 1] + 1 &&
+           (lens.empty() || lens[j] == lens[i])) {
+      ++j;
+    }
+    return j;
+  }
+
+  /** \brief dst += src, vectorized by the compiler or by Reduce if long */
+  static void Add(Val* __restrict dst, const Val* __restrict src, size_t n) {
+    if (ReduceTypeOf<Val>::value && n >= kReduceValues) {
+      ReduceSum(ReduceTypeOf<Val>::type, dst, src, n);
+      return;
+    }
+    for (size_t i = 0; i < n; ++i) dst[i] += src[i];
+  }
+
+  /**
+   * \brief the dense values of [begin, end), nullptr if not all of them are
+   * there. create extends the dense array to them if it is adjacent, has the
+   * same len, and none of them is in the hash yet
+   */
+  Val* Dense(Key begin, Key end, int len, bool create) {
+    if (dense_len_ && begin >= dense_begin_ && end <= dense_end_) {
+      CHECK_EQ(len, dense_len_) << "the value length of key " << begin
+                                << " changed";
+      return &dense_[(begin - dense_base_) * dense_len_];
+    }
+    if (!create) return nullptr;
+    if (dense_len_ && (len != dense_len_ || end < dense_begin_ ||
+                       begin > dense_end_)) {
+      return nullptr;
+    }
+    Key new_begin = dense_len_ ? std::min(begin, dense_begin_) : begin;
+    Key new_end = dense_len_ ? std::max(end, dense_end_) : end;
+    if (new_end - new_begin > kMaxDenseValues / len) return nullptr;
+    if (num_keys_) {
+      for (Key key = begin; key < end; ++key) {
+        if (slots_[Probe(key)].len) return nullptr;
+      }
+    }
+    if (!dense_len_) {
+      dense_len_ = len;
+      dense_base_ = dense_begin_ = dense_end_ = begin;
+    }
+    Key capacity = dense_.size() / len;
+    if (new_begin < dense_base_ || new_end - dense_base_ > capacity) {
+      // double, with the headroom on the side it grows to, so that adjacent
+      // pushes in either order copy each value O(1) times
+      Key need = new_end - new_begin;
+      capacity = std::max(need, std::min<Key>(2 * capacity,
+                                              kMaxDenseValues / len));
+      Key front = new_begin < dense_begin_ ? capacity - need : 0;
+      front = std::min(front, new_begin);
+      capacity = std::min(capacity, ~Key(0) - (new_begin - front));
+      std::vector<Val> grown(capacity * len, 0);
+      std::copy(dense_.begin() + (dense_begin_ - dense_base_) * len,
+                dense_.begin() + (dense_end_ - dense_base_) * len,
+                grown.begin() + (dense_begin_ - (new_begin - front)) * len);
+      dense_.swap(grown);
+      dense_base_ = new_begin - front;
+    }
+    // the headroom stays zeros, so these start at zero too
+    dense_begin_ = new_begin;
+    dense_end_ = new_end;
+    return &dense_[(begin - dense_base_) * len];
+  }
+
+  /** \brief the first slot of the probe of key */
+  size_t Hash(Key key) const {
+    return (static_cast<uint64_t>(key) * 0x9E3779B97F4A7C15ull) >> 32 &
+           (slots_.size() - 1);
+  }
+
+  /** \brief the slot of key in the hash, or the empty one it would take */
+  size_t Probe(Key key) const {
+    size_t mask = slots_.size() - 1;
+    size_t i = Hash(key);
+    while (slots_[i].len && slots_[i].key != key) i = (i + 1) & mask;
+    return i;
+  }
+
+  /** \brief the value of the key of a full slot */
+  Val* Value(Slot* slot) {
+    if (kInline && slot->len == 1) return reinterpret_cast<Val*>(&slot->value);
+    return &arena_[slot->offset];
+  }
+
+  /** \brief the value of key, nullptr with *len 1 if never pushed */
+  const Val* Find(Key key, int* len) {
+    if (dense_len_ && key >= dense_begin_ && key < dense_end_) {
+      *len = dense_len_;
+      return &dense_[(key - dense_base_) * dense_len_];
+    }
+    Slot* slot = &slots_[Probe(key)];
+    if (!slot->len) return nullptr;
+    *len = slot->len;
+    return Value(slot);
+  }
+
+  /** \brief the value of key, zeros of len if new */
+  Val* Insert(Key key, int len) {
+    if (dense_len_ && key >= dense_begin_ && key < dense_end_) {
+      CHECK_EQ(len, dense_len_) << "the value length of key " << key
+                                << " changed";
+      return &dense_[(key - dense_base_) * dense_len_];
+    }
+    Slot* slot = &slots_[Probe(key)];
+    if (slot->len) {
+      CHECK_EQ(len, static_cast<int>(slot->len))
+          << "the value length of key " << key << " changed";
+      return Value(slot);
+    }
+    CHECK_GT(len, 0);
+    // at most 70% full
+    if ((num_keys_ + 1) * 10 > slots_.size() * 7) {
+      Rehash();
+      slot = &slots_[Probe(key)];
+    }
+    slot->key = key;
+    slot->len = len;
+    ++num_keys_;
+    if (kInline && len == 1) {
+      slot->value = 0;
+    } else {
+      CHECK_LE(arena_.size() + len, static_cast<uint64_t>(1) << 32)
+          << "the values of the hash are too many";
+      slot->offset = arena_.size();
+      arena_.resize(arena_.size() + len, 0);
+    }
+    return Value(slot);
+  }
+
+  void Rehash() {
+    std::vector<Slot> old(slots_.size() * 2);
+    old.swap(slots_);
+    for (const auto& slot : old) {
+      if (slot.len) slots_[Probe(slot.key)] = slot;
+    }
+  }
+
+  // the values of [dense_base_, dense_base_ + dense_.size() / dense_len_),
+  // those of [dense_begin_, dense_end_) pushed, the others zero headroom
+  std::vector<Val> dense_;
+  Key dense_base_ = 0;
+  Key dense_begin_ = 0;
+  Key dense_end_ = 0;
+  // 0 until the first dense push
+  int dense_len_ = 0;
+
+  std::vector<Slot> slots_;
+  std::vector<Val> arena_;
+  size_t num_keys_ = 0;
+
+  // the values copied by a pull, nullptr for zeros
+  std::vector<std::pair<const Val*, size_t>> pull_parts_;
+};
+
+}  // namespace ps
+#endif  // PS_INTERNAL_KV_STORE_H_
@@ -8,6 +8,8 @@
 #include <string>
 #include <sstream>
 #include "ps/sarray.h"
+#include "ps/range.h"
+#include "ps/internal/small_vector.h"
 namespace ps {
 /** \brief data type */
 enum DataType {
@@ -160,6 +162,8 @@ struct Meta {
     }
     if (head != kEmpty) ss << ", head=" << head;
     if (control.empty() && !simple_app) ss << ", key=" << key; // valid data msg
+    if (loss_ratio > 0) ss << ", loss_ratio=" << loss_ratio;
+    if (priority) ss << ", priority=" << priority;
     if (body.size()) ss << ", body=" << body;
     if (data_type.size()) {
       ss << ", data_type={";
@@ -189,20 +193,24 @@ struct Meta {
   bool simple_app;
   /** \brief an string body */
   std::string body;
-  /** \brief data type of message.data[i] */
-  std::vector<DataType> data_type;
+  /** \brief data type of message.data[i], keys, values and lens fit inline */
+  SmallVector<DataType, 4> data_type;
   /** \brief system control message */
   Control control;
   /** \brief the byte size */
   int data_size = 0;
   /** \brief the key */
-  uint64_t key;
+  uint64_t key = 0;
   /** \brief the address */
   uint64_t addr = 0;
   /** \brief the value length */
-  int val_len;
+  int val_len = 0;
   /** \brief the optional 4-bytes field */
-  int option;
+  int option = 0;
+  /** \brief the tolerated fraction of lost value bytes, 0 for reliable */
+  float loss_ratio = 0;
+  /** \brief the priority of the values, higher is more urgent */
+  int priority = 0;
 };
 /**
  * \brief messages that communicated amaong nodes.
@@ -212,6 +220,15 @@ struct Message {
   Meta meta;
   /** \brief the large chunk of data of this message */
   std::vector<SArray<char> > data;
+  /**
+   * \brief some bytes of data[1] were lost. only set by the receiving van of
+   * a message with a loss bound, the lost bytes read as zeros
+   */
+  bool partial = false;
+  /**
+   * \brief the byte ranges of data[1] that arrived if partial, possibly none
+   */
+  std::vector<Range> recv_ranges;
   /**
    * \brief push array into data, and add the data type
    */
@@ -0,0 +1,184 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_INTERNAL_MPMC_QUEUE_H_
+#define PS_INTERNAL_MPMC_QUEUE_H_
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "ps/base.h"
+namespace ps {
+
+/**
+ * \brief bounded lock-free multi-producer multi-consumer queue, a ring of
+ * cells each stamped with the turn it is in. a waiting thread spins a little
+ * and then parks, it is only woken if parked, so that a push costs no
+ * syscall while the consumer keeps up. Push blocks while the queue is full
+ */
+template <typename T>
+class MPMCQueue {
+ public:
+  static const size_t kDefaultCapacity = 4096;
+
+  /** \param capacity rounded up to a power of 2 */
+  explicit MPMCQueue(size_t capacity = kDefaultCapacity) {
+    size_t size = 2;
+    while (size < capacity) size *= 2;
+    cells_.reset(new Cell[size]);
+    mask_ = size - 1;
+    for (size_t i = 0; i < size; ++i) {
+      cells_[i].turn.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * \brief push an value into the end, wait while full. threadsafe
+   * \param new_value the value
+   */
+  void Push(T new_value) {
+    for (int spin = 0; !TryPush(&new_value); ++spin) {
+      if (spin < kSpins) {
+        std::this_thread::yield();
+        continue;
+      }
+      std::unique_lock<std::mutex> lk(mu_);
+      push_waiters_.fetch_add(1);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (!TryPush(&new_value)) not_full_.wait(lk);
+      push_waiters_.fetch_sub(1);
+    }
+    Wake(&pop_waiters_, &not_empty_);
+  }
+
+  /**
+   * \brief pop an element from the beginning if any, threadsafe
+   * \return false if empty
+   */
+  bool TryPop(T* value) {
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    Cell* cell;
+    for (;;) {
+      cell = &cells_[pos & mask_];
+      size_t turn = cell->turn.load(std::memory_order_acquire);
+      intptr_t dif = static_cast<intptr_t>(turn) - static_cast<intptr_t>(pos + 1);
+      if (dif == 0) {
+        if (dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (dif < 0) {
+        return false;
+      } else {
+        pos = dequeue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    *value = std::move(cell->value);
+    cell->turn.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * \brief wait until pop an element from the beginning, threadsafe
+   * \param value the poped value
+   */
+  void WaitAndPop(T* value) { WaitAndPopN(value, 1); }
+
+  /**
+   * \brief wait until at least one element is there and pop up to n of
+   * them in order, threadsafe
+   * \return the number of elements poped into values
+   */
+  size_t WaitAndPopN(T* values, size_t n) {
+    size_t num = 0;
+    for (int spin = 0;; ++spin) {
+      while (num < n && TryPop(values + num)) ++num;
+      if (num) break;
+      if (spin < kSpins) {
+        std::this_thread::yield();
+        continue;
+      }
+      std::unique_lock<std::mutex> lk(mu_);
+      pop_waiters_.fetch_add(1);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      while (num < n && TryPop(values + num)) ++num;
+      if (!num) not_empty_.wait(lk);
+      pop_waiters_.fetch_sub(1);
+      if (num) break;
+    }
+    Wake(&push_waiters_, &not_full_);
+    // another consumer may have missed the push woken for this one
+    if (num == n && !Empty()) Wake(&pop_waiters_, &not_empty_);
+    return num;
+  }
+
+  /** \brief whether it is empty, only a hint while others push or pop */
+  bool Empty() const {
+    size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+    size_t turn = cells_[pos & mask_].turn.load(std::memory_order_acquire);
+    return turn != pos + 1;
+  }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> turn;
+    T value;
+  };
+
+  /** \brief moves the value only on success */
+  bool TryPush(T* value) {
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    Cell* cell;
+    for (;;) {
+      cell = &cells_[pos & mask_];
+      size_t turn = cell->turn.load(std::memory_order_acquire);
+      intptr_t dif = static_cast<intptr_t>(turn) - static_cast<intptr_t>(pos);
+      if (dif == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (dif < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    cell->value = std::move(*value);
+    cell->turn.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * \brief wake a thread parked on cond. the fence pairs with the one of
+   * the parking thread, either it sees the change or this sees it parked
+   */
+  void Wake(std::atomic<int>* waiters, std::condition_variable* cond) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters->load(std::memory_order_relaxed) == 0) return;
+    std::lock_guard<std::mutex> lk(mu_);
+    cond->notify_one();
+  }
+
+  // yields before parking, enough to cover a handoff between busy threads
+  static const int kSpins = 16;
+
+  std::unique_ptr<Cell[]> cells_;
+  size_t mask_;
+  // the producers and the consumers write to their own cache lines
+  char pad0_[64];
+  std::atomic<size_t> enqueue_pos_{0};
+  char pad1_[64];
+  std::atomic<size_t> dequeue_pos_{0};
+  char pad2_[64];
+  std::atomic<int> pop_waiters_{0};
+  std::atomic<int> push_waiters_{0};
+  std::mutex mu_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+};
+
+}  // namespace ps
+#endif  // PS_INTERNAL_MPMC_QUEUE_H_
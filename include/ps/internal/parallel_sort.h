@@ -6,30 +6,174 @@
 #ifndef PS_INTERNAL_PARALLEL_SORT_H_
 #define PS_INTERNAL_PARALLEL_SORT_H_
 #include <functional>
-#include <thread>
+#include <iterator>
 #include <algorithm>
+#include <vector>
+#include "ps/base.h"
 #include "ps/sarray.h"
+#include "ps/internal/thread_pool.h"
 namespace ps {
 
 namespace  {
+/** \brief the fewest elements sorted by a thread */
+const size_t kSortGrain = 1 << 14;
 /**
- * \brief the thread function
- *
- * \param data start pointer of data
- * \param len  length of data
- * \param grainsize max data length of one thread
- * \param cmp comparison function
+ * \brief the number of parts a sort of len elements is split into
+ */
+inline int NumSortParts(size_t len, int num_threads) {
+  CHECK_GT(num_threads, 0);
+  size_t parts = std::min<size_t>(num_threads, ThreadPool::Get()->size());
+  return std::max<size_t>(1, std::min(parts, len / kSortGrain));
+}
+
+/** \brief copy src to dst over the ThreadPool */
+template<typename T>
+void ParallelCopy(T* src, size_t len, int parts, T* dst) {
+  ThreadPool::Get()->Run(parts, [&](int i) {
+    std::copy(std::make_move_iterator(src + len * i / parts),
+              std::make_move_iterator(src + len * (i + 1) / parts),
+              dst + len * i / parts);
+  });
+}
+
+/**
+ * \brief sort the parts of data, then merge them pairwise. each merge is split
+ * into pieces at a key of the first run, so that all threads merge
  */
 template<typename T, class Fn>
-void ParallelSort(T* data, size_t len, size_t grainsize, const Fn& cmp) {
-  if (len <= grainsize) {
-    std::sort(data, data + len, cmp);
-  } else {
-    std::thread thr(ParallelSort<T, Fn>, data, len/2, grainsize, cmp);
-    ParallelSort(data + len/2, len - len/2, grainsize, cmp);
-    thr.join();
+void MergeSort(T* data, size_t len, int parts, const Fn& cmp) {
+  auto pool = ThreadPool::Get();
+  // the starts of the sorted runs, and len
+  std::vector<size_t> runs(parts + 1);
+  for (int i = 0; i <= parts; ++i) runs[i] = len * i / parts;
+  pool->Run(parts, [&](int i) {
+    std::sort(data + runs[i], data + runs[i+1], cmp);
+  });
+  if (parts == 1) return;
 
-    std::inplace_merge(data, data + len/2, data + len, cmp);
+  // a piece of a merge, written to dst from out
+  struct Piece {
+    size_t a, a_end, b, b_end, out;
+  };
+  std::vector<T> buf(len);
+  T* src = data;
+  T* dst = buf.data();
+  while (runs.size() > 2) {
+    std::vector<Piece> pieces;
+    std::vector<size_t> merged;
+    for (size_t r = 0; r + 1 < runs.size(); r += 2) {
+      merged.push_back(runs[r]);
+      size_t begin = runs[r], mid = runs[r+1];
+      size_t end = r + 2 < runs.size() ? runs[r+2] : mid;
+      int num_pieces = std::max<size_t>(1, parts * (end - begin) / len);
+      size_t a = begin, b = mid;
+      for (int j = 1; j <= num_pieces; ++j) {
+        size_t a_end = j == num_pieces ? mid : begin + (mid - begin) * j / num_pieces;
+        size_t b_end = j == num_pieces ? end :
+            std::lower_bound(src + b, src + end, src[a_end], cmp) - src;
+        pieces.push_back({a, a_end, b, b_end, a + b - mid});
+        a = a_end;
+        b = b_end;
+      }
+    }
+    merged.push_back(len);
+    pool->Run(pieces.size(), [&](int i) {
+      const Piece& p = pieces[i];
+      std::merge(std::make_move_iterator(src + p.a),
+                 std::make_move_iterator(src + p.a_end),
+                 std::make_move_iterator(src + p.b),
+                 std::make_move_iterator(src + p.b_end),
+                 dst + p.out, cmp);
+    });
+    runs.swap(merged);
+    std::swap(src, dst);
+  }
+  if (src != data) ParallelCopy(src, len, parts, data);
+}
+
+/**
+ * \brief sort keys increasingly, and vals along if not nullptr, by a stable
+ * LSD radix sort of 11-bit digits. the digits all keys share are skipped
+ */
+template<typename V>
+void RadixSort(Key* keys, V* vals, size_t len, int parts) {
+  const int kBits = 11, kBuckets = 1 << kBits;
+  auto pool = ThreadPool::Get();
+  // the bits that differ among keys
+  std::vector<Key> ors(parts, 0), ands(parts, kMaxKey);
+  pool->Run(parts, [&](int p) {
+    Key key_or = 0, key_and = kMaxKey;
+    for (size_t i = len * p / parts; i < len * (p + 1) / parts; ++i) {
+      key_or |= keys[i];
+      key_and &= keys[i];
+    }
+    ors[p] = key_or;
+    ands[p] = key_and;
+  });
+  Key key_or = 0, key_and = kMaxKey;
+  for (int p = 0; p < parts; ++p) {
+    key_or |= ors[p];
+    key_and &= ands[p];
+  }
+  Key differ = key_or ^ key_and;
+
+  std::vector<Key> key_buf(len);
+  std::vector<V> val_buf(vals ? len : 0);
+  Key* key_src = keys;
+  Key* key_dst = key_buf.data();
+  V* val_src = vals;
+  V* val_dst = val_buf.data();
+  // offsets[p * kBuckets + b] is where the next key of part p in bucket b goes
+  std::vector<size_t> offsets(parts * kBuckets);
+  for (int shift = 0; shift < 64; shift += kBits) {
+    if (((differ >> shift) & (kBuckets - 1)) == 0) continue;
+    pool->Run(parts, [&](int p) {
+      size_t* count = &offsets[p * kBuckets];
+      std::fill(count, count + kBuckets, 0);
+      for (size_t i = len * p / parts; i < len * (p + 1) / parts; ++i) {
+        ++count[(key_src[i] >> shift) & (kBuckets - 1)];
+      }
+    });
+    size_t offset = 0;
+    for (int b = 0; b < kBuckets; ++b) {
+      for (int p = 0; p < parts; ++p) {
+        size_t count = offsets[p * kBuckets + b];
+        offsets[p * kBuckets + b] = offset;
+        offset += count;
+      }
+    }
+    pool->Run(parts, [&](int p) {
+      size_t* offset = &offsets[p * kBuckets];
+      const Key* src = key_src;
+      Key* dst = key_dst;
+      for (size_t i = len * p / parts; i < len * (p + 1) / parts; ++i) {
+        Key key = src[i];
+        size_t j = offset[(key >> shift) & (kBuckets - 1)]++;
+        dst[j] = key;
+        if (vals) val_dst[j] = std::move(val_src[i]);
+      }
+    });
+    std::swap(key_src, key_dst);
+    std::swap(val_src, val_dst);
+  }
+  if (key_src != keys) {
+    ParallelCopy(key_src, len, parts, keys);
+    if (vals) ParallelCopy(val_src, len, parts, vals);
+  }
+}
+
+/** \brief the sort of data by cmp */
+template<typename T, class Fn>
+void SortParts(T* data, size_t len, int parts, const Fn& cmp) {
+  MergeSort(data, len, parts, cmp);
+}
+
+/** \brief keys in increasing order are radix sorted */
+inline void SortParts(Key* data, size_t len, int parts, const std::less<Key>&) {
+  if (len < kSortGrain) {
+    std::sort(data, data + len);
+  } else {
+    RadixSort<char>(data, nullptr, len, parts);
   }
 }
 }  // namespace
@@ -37,21 +181,38 @@ void ParallelSort(T* data, size_t len, size_t grainsize, const Fn& cmp) {
 /**
  * \brief Parallel Sort
  *
+ * sorts on the ThreadPool: parts are sorted, then merged pairwise in
+ * parallel. an array of Key in increasing order is radix sorted instead
+ *
  * \param arr the array for sorting
- * \param num_threads number of thread
+ * \param num_threads the most threads used
  * \param cmp the comparision function such as
  * [](const T& a, const T& b) {* return a < b; }
  * or an even simplier version:
  * std::less<T>()
  */
-template<typename T, class Fn>
+template<typename T, class Fn = std::less<T>>
 void ParallelSort(SArray<T>* arr,
                   int num_threads = 2,
                   const Fn& cmp = std::less<T>()) {
-  CHECK_GT(num_threads, 0);
-  CHECK(cmp);
-  size_t grainsize = std::max(arr->size() / num_threads + 5, (size_t)1024*16);
-  ParallelSort(arr->data(), arr->size(), grainsize, cmp);
+  SortParts(arr->data(), arr->size(), NumSortParts(arr->size(), num_threads), cmp);
+}
+
+/**
+ * \brief Parallel Sort of key-value pairs
+ *
+ * sorts keys in increasing order and moves vals along on the ThreadPool, by
+ * a stable radix sort, so the vals of equal keys keep their order
+ *
+ * \param keys the keys
+ * \param vals a value for each key
+ * \param num_threads the most threads used
+ */
+template<typename V>
+void ParallelSort(SArray<Key>* keys, SArray<V>* vals, int num_threads = 2) {
+  CHECK_EQ(keys->size(), vals->size());
+  size_t len = keys->size();
+  RadixSort(keys->data(), vals->data(), len, NumSortParts(len, num_threads));
 }
 
 }  // namespace ps
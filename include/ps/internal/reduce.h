@@ -0,0 +1,79 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ * \file   reduce.h
+ * \brief  elementwise reductions of the values of a server
+ */
+#ifndef PS_INTERNAL_REDUCE_H_
+#define PS_INTERNAL_REDUCE_H_
+#include <stddef.h>
+#include <stdint.h>
+namespace ps {
+
+/** \brief the element types of a reduction */
+enum ReduceType {
+  REDUCE_FLOAT32, REDUCE_FLOAT64,
+  // IEEE half and bfloat16, reduced in float32
+  REDUCE_FLOAT16, REDUCE_BFLOAT16,
+  REDUCE_INT32, REDUCE_INT64
+};
+
+/** \brief the operations of a reduction */
+enum ReduceOp {
+  REDUCE_SUM,
+  REDUCE_AVERAGE,  // the sum divided by the number of inputs
+  REDUCE_MAX
+};
+
+/** \brief the bytes of an element of type */
+size_t ReduceTypeSize(ReduceType type);
+
+/**
+ * \brief dst = op(srcs[0], ..., srcs[num_srcs - 1]) elementwise, in one pass
+ * over the inputs. dst may be one of srcs.
+ *
+ * on x86 the kernels are compiled for SSE2, AVX2 and AVX-512 and the widest
+ * the cpu has is picked at load time, on arm they use NEON. a large
+ * reduction is split over the ThreadPool, and its result written around the
+ * cache unless dst is an input
+ *
+ * \param len the number of elements of dst and of each input
+ */
+void Reduce(ReduceOp op, ReduceType type, void* dst, const void* const* srcs,
+            int num_srcs, size_t len);
+
+/**
+ * \brief dst += src, len elements
+ */
+inline void ReduceSum(ReduceType type, void* dst, const void* src,
+                      size_t len) {
+  const void* srcs[2] = {dst, src};
+  Reduce(REDUCE_SUM, type, dst, srcs, 2, len);
+}
+
+/**
+ * \brief the ReduceType of V, value is false if there is none and then type
+ * means nothing
+ */
+template <typename V> struct ReduceTypeOf {
+  static const bool value = false;
+  static const ReduceType type = REDUCE_FLOAT32;
+};
+template <> struct ReduceTypeOf<float> {
+  static const bool value = true;
+  static const ReduceType type = REDUCE_FLOAT32;
+};
+template <> struct ReduceTypeOf<double> {
+  static const bool value = true;
+  static const ReduceType type = REDUCE_FLOAT64;
+};
+template <> struct ReduceTypeOf<int32_t> {
+  static const bool value = true;
+  static const ReduceType type = REDUCE_INT32;
+};
+template <> struct ReduceTypeOf<int64_t> {
+  static const bool value = true;
+  static const ReduceType type = REDUCE_INT64;
+};
+
+}  // namespace ps
+#endif  // PS_INTERNAL_REDUCE_H_
@@ -0,0 +1,103 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_INTERNAL_SMALL_VECTOR_H_
+#define PS_INTERNAL_SMALL_VECTOR_H_
+#include <string.h>
+#include <algorithm>
+#include <type_traits>
+namespace ps {
+
+/**
+ * \brief a vector keeping up to N elements inline, so that a message with a
+ * few of them costs no allocation. only for trivially copyable elements
+ */
+template <typename T, size_t N>
+class SmallVector {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "SmallVector moves its elements with memcpy");
+
+ public:
+  SmallVector() {}
+
+  SmallVector(const SmallVector& other) { *this = other; }
+
+  SmallVector(SmallVector&& other) { *this = std::move(other); }
+
+  ~SmallVector() {
+    if (data_ != inline_) delete[] data_;
+  }
+
+  SmallVector& operator=(const SmallVector& other) {
+    if (this == &other) return *this;
+    size_ = 0;
+    reserve(other.size_);
+    memcpy(data_, other.data_, other.size_ * sizeof(T));
+    size_ = other.size_;
+    return *this;
+  }
+
+  SmallVector& operator=(SmallVector&& other) {
+    if (this == &other) return *this;
+    if (other.data_ == other.inline_) {
+      *this = static_cast<const SmallVector&>(other);
+    } else {
+      if (data_ != inline_) delete[] data_;
+      data_ = other.data_;
+      size_ = other.size_;
+      capacity_ = other.capacity_;
+      other.data_ = other.inline_;
+      other.capacity_ = N;
+    }
+    other.size_ = 0;
+    return *this;
+  }
+
+  size_t size() const { return size_; }
+
+  bool empty() const { return size_ == 0; }
+
+  void clear() { size_ = 0; }
+
+  T* data() { return data_; }
+  const T* data() const { return data_; }
+
+  T* begin() { return data_; }
+  T* end() { return data_ + size_; }
+  const T* begin() const { return data_; }
+  const T* end() const { return data_ + size_; }
+
+  T& operator[](size_t i) { return data_[i]; }
+  const T& operator[](size_t i) const { return data_[i]; }
+
+  void reserve(size_t n) {
+    if (n <= capacity_) return;
+    n = std::max(n, capacity_ * 2);
+    T* data = new T[n];
+    memcpy(data, data_, size_ * sizeof(T));
+    if (data_ != inline_) delete[] data_;
+    data_ = data;
+    capacity_ = n;
+  }
+
+  /** \brief the new elements are left uninitialized */
+  void resize(size_t n) {
+    reserve(n);
+    size_ = n;
+  }
+
+  void push_back(const T& value) {
+    T copy = value;  // value may live in the storage being grown
+    if (size_ == capacity_) reserve(size_ + 1);
+    data_[size_++] = copy;
+  }
+
+ private:
+  T inline_[N];
+  T* data_ = inline_;
+  size_t size_ = 0;
+  size_t capacity_ = N;
+};
+
+}  // namespace ps
+#endif  // PS_INTERNAL_SMALL_VECTOR_H_
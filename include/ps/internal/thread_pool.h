@@ -0,0 +1,120 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_INTERNAL_THREAD_POOL_H_
+#define PS_INTERNAL_THREAD_POOL_H_
+#include <stdlib.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "ps/internal/env.h"
+namespace ps {
+
+/**
+ * \brief persistent threads running the parts of a computation split by
+ * ps-lite, such as a large reduction. the caller of Run takes parts too
+ * while it waits, so that Run may be called from a part
+ */
+class ThreadPool {
+ public:
+  /**
+   * \brief the pool shared by ps-lite, of PS_COMPUTE_THREADS threads counting
+   * the caller, by default the number of cores
+   */
+  static ThreadPool* Get() {
+    static ThreadPool pool(DefaultSize());
+    return &pool;
+  }
+
+  /** \param size the number of threads counting the caller */
+  explicit ThreadPool(int size) {
+    for (int i = 1; i < size; ++i) threads_.emplace_back([this] { Work(); });
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      stop_ = true;
+    }
+    work_cond_.notify_all();
+    for (auto& t : threads_) t.join();
+  }
+
+  /** \brief the number of threads counting the caller */
+  int size() const { return threads_.size() + 1; }
+
+  /**
+   * \brief run fn(0), ..., fn(n-1) in parallel, return when all returned
+   */
+  void Run(int n, const std::function<void(int)>& fn) {
+    if (n <= 1 || threads_.empty()) {
+      for (int i = 0; i < n; ++i) fn(i);
+      return;
+    }
+    Batch batch{&fn, n};
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      for (int i = 1; i < n; ++i) parts_.push_back({&batch, i});
+    }
+    work_cond_.notify_all();
+    fn(0);
+    std::unique_lock<std::mutex> lk(mu_);
+    --batch.pending;
+    while (batch.pending) {
+      if (parts_.empty()) {
+        done_cond_.wait(lk);
+        continue;
+      }
+      RunPart(&lk);
+    }
+  }
+
+ private:
+  struct Batch {
+    const std::function<void(int)>* fn;
+    int pending;
+  };
+  struct Part {
+    Batch* batch;
+    int index;
+  };
+
+  static int DefaultSize() {
+    auto val = Environment::Get()->find("PS_COMPUTE_THREADS");
+    int size = val ? atoi(val) : std::thread::hardware_concurrency();
+    return std::max(size, 1);
+  }
+
+  /** \brief run the first part, lk is unlocked meanwhile */
+  void RunPart(std::unique_lock<std::mutex>* lk) {
+    Part part = parts_.front();
+    parts_.pop_front();
+    lk->unlock();
+    (*part.batch->fn)(part.index);
+    lk->lock();
+    if (--part.batch->pending == 0) done_cond_.notify_all();
+  }
+
+  void Work() {
+    std::unique_lock<std::mutex> lk(mu_);
+    for (;;) {
+      work_cond_.wait(lk, [this] { return stop_ || !parts_.empty(); });
+      if (parts_.empty()) return;
+      RunPart(&lk);
+    }
+  }
+
+  std::vector<std::thread> threads_;
+  std::mutex mu_;
+  std::condition_variable work_cond_;
+  std::condition_variable done_cond_;
+  std::deque<Part> parts_;
+  bool stop_ = false;
+};
+
+}  // namespace ps
+#endif  // PS_INTERNAL_THREAD_POOL_H_
@@ -105,16 +105,37 @@ class Van {
    */
   virtual int SendMsg(Message &msg) = 0;
 
+  /**
+   * \brief the newest meta format this van can carry, advertised in its
+   * ADD_NODE. 0 for the RawMeta only, e.g. a van sizing its buffers once per
+   * key. PS_META_FORMAT=legacy keeps every van at 0
+   */
+  virtual int MaxMetaVersion();
+
   /**
    * \brief get the length of pack meta
    */
   int GetPackMetaLen(const Meta &meta);
 
   /**
-   * \brief pack meta into a string
+   * \brief pack meta into a string, a null *meta_buf is taken from a pool
+   * and goes back with FreeMetaBuf
    */
   void PackMeta(const Meta &meta, char **meta_buf, int *buf_size);
 
+  /**
+   * \brief pack meta into meta_buf, resized to fit, and return its size. the
+   * meta is encoded once, in the one format read, so that a frame sized by
+   * the return value holds it even if the format changes meanwhile
+   */
+  int PackMeta(const Meta &meta, std::string *meta_buf);
+
+  /**
+   * \brief return a buffer of PackMeta, it fits as the free function of
+   * zmq_msg_init_data
+   */
+  static void FreeMetaBuf(void *data, void *hint);
+
   /**
    * \brief unpack meta from a string
    */
@@ -124,6 +145,8 @@ class Van {
   Node my_node_;
   bool is_scheduler_;
   std::mutex start_mu_;
+  /** the meta format PackMeta writes, agreed by all nodes at ADD_NODE */
+  std::atomic<int> meta_version_{0};
 
  private:
   /** thread function for receving */
@@ -155,6 +178,8 @@ class Van {
   int drop_rate_ = 0;
   std::atomic<int> timestamp_{0};
   int init_stage = 0;
+  /** the scheduler only: the newest meta format all nodes so far can carry */
+  int meta_version_offer_ = 0;
 
   /**
    * \brief processing logic of AddNode message for scheduler
@@ -4,10 +4,18 @@
 #ifndef PS_KV_APP_H_
 #define PS_KV_APP_H_
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <utility>
 #include <vector>
 #include "ps/base.h"
 #include "ps/simple_app.h"
+#include "ps/internal/kv_store.h"
+#include "ps/internal/mpmc_queue.h"
+#include "ps/internal/thread_pool.h"
 #include <fstream>
 #include <iostream>
 #include <stdlib.h>
@@ -85,6 +93,7 @@ class KVWorker : public SimpleApp {
     using namespace std::placeholders;
     slicer_ = std::bind(&KVWorker<Val>::DefaultSlicer, this, _1, _2, _3);
     obj_ = new Customer(app_id, customer_id, std::bind(&KVWorker<Val>::Process, this, _1));
+    is_worker_zpull_ = false;
 #ifdef USE_PROFILING
     const char *val;
     val = Environment::Get()->find("DMLC_ENABLE_RDMA");
@@ -189,7 +198,10 @@ class KVWorker : public SimpleApp {
    * if \ref Wait returns or the callback is called.
    *
    * @param keys a list of keys, must be unique and sorted in increasing order
-   * @param vals the buffer for the pulled values. It can be 0 size.
+   * @param vals the buffer for the pulled values. It can be 0 size. If sized
+   * to the same number of values per key, the values of each server are
+   * copied into it as its response arrives, unless \a lens is wanted for
+   * several keys
    * @param lens optional buffer for the value length. If set, it can be 0 size.
    * @param cmd an optional command sent to the servers
    * @param cb the callback which is called when the pull is finished.
@@ -255,6 +267,56 @@ class KVWorker : public SimpleApp {
             const Callback& cb = nullptr) {
     return Pull_(keys, vals, lens, cmd, cb);
   }
+
+  /**
+   * \brief loss-tolerant zero-copy Push
+   *
+   * This function is similar to \ref ZPush except that the values of
+   * keys[i] may lose up to a fraction loss_ratios[i] of their bytes on the
+   * way, and are sent with priority priorities[i], higher is more urgent.
+   * The servers are told which values arrived, see \ref KVMeta.
+   *
+   * Keys sent to a same server share one bound, the smallest loss ratio and
+   * the highest priority among them. Vans which cannot drop data treat the
+   * loss ratio as 0.
+   *
+   * @param loss_ratios the tolerated loss ratio of each key, in [0, 1)
+   * @param priorities optional, the priority of each key
+   */
+  int LossyZPush(const SArray<Key>& keys,
+                 const SArray<Val>& vals,
+                 const SArray<float>& loss_ratios,
+                 const SArray<int>& priorities = {},
+                 const SArray<int>& lens = {},
+                 int cmd = 0,
+                 const Callback& cb = nullptr) {
+    int ts = obj_->NewRequest(kServerGroup);
+    AddCallback(ts, cb);
+    KVPairs<Val> kvs;
+    kvs.keys = keys;
+    kvs.vals = vals;
+    kvs.lens = lens;
+    Send(ts, true, cmd, kvs, loss_ratios, priorities);
+    return ts;
+  }
+
+  /**
+   * \brief loss-tolerant zero-copy Pull
+   *
+   * This function is similar to \ref ZPull except that the values of
+   * keys[i] may lose up to a fraction loss_ratios[i] of their bytes on the
+   * way back, and the lost values read as zeros. See \ref LossyZPush for
+   * the bounds.
+   */
+  int LossyZPull(const SArray<Key>& keys,
+                 SArray<Val>* vals,
+                 const SArray<float>& loss_ratios,
+                 const SArray<int>& priorities = {},
+                 SArray<int>* lens = nullptr,
+                 int cmd = 0,
+                 const Callback& cb = nullptr) {
+    return Pull_(keys, vals, lens, cmd, cb, loss_ratios, priorities);
+  }
   using SlicedKVs = std::vector<std::pair<bool, KVPairs<Val>>>;
   /**
    * \brief a slicer partitions a key-value list according to the key ranges
@@ -286,7 +348,9 @@ class KVWorker : public SimpleApp {
    */
   template <typename C, typename D>
   int Pull_(const SArray<Key>& keys, C* vals, D* lens,
-            int cmd, const Callback& cb);
+            int cmd, const Callback& cb,
+            const SArray<float>& loss_ratios = {},
+            const SArray<int>& priorities = {});
   /**
    * \brief add a callback for a request. threadsafe.
    * @param cb callback
@@ -308,17 +372,52 @@ class KVWorker : public SimpleApp {
    * @param timestamp the timestamp of the request
    * @param push whether or not it is a push request
    * @param cmd command
+   * @param loss_ratios optional, the tolerated loss ratio of each key
+   * @param priorities optional, the priority of each key
    */
-  void Send(int timestamp, bool push, int cmd, const KVPairs<Val>& kvs);
+  void Send(int timestamp, bool push, int cmd, const KVPairs<Val>& kvs,
+            const SArray<float>& loss_ratios = {},
+            const SArray<int>& priorities = {});
   /** \brief internal receive handle */
   void Process(const Message& msg);
   /** \brief default kv slicer */
   void DefaultSlicer(const KVPairs<Val>& send,
                      const std::vector<Range>& ranges,
                      SlicedKVs* sliced);
+  /**
+   * \brief val_pos[i] = the sum of lens[0, pos[i]), over the ThreadPool if
+   * there are many lens. pos[0] is 0
+   */
+  static void SumLens(const SArray<int>& lens, const std::vector<size_t>& pos,
+                      std::vector<size_t>* val_pos);
+  /** \brief the number of lens from which SumLens runs in parallel */
+  static const size_t kParallelSlice = 1 << 18;
 
-  /** \brief data buffer for received kvs for each timestamp */
-  std::unordered_map<int, std::vector<KVPairs<Val>>> recv_kvs_;
+  /** \brief a pull in flight */
+  struct PullState {
+    SArray<Key> keys;
+    /**
+     * \brief the caller's buffer, assumed to hold k values per key. a
+     * response is copied into it as it arrives, if it has k values per key.
+     * nullptr if the caller did not size it, or wants the lens of several
+     * keys that are not all k
+     */
+    Val* vals = nullptr;
+    size_t k = 0;
+    /** \brief the caller's lens, nullptr if not wanted */
+    int* lens = nullptr;
+    /** \brief the keys copied into vals */
+    std::atomic<size_t> num_keys{0};
+    /**
+     * \brief a response had not k values per key, then vals is filled from
+     * kvs at the end as if it was nullptr
+     */
+    std::atomic<bool> mismatch{false};
+    /** \brief the responses, kept until the end */
+    std::vector<KVPairs<Val>> kvs;
+  };
+  /** \brief the pulls in flight by timestamp */
+  std::unordered_map<int, std::shared_ptr<PullState>> pulls_;
   /** \brief callbacks for each timestamp */
   std::unordered_map<int, Callback> callbacks_;
   /** \brief lock */
@@ -343,6 +442,19 @@ struct KVMeta {
   int customer_id;
   /** \brief the key */
   Key key;
+  /** \brief the tolerated loss ratio of the values */
+  float loss_ratio;
+  /** \brief the priority of the values */
+  int priority;
+  /**
+   * \brief some values of a push were lost, they read as zeros
+   */
+  bool partial = false;
+  /**
+   * \brief the ranges of value indices that arrived if partial, possibly
+   * none. a partially received value counts as lost
+   */
+  std::vector<Range> recv_ranges;
 };
 
 /**
@@ -359,6 +471,16 @@ class KVServer : public SimpleApp {
    */
   explicit KVServer(int app_id) : SimpleApp() {
     using namespace std::placeholders;
+    // the handler threads are up before the first request
+    const char *threads = Environment::Get()->find("PS_KV_SERVER_THREADS");
+    int num_threads = threads ? atoi(threads) : 0;
+    for (int i = 0; i < num_threads; ++i) {
+      shard_queues_.emplace_back(new MPMCQueue<ShardRequest>(kShardQueueSize));
+    }
+    // a thread reads shard_queues_, which must not grow meanwhile
+    for (int i = 0; i < num_threads; ++i) {
+      shard_threads_.emplace_back(&KVServer<Val>::HandleShard, this, i);
+    }
     obj_ = new Customer(app_id, app_id, std::bind(&KVServer<Val>::Process, this, _1));
 #ifdef USE_PROFILING
     const char *val;
@@ -390,6 +512,15 @@ class KVServer : public SimpleApp {
 
   /** \brief deconstructor */
   virtual ~KVServer() {
+    // nothing is queued once receiving stopped, the requests queued before
+    // are still handled and may respond through obj_
+    obj_->Stop();
+    for (auto& queue : shard_queues_) {
+      ShardRequest stop;
+      stop.msg.meta.control.cmd = Control::TERMINATE;
+      queue->Push(stop);
+    }
+    for (auto& thread : shard_threads_) thread.join();
     delete obj_;
     obj_ = nullptr;
     auto iter = server_key_map.begin();
@@ -409,6 +540,16 @@ class KVServer : public SimpleApp {
 
   /**
    * \brief the handle to process a push/pull request from a worker
+   *
+   * by default it runs on the receiving thread of the server, one request
+   * at a time. with PS_KV_SERVER_THREADS=N the keys are spread over N
+   * threads by their hash, and a request runs on the thread of its keys. a
+   * request with keys of several threads runs once all of them reached it,
+   * while they wait. so the requests of a key run in order, a push and a
+   * later pull of a key see each other, while other keys run concurrently.
+   * the handle then has to guard whatever it shares across keys. \ref
+   * Response may be called from any thread
+   *
    * \param req_meta meta-info of this request
    * \param req_data kv pairs of this request
    * \param server this pointer
@@ -434,9 +575,37 @@ class KVServer : public SimpleApp {
  private:
   /** \brief internal receive handle */
   void Process(const Message& msg);
+  /** \brief run the request handle on a request */
+  void Handle(const Message& msg);
+  /** \brief the handler thread of a shard of the keys */
+  void HandleShard(int shard);
+  /** \brief the shard of a key */
+  size_t Shard(Key key) const;
   /** \brief request handle */
   ReqHandle request_handle_;
 
+  /** \brief a request with the keys of several shards */
+  struct JointRequest {
+    Message msg;
+    /** \brief the shards yet to reach it */
+    int pending;
+    bool done = false;
+    std::mutex mu;
+    std::condition_variable cond;
+  };
+  /** \brief a request queued to a shard */
+  struct ShardRequest {
+    Message msg;
+    /** \brief set if the request is queued to several shards */
+    std::shared_ptr<JointRequest> joint;
+  };
+  static const size_t kShardQueueSize = 1024;
+  /** \brief the requests of each handler thread, empty without them */
+  std::vector<std::unique_ptr<MPMCQueue<ShardRequest>>> shard_queues_;
+  /** \brief the shards of the request in Process, reused */
+  std::vector<size_t> shards_;
+  std::vector<std::thread> shard_threads_;
+
   std::unordered_map<Key, KVPairs<Val> > server_key_map;
 
   /** \brief lock */
@@ -447,30 +616,28 @@ class KVServer : public SimpleApp {
 
 
 /**
- * \brief an example handle adding pushed kv into store
+ * \brief an example handle adding pushed kv into store. the store is shared by
+ * all keys, so with PS_KV_SERVER_THREADS the threads take turns on it
  */
 template <typename Val>
 struct KVServerDefaultHandle {
   void operator()(
       const KVMeta& req_meta, const KVPairs<Val>& req_data, KVServer<Val>* server) {
-    size_t n = req_data.keys.size();
     KVPairs<Val> res;
-    if (req_meta.push) {
-      CHECK_EQ(n, req_data.vals.size());
-    } else {
-      res.keys = req_data.keys; res.vals.resize(n);
-    }
-    for (size_t i = 0; i < n; ++i) {
-      Key key = req_data.keys[i];
+    {
+      std::lock_guard<std::mutex> lk(*mu);
       if (req_meta.push) {
-        store[key] += req_data.vals[i];
+        store.Push(req_data.keys, req_data.vals, req_data.lens);
       } else {
-        res.vals[i] = store[key];
+        res.keys = req_data.keys;
+        store.Pull(req_data.keys, &res.vals, &res.lens);
       }
     }
     server->Response(req_meta, res);
   }
-  std::unordered_map<Key, Val> store;
+  KVStore<Val> store;
+  /** \brief guards store, held by pointer as std::function copies the handle */
+  std::shared_ptr<std::mutex> mu = std::make_shared<std::mutex>();
 };
 
 
@@ -481,6 +648,74 @@ void KVServer<Val>::Process(const Message& msg) {
   if (msg.meta.simple_app) {
     SimpleApp::Process(msg); return;
   }
+  if (shard_queues_.empty()) {
+    Handle(msg);
+    return;
+  }
+  // the shards of the keys, in increasing order
+  shards_.clear();
+  size_t num_keys = msg.data.size() ? msg.data[0].size() / sizeof(Key) : 0;
+  if (num_keys) {
+    const Key* keys = reinterpret_cast<const Key*>(msg.data[0].data());
+    std::vector<bool> touched(shard_queues_.size());
+    for (size_t i = 0; i < num_keys && shards_.size() < touched.size(); ++i) {
+      size_t shard = Shard(keys[i]);
+      if (!touched[shard]) {
+        touched[shard] = true;
+        shards_.push_back(shard);
+      }
+    }
+  } else {
+    shards_.push_back(Shard(msg.meta.key));
+  }
+  ShardRequest req;
+  req.msg = msg;
+  if (shards_.size() > 1) {
+    req.joint = std::make_shared<JointRequest>();
+    req.joint->msg = msg;
+    req.joint->pending = shards_.size();
+    req.msg = Message();
+  }
+  // this is the only thread queueing, so the joint requests are in the same
+  // order in every queue
+  for (size_t shard : shards_) shard_queues_[shard]->Push(req);
+}
+
+template <typename Val>
+size_t KVServer<Val>::Shard(Key key) const {
+  // the keys are often strided, e.g. by the key range of a server
+  uint64_t hash = static_cast<uint64_t>(key) * 0x9E3779B97F4A7C15ull;
+  return (hash >> 32) % shard_queues_.size();
+}
+
+template <typename Val>
+void KVServer<Val>::HandleShard(int shard) {
+  auto& queue = *shard_queues_[shard];
+  while (true) {
+    ShardRequest req;
+    queue.WaitAndPop(&req);
+    if (!req.joint) {
+      if (req.msg.meta.control.cmd == Control::TERMINATE) break;
+      Handle(req.msg);
+      continue;
+    }
+    // the last shard to reach it runs it, the others wait until it ran
+    auto& joint = *req.joint;
+    std::unique_lock<std::mutex> lk(joint.mu);
+    if (--joint.pending == 0) {
+      lk.unlock();
+      Handle(joint.msg);
+      lk.lock();
+      joint.done = true;
+      joint.cond.notify_all();
+    } else {
+      joint.cond.wait(lk, [&joint] { return joint.done; });
+    }
+  }
+}
+
+template <typename Val>
+void KVServer<Val>::Handle(const Message& msg) {
   KVMeta meta;
   meta.cmd       = msg.meta.head;
   meta.push      = msg.meta.push;
@@ -488,6 +723,14 @@ void KVServer<Val>::Process(const Message& msg) {
   meta.timestamp = msg.meta.timestamp;
   meta.customer_id = msg.meta.customer_id;
   meta.key       = msg.meta.key;
+  meta.loss_ratio = msg.meta.loss_ratio;
+  meta.priority  = msg.meta.priority;
+  meta.partial   = msg.partial;
+  for (const auto& r : msg.recv_ranges) {
+    uint64_t begin = (r.begin() + sizeof(Val) - 1) / sizeof(Val);
+    uint64_t end = r.end() / sizeof(Val);
+    if (begin < end) meta.recv_ranges.emplace_back(begin, end);
+  }
 
   KVPairs<Val> data;
   int n = msg.data.size();
@@ -527,6 +770,8 @@ void KVServer<Val>::Response(const KVMeta& req, const KVPairs<Val>& res) {
   msg.meta.timestamp   = req.timestamp;
   msg.meta.recver      = req.sender;
   msg.meta.key         = req.key;
+  msg.meta.loss_ratio  = req.loss_ratio;
+  msg.meta.priority    = req.priority;
   if (res.keys.size()) {
     msg.AddData(res.keys);
     msg.AddData(res.vals);
@@ -554,35 +799,38 @@ void KVWorker<Val>::DefaultSlicer(
     typename KVWorker<Val>::SlicedKVs* sliced) {
   sliced->resize(ranges.size());
 
-  // find the positions in msg.key
+  // find the positions in msg.key. the positions of the last call of this
+  // thread are tried first, a key array sent again needs no search
   size_t n = ranges.size();
-  std::vector<size_t> pos(n+1);
-  const Key* begin = send.keys.begin();
-  const Key* end = send.keys.end();
-  for (size_t i = 0; i < n; ++i) {
-    if (i == 0) {
-      pos[0] = std::lower_bound(begin, end, ranges[0].begin()) - begin;
-      begin += pos[0];
-    } else {
-      CHECK_EQ(ranges[i-1].end(), ranges[i].begin());
+  thread_local std::vector<size_t> last_pos;
+  last_pos.resize(n+1);
+  const Key* keys = send.keys.data();
+  size_t m = send.keys.size();
+  for (size_t i = 0; i <= n; ++i) {
+    if (i > 0 && i < n) CHECK_EQ(ranges[i-1].end(), ranges[i].begin());
+    Key bound = i < n ? ranges[i].begin() : ranges[n-1].end();
+    size_t from = i ? last_pos[i-1] : 0;
+    size_t& p = last_pos[i];
+    // p is the lower bound if keys[p-1] < bound <= keys[p]
+    if (p < from || p > m || (p > from && keys[p-1] >= bound) ||
+        (p < m && keys[p] < bound)) {
+      p = std::lower_bound(keys + from, keys + m, bound) - keys;
     }
-    size_t len = std::lower_bound(begin, end, ranges[i].end()) - begin;
-    begin += len;
-    pos[i+1] = pos[i] + len;
-
-    // don't send it to servers for empty kv
-    sliced->at(i).first = (len != 0);
   }
-  CHECK_EQ(pos[n], send.keys.size());
+  const std::vector<size_t>& pos = last_pos;
+  CHECK_EQ(pos[n] - pos[0], m);
   if (send.keys.empty()) return;
 
   // the length of value
-  size_t k = 0, val_begin = 0, val_end = 0;
+  size_t k = 0;
+  std::vector<size_t> val_pos;
   if (send.lens.empty()) {
     k = send.vals.size() / send.keys.size();
     CHECK_EQ(k * send.keys.size(), send.vals.size());
   } else {
     CHECK_EQ(send.keys.size(), send.lens.size());
+    SumLens(send.lens, pos, &val_pos);
+    CHECK_EQ(val_pos[n], send.vals.size());
   }
 
   // slice
@@ -596,9 +844,7 @@ void KVWorker<Val>::DefaultSlicer(
     kv.keys = send.keys.segment(pos[i], pos[i+1]);
     if (send.lens.size()) {
       kv.lens = send.lens.segment(pos[i], pos[i+1]);
-      for (int l : kv.lens) val_end += l;
-      kv.vals = send.vals.segment(val_begin, val_end);
-      val_begin = val_end;
+      kv.vals = send.vals.segment(val_pos[i], val_pos[i+1]);
     } else {
       kv.vals = send.vals.segment(pos[i]*k, pos[i+1]*k);
     }
@@ -606,7 +852,42 @@ void KVWorker<Val>::DefaultSlicer(
 }
 
 template <typename Val>
-void KVWorker<Val>::Send(int timestamp, bool push, int cmd, const KVPairs<Val>& kvs) {
+void KVWorker<Val>::SumLens(const SArray<int>& lens,
+                            const std::vector<size_t>& pos,
+                            std::vector<size_t>* val_pos) {
+  size_t n = pos.size() - 1;
+  // sums[part * n + i] is the sum of the lens of server i in a part
+  auto pool = ThreadPool::Get();
+  int parts = lens.size() < kParallelSlice ? 1 : pool->size();
+  std::vector<size_t> sums(parts * n);
+  pool->Run(parts, [&](int part) {
+    size_t begin = lens.size() * part / parts;
+    size_t end = lens.size() * (part + 1) / parts;
+    size_t i = std::upper_bound(pos.begin(), pos.end(), begin) - pos.begin() - 1;
+    for (; begin < end; ++i) {
+      size_t seg_end = std::min(end, pos[i+1]);
+      const int* l = lens.data();
+      size_t sum = 0;
+      for (size_t j = begin; j < seg_end; ++j) sum += l[j];
+      sums[part * n + i] = sum;
+      begin = seg_end;
+    }
+  });
+  val_pos->assign(n + 1, 0);
+  for (size_t i = 0; i < n; ++i) {
+    size_t sum = 0;
+    for (int part = 0; part < parts; ++part) sum += sums[part * n + i];
+    (*val_pos)[i+1] = (*val_pos)[i] + sum;
+  }
+}
+
+template <typename Val>
+void KVWorker<Val>::Send(int timestamp, bool push, int cmd, const KVPairs<Val>& kvs,
+                         const SArray<float>& loss_ratios,
+                         const SArray<int>& priorities) {
+  if (loss_ratios.size()) CHECK_EQ(loss_ratios.size(), kvs.keys.size());
+  if (priorities.size()) CHECK_EQ(priorities.size(), kvs.keys.size());
+  const SArray<Key>& send_keys = kvs.keys;
   // slice the message
   SlicedKVs sliced;
   slicer_(kvs, Postoffice::Get()->GetServerKeyRanges(), &sliced);
@@ -632,6 +913,20 @@ void KVWorker<Val>::Send(int timestamp, bool push, int cmd, const KVPairs<Val>&
     msg.meta.timestamp   = timestamp;
     msg.meta.recver      = Postoffice::Get()->ServerRankToID(i);
     const auto& kvs = s.second;
+    if ((loss_ratios.size() || priorities.size()) && kvs.keys.size()) {
+      // a message is as reliable as its least tolerant key
+      Range range = FindRange(send_keys, kvs.keys.front(), kvs.keys.back()+1);
+      if (loss_ratios.size()) {
+        msg.meta.loss_ratio = *std::min_element(
+            loss_ratios.begin() + range.begin(), loss_ratios.begin() + range.end());
+        CHECK(msg.meta.loss_ratio >= 0 && msg.meta.loss_ratio < 1)
+            << "invalid loss ratio " << msg.meta.loss_ratio;
+      }
+      if (priorities.size()) {
+        msg.meta.priority = *std::max_element(
+            priorities.begin() + range.begin(), priorities.begin() + range.end());
+      }
+    }
     if (kvs.keys.size()) {
       msg.AddData(kvs.keys);
       msg.AddData(kvs.vals);
@@ -678,9 +973,32 @@ void KVWorker<Val>::Process(const Message& msg) {
       kvs.lens = msg.data[2];
     }
     mu_.lock();
-    recv_kvs_[ts].push_back(kvs);
+    auto it = pulls_.find(ts);
+    CHECK(it != pulls_.end()) << "no pull of timestamp " << ts;
+    auto pull = it->second;
+    pull->kvs.push_back(kvs);
     mu_.unlock();
 
+    // if every response has k values per key, each lands where the sorted
+    // copy would put it
+    if (pull->vals && kvs.vals.size() != kvs.keys.size() * pull->k) {
+      pull->mismatch = true;
+    }
+    if (pull->vals && !pull->mismatch) {
+      Range range = FindRange(pull->keys, kvs.keys.front(), kvs.keys.back()+1);
+      CHECK_EQ(range.size(), kvs.keys.size()) << "unmatched keys size from one server";
+      Val* dst = pull->vals + range.begin() * pull->k;
+      // a van may have received into dst already
+      if (dst != kvs.vals.data() && !is_worker_zpull_) {
+        memcpy(dst, kvs.vals.data(), kvs.vals.size() * sizeof(Val));
+      }
+      if (pull->lens) {
+        CHECK_EQ(kvs.lens.size(), kvs.keys.size());
+        memcpy(pull->lens + range.begin(), kvs.lens.data(),
+               kvs.lens.size() * sizeof(int));
+      }
+      pull->num_keys += kvs.keys.size();
+    }
   }
   // finished, run callbacks
   if (obj_->NumResponse(ts) == Postoffice::Get()->num_servers() - 1)  {
@@ -706,12 +1024,49 @@ void KVWorker<Val>::RunCallback(int timestamp) {
 template <typename Val>
 template <typename C, typename D>
 int KVWorker<Val>::Pull_(
-    const SArray<Key>& keys, C* vals, D* lens, int cmd, const Callback& cb) {
+    const SArray<Key>& keys, C* vals, D* lens, int cmd, const Callback& cb,
+    const SArray<float>& loss_ratios, const SArray<int>& priorities) {
   int ts = obj_->NewRequest(kServerGroup);
-  AddCallback(ts, [this, ts, keys, vals, lens, cb]() mutable {
+  CHECK_NOTNULL(vals);
+  auto pull = std::make_shared<PullState>();
+  pull->keys = keys;
+  // the values of a server go at k times the index of its first key, if
+  // vals holds k per key. a single key, as one tensor, takes all of vals.
+  // lens the caller sized must all be k
+  bool same_lens = !lens || keys.size() == 1;
+  if (lens && lens->size() == keys.size() && keys.size() &&
+      vals->size() == keys.size() * (*lens)[0]) {
+    same_lens = std::all_of(lens->begin(), lens->end(),
+                            [&](int len) { return len == (*lens)[0]; });
+  }
+  if (same_lens && keys.size() && vals->size() &&
+      vals->size() % keys.size() == 0) {
+    pull->vals = vals->data();
+    pull->k = vals->size() / keys.size();
+    if (lens) {
+      if (lens->empty()) {
+        lens->resize(keys.size());
+      } else {
+        CHECK_EQ(lens->size(), keys.size());
+      }
+      pull->lens = lens->data();
+    }
+  }
+  mu_.lock();
+  pulls_[ts] = pull;
+  mu_.unlock();
+
+  AddCallback(ts, [this, ts, pull, vals, lens, cb]() mutable {
       mu_.lock();
-      auto& kvs = recv_kvs_[ts];
+      pulls_.erase(ts);
       mu_.unlock();
+      if (pull->vals && !pull->mismatch) {
+        CHECK_EQ(pull->num_keys.load(), pull->keys.size()) << "lost some servers?";
+        if (cb) cb();
+        return;
+      }
+      auto& keys = pull->keys;
+      auto& kvs = pull->kvs;
 
       // do check
       size_t total_key = 0, total_val = 0;
@@ -729,7 +1084,6 @@ int KVWorker<Val>::Pull_(
           const KVPairs<Val>& a, const KVPairs<Val>& b) {
                   return a.keys.front() < b.keys.front();
         });
-      CHECK_NOTNULL(vals);
       if (vals->empty()) {
         vals->resize(total_val);
       } else {
@@ -756,15 +1110,11 @@ int KVWorker<Val>::Pull_(
           }
         }
       }
-
-      mu_.lock();
-      recv_kvs_.erase(ts);
-      mu_.unlock();
       if (cb) cb();
     });
 
   KVPairs<Val> kvs; kvs.keys = keys;
-  Send(ts, false, cmd, kvs);
+  Send(ts, false, cmd, kvs, loss_ratios, priorities);
   return ts;
 }
 
@@ -60,6 +60,23 @@ class SimpleApp {
    */
   virtual inline void Wait(int timestamp) { obj_->WaitRequest(timestamp); }
 
+  /**
+   * \brief return whether a request is finished, without blocking
+   *
+   * \param timestamp
+   */
+  virtual inline bool Test(int timestamp) { return obj_->TestRequest(timestamp); }
+
+  /**
+   * \brief wait until one of the requests is finished
+   *
+   * \param timestamps
+   * @return the timestamp of a finished request
+   */
+  virtual inline int WaitAny(const std::vector<int>& timestamps) {
+    return obj_->WaitAnyRequest(timestamps);
+  }
+
 
   /**
    * \brief send back a response for a request
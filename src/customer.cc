@@ -3,7 +3,9 @@
  */
 #include "ps/internal/customer.h"
 #include "ps/internal/postoffice.h"
-#include "ps/internal/threadsafe_queue.h"
+#include "ps/internal/mpmc_queue.h"
+#include "./thread_placement.h"
+#include <algorithm>
 #include <map>
 #include <atomic>
 #include <set>
@@ -15,57 +17,164 @@ namespace ps {
 const int Node::kEmpty = std::numeric_limits<int>::max();
 const int Meta::kEmpty = std::numeric_limits<int>::max();
 
+namespace {
+// the ring starts with this many slots, and grows only while all are pending
+const int kInitTrackerSize = 1024;
+// the timestamps cycle in [0, kTimestampSpace)
+const int kTimestampSpace = 1 << 30;
+// the messages Receiving pops at once
+const size_t kRecvBatch = 16;
+}  // namespace
+
 Customer::Customer(int app_id, int customer_id, const Customer::RecvHandle& recv_handle)
-    : app_id_(app_id), customer_id_(customer_id), recv_handle_(recv_handle) {
+    : app_id_(app_id), customer_id_(customer_id), recv_handle_(recv_handle),
+      tracker_(kInitTrackerSize) {
   Postoffice::Get()->AddCustomer(this);
   recv_thread_ = std::unique_ptr<std::thread>(new std::thread(&Customer::Receiving, this));
 }
 
 Customer::~Customer() {
+  Stop();
+}
+
+void Customer::Stop() {
+  if (!recv_thread_) return;
   Postoffice::Get()->RemoveCustomer(this);
   Message msg;
   msg.meta.control.cmd = Control::TERMINATE;
   recv_queue_.Push(msg);
   recv_thread_->join();
+  recv_thread_.reset();
+}
+
+Customer::Request* Customer::FindRequest(int timestamp) {
+  auto &req = tracker_[timestamp & (tracker_.size() - 1)];
+  return req.timestamp == timestamp ? &req : nullptr;
+}
+
+void Customer::GrowTracker() {
+  size_t size = tracker_.size();
+  bool fits = false;
+  while (!fits) {
+    size *= 2;
+    std::vector<bool> used(size, false);
+    fits = true;
+    for (const auto &req : tracker_) {
+      if (req.finished()) continue;
+      size_t i = req.timestamp & (size - 1);
+      if (used[i]) {
+        fits = false;
+        break;
+      }
+      used[i] = true;
+    }
+  }
+  // the finished requests are dropped, their waiters are gone
+  std::vector<Request> grown(size);
+  for (auto &req : tracker_) {
+    if (!req.finished()) grown[req.timestamp & (size - 1)] = std::move(req);
+  }
+  tracker_.swap(grown);
+  PS_VLOG(1) << "customer " << customer_id_ << " tracks up to " << size
+             << " pending requests";
 }
 
 int Customer::NewRequest(int recver) {
   std::lock_guard<std::mutex> lk(tracker_mu_);
   int num = Postoffice::Get()->GetNodeIDs(recver).size();
-  tracker_.push_back(std::make_pair(num, 0));
-  return tracker_.size() - 1;
+  int timestamp = next_timestamp_;
+  next_timestamp_ = (next_timestamp_ + 1) % kTimestampSpace;
+  while (!tracker_[timestamp & (tracker_.size() - 1)].finished()) {
+    GrowTracker();
+  }
+  auto &req = tracker_[timestamp & (tracker_.size() - 1)];
+  req.timestamp = timestamp;
+  req.expected = num;
+  req.responses = 0;
+  return timestamp;
 }
 
 void Customer::WaitRequest(int timestamp) {
   std::unique_lock<std::mutex> lk(tracker_mu_);
-  tracker_cond_.wait(lk, [this, timestamp]{
-      return tracker_[timestamp].first == tracker_[timestamp].second;
-    });
+  Request *req = FindRequest(timestamp);
+  if (!req || req->finished()) return;
+  Waiter waiter;
+  req->waiters.push_back(&waiter);
+  waiter.cond.wait(lk, [&waiter] { return waiter.finished != -1; });
+}
+
+bool Customer::TestRequest(int timestamp) {
+  std::lock_guard<std::mutex> lk(tracker_mu_);
+  Request *req = FindRequest(timestamp);
+  return !req || req->finished();
+}
+
+int Customer::WaitAnyRequest(const std::vector<int>& timestamps) {
+  CHECK(!timestamps.empty());
+  std::unique_lock<std::mutex> lk(tracker_mu_);
+  for (int timestamp : timestamps) {
+    Request *req = FindRequest(timestamp);
+    if (!req || req->finished()) return timestamp;
+  }
+  Waiter waiter;
+  for (int timestamp : timestamps) {
+    FindRequest(timestamp)->waiters.push_back(&waiter);
+  }
+  waiter.cond.wait(lk, [&waiter] { return waiter.finished != -1; });
+  // the pending ones still point to the waiter
+  for (int timestamp : timestamps) {
+    Request *req = FindRequest(timestamp);
+    if (!req) continue;
+    auto &waiters = req->waiters;
+    waiters.erase(std::remove(waiters.begin(), waiters.end(), &waiter),
+                  waiters.end());
+  }
+  return waiter.finished;
 }
 
 int Customer::NumResponse(int timestamp) {
   std::lock_guard<std::mutex> lk(tracker_mu_);
-  return tracker_[timestamp].second;
+  Request *req = FindRequest(timestamp);
+  return req ? req->responses : -1;
 }
 
 void Customer::AddResponse(int timestamp, int num) {
   std::lock_guard<std::mutex> lk(tracker_mu_);
-  tracker_[timestamp].second += num;
+  AddResponseLocked(timestamp, num);
+}
+
+void Customer::AddResponseLocked(int timestamp, int num) {
+  Request *req = FindRequest(timestamp);
+  // a late response, e.g. resent, to a request finished long ago
+  if (!req) return;
+  req->responses += num;
+  if (!req->finished()) return;
+  for (Waiter *waiter : req->waiters) {
+    waiter->finished = timestamp;
+    waiter->cond.notify_one();
+  }
+  req->waiters.clear();
 }
 
 void Customer::Receiving() {
+  ThreadPlacement::Get()->PinCurrentThread("customer");
+  // a burst of messages is taken in one go
+  std::vector<Message> batch(kRecvBatch);
   while (true) {
-    Message recv;
-    recv_queue_.WaitAndPop(&recv);
-    if (!recv.meta.control.empty() 
-          && recv.meta.control.cmd == Control::TERMINATE) {
-      break;
-    }
-    recv_handle_(recv);
-    if (!recv.meta.request) {
-      std::lock_guard<std::mutex> lk(tracker_mu_);
-      tracker_[recv.meta.timestamp].second++;
-      tracker_cond_.notify_all();
+    size_t n = recv_queue_.WaitAndPopN(batch.data(), batch.size());
+    for (size_t i = 0; i < n; ++i) {
+      Message &recv = batch[i];
+      if (!recv.meta.control.empty()
+            && recv.meta.control.cmd == Control::TERMINATE) {
+        return;
+      }
+      recv_handle_(recv);
+      if (!recv.meta.request) {
+        std::lock_guard<std::mutex> lk(tracker_mu_);
+        AddResponseLocked(recv.meta.timestamp, 1);
+      }
+      // do not hold the data until the slot is reused
+      recv.data.clear();
     }
   }
 }
@@ -65,12 +65,44 @@ struct RawMeta {
   int val_len;
   // the option field
   int option;
+  // the tolerated fraction of lost value bytes
+  float loss_ratio;
+  // the priority of the values
+  int priority;
 
   // body
   // data_type
   // node
 };
 
+// the version of the compact meta, a RawMeta is version 0. a compact meta is
+// shorter than a RawMeta, which tells the two apart, and starts with its
+// version, then a varint of CompactMetaField for the fields present and the
+// fields in that order: the ints as zigzag varints, the body and the data
+// types (a byte each) after their count, and for a control message the cmd,
+// barrier_group, msg_sig and the nodes with their hostname length-prefixed
+const int kCompactMetaVersion = 1;
+
+enum CompactMetaField {
+  kMetaRequest = 1 << 0,
+  kMetaPush = 1 << 1,
+  kMetaSimpleApp = 1 << 2,
+  kMetaHead = 1 << 3,
+  kMetaAppId = 1 << 4,
+  kMetaCustomerId = 1 << 5,
+  kMetaTimestamp = 1 << 6,
+  kMetaBody = 1 << 7,
+  kMetaDataType = 1 << 8,
+  kMetaControl = 1 << 9,
+  kMetaDataSize = 1 << 10,
+  kMetaKey = 1 << 11,
+  kMetaAddr = 1 << 12,
+  kMetaValLen = 1 << 13,
+  kMetaOption = 1 << 14,
+  kMetaLossRatio = 1 << 15,
+  kMetaPriority = 1 << 16,
+};
+
 } // namespace
 
 #endif
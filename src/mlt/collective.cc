@@ -0,0 +1,497 @@
+#include "collective.h"
+
+#include "prism/utils.h"
+
+#include <algorithm>
+
+#if defined(__AVX__) || defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+/// dst[i] += src[i]
+inline void SumInto(float* dst, const float* src, size_t n) {
+  size_t i = 0;
+#if defined(__AVX__)
+  for (; i + 8 <= n; i += 8) {
+    __m256 a = _mm256_loadu_ps(dst + i);
+    __m256 b = _mm256_loadu_ps(src + i);
+    _mm256_storeu_ps(dst + i, _mm256_add_ps(a, b));
+  }
+#elif defined(__SSE__)
+  for (; i + 4 <= n; i += 4) {
+    __m128 a = _mm_loadu_ps(dst + i);
+    __m128 b = _mm_loadu_ps(src + i);
+    _mm_storeu_ps(dst + i, _mm_add_ps(a, b));
+  }
+#endif
+  for (; i < n; i++) dst[i] += src[i];
+}
+
+using Range = Collective::Range;
+
+/// sort and coalesce the ranges, dropping the empty ones
+void MergeRanges(std::vector<Range>* ranges) {
+  std::sort(ranges->begin(), ranges->end());
+  std::vector<Range> merged;
+  for (const Range& r : *ranges) {
+    if (r.first >= r.second) continue;
+    if (!merged.empty() && r.first <= merged.back().second) {
+      merged.back().second = std::max(merged.back().second, r.second);
+    } else {
+      merged.push_back(r);
+    }
+  }
+  ranges->swap(merged);
+}
+
+/// the parts of the sorted ranges within [first, last)
+void Intersect(const std::vector<Range>& ranges, size_t first, size_t last,
+               std::vector<Range>* out) {
+  for (const Range& r : ranges) {
+    size_t a = std::max(r.first, first);
+    size_t b = std::min(r.second, last);
+    if (a < b) out->emplace_back(a, b);
+  }
+}
+
+constexpr int kMaxChunks = 256;
+constexpr int kMaxSteps = 1024;
+constexpr int kOpIdMask = 0x7ff;
+
+}  // namespace
+
+Collective::Collective(MLTCommunicator* comm, CompletionQueue* cq,
+                       PktPrioFunc* prio_func)
+    : comm_{comm}, cq_{cq}, prio_func_{prio_func} {
+  chunk_bytes_ = prism::GetEnvOrDefault<long>("MLT_RING_CHUNK_SIZE", 262144);
+  comm_->SetCompletionQueue(cq_);
+}
+
+void Collective::RingAllreduce(const std::vector<int>& ring, float* data,
+                               size_t len, double loss_ratio,
+                               std::vector<Range>* partial) {
+  std::vector<Range> ranges;
+  RunRing(ring, data, len, loss_ratio, true, true, &ranges);
+  if (partial) *partial = std::move(ranges);
+}
+
+void Collective::RingReduceScatter(const std::vector<int>& ring, float* data,
+                                   size_t len, double loss_ratio,
+                                   std::vector<Range>* partial) {
+  std::vector<Range> ranges;
+  if (partial) ranges = *partial;
+  RunRing(ring, data, len, loss_ratio, true, false, &ranges);
+  if (partial) *partial = std::move(ranges);
+}
+
+void Collective::RingAllGather(const std::vector<int>& ring, float* data,
+                               size_t len, double loss_ratio,
+                               std::vector<Range>* partial) {
+  std::vector<Range> ranges;
+  if (partial) ranges = *partial;
+  RunRing(ring, data, len, loss_ratio, false, true, &ranges);
+  if (partial) *partial = std::move(ranges);
+}
+
+void Collective::HierarchicalAllreduce(const std::vector<int>& ranks,
+                                       int num_cols, float* data, size_t len,
+                                       double loss_ratio,
+                                       std::vector<Range>* partial) {
+  CHECK_GT(num_cols, 0);
+  CHECK_EQ(ranks.size() % num_cols, 0U)
+      << ranks.size() << " ranks do not fit in " << num_cols << " columns";
+  auto it = std::find(ranks.begin(), ranks.end(), comm_->comm_id());
+  CHECK(it != ranks.end()) << "comm_id " << comm_->comm_id() << " not found";
+  int pos = it - ranks.begin();
+  int num_rows = ranks.size() / num_cols;
+  int my_row = pos / num_cols, my_col = pos % num_cols;
+
+  std::vector<int> row, col;
+  for (int j = 0; j < num_cols; j++) row.push_back(ranks[my_row * num_cols + j]);
+  for (int i = 0; i < num_rows; i++) col.push_back(ranks[i * num_cols + my_col]);
+
+  /// 1. reduce-scatter along the row
+  std::vector<Range> ranges;
+  RunRing(row, data, len, loss_ratio, true, false, &ranges);
+
+  /// 2. allreduce the owned segment along the column, the members of a column
+  /// own the same segment of their rows
+  Range seg = RingOwnedSegment(row, len);
+  std::vector<Range> seg_ranges, others;
+  Intersect(ranges, seg.first, seg.second, &seg_ranges);
+  for (Range& r : seg_ranges) {
+    r.first -= seg.first;
+    r.second -= seg.first;
+  }
+  RunRing(col, data + seg.first, seg.second - seg.first, loss_ratio, true,
+          true, &seg_ranges);
+  Intersect(ranges, 0, seg.first, &others);
+  Intersect(ranges, seg.second, len, &others);
+  for (const Range& r : seg_ranges) {
+    others.emplace_back(r.first + seg.first, r.second + seg.first);
+  }
+  MergeRanges(&others);
+
+  /// 3. all-gather along the row
+  RunRing(row, data, len, loss_ratio, false, true, &others);
+  if (partial) *partial = std::move(others);
+}
+
+Range Collective::RingOwnedSegment(const std::vector<int>& ring,
+                                   size_t len) const {
+  int n = ring.size();
+  auto it = std::find(ring.begin(), ring.end(), comm_->comm_id());
+  CHECK(it != ring.end()) << "comm_id " << comm_->comm_id() << " not in ring";
+  int index = it - ring.begin();
+  return Split(0, len, n, (index + 1) % n);
+}
+
+void Collective::Barrier(const std::vector<int>& ring) {
+  int n = ring.size();
+  if (n <= 1) return;
+  auto it = std::find(ring.begin(), ring.end(), comm_->comm_id());
+  CHECK(it != ring.end()) << "comm_id " << comm_->comm_id() << " not in ring";
+  int index = it - ring.begin();
+  int left = ring[(index + n - 1) % n];
+  int right = ring[(index + 1) % n];
+  int op_id = op_seq_++;
+
+  /// the first round tells the head that everyone has entered, the second
+  /// one tells the others
+  auto wait = [this](int src, int msg_id) {
+    FlowId key = EncodeFlow(src, msg_id);
+    while (!metas_.count(key)) PollMeta(nullptr);
+    metas_.erase(key);
+  };
+  for (int round = 0; round < 2; round++) {
+    int msg_id = MsgId(op_id, kBarrier, round, 0);
+    if (index == 0) {
+      SendMeta(right, msg_id, {});
+      wait(left, msg_id);
+    } else {
+      wait(left, msg_id);
+      SendMeta(right, msg_id, {});
+    }
+  }
+}
+
+void Collective::RunRing(const std::vector<int>& ring, float* data, size_t len,
+                         double loss_ratio, bool reduce_scatter,
+                         bool all_gather, std::vector<Range>* partial) {
+  int n = ring.size();
+  if (n <= 1) return;
+  CHECK_LT(n - 1, kMaxSteps) << "too many members in a ring";
+  auto it = std::find(ring.begin(), ring.end(), comm_->comm_id());
+  CHECK(it != ring.end()) << "comm_id " << comm_->comm_id() << " not in ring";
+
+  RingOp op;
+  op.n = n;
+  op.index = it - ring.begin();
+  op.left = ring[(op.index + n - 1) % n];
+  op.right = ring[(op.index + 1) % n];
+  op.op_id = op_seq_++;
+  op.data = data;
+  op.len = len;
+  op.loss_ratio = loss_ratio;
+  op.reduce_scatter = reduce_scatter;
+  op.all_gather = all_gather;
+
+  /// the same on all members, since it only depends on len and n
+  size_t max_seg_bytes = (len + n - 1) / n * sizeof(float);
+  size_t chunks = (max_seg_bytes + chunk_bytes_ - 1) / chunk_bytes_;
+  op.num_chunks = std::min<size_t>(std::max<size_t>(chunks, 1), kMaxChunks);
+
+  int flows = (reduce_scatter + all_gather) * (n - 1) * op.num_chunks;
+  op.pending_sends = flows;
+  op.pending_recvs = flows;
+
+  op.partial.resize(n * op.num_chunks);
+  for (int seg = 0; seg < n; seg++) {
+    for (int c = 0; c < op.num_chunks; c++) {
+      Range r = Chunk(op, seg, c);
+      Intersect(*partial, r.first, r.second,
+                &op.partial[seg * op.num_chunks + c]);
+    }
+  }
+
+  /// post the receives ahead, so that the chunks find them on arrival. the
+  /// all-gather of a chunk overwrites what reduce-scatter sends, so in a full
+  /// allreduce its receive is posted once that send is done
+  Phase first = reduce_scatter ? kReduceScatter : kAllGather;
+  if (reduce_scatter && recv_buf_.size() < len) recv_buf_.resize(len);
+  for (int step = 0; step + 1 < n; step++) {
+    for (int c = 0; c < op.num_chunks; c++) PostRecv(&op, first, step, c);
+  }
+  for (int c = 0; c < op.num_chunks; c++) Send(&op, first, 0, c);
+
+  Progress(&op);
+
+  partial->clear();
+  for (const auto& ranges : op.partial) {
+    partial->insert(partial->end(), ranges.begin(), ranges.end());
+  }
+  MergeRanges(partial);
+}
+
+void Collective::Progress(RingOp* op) {
+  const int max_comps = 32;
+  Completion comps[max_comps];
+  std::vector<FlowId> arrived;
+  while (op->pending_sends > 0 || op->pending_recvs > 0) {
+    while (!ready_.empty()) {
+      Event ev = ready_.front();
+      ready_.pop_front();
+      if (ev.is_recv) {
+        HandleRecv(op, ev);
+      } else {
+        HandleSend(op, ev);
+      }
+    }
+
+    int ret = cq_->PollOnce(max_comps, comps);
+    for (int i = 0; i < ret; i++) {
+      const Completion& comp = comps[i];
+      Event ev;
+      int op_id;
+      DecodeMsgId(comp.msg_id, &op_id, &ev.phase, &ev.step, &ev.chunk);
+      CHECK_EQ(op_id, op->op_id & kOpIdMask)
+          << "completion of msg_id " << comp.msg_id << " from another operation";
+      if (comp.type == CompletionType::kSend) {
+        ev.is_recv = false;
+        HandleSend(op, ev);
+        continue;
+      }
+
+      CHECK_EQ(comp.remote_comm_id, op->left);
+      auto it = op->recvs.find(comp.msg_id);
+      CHECK(it != op->recvs.end()) << "unexpected msg_id " << comp.msg_id;
+      RecvState& st = it->second;
+      st.data_done = true;
+      int seg = SegmentOf(*op, ev.phase, ev.step, true);
+      Range r = Chunk(*op, seg, ev.chunk);
+      size_t count = r.second - r.first;
+      if (loss_policy_) {
+        loss_policy_->OnReceive(comp.remote_comm_id, count * sizeof(float),
+                                comp.bytes_received);
+      }
+      if (comp.partial) {
+        /// a float partially received is lost as well
+        size_t next = 0;
+        for (const auto& bytes : comp.recv_ranges) {
+          size_t a = (bytes.first + sizeof(float) - 1) / sizeof(float);
+          size_t b = std::min(bytes.second / sizeof(float), count);
+          if (a >= b) continue;
+          if (next < a) st.missing.emplace_back(next, a);
+          next = b;
+        }
+        if (next < count) st.missing.emplace_back(next, count);
+      }
+      CheckRecvReady(op, comp.msg_id);
+    }
+
+    arrived.clear();
+    PollMeta(&arrived);
+    for (FlowId key : arrived) {
+      auto [src, msg_id] = DecodeFlow(key);
+      if (src == op->left) CheckRecvReady(op, msg_id);
+    }
+  }
+}
+
+void Collective::HandleRecv(RingOp* op, const Event& ev) {
+  int msg_id = MsgId(op->op_id, ev.phase, ev.step, ev.chunk);
+  auto it = op->recvs.find(msg_id);
+  CHECK(it != op->recvs.end());
+  RecvState& st = it->second;
+
+  int seg = SegmentOf(*op, ev.phase, ev.step, true);
+  Range r = Chunk(*op, seg, ev.chunk);
+  auto& partial = op->partial[seg * op->num_chunks + ev.chunk];
+  if (ev.phase == kReduceScatter) {
+    /// sum what arrived, the missing elements count as zero
+    size_t next = r.first;
+    for (const Range& m : st.missing) {
+      size_t a = r.first + m.first;
+      SumInto(op->data + next, recv_buf_.data() + next, a - next);
+      next = r.first + m.second;
+    }
+    SumInto(op->data + next, recv_buf_.data() + next, r.second - next);
+  } else {
+    /// the chunk replaces ours, the missing elements keep our partial sum
+    partial.clear();
+  }
+  for (const Range& m : st.missing) {
+    partial.emplace_back(r.first + m.first, r.first + m.second);
+  }
+  for (const Range& u : st.upstream) {
+    partial.emplace_back(r.first + u.first, r.first + u.second);
+  }
+  MergeRanges(&partial);
+  op->recvs.erase(it);
+  op->pending_recvs--;
+
+  /// forward the chunk
+  if (ev.step + 2 < op->n) {
+    Send(op, ev.phase, ev.step + 1, ev.chunk);
+  } else if (ev.phase == kReduceScatter && op->all_gather) {
+    Send(op, kAllGather, 0, ev.chunk);
+  }
+}
+
+void Collective::HandleSend(RingOp* op, const Event& ev) {
+  op->pending_sends--;
+  if (ev.phase == kReduceScatter && op->all_gather) {
+    PostRecv(op, kAllGather, ev.step, ev.chunk);
+  }
+}
+
+void Collective::PostRecv(RingOp* op, Phase phase, int step, int chunk) {
+  int msg_id = MsgId(op->op_id, phase, step, chunk);
+  int seg = SegmentOf(*op, phase, step, true);
+  Range r = Chunk(*op, seg, chunk);
+  RecvState& st = op->recvs[msg_id];
+  /// empty chunks are not sent, neither are their metas
+  if (r.first == r.second) {
+    st.data_done = true;
+    st.meta_done = true;
+    st.queued = true;
+    ready_.push_back({true, phase, step, chunk});
+    return;
+  }
+  if (op->loss_ratio == 0) st.meta_done = true;
+
+  float* base = phase == kReduceScatter ? recv_buf_.data() : op->data;
+  LtMessage msg;
+  msg.msg_id = msg_id;
+  msg.buf = reinterpret_cast<char*>(base + r.first);
+  msg.size = (r.second - r.first) * sizeof(float);
+  double loss_ratio = op->loss_ratio;
+  if (loss_policy_) {
+    loss_ratio =
+        loss_policy_->LossRatio({op->left, msg.size, layer_, op->loss_ratio});
+  }
+  comm_->PostRecv(op->left, msg, loss_ratio);
+  CheckRecvReady(op, msg_id);
+}
+
+void Collective::Send(RingOp* op, Phase phase, int step, int chunk) {
+  int msg_id = MsgId(op->op_id, phase, step, chunk);
+  int seg = SegmentOf(*op, phase, step, false);
+  Range r = Chunk(*op, seg, chunk);
+  if (r.first == r.second) {
+    ready_.push_back({false, phase, step, chunk});
+    return;
+  }
+  if (op->loss_ratio > 0) {
+    std::vector<Range> ranges;
+    for (const Range& p : op->partial[seg * op->num_chunks + chunk]) {
+      ranges.emplace_back(p.first - r.first, p.second - r.first);
+    }
+    SendMeta(op->right, msg_id, ranges);
+  }
+
+  LtMessage msg;
+  msg.msg_id = msg_id;
+  msg.buf = reinterpret_cast<char*>(op->data + r.first);
+  msg.size = (r.second - r.first) * sizeof(float);
+  comm_->PostSend(op->right, msg, prio_func_);
+}
+
+void Collective::CheckRecvReady(RingOp* op, int msg_id) {
+  auto it = op->recvs.find(msg_id);
+  if (it == op->recvs.end()) return;
+  RecvState& st = it->second;
+  if (!st.meta_done) {
+    auto it_meta = metas_.find(EncodeFlow(op->left, msg_id));
+    if (it_meta != metas_.end()) {
+      st.upstream = std::move(it_meta->second);
+      metas_.erase(it_meta);
+      st.meta_done = true;
+    }
+  }
+  if (st.data_done && st.meta_done && !st.queued) {
+    st.queued = true;
+    Event ev;
+    ev.is_recv = true;
+    int op_id;
+    DecodeMsgId(msg_id, &op_id, &ev.phase, &ev.step, &ev.chunk);
+    ready_.push_back(ev);
+  }
+}
+
+void Collective::PollMeta(std::vector<FlowId>* arrived) {
+  int src;
+  std::unique_ptr<Buffer> buffer;
+  while (comm_->TryRecvMeta(&src, &buffer)) {
+    UserDataHeader* hdr = GetInHeader<UserDataHeader>(buffer.get());
+    size_t bytes = buffer->msg_length() - sizeof(*hdr);
+    const uint32_t* p = reinterpret_cast<const uint32_t*>(hdr->payload);
+    CHECK_GE(bytes, 2 * sizeof(uint32_t)) << "invalid meta from " << src;
+    int msg_id = p[0];
+    uint32_t num_ranges = p[1];
+    CHECK_EQ(bytes, (2 + 2 * num_ranges) * sizeof(uint32_t));
+    std::vector<Range> ranges;
+    for (uint32_t i = 0; i < num_ranges; i++) {
+      ranges.emplace_back(p[2 + 2 * i], p[3 + 2 * i]);
+    }
+    FlowId key = EncodeFlow(src, msg_id);
+    metas_[key] = std::move(ranges);
+    if (arrived) arrived->push_back(key);
+  }
+}
+
+void Collective::SendMeta(int dest, int msg_id,
+                          const std::vector<Range>& ranges) {
+  /// msg_id, number of ranges, then the ranges
+  std::vector<uint32_t> payload;
+  payload.push_back(msg_id);
+  payload.push_back(ranges.size());
+  for (const Range& r : ranges) {
+    payload.push_back(r.first);
+    payload.push_back(r.second);
+  }
+  size_t bytes = payload.size() * sizeof(uint32_t);
+  Buffer buffer(payload.data(), bytes, bytes);
+  comm_->SendMetaAsync(dest, &buffer);
+}
+
+int Collective::SegmentOf(const RingOp& op, Phase phase, int step,
+                          bool recv) const {
+  /// reduce-scatter step s sends segment i - s and receives i - s - 1, so
+  /// member i ends up with segment i + 1, which all-gather step s sends
+  /// as i + 1 - s while receiving i - s
+  int seg;
+  if (phase == kReduceScatter) {
+    seg = op.index - step - (recv ? 1 : 0);
+  } else {
+    seg = op.index + 1 - step - (recv ? 1 : 0);
+  }
+  return (seg % op.n + op.n) % op.n;
+}
+
+Range Collective::Chunk(const RingOp& op, int segment, int chunk) const {
+  Range seg = Split(0, op.len, op.n, segment);
+  return Split(seg.first, seg.second, op.num_chunks, chunk);
+}
+
+Range Collective::Split(size_t first, size_t last, int parts, int i) {
+  size_t size = last - first;
+  size_t base = size / parts, rem = size % parts;
+  size_t begin = first + i * base + std::min<size_t>(i, rem);
+  return {begin, begin + base + (static_cast<size_t>(i) < rem ? 1 : 0)};
+}
+
+int Collective::MsgId(int op_id, Phase phase, int step, int chunk) {
+  /// op_id: 11 bits, phase: 2 bits, step: 10 bits, chunk: 8 bits
+  return (op_id & kOpIdMask) << 20 | phase << 18 | step << 8 | chunk;
+}
+
+void Collective::DecodeMsgId(int msg_id, int* op_id, Phase* phase, int* step,
+                             int* chunk) {
+  *op_id = msg_id >> 20 & kOpIdMask;
+  *phase = static_cast<Phase>(msg_id >> 18 & 0x3);
+  *step = msg_id >> 8 & (kMaxSteps - 1);
+  *chunk = msg_id & (kMaxChunks - 1);
+}
@@ -0,0 +1,180 @@
+#ifndef COLLECTIVE_H_
+#define COLLECTIVE_H_
+
+#include "mlt_communicator.h"
+#include "completion.h"
+#include "prio_func.h"
+#include "loss_policy.h"
+
+#include <deque>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * Collective runs server-less allreduce of float32 tensors on top of the
+ * point-to-point flows of a MLTCommunicator.
+ *
+ * A ring allreduce is a reduce-scatter followed by an all-gather. Each of the
+ * n segments of the tensor is cut into chunks which travel the ring
+ * independently: a chunk is forwarded as soon as it has been summed, and the
+ * all-gather of a chunk starts as soon as its reduce-scatter is over.
+ *
+ * With a loss ratio, a chunk may arrive partially. The missing elements count
+ * as zero in the sum, and the elements which miss some contribution are
+ * reported as partial. The partial ranges of a chunk follow it along the ring
+ * through the meta channel.
+ *
+ * A LossPolicy may choose the loss ratio of each chunk, up to the loss ratio
+ * of the operation, which still decides whether the partial ranges travel.
+ *
+ * All the members of a ring must call the same operations in the same order.
+ * While operating, the collective owns the completion queue and the meta
+ * channel of the communicator, use Barrier instead of exchanging metas.
+ */
+class Collective {
+ public:
+  /*! \brief: element range [first, last) */
+  using Range = std::pair<size_t, size_t>;
+
+  Collective(MLTCommunicator* comm, CompletionQueue* cq,
+             PktPrioFunc* prio_func);
+
+  /**
+   * \brief: sum data over the ring in place
+   *
+   * \param ring the comm ids of the ring members, in ring order
+   * \param partial the sorted element ranges missing some contribution
+   */
+  void RingAllreduce(const std::vector<int>& ring, float* data, size_t len,
+                     double loss_ratio, std::vector<Range>* partial);
+
+  /**
+   * \brief: after it, this member holds the sum of RingOwnedSegment only
+   *
+   * \param partial the partial ranges of data, updated in place
+   */
+  void RingReduceScatter(const std::vector<int>& ring, float* data, size_t len,
+                         double loss_ratio, std::vector<Range>* partial);
+
+  /**
+   * \brief: broadcast the RingOwnedSegment of each member to the others
+   *
+   * \param partial the partial ranges of data, updated in place
+   */
+  void RingAllGather(const std::vector<int>& ring, float* data, size_t len,
+                     double loss_ratio, std::vector<Range>* partial);
+
+  /**
+   * \brief: 2D allreduce over ranks laid row by row on a grid of num_cols
+   * columns, a reduce-scatter along the rows, an allreduce of the owned
+   * segment along the columns, then an all-gather along the rows. The rings
+   * are shorter and the inter-row traffic is divided by num_cols
+   */
+  void HierarchicalAllreduce(const std::vector<int>& ranks, int num_cols,
+                             float* data, size_t len, double loss_ratio,
+                             std::vector<Range>* partial);
+
+  /*! \brief: the segment this member holds after a reduce-scatter */
+  Range RingOwnedSegment(const std::vector<int>& ring, size_t len) const;
+
+  /*! \brief: return after all the members of the ring have entered */
+  void Barrier(const std::vector<int>& ring);
+
+  /*! \brief: the target size of a chunk, in bytes */
+  void set_chunk_bytes(size_t chunk_bytes) { chunk_bytes_ = chunk_bytes; }
+
+  /*! \brief: the policy choosing the loss ratio of each chunk, not owned */
+  void set_loss_policy(LossPolicy* loss_policy) { loss_policy_ = loss_policy; }
+
+  /*! \brief: the layer of the tensors of the next operations, for the policy */
+  void set_layer(int layer) { layer_ = layer; }
+
+ private:
+  enum Phase { kReduceScatter = 0, kAllGather = 1, kBarrier = 2 };
+
+  struct Event {
+    bool is_recv;
+    Phase phase;
+    int step;
+    int chunk;
+  };
+
+  struct RecvState {
+    bool data_done = false;
+    bool meta_done = false;
+    bool queued = false;
+    /// element ranges of the chunk that did not arrive
+    std::vector<Range> missing;
+    /// partial ranges of the chunk at the sender
+    std::vector<Range> upstream;
+  };
+
+  /// the state of one ring operation
+  struct RingOp {
+    int n;
+    int index;
+    int left;
+    int right;
+    int op_id;
+    float* data;
+    size_t len;
+    double loss_ratio;
+    bool reduce_scatter;
+    bool all_gather;
+    int num_chunks;
+    int pending_sends;
+    int pending_recvs;
+    /// partial ranges of each chunk, indexed by segment * num_chunks + chunk
+    std::vector<std::vector<Range>> partial;
+    std::unordered_map<int, RecvState> recvs;
+  };
+
+  void RunRing(const std::vector<int>& ring, float* data, size_t len,
+               double loss_ratio, bool reduce_scatter, bool all_gather,
+               std::vector<Range>* partial);
+
+  void Progress(RingOp* op);
+
+  void HandleRecv(RingOp* op, const Event& ev);
+
+  void HandleSend(RingOp* op, const Event& ev);
+
+  void PostRecv(RingOp* op, Phase phase, int step, int chunk);
+
+  void Send(RingOp* op, Phase phase, int step, int chunk);
+
+  void CheckRecvReady(RingOp* op, int msg_id);
+
+  void PollMeta(std::vector<FlowId>* arrived);
+
+  void SendMeta(int dest, int msg_id, const std::vector<Range>& ranges);
+
+  /// the segment sent or received at a step of a phase
+  int SegmentOf(const RingOp& op, Phase phase, int step, bool recv) const;
+
+  Range Chunk(const RingOp& op, int segment, int chunk) const;
+
+  static Range Split(size_t first, size_t last, int parts, int i);
+
+  static int MsgId(int op_id, Phase phase, int step, int chunk);
+
+  static void DecodeMsgId(int msg_id, int* op_id, Phase* phase, int* step,
+                          int* chunk);
+
+  MLTCommunicator* comm_;
+  CompletionQueue* cq_;
+  PktPrioFunc* prio_func_;
+  LossPolicy* loss_policy_{nullptr};
+  int layer_{-1};
+  size_t chunk_bytes_;
+  /*! \brief: sequence number of the ring operations, the same on all ranks */
+  int op_seq_{0};
+  /*! \brief: temporary buffer for the incoming chunks of reduce-scatter */
+  std::vector<float> recv_buf_;
+  /*! \brief: metas received ahead, keyed by flow */
+  std::unordered_map<FlowId, std::vector<Range>> metas_;
+  std::deque<Event> ready_;
+};
+
+#endif  // COLLECTIVE_H_
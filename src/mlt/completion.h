@@ -3,6 +3,8 @@
 
 #include <mutex>
 #include <queue>
+#include <utility>
+#include <vector>
 
 enum class CompletionType : uint32_t {
   kSend,
@@ -19,6 +21,11 @@ struct Completion {
     size_t bytes_received;
     size_t bytes_sent;
   };
+  /// a kRecv flow lost some bytes, then recv_ranges holds those that arrived
+  bool partial = false;
+  /// byte ranges [first, last) of a partial kRecv flow that arrived, empty if
+  /// none did by the deadline of the receive. empty if the flow is whole
+  std::vector<std::pair<size_t, size_t>> recv_ranges;
 };
 
 struct CompletionQueue {
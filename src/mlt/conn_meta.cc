@@ -1,24 +1,80 @@
 #include "conn_meta.h"
 #include "mlt_global.h"
+#include "thread_proto.h"
 
 ConnMeta::ConnMeta(int dest)
     : dest_comm_id{dest},
       tx_meter{MLTGlobal::Get()->RateMonitorIntervalUs()},
-      rx_meter{MLTGlobal::Get()->RateMonitorIntervalUs()} {
+      pacing{PacingMode::kUser},
+      paced_rate{0},
+      rx_meter{MLTGlobal::Get()->RateMonitorIntervalUs()},
+      flow_handle_used(kMaxFlowHandles),
+      next_flow_handle{0},
+      rx_flow_epoch{0},
+      early_next{0} {
   send_window.store(MLTGlobal::Get()->InitialSendingWindow());
   sending_rate.store(MLTGlobal::Get()->InitialSendingRate());
+  rx_loss_rate.store(0);
+  segment = MLTGlobal::Get()->MaxPayload();
+  rx_max_segment = segment;
   InitBacklog();
+  InitEarlyPackets();
 }
 
 void ConnMeta::InitBacklog() {
   backlog_buffer_size = MLTGlobal::Get()->ConnectionBacklogSize();
+  backlog_slot = 0;
   if (prism::GetEnvOrDefault<int>("MLT_DISABLE_FLOW_BACKLOG", 1) != 0)
     return;
 
   backlog_buffer = std::unique_ptr<char[]>(new char[backlog_buffer_size]);
+  const auto& local_cpus = MLTGlobal::Get()->LocalCpus();
+  if (!local_cpus.empty()) {
+    ThreadProto::TouchOnCpus(backlog_buffer.get(), backlog_buffer_size,
+                             local_cpus);
+  }
+  CarveBacklog(rx_max_segment + MLTGlobal::Get()->PacketHeaderSize());
+}
+
+void ConnMeta::CarveBacklog(size_t slot) {
+  if (!backlog_buffer || slot == backlog_slot) return;
+  /// the slots held by packets would be cut in two, try at the next FlowStart
+  if (backlog_slot &&
+      backlog_free_list.size() != backlog_buffer_size / backlog_slot)
+    return;
+  backlog_slot = slot;
+  backlog_free_list.clear();
   char* ptr = backlog_buffer.get();
-  while (ptr < ptr + backlog_buffer_size) {
+  char* end = ptr + backlog_buffer_size;
+  while (ptr + slot <= end) {
     backlog_free_list.emplace_back(reinterpret_cast<GradPacket*>(ptr));
-    ptr += MLTGlobal::Get()->MaxSegment();
+    ptr += slot;
   }
-}
\ No newline at end of file
+}
+void ConnMeta::InitEarlyPackets() {
+  if (!MLTGlobal::Get()->CompactHeader()) return;
+  size_t num_pkts = prism::GetEnvOrDefault<int>("MLT_EARLY_PACKETS", 256);
+  size_t segment = MLTGlobal::Get()->MaxSegment();
+  early_buffer = std::unique_ptr<char[]>(new char[num_pkts * segment]);
+  early_pkts.resize(num_pkts, EarlyPacket{0, 0, 0});
+}
+
+uint16_t ConnMeta::AcquireFlowHandle() {
+  std::lock_guard<std::mutex> lk(flow_handle_mtx);
+  for (int i = 0; i < kMaxFlowHandles; i++) {
+    int handle = next_flow_handle;
+    next_flow_handle = (next_flow_handle + 1) % kMaxFlowHandles;
+    if (!flow_handle_used[handle]) {
+      flow_handle_used[handle] = true;
+      return handle;
+    }
+  }
+  LOG(FATAL) << "all " << kMaxFlowHandles << " flow handles to " << dest_comm_id
+             << " are in use";
+  return 0;
+}
+
+void ConnMeta::ReleaseFlowHandle(uint16_t handle) {
+  std::lock_guard<std::mutex> lk(flow_handle_mtx);
+  flow_handle_used[handle] = false;
+}
@@ -5,7 +5,9 @@
 #include "buffer.h"
 #include "ltmessage.h"
 #include "prio_func.h"
+#include "shared_flow.h"
 #include "meter.h"
+#include "pacer.h"
 
 #include <atomic>
 #include <map>
@@ -26,9 +28,21 @@ struct ConnMeta {
   // sending window, unit: bytes
   std::atomic<size_t> send_window;
   std::atomic<double> sending_rate;
+  // moving average of the share of a flow from the peer missing when its
+  // first pass is over, written by receiving thread
+  std::atomic<double> rx_loss_rate;
+  // gradient bytes of a full packet to the peer, from the path MTU
+  uint32_t segment;
+  // the largest gradient bytes of a full packet among the flows from the
+  // peer, learned from FlowStart. the flows of a multicast may be cut
+  // smaller, see LtMessageExt::segment. only accessed by receiving thread
+  uint32_t rx_max_segment;
 
-  using SendRequest = std::tuple<std::unique_ptr<LtMessageExt>, PktPrioFunc*>;
-  // key: msg_id, value <LtMessageExt, PktPrioFunc*>
+  // the last element is the packets shared by the destinations of a
+  // multicast flow, nullptr otherwise
+  using SendRequest = std::tuple<std::unique_ptr<LtMessageExt>, PktPrioFunc*,
+                                 std::shared_ptr<SharedFlow>>;
+  // key: msg_id, value <LtMessageExt, PktPrioFunc*, SharedFlow>
   std::map<int, SendRequest> sending_msgs;
   std::map<int, SendRequest> retransmitting_msgs;
   // key: msg_id, value buffer with type kRetransmitRequest, current index in pkt_seqs
@@ -43,6 +57,11 @@ struct ConnMeta {
 
   // sending rate monitor
   RateMeter tx_meter;
+  // how the packets to the peer are paced, the next departure and the rate
+  // the kernel has, only accessed by the tx thread
+  PacingMode pacing;
+  TxClock tx_clock;
+  double paced_rate;
   // receiving rate monitor
   RateMeter rx_meter;
 
@@ -53,12 +72,57 @@ struct ConnMeta {
   // these members are only accessed by receiving thread
   size_t backlog_buffer_size;
   std::unique_ptr<char[]> backlog_buffer;
+  // bytes of a slot, a datagram of rx_max_segment
+  size_t backlog_slot;
   std::vector<GradPacket*> backlog_free_list;
-  std::unordered_map<int, std::vector<GradPacket*>> backlog_used_map;
+  // a raw packet and its datagram length, the compact header does not carry it
+  using BacklogPacket = std::pair<GradPacket*, uint32_t>;
+  std::unordered_map<int, std::vector<BacklogPacket>> backlog_used_map;
+
+  // flow handles of the compact packet header. the sender takes them round
+  // robin, so that a late packet never finds its handle reused soon
+  std::mutex flow_handle_mtx;
+  std::vector<bool> flow_handle_used;
+  int next_flow_handle;
+  // the receiver learns them from FlowStart, only accessed by receiving thread
+  // index: handle, value: the posted receive, or nullptr
+  std::vector<LtMessageExt*> rx_flows;
+  // index: handle, value: msg_id, or -1 if the handle is unknown
+  std::vector<int> rx_flow_msg_ids;
+  // index: handle, value: the segment of its flow
+  std::vector<uint32_t> rx_flow_segments;
+  // key: msg_id, value: handle
+  std::unordered_map<int, uint16_t> rx_flow_handles;
+  // number of FlowStart received
+  uint64_t rx_flow_epoch;
+  // the receives completed by their deadline, whose StopConfirm has not
+  // arrived, their packets are dropped. key: msg_id, value: whether
+  // StopRequest has been sent, it waits for a sign that the flow has started
+  std::unordered_map<int, bool> rx_expired;
+  // a ring of the packets that overtook the FlowStart of their handle
+  struct EarlyPacket {
+    uint64_t epoch;
+    uint32_t size;  // 0 if the slot is free
+    uint16_t handle;
+  };
+  std::unique_ptr<char[]> early_buffer;
+  std::vector<EarlyPacket> early_pkts;
+  size_t early_next;
 
   ConnMeta(int dest);
 
   void InitBacklog();
+
+  // cut the backlog into slots of the given bytes, unless a packet is held
+  void CarveBacklog(size_t slot);
+
+  void InitEarlyPackets();
+
+  /// called by user thread
+  uint16_t AcquireFlowHandle();
+
+  /// called by priority channel thread
+  void ReleaseFlowHandle(uint16_t handle);
 };
 
 #endif  //  CONN_META_H_
\ No newline at end of file
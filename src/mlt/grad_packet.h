@@ -1,12 +1,17 @@
 #ifndef GRAD_PACKET_H_
 #define GRAD_PACKET_H_
 
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include <sstream>
 
+#include "prism/logging.h"
+
 #define PACKED __attribute__((__packed__))
 
-// TODO(cjr): compress this header
+/// the in-memory form of a packet. its first kGradPacketHeader bytes are the
+/// legacy header on the wire, see CompactGradHeader for the compact one
 struct GradMessage {
   uint32_t msg_id;      // a.k.a. tensor_id, get from the application
   uint32_t offset;       // offset in the origin tensor
@@ -17,6 +22,8 @@ struct GradMessage {
   uint8_t tos;
   uint8_t is_last;       // whether it is the last packet of the flow
   uint64_t grad_ptr;
+  uint16_t handle;       // flow handle, only on the wire of the compact header
+  uint64_t txtime;       // earliest departure on CLOCK_MONOTONIC, 0 for now
 
   /// Attention: this function is very slow, should not occur in datapath
   inline std::string DebugString() const {
@@ -28,7 +35,8 @@ struct GradMessage {
        << ", dst_comm_id: " << dst_comm_id
        << ", src_comm_id: " << src_comm_id
        << ", tos: " << static_cast<int>(tos)
-       << ", is_last: " << static_cast<bool>(is_last) << " }";
+       << ", is_last: " << static_cast<bool>(is_last)
+       << ", handle: " << handle << " }";
     return ss.str();
   }
 
@@ -48,10 +56,71 @@ struct GradMessage {
 /// packet
 using GradPacket = GradMessage;
 
-const int kGradPacketHeader = sizeof(GradPacket) - sizeof(GradMessage::grad_ptr);
+const int kGradPacketHeader = offsetof(GradMessage, grad_ptr);
 
 static_assert(kGradPacketHeader == 20);
 
+/// the packet on the wire ends its header before grad_ptr, so parse a copy of
+/// the header rather than writing grad_ptr over the first gradients
+inline void ParseGradPacket(const char* buf, GradPacket* pkt) {
+  memcpy(pkt, buf, kGradPacketHeader);
+  pkt->grad_ptr = reinterpret_cast<uint64_t>(buf + kGradPacketHeader);
+  pkt->handle = 0;
+}
+
+/**
+ * The compact header of version 1. The other fields of the legacy header are
+ * implied: offset is seq times the payload bound, len comes from the datagram
+ * length, dst_comm_id from the socket and tos from the IP header. msg_id and
+ * the payload bound are found from the handle, which the sender announces in
+ * FlowStart.
+ */
+struct CompactGradHeader {
+  uint16_t src_comm_id;
+  uint16_t handle;
+  uint32_t seq_flags;    // version: 2 bits, is_last: 1 bit, seq: 29 bits
+} PACKED;
+
+const int kCompactGradHeader = sizeof(CompactGradHeader);
+
+static_assert(kCompactGradHeader == 8);
+
+const uint32_t kCompactHeaderVersion = 1;
+const uint32_t kCompactSeqMask = (1u << 29) - 1;
+/// the handles of the flows on one connection
+const int kMaxFlowHandles = 1 << 16;
+
+inline void WriteCompactGradHeader(const GradPacket& pkt,
+                                   CompactGradHeader* hdr) {
+  hdr->src_comm_id = pkt.src_comm_id;
+  hdr->handle = pkt.handle;
+  hdr->seq_flags = (kCompactHeaderVersion << 30) |
+                   (static_cast<uint32_t>(pkt.is_last != 0) << 29) |
+                   (pkt.seq & kCompactSeqMask);
+}
+
+/// parse all but msg_id, offset and dst_comm_id, return false if the version
+/// does not match. offset is seq times the payload bound of the flow, which
+/// the caller knows. len is kept as in the legacy header, payload plus
+/// kGradPacketHeader
+inline bool ParseCompactGradPacket(const char* buf, size_t size,
+                                   GradPacket* pkt) {
+  CompactGradHeader hdr;
+  memcpy(&hdr, buf, kCompactGradHeader);
+  if ((hdr.seq_flags >> 30) != kCompactHeaderVersion) return false;
+  pkt->msg_id = 0;
+  pkt->seq = hdr.seq_flags & kCompactSeqMask;
+  pkt->offset = 0;
+  pkt->len = size - kCompactGradHeader + kGradPacketHeader;
+  pkt->dst_comm_id = 0;
+  pkt->src_comm_id = hdr.src_comm_id;
+  pkt->tos = 0;
+  pkt->is_last = (hdr.seq_flags >> 29) & 1;
+  pkt->grad_ptr = reinterpret_cast<uint64_t>(buf + kCompactGradHeader);
+  pkt->handle = hdr.handle;
+  return true;
+}
+
 template <typename T>
 inline T* GetGradientPtr(const GradPacket& pkt) {
   return reinterpret_cast<T*>(pkt.grad_ptr);
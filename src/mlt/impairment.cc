@@ -0,0 +1,250 @@
+#include "impairment.h"
+#include "pacer.h"
+
+#include "prism/logging.h"
+#include "prism/utils.h"
+
+#include <netinet/in.h>
+#include <algorithm>
+#include <functional>
+#include <sstream>
+
+namespace {
+
+/// "tos:probability,..." into the drop probability of each tos
+void ParseTosLoss(const std::string& str, std::array<double, 256>* tos_loss) {
+  std::stringstream ss(str);
+  for (std::string item; std::getline(ss, item, ',');) {
+    if (item.empty()) continue;
+    auto colon = item.find(':');
+    CHECK(colon != std::string::npos) << "invalid MLT_IMPAIR_TOS_LOSS: " << str;
+    long tos = std::stol(item.substr(0, colon), nullptr, 0);
+    CHECK(0 <= tos && tos < 256) << "invalid tos in MLT_IMPAIR_TOS_LOSS: " << tos;
+    (*tos_loss)[tos] = std::stod(item.substr(colon + 1));
+  }
+}
+
+/// the destination of a datagram as a key
+uint64_t LinkKey(const struct sockaddr_storage& addr, socklen_t addrlen) {
+  if (addr.ss_family == AF_INET) {
+    auto in = reinterpret_cast<const struct sockaddr_in*>(&addr);
+    return (static_cast<uint64_t>(in->sin_addr.s_addr) << 16) | in->sin_port;
+  }
+  return std::hash<std::string>()(
+      std::string(reinterpret_cast<const char*>(&addr), addrlen));
+}
+
+}  // namespace
+
+ImpairmentConfig ImpairmentConfig::FromEnv() {
+  ImpairmentConfig config;
+  config.loss = prism::GetEnvOrDefault<double>("MLT_IMPAIR_LOSS", 0);
+  config.ge_p = prism::GetEnvOrDefault<double>("MLT_IMPAIR_GE_P", 0);
+  config.ge_r = prism::GetEnvOrDefault<double>("MLT_IMPAIR_GE_R", 1);
+  config.ge_bad_loss = prism::GetEnvOrDefault<double>("MLT_IMPAIR_GE_LOSS", 1);
+  ParseTosLoss(prism::GetEnvOrDefault<std::string>("MLT_IMPAIR_TOS_LOSS", ""),
+               &config.tos_loss);
+  config.reorder = prism::GetEnvOrDefault<double>("MLT_IMPAIR_REORDER", 0);
+  config.reorder_window =
+      prism::GetEnvOrDefault<int>("MLT_IMPAIR_REORDER_WINDOW", 3);
+  config.delay_ns =
+      prism::GetEnvOrDefault<long>("MLT_IMPAIR_DELAY_US", 0) * 1000;
+  config.jitter_ns =
+      prism::GetEnvOrDefault<long>("MLT_IMPAIR_JITTER_US", 0) * 1000;
+  config.rate = prism::GetEnvOrDefault<double>("MLT_IMPAIR_RATE", 0);
+  config.max_queue = prism::GetEnvOrDefault<long>("MLT_IMPAIR_QUEUE", 4096);
+  config.seed = prism::GetEnvOrDefault<long>("MLT_IMPAIR_SEED", 1);
+  return config;
+}
+
+bool ImpairmentConfig::enabled() const {
+  bool tos_loss_set = std::any_of(tos_loss.begin(), tos_loss.end(),
+                                  [](double p) { return p > 0; });
+  return loss > 0 || ge_p > 0 || tos_loss_set || reorder > 0 || delay_ns ||
+         jitter_ns || rate > 0;
+}
+
+ImpairedIoEngine::ImpairedIoEngine(IoEngine* engine,
+                                   const ImpairmentConfig& config,
+                                   uint64_t salt)
+    : engine_{engine}, config_{config}, salt_{salt} {
+  CHECK_GT(config_.max_queue, 0);
+}
+
+ImpairedIoEngine::~ImpairedIoEngine() {
+  size_t total = num_sent_ + num_tos_dropped_ + num_lost_;
+  LOG(INFO) << "impairment: " << total << " datagrams, " << num_tos_dropped_
+            << " dropped by tos, " << num_lost_ << " lost, " << num_reordered_
+            << " reordered, " << queue_.size() + held_ << " still held";
+}
+
+ImpairedIoEngine::Link* ImpairedIoEngine::GetLink(uint64_t key) {
+  auto it = links_.find(key);
+  if (it == links_.end()) {
+    it = links_.emplace(key, Link()).first;
+    /// seed_seq keeps 32 bits of each value
+    std::seed_seq seq{config_.seed, config_.seed >> 32, salt_, salt_ >> 32,
+                      key, key >> 32};
+    it->second.rng.seed(seq);
+  }
+  return &it->second;
+}
+
+bool ImpairedIoEngine::Lose(Link* link) {
+  if (config_.ge_p > 0) {
+    link->bad = link->bad ? Uniform(link) >= config_.ge_r
+                          : Uniform(link) < config_.ge_p;
+  }
+  double p = link->bad ? config_.ge_bad_loss : config_.loss;
+  return p > 0 && Uniform(link) < p;
+}
+
+int ImpairedIoEngine::SendMsgs(int fd, struct msghdr* msgs, int n) {
+  int tos = 0;
+  socklen_t optlen = sizeof(tos);
+  PCHECK(!getsockopt(fd, IPPROTO_IP, IP_TOS, &tos, &optlen));
+  /// a connected socket sends without an address
+  struct sockaddr_storage peer;
+  socklen_t peerlen = 0;
+
+  uint64_t now = MonotonicNs();
+  int i = 0;
+  for (; i < n && queue_.size() + held_ < config_.max_queue; i++) {
+    const struct msghdr& msg = msgs[i];
+    Datagram d;
+    d.fd = fd;
+    d.addrlen = msg.msg_namelen;
+    if (msg.msg_name) {
+      memcpy(&d.addr, msg.msg_name, msg.msg_namelen);
+      d.link = LinkKey(d.addr, d.addrlen);
+    } else {
+      d.addrlen = 0;
+      if (!peerlen) {
+        peerlen = sizeof(peer);
+        PCHECK(!getpeername(fd, reinterpret_cast<struct sockaddr*>(&peer),
+                            &peerlen));
+      }
+      d.link = LinkKey(peer, peerlen);
+    }
+
+    Link* link = GetLink(d.link);
+    double tos_loss = config_.tos_loss[tos & 0xff];
+    if (tos_loss > 0 && Uniform(link) < tos_loss) {
+      num_tos_dropped_++;
+      continue;
+    }
+    if (Lose(link)) {
+      num_lost_++;
+      continue;
+    }
+
+    for (size_t j = 0; j < msg.msg_iovlen; j++) {
+      d.bytes.append(static_cast<const char*>(msg.msg_iov[j].iov_base),
+                     msg.msg_iov[j].iov_len);
+    }
+    uint64_t departure = now;
+    if (config_.rate > 0) {
+      departure = std::max(now, link->free_ns);
+      link->free_ns =
+          departure + static_cast<uint64_t>(d.bytes.size() * 1e9 / config_.rate);
+    }
+    int64_t release = departure + config_.delay_ns;
+    if (config_.jitter_ns) {
+      release += static_cast<int64_t>((2 * Uniform(link) - 1) * config_.jitter_ns);
+      release = std::max<int64_t>(release, departure);
+    }
+    if (config_.reorder > 0 && Uniform(link) < config_.reorder) {
+      link->held.emplace_back(config_.reorder_window, std::move(d));
+      held_++;
+      num_reordered_++;
+      continue;
+    }
+    Enqueue(std::move(d), release);
+  }
+  return i;
+}
+
+void ImpairedIoEngine::Enqueue(Datagram&& d, uint64_t release_ns) {
+  GetLink(d.link)->queued++;
+  queue_.emplace(std::make_pair(release_ns, seq_++), std::move(d));
+}
+
+void ImpairedIoEngine::ReleaseHeld(Link* link, uint64_t now_ns, bool all) {
+  for (size_t i = 0; i < link->held.size();) {
+    if (!all && link->held[i].first > 0) {
+      i++;
+      continue;
+    }
+    Enqueue(std::move(link->held[i].second), now_ns);
+    link->held.erase(link->held.begin() + i);
+    held_--;
+  }
+}
+
+bool ImpairedIoEngine::Transmit(const Datagram& d) {
+  struct iovec iov = {const_cast<char*>(d.bytes.data()), d.bytes.size()};
+  struct msghdr msg = {};
+  if (d.addrlen) {
+    msg.msg_name = const_cast<struct sockaddr_storage*>(&d.addr);
+    msg.msg_namelen = d.addrlen;
+  }
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  return engine_->SendMsgs(d.fd, &msg, 1) == 1;
+}
+
+void ImpairedIoEngine::Flush() {
+  if (queue_.empty() && !held_) return;
+  uint64_t now = MonotonicNs();
+  for (;;) {
+    while (!queue_.empty() && queue_.begin()->first.first <= now) {
+      auto it = queue_.begin();
+      if (!Transmit(it->second)) return;
+      Link* link = GetLink(it->second.link);
+      queue_.erase(it);
+      link->queued--;
+      num_sent_++;
+      for (auto& held : link->held) held.first--;
+      ReleaseHeld(link, now, false);
+    }
+    if (!held_) return;
+    /// nothing is left to overtake the reordered datagrams of an idle link
+    bool released = false;
+    for (auto& kv : links_) {
+      Link* link = &kv.second;
+      if (link->queued || link->held.empty()) continue;
+      ReleaseHeld(link, now, true);
+      released = true;
+    }
+    if (!released) return;
+  }
+}
+
+void ImpairedIoEngine::RemoveSender(int fd) {
+  for (auto it = queue_.begin(); it != queue_.end();) {
+    if (it->second.fd != fd) {
+      ++it;
+      continue;
+    }
+    GetLink(it->second.link)->queued--;
+    it = queue_.erase(it);
+  }
+  for (auto& kv : links_) {
+    auto& held = kv.second.held;
+    size_t before = held.size();
+    held.erase(std::remove_if(held.begin(), held.end(),
+                              [fd](const std::pair<int, Datagram>& h) {
+                                return h.second.fd == fd;
+                              }),
+               held.end());
+    held_ -= before - held.size();
+  }
+  engine_->RemoveSender(fd);
+}
+
+IoEngine* CreateImpairment(IoEngine* engine, uint64_t salt) {
+  ImpairmentConfig config = ImpairmentConfig::FromEnv();
+  if (!config.enabled()) return engine;
+  LOG(WARNING) << "the datagrams go through the impairments of MLT_IMPAIR_*";
+  return new ImpairedIoEngine(engine, config, salt);
+}
@@ -0,0 +1,142 @@
+#ifndef IMPAIRMENT_H_
+#define IMPAIRMENT_H_
+
+#include "io_engine.h"
+
+#include <stdint.h>
+#include <array>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * what the emulated network does to the datagrams, read from MLT_IMPAIR_*.
+ * the loss follows a Gilbert-Elliott chain per destination: a packet is lost
+ * with loss in the good state and bad_loss in the bad one, the chain turns
+ * bad with p and good again with r at each packet, p = 0 is Bernoulli loss
+ */
+struct ImpairmentConfig {
+  double loss{0};
+  double ge_p{0};
+  double ge_r{1};
+  double ge_bad_loss{1};
+  /// drop probability of the packets of each tos, as a priority queue would
+  std::array<double, 256> tos_loss{};
+  /// a packet is held back with reorder until reorder_window later packets
+  /// to its destination have left
+  double reorder{0};
+  int reorder_window{3};
+  /// delay plus a uniform jitter in [-jitter, jitter]
+  uint64_t delay_ns{0};
+  uint64_t jitter_ns{0};
+  /// bytes per second of the link to each destination, 0 unlimited
+  double rate{0};
+  /// datagrams held at most, the sender is pushed back beyond
+  size_t max_queue{4096};
+  uint64_t seed{1};
+
+  static ImpairmentConfig FromEnv();
+
+  /// whether any impairment is asked for
+  bool enabled() const;
+};
+
+/**
+ * ImpairedIoEngine sits between the endpoints and the engine sending their
+ * datagrams, and emulates a lossy network on a loopback box. It takes the
+ * datagrams, decides their fate and holds them until their release, Flush
+ * passes the due ones to the engine. Each destination draws from its own
+ * generator seeded by the config, the salt and the address, so that a run
+ * drops the same packets whatever the interleaving of the destinations.
+ * The held datagrams leave without their cmsg, e.g. SCM_TXTIME.
+ */
+class ImpairedIoEngine : public IoEngine {
+ public:
+  ImpairedIoEngine(IoEngine* engine, const ImpairmentConfig& config,
+                   uint64_t salt);
+
+  virtual ~ImpairedIoEngine();
+
+  virtual int SendMsgs(int fd, struct msghdr* msgs, int n) override;
+
+  virtual void Flush() override;
+
+  virtual void RemoveSender(int fd) override;
+
+  virtual bool HasReceivers() const override {
+    return engine_->HasReceivers();
+  }
+
+  virtual void AddReceiver(int fd, void* ctx, bool stream) override {
+    engine_->AddReceiver(fd, ctx, stream);
+  }
+
+  virtual void RemoveReceiver(int fd) override { engine_->RemoveReceiver(fd); }
+
+  virtual size_t PollRecv(const RecvCallback& fn) override {
+    return engine_->PollRecv(fn);
+  }
+
+  virtual int fd() const override { return engine_->fd(); }
+
+ private:
+  struct Datagram {
+    int fd;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    std::string bytes;
+    uint64_t link;
+  };
+
+  struct Link {
+    std::mt19937_64 rng;
+    /// the state of the Gilbert-Elliott chain
+    bool bad{false};
+    /// when the emulated link is idle again
+    uint64_t free_ns{0};
+    /// datagrams of the link in queue_
+    size_t queued{0};
+    /// the reordered datagrams and how many more have to leave before them
+    std::vector<std::pair<int, Datagram>> held;
+  };
+
+  Link* GetLink(uint64_t key);
+
+  double Uniform(Link* link) {
+    return std::uniform_real_distribution<double>(0, 1)(link->rng);
+  }
+
+  /// whether the channel loses the next datagram of the link
+  bool Lose(Link* link);
+
+  void Enqueue(Datagram&& d, uint64_t release_ns);
+
+  /// move the reordered datagrams of the link due, or all, to queue_
+  void ReleaseHeld(Link* link, uint64_t now_ns, bool all);
+
+  /// false if the socket is full
+  bool Transmit(const Datagram& d);
+
+  std::unique_ptr<IoEngine> engine_;
+  ImpairmentConfig config_;
+  uint64_t salt_;
+  std::unordered_map<uint64_t, Link> links_;
+  /// key: release time and arrival order
+  std::map<std::pair<uint64_t, uint64_t>, Datagram> queue_;
+  uint64_t seq_{0};
+  size_t held_{0};
+
+  size_t num_sent_{0};
+  size_t num_tos_dropped_{0};
+  size_t num_lost_{0};
+  size_t num_reordered_{0};
+};
+
+/// wrap engine with the impairments asked by MLT_IMPAIR_*, or return it as
+/// is if none. salt tells the senders apart
+IoEngine* CreateImpairment(IoEngine* engine, uint64_t salt);
+
+#endif  // IMPAIRMENT_H_
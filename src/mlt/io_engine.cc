@@ -0,0 +1,460 @@
+#include "io_engine.h"
+
+#include "prism/logging.h"
+#include "prism/utils.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+class EpollIoEngine : public IoEngine {
+ public:
+  int SendMsgs(int fd, struct msghdr* msgs, int n) override {
+    for (int i = 0; i < n; i++) {
+      if (sendmsg(fd, &msgs[i], 0) != -1 || errno == ECONNREFUSED) continue;
+      CHECK(errno == EAGAIN || errno == EWOULDBLOCK) << "errno = " << errno;
+      return i;
+    }
+    return n;
+  }
+};
+
+/// the submission and completion rings on the raw syscalls
+class IoUring {
+ public:
+  ~IoUring() {
+    if (sqes_ != MAP_FAILED) munmap(sqes_, sqes_size_);
+    if (cq_ring_ != MAP_FAILED) munmap(cq_ring_, cq_ring_size_);
+    if (sq_ring_ != MAP_FAILED) munmap(sq_ring_, sq_ring_size_);
+    if (fd_ >= 0) close(fd_);
+  }
+
+  bool Init(unsigned entries, bool sqpoll) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    if (sqpoll) {
+      p.flags |= IORING_SETUP_SQPOLL;
+      p.sq_thread_idle = 1000;
+    }
+    fd_ = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd_ < 0) return false;
+    sqpoll_ = sqpoll;
+
+    sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+    sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED) return false;
+    if (!single_mmap) {
+      cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+      if (cq_ring_ == MAP_FAILED) return false;
+    }
+    sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return false;
+    sqes_ = static_cast<struct io_uring_sqe*>(sqes);
+
+    char* sq = static_cast<char*>(sq_ring_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    sq_flags_ = reinterpret_cast<unsigned*>(sq + p.sq_off.flags);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    sq_entries_ = p.sq_entries;
+    /// the sqe of a slot is always the one of the same index
+    unsigned* array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    for (unsigned i = 0; i < sq_entries_; i++) array[i] = i;
+
+    char* cq = static_cast<char*>(single_mmap ? sq_ring_ : cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+    return true;
+  }
+
+  inline unsigned SqSpace() const {
+    return sq_entries_ - (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE));
+  }
+
+  /// a zeroed sqe, nullptr if the ring is full
+  inline struct io_uring_sqe* GetSqe() {
+    if (SqSpace() == 0) return nullptr;
+    struct io_uring_sqe* sqe = &sqes_[sqe_tail_++ & sq_mask_];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+  }
+
+  /// hand the new sqes to the kernel and wait for wait_nr completions, under
+  /// SQPOLL no syscall is made unless the kernel thread sleeps or we wait
+  int Submit(unsigned wait_nr) {
+    unsigned to_submit = sqe_tail_ - submitted_;
+    __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+    submitted_ = sqe_tail_;
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    if (sqpoll_) {
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (__atomic_load_n(sq_flags_, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+        flags |= IORING_ENTER_SQ_WAKEUP;
+      if (!flags) return 0;
+    } else if (!to_submit && !wait_nr) {
+      return 0;
+    }
+    return Enter(to_submit, wait_nr, flags);
+  }
+
+  inline struct io_uring_cqe* PeekCqe() {
+    unsigned head = *cq_head_;
+    if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+      if (!(__atomic_load_n(sq_flags_, __ATOMIC_RELAXED) &
+            IORING_SQ_CQ_OVERFLOW)) {
+        return nullptr;
+      }
+      /// the kernel keeps what did not fit, flush it into the ring
+      Enter(0, 0, IORING_ENTER_GETEVENTS);
+      if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) return nullptr;
+    }
+    return &cqes_[head & cq_mask_];
+  }
+
+  inline void SeenCqe() {
+    __atomic_store_n(cq_head_, *cq_head_ + 1, __ATOMIC_RELEASE);
+  }
+
+  inline int Register(unsigned opcode, void* arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd_, opcode, arg, nr_args);
+  }
+
+  inline int fd() const { return fd_; }
+
+ private:
+  int Enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+    int ret;
+    do {
+      ret = syscall(__NR_io_uring_enter, fd_, to_submit, min_complete, flags,
+                    nullptr, 0);
+    } while (ret < 0 && errno == EINTR);
+    PCHECK(ret >= 0 || errno == EBUSY || errno == EAGAIN) << "io_uring_enter";
+    return ret;
+  }
+
+  int fd_{-1};
+  bool sqpoll_{false};
+  void* sq_ring_{MAP_FAILED};
+  size_t sq_ring_size_{0};
+  void* cq_ring_{MAP_FAILED};
+  size_t cq_ring_size_{0};
+  struct io_uring_sqe* sqes_{static_cast<struct io_uring_sqe*>(MAP_FAILED)};
+  size_t sqes_size_{0};
+
+  unsigned* sq_head_;
+  unsigned* sq_tail_;
+  unsigned* sq_flags_;
+  unsigned sq_mask_;
+  unsigned sq_entries_;
+  /// the sqes handed out and those given to the kernel
+  unsigned sqe_tail_{0};
+  unsigned submitted_{0};
+
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned cq_mask_;
+  struct io_uring_cqe* cqes_;
+};
+
+/// the user_data of the sends, with their index in the batch, and cancels,
+/// the receivers have small ids
+constexpr uint64_t kTxTag = 1ULL << 63;
+constexpr uint64_t kCancelTag = 1ULL << 62;
+constexpr uint16_t kBufGroup = 0;
+
+class UringIoEngine : public IoEngine {
+ public:
+  ~UringIoEngine() {
+    if (buf_ring_ != MAP_FAILED) munmap(buf_ring_, buf_ring_size_);
+  }
+
+  bool Init(size_t buf_size, int num_bufs, unsigned entries, bool sqpoll) {
+    if (!ring_.Init(entries, sqpoll)) {
+      PLOG(WARNING) << "io_uring_setup";
+      return false;
+    }
+    if (num_bufs == 0) return true;
+    CHECK_EQ(num_bufs & (num_bufs - 1), 0) << "num_bufs must be 2^n";
+
+    /// a datagram comes after the header of recvmsg
+    buf_size_ = buf_size + sizeof(struct io_uring_recvmsg_out);
+    num_bufs_ = num_bufs;
+    bufs_ = std::make_unique<char[]>(buf_size_ * num_bufs_);
+    buf_ring_size_ = num_bufs_ * sizeof(struct io_uring_buf);
+    buf_ring_ = mmap(nullptr, buf_ring_size_, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf_ring_ == MAP_FAILED) return false;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring_);
+    reg.ring_entries = num_bufs_;
+    reg.bgid = kBufGroup;
+    if (ring_.Register(IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+      PLOG(WARNING) << "IORING_REGISTER_PBUF_RING, needs linux 5.19";
+      return false;
+    }
+    for (int bid = 0; bid < num_bufs_; bid++) RecycleBuf(bid);
+    PublishBufs();
+
+    memset(&recv_msg_, 0, sizeof(recv_msg_));
+    return true;
+  }
+
+  /// the batch is linked, so that a send which would block cancels those
+  /// after it and the order is kept
+  int SendMsgs(int fd, struct msghdr* msgs, int n) override {
+    n = std::min<int>(n, ring_.SqSpace());
+    for (int i = 0; i < n; i++) {
+      struct io_uring_sqe* sqe = ring_.GetSqe();
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->fd = fd;
+      sqe->addr = reinterpret_cast<uint64_t>(&msgs[i]);
+      sqe->len = 1;
+      sqe->user_data = kTxTag | i;
+      if (i + 1 < n) sqe->flags = IOSQE_IO_LINK;
+    }
+    results_.assign(n, 0);
+    int completed = 0;
+    ring_.Submit(n);
+    for (;;) {
+      struct io_uring_cqe* cqe;
+      while ((cqe = ring_.PeekCqe())) {
+        if (cqe->user_data & kTxTag) {
+          results_[cqe->user_data & ~kTxTag] = cqe->res;
+          completed++;
+        } else {
+          deferred_.push_back(*cqe);
+        }
+        ring_.SeenCqe();
+      }
+      if (completed == n) break;
+      ring_.Submit(1);
+    }
+
+    for (int i = 0; i < n; i++) {
+      int res = results_[i];
+      if (res >= 0 || res == -ECONNREFUSED) continue;
+      CHECK(res == -EAGAIN || res == -ECANCELED) << "sendmsg: " << strerror(-res);
+      return i;
+    }
+    return n;
+  }
+
+  bool HasReceivers() const override { return num_bufs_ > 0; }
+
+  void AddReceiver(int fd, void* ctx, bool stream) override {
+    CHECK(HasReceivers()) << "the engine has no receive ring";
+    uint64_t id = next_id_++;
+    receivers_[id] = {fd, ctx, stream};
+    fd_ids_[fd] = id;
+    Arm(id);
+    ring_.Submit(0);
+  }
+
+  void RemoveReceiver(int fd) override {
+    auto it = fd_ids_.find(fd);
+    if (it == fd_ids_.end()) return;
+    uint64_t id = it->second;
+    fd_ids_.erase(it);
+    /// the completions still coming find no receiver and are dropped
+    if (receivers_.erase(id) == 0) return;
+    struct io_uring_sqe* sqe = GetSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = id;
+    sqe->user_data = kCancelTag;
+    ring_.Submit(0);
+  }
+
+  size_t PollRecv(const RecvCallback& fn) override {
+    size_t count = 0;
+    for (const auto& cqe : deferred_) count += HandleRecv(cqe, fn);
+    deferred_.clear();
+    struct io_uring_cqe* cqe;
+    while ((cqe = ring_.PeekCqe())) {
+      struct io_uring_cqe copy = *cqe;
+      ring_.SeenCqe();
+      count += HandleRecv(copy, fn);
+    }
+    /// rearm once the buffers are back, or they would run out again
+    PublishBufs();
+    if (!rearming_.empty()) {
+      for (uint64_t id : rearming_) {
+        if (receivers_.count(id)) Arm(id);
+      }
+      rearming_.clear();
+      ring_.Submit(0);
+    }
+    return count;
+  }
+
+  int fd() const override { return ring_.fd(); }
+
+ private:
+  struct Receiver {
+    int fd;
+    void* ctx;
+    bool stream;
+  };
+
+  struct io_uring_sqe* GetSqe() {
+    struct io_uring_sqe* sqe = ring_.GetSqe();
+    if (!sqe) {
+      ring_.Submit(0);
+      sqe = ring_.GetSqe();
+      CHECK(sqe) << "the submission ring is full";
+    }
+    return sqe;
+  }
+
+  void Arm(uint64_t id) {
+    const Receiver& r = receivers_[id];
+    struct io_uring_sqe* sqe = GetSqe();
+    if (r.stream) {
+      sqe->opcode = IORING_OP_RECV;
+    } else {
+      sqe->opcode = IORING_OP_RECVMSG;
+      sqe->addr = reinterpret_cast<uint64_t>(&recv_msg_);
+      sqe->len = 1;
+    }
+    sqe->fd = r.fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kBufGroup;
+    if (multishot_) sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = id;
+  }
+
+  size_t HandleRecv(const struct io_uring_cqe& cqe, const RecvCallback& fn) {
+    if (cqe.user_data & (kTxTag | kCancelTag)) return 0;
+    bool has_buf = cqe.flags & IORING_CQE_F_BUFFER;
+    uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    uint64_t id = cqe.user_data;
+    auto it = receivers_.find(id);
+    if (it == receivers_.end()) {
+      if (has_buf) RecycleBuf(bid);
+      return 0;
+    }
+    Receiver r = it->second;
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+
+    if (cqe.res < 0 || (r.stream && cqe.res == 0)) {
+      if (has_buf) RecycleBuf(bid);
+      if (cqe.res == -ENOBUFS) {
+        /// all the buffers are with the channel
+      } else if (cqe.res == -EINVAL && multishot_) {
+        LOG(WARNING) << "no multishot receive, needs linux 6.0";
+        multishot_ = false;
+      } else if (r.stream) {
+        /// the end of the stream, or its error
+        RemoveReceiver(r.fd);
+        fn(r.ctx, nullptr, cqe.res);
+        return 0;
+      } else {
+        LOG(WARNING) << "recvmsg: " << strerror(-cqe.res);
+      }
+      if (!more) rearming_.push_back(id);
+      return 0;
+    }
+
+    CHECK(has_buf);
+    char* buf = bufs_.get() + bid * buf_size_;
+    if (r.stream) {
+      fn(r.ctx, buf, cqe.res);
+    } else {
+      auto out = reinterpret_cast<struct io_uring_recvmsg_out*>(buf);
+      CHECK_GE(static_cast<size_t>(cqe.res), sizeof(*out));
+      if (out->flags & MSG_TRUNC) {
+        LOG(WARNING) << "datagram of " << out->payloadlen << " bytes truncated";
+      } else {
+        fn(r.ctx, buf + sizeof(*out), out->payloadlen);
+      }
+    }
+    RecycleBuf(bid);
+    if (!more) rearming_.push_back(id);
+    return 1;
+  }
+
+  /// the ring is an array of io_uring_buf whose first resv is the tail. the
+  /// flexible array of io_uring_buf_ring does not start at 0 in C++, where
+  /// the empty struct before it takes a byte, so it is not used
+  inline void RecycleBuf(uint16_t bid) {
+    auto bufs = static_cast<struct io_uring_buf*>(buf_ring_);
+    struct io_uring_buf* buf =
+        &bufs[(buf_tail_ + bufs_to_publish_++) & (num_bufs_ - 1)];
+    buf->addr = reinterpret_cast<uint64_t>(bufs_.get() + bid * buf_size_);
+    buf->len = buf_size_;
+    buf->bid = bid;
+  }
+
+  inline void PublishBufs() {
+    if (bufs_to_publish_ == 0) return;
+    buf_tail_ += bufs_to_publish_;
+    bufs_to_publish_ = 0;
+    auto bufs = static_cast<struct io_uring_buf*>(buf_ring_);
+    __atomic_store_n(&bufs[0].resv, buf_tail_, __ATOMIC_RELEASE);
+  }
+
+  IoUring ring_;
+  /// the send results of a batch
+  std::vector<int> results_;
+  /// the receive completions reaped while waiting for the sends
+  std::vector<struct io_uring_cqe> deferred_;
+
+  /*! \brief: the receive ring, registered as a provided buffer ring */
+  size_t buf_size_{0};
+  int num_bufs_{0};
+  std::unique_ptr<char[]> bufs_;
+  void* buf_ring_{MAP_FAILED};
+  size_t buf_ring_size_{0};
+  uint16_t buf_tail_{0};
+  int bufs_to_publish_{0};
+
+  /// no name nor control, a datagram follows its io_uring_recvmsg_out
+  struct msghdr recv_msg_;
+  bool multishot_{true};
+  uint64_t next_id_{1};
+  std::unordered_map<uint64_t, Receiver> receivers_;
+  std::unordered_map<int, uint64_t> fd_ids_;
+  std::vector<uint64_t> rearming_;
+};
+
+}  // namespace
+
+IoEngine::Kind ParseIoEngine(const std::string& name) {
+  if (name == "epoll") return IoEngine::kEpoll;
+  if (name == "io_uring") return IoEngine::kIoUring;
+  LOG(FATAL) << "unknown io engine: " << name;
+  return IoEngine::kEpoll;
+}
+
+IoEngine* CreateIoEngine(IoEngine::Kind kind, size_t buf_size, int num_bufs) {
+  if (kind == IoEngine::kIoUring) {
+    unsigned entries = prism::GetEnvOrDefault<int>("MLT_IO_URING_ENTRIES", 1024);
+    bool sqpoll = prism::GetEnvOrDefault<int>("MLT_IO_URING_SQPOLL", 0);
+    auto engine = std::make_unique<UringIoEngine>();
+    if (engine->Init(buf_size, num_bufs, entries, sqpoll)) {
+      return engine.release();
+    }
+    LOG(WARNING) << "io_uring unavailable, fall back to epoll";
+  }
+  return new EpollIoEngine();
+}
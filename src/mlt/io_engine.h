@@ -0,0 +1,62 @@
+#ifndef IO_ENGINE_H_
+#define IO_ENGINE_H_
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <functional>
+#include <string>
+
+/**
+ * IoEngine moves the bytes of the sockets of a channel, each channel thread
+ * owns one. The epoll engine makes a syscall per sendmsg and lets the
+ * channels receive by themselves, the io_uring engine submits the tx queue
+ * as one batch and receives through multishot requests into a ring of
+ * buffers registered with the kernel, without a syscall per packet.
+ */
+class IoEngine {
+ public:
+  enum Kind { kEpoll, kIoUring };
+
+  /// a received datagram or a piece of a stream, size <= 0 ends a stream
+  using RecvCallback =
+      std::function<void(void* ctx, const char* buf, ssize_t size)>;
+
+  virtual ~IoEngine() {}
+
+  /// send the datagrams on fd in order, stop at the first which would block,
+  /// return how many are done. a datagram refused by the peer of a connected
+  /// socket is done too, it is lost as on an unconnected one
+  virtual int SendMsgs(int fd, struct msghdr* msgs, int n) = 0;
+
+  /// send what the engine holds back, the owning thread calls it in its loop
+  virtual void Flush() {}
+
+  /// forget what is held for fd, before closing it
+  virtual void RemoveSender(int fd) {}
+
+  /// whether the engine receives from the sockets, through AddReceiver and
+  /// PollRecv, instead of the channel
+  virtual bool HasReceivers() const { return false; }
+
+  /// receive from fd, datagrams or a byte stream, ctx goes to the callback
+  virtual void AddReceiver(int fd, void* ctx, bool stream) {}
+
+  /// stop receiving from fd, before closing it
+  virtual void RemoveReceiver(int fd) {}
+
+  /// pass what the receivers got to fn, return how many buffers
+  virtual size_t PollRecv(const RecvCallback& fn) { return 0; }
+
+  /// a fd readable while PollRecv has something, -1 if none
+  virtual int fd() const { return -1; }
+};
+
+// "epoll" or "io_uring"
+IoEngine::Kind ParseIoEngine(const std::string& name);
+
+/// buf_size and num_bufs size the receive ring of io_uring, num_bufs is a
+/// power of two or 0 for an engine which only sends. fall back to epoll if
+/// the kernel cannot
+IoEngine* CreateIoEngine(IoEngine::Kind kind, size_t buf_size, int num_bufs);
+
+#endif  // IO_ENGINE_H_
@@ -0,0 +1,110 @@
+#include "loss_policy.h"
+#include "mlt_communicator.h"
+
+#include "prism/utils.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace {
+
+/// the step of the allowance per iteration
+constexpr double kGain = 0.25;
+/// weight of the last iteration in the moving average of the dropped share
+constexpr double kDropRateGain = 0.125;
+/// a factor scales the allowance by no more than this, up or down
+constexpr double kMaxFactor = 4;
+/// the loss rate difference between connections that still matters
+constexpr double kLossEpsilon = 1e-3;
+
+double ClampFactor(double f) {
+  return std::min(kMaxFactor, std::max(1 / kMaxFactor, f));
+}
+
+/// the p-th percentile of the values, p in [0, 1]
+double Percentile(std::vector<double> values, double p) {
+  size_t k = std::min(values.size() - 1,
+                      static_cast<size_t>(p * values.size()));
+  std::nth_element(values.begin(), values.begin() + k, values.end());
+  return values[k];
+}
+
+}  // namespace
+
+AdaptiveLossPolicy::AdaptiveLossPolicy(MLTCommunicator* comm) : comm_{comm} {
+  target_ = prism::GetEnvOrDefault<double>("MLT_LOSS_TARGET", 0.01);
+  tail_ = prism::GetEnvOrDefault<double>("MLT_LOSS_TAIL", 1.2);
+  window_ = prism::GetEnvOrDefault<long>("MLT_LOSS_WINDOW", 32);
+  CHECK_GT(window_, 0U);
+}
+
+double AdaptiveLossPolicy::LossRatio(const LossQuery& query) {
+  if (allowance_ == 0) return 0;
+  double ratio = allowance_;
+
+  /// 1. the connections losing more than the others
+  double loss = comm_->RxLossRate(query.src);
+  conn_loss_[query.src] = loss;
+  double mean_loss = 0;
+  for (const auto& kv : conn_loss_) mean_loss += kv.second;
+  mean_loss /= conn_loss_.size();
+  ratio *= ClampFactor((loss + kLossEpsilon) / (mean_loss + kLossEpsilon));
+
+  /// 2. the layers which suffer more from loss
+  auto it = sensitivity_.find(query.layer);
+  if (it != sensitivity_.end()) ratio *= ClampFactor(1 / it->second);
+  auto it_norm = grad_norm_.find(query.layer);
+  if (it_norm != grad_norm_.end() && it_norm->second > 0) {
+    double mean_norm = grad_norm_sum_ / grad_norm_.size();
+    ratio *= ClampFactor(mean_norm / it_norm->second);
+  }
+  return std::min(ratio, query.max_ratio);
+}
+
+void AdaptiveLossPolicy::OnReceive(int src, size_t bytes,
+                                   size_t bytes_received) {
+  iter_bytes_ += bytes;
+  iter_dropped_ += bytes - std::min(bytes, bytes_received);
+}
+
+void AdaptiveLossPolicy::OnIteration(double iter_us) {
+  if (iter_bytes_ > 0) {
+    double dropped = static_cast<double>(iter_dropped_) / iter_bytes_;
+    drop_rate_ += kDropRateGain * (dropped - drop_rate_);
+  }
+  iter_bytes_ = 0;
+  iter_dropped_ = 0;
+
+  iter_times_.push_back(iter_us);
+  if (iter_times_.size() > window_) iter_times_.pop_front();
+  std::vector<double> times(iter_times_.begin(), iter_times_.end());
+  double p50 = Percentile(times, 0.5);
+  double p99 = Percentile(times, 0.99);
+
+  if (drop_rate_ > target_) {
+    allowance_ *= 1 - kGain;
+  } else if (p99 > tail_ * p50) {
+    allowance_ = std::min(1.0, allowance_ + kGain * target_);
+  } else {
+    /// no tail to cut, give the bytes back slowly
+    allowance_ *= 1 - kGain / 4;
+  }
+}
+
+void AdaptiveLossPolicy::SetSensitivity(int layer, double weight) {
+  CHECK_GT(weight, 0) << "invalid sensitivity of layer " << layer;
+  sensitivity_[layer] = weight;
+}
+
+void AdaptiveLossPolicy::SetGradientNorm(int layer, double norm) {
+  double& old = grad_norm_[layer];
+  grad_norm_sum_ += norm - old;
+  old = norm;
+}
+
+LossPolicy* CreateLossPolicy(const std::string& name, MLTCommunicator* comm) {
+  if (name == "fixed") return new FixedLossPolicy();
+  if (name == "adaptive") return new AdaptiveLossPolicy(comm);
+  LOG(FATAL) << "unknown loss policy: " << name;
+  return nullptr;
+}
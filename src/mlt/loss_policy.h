@@ -0,0 +1,100 @@
+#ifndef LOSS_POLICY_H_
+#define LOSS_POLICY_H_
+
+#include <stddef.h>
+#include <deque>
+#include <string>
+#include <unordered_map>
+
+class MLTCommunicator;
+
+// a receive about to be posted
+struct LossQuery {
+  int src;           // comm_id of the sender
+  size_t bytes;      // size of the receive
+  int layer;         // the layer of the tensor, -1 if unknown
+  double max_ratio;  // the loss ratio the caller allows at most
+};
+
+/**
+ * LossPolicy chooses the loss ratio of each receive, in place of a fixed one,
+ * from what it is told about the receives and the iterations. it is called
+ * by one thread only, the user thread of Collective or the polling thread of
+ * MLTVan.
+ */
+struct LossPolicy {
+  virtual ~LossPolicy() {}
+
+  virtual double LossRatio(const LossQuery& query) = 0;
+
+  // a receive of bytes from src has completed with bytes_received
+  virtual void OnReceive(int src, size_t bytes, size_t bytes_received) {}
+
+  // a training iteration has taken iter_us
+  virtual void OnIteration(double iter_us) {}
+
+  // how much a layer suffers from loss, 1 by default, higher means less loss
+  virtual void SetSensitivity(int layer, double weight) {}
+
+  // the gradient norm of a layer, optionally supplied by the application
+  virtual void SetGradientNorm(int layer, double norm) {}
+};
+
+// the loss ratio of the caller, as without a policy
+struct FixedLossPolicy : public LossPolicy {
+  double LossRatio(const LossQuery& query) override { return query.max_ratio; }
+};
+
+/**
+ * AdaptiveLossPolicy holds the share of bytes dropped under MLT_LOSS_TARGET
+ * while the iteration times have a tail, and drops nothing otherwise.
+ *
+ * Its allowance grows additively while the p99 iteration time of the last
+ * MLT_LOSS_WINDOW iterations exceeds MLT_LOSS_TAIL times the median, and
+ * shrinks multiplicatively while the dropped share exceeds the target, or
+ * slowly once the tail is gone. A receive may lose the allowance, scaled up
+ * for the connections losing more packets than the others, since they make
+ * the tail, and down for the sensitive layers and those with a large
+ * gradient norm.
+ */
+class AdaptiveLossPolicy : public LossPolicy {
+ public:
+  explicit AdaptiveLossPolicy(MLTCommunicator* comm);
+
+  double LossRatio(const LossQuery& query) override;
+
+  void OnReceive(int src, size_t bytes, size_t bytes_received) override;
+
+  void OnIteration(double iter_us) override;
+
+  void SetSensitivity(int layer, double weight) override;
+
+  void SetGradientNorm(int layer, double norm) override;
+
+  double allowance() const { return allowance_; }
+
+  double drop_rate() const { return drop_rate_; }
+
+ private:
+  MLTCommunicator* comm_;
+  double target_;
+  double tail_;
+  size_t window_;
+  /*! \brief: the loss ratio of a receive with all factors at 1 */
+  double allowance_{0};
+  /*! \brief: moving average of the share of bytes dropped per iteration */
+  double drop_rate_{0};
+  size_t iter_bytes_{0};
+  size_t iter_dropped_{0};
+  std::deque<double> iter_times_;
+  /*! \brief: the packet loss rate last seen on each connection */
+  std::unordered_map<int, double> conn_loss_;
+  std::unordered_map<int, double> sensitivity_;
+  std::unordered_map<int, double> grad_norm_;
+  double grad_norm_sum_{0};
+};
+
+// "fixed" or "adaptive"
+LossPolicy* CreateLossPolicy(const std::string& name, MLTCommunicator* comm);
+
+#endif  // LOSS_POLICY_H_
@@ -3,6 +3,10 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <utility>
+#include <vector>
 #include "buffer.h"
 #include "grad_packet.h"
 #include "block_mgr.h"
@@ -28,6 +32,12 @@ struct LtMessage {
   size_t size;
 };
 
+/// what a receive cut by its deadline leaves in the bytes that never arrived
+enum class GapFill {
+  kStale,  // whatever the buffer held before
+  kZero,
+};
+
 struct LtMessageExt {
   uint32_t msg_id;
   char* buf;
@@ -40,6 +50,16 @@ struct LtMessageExt {
   size_t bound;
 
   bool stopped;
+  /// the flow handle in the compact packet header, see CompactGradHeader
+  uint16_t handle;
+  /// gradient bytes of a full packet of this flow, the receiver learns it
+  /// from FlowStart
+  uint32_t segment;
+  /// the receive completes by this time with whatever arrived
+  std::chrono::steady_clock::time_point deadline;
+  GapFill gap_fill;
+  /// whether the first FlowFinish has been counted in the loss rate
+  bool loss_sampled;
 
   /// TODO(cjr): this index can be more efficient by using a balanced search
   /// tree, with each node maintaining an interval
@@ -57,6 +77,11 @@ struct LtMessageExt {
         bytes_received{0},
         bound{ltmsg.size},
         stopped{false},
+        handle{0},
+        segment{0},
+        deadline{std::chrono::steady_clock::time_point::max()},
+        gap_fill{GapFill::kStale},
+        loss_sampled{false},
         block_mgr{std::make_unique<TreeBlockMgr>(0)} {}
 
   inline size_t CopyGradients(const GradPacket* pkt) {
@@ -75,11 +100,43 @@ struct LtMessageExt {
         << "pkt->offset: " << pkt->offset << ", pkt->len: " << pkt->len;
     memcpy(buf + pkt->offset, pkt->GetGradientPtr<float*>(), grad_bytes);
     bytes_received += grad_bytes;
+    /// the legacy header carries the offset, so the segment is known before
+    /// FlowStart from any packet but the first
+    if (segment == 0 && seq > 0) segment = pkt->offset / seq;
 
     return grad_bytes;
   }
 
   inline bool FinishReceiving() { return bytes_received >= bound; }
+
+  /**
+   * \brief get the byte ranges that have arrived, from the sequence numbers
+   * taken in block_mgr
+   *
+   * \param segment the payload bytes carried by each packet, 0 if unknown,
+   * then only the first packet may have arrived
+   * \param ranges the [first, last) byte ranges, in increasing order
+   */
+  void GetReceivedRanges(size_t segment,
+                         std::vector<std::pair<size_t, size_t>>* ranges) {
+    ranges->clear();
+    if (segment == 0) {
+      if (bytes_received > 0) ranges->emplace_back(0, bytes_received);
+      return;
+    }
+    std::vector<Block> free_blocks(block_mgr->ByteSize() / sizeof(Block));
+    block_mgr->SerializeToBuffer(free_blocks.data(), block_mgr->ByteSize());
+    /// sequence numbers beyond block_mgr->Size() have never arrived
+    free_blocks.emplace_back(block_mgr->Size(), block_mgr->Size());
+    uint32_t seq = 0;
+    for (const Block& block : free_blocks) {
+      if (seq < block.first) {
+        ranges->emplace_back(seq * segment,
+                             std::min(block.first * segment, size));
+      }
+      seq = block.last;
+    }
+  }
 };
 
 enum class SignalType : uint32_t {
@@ -90,6 +147,7 @@ enum class SignalType : uint32_t {
   kRetransmitRequest,
   kStopRequest,
   kStopConfirm,
+  kFusionLayout,  // the layout of a fused flow, see TensorFusion
 };
 
 [[maybe_unused]]
@@ -101,6 +159,7 @@ static const char* kSignalTypeStr[] = {
   "kRetransmitRequest",
   "kStopRequest",
   "kStopConfirm",
+  "kFusionLayout",
 };
 
 struct UserDataHeader {
@@ -116,9 +175,11 @@ struct FlowStart {
   int msg_id;  // a.k.a msg_id
   uint32_t flow_size;
   uint32_t max_seq_num;
+  uint32_t handle;  // the flow handle of the compact packet header
+  uint32_t segment;  // gradient bytes of a full packet of this flow
 };
 
-static_assert(sizeof(FlowStart) == 16);
+static_assert(sizeof(FlowStart) == 24);
 
 struct RateAdjustment {
   SignalType type;
@@ -1,4 +1,5 @@
 #include "mlt_communicator.h"
+#include "impairment.h"
 
 void MLTCommunicator::Start(int listen_port) {
   int num_priorities = prism::GetEnvOrDefault<int>("MLT_NUM_PRIO", 8);
@@ -6,7 +7,23 @@ void MLTCommunicator::Start(int listen_port) {
     num_priorities = MLTGlobal::Get()->NumQueues();
 
   int wq_size = prism::GetEnvOrDefault<int>("MLT_WQ_SIZE", 32);
+  /// each channel thread has its own engine, the rings are not shared
+  auto io_engine = ParseIoEngine(
+      prism::GetEnvOrDefault<std::string>("MLT_IO_ENGINE", "epoll"));
+  int rx_bufs = prism::GetEnvOrDefault<int>("MLT_IO_URING_BUFS", 1024);
+
+  int udp_port = prism::GetEnvOrDefault<int>("MLT_UDP_PORT", 5555);
+  /// overwrite with command line argument
+  if (listen_port) udp_port = listen_port;
+
   priority_channel_ = std::make_unique<PriorityChannel>(this, wq_size);
+  /// MLT_IMPAIR_* emulates a lossy network in front of the sockets. the comm
+  /// id may be unassigned yet, e.g. under MLTVan, while the port tells apart
+  /// the senders of the box
+  uint64_t salt = (static_cast<uint64_t>(udp_port) << 32) |
+                  static_cast<uint32_t>(comm_id_.load());
+  priority_channel_->set_io_engine(
+      CreateImpairment(CreateIoEngine(io_engine, 0, 0), salt));
   for (int i = 0; i < num_priorities; i++) {
     int dscp = i * 8;
     int ect = 1, non_ect = 0;
@@ -16,20 +33,24 @@ void MLTCommunicator::Start(int listen_port) {
       priority_channel_->AddEndpoint(endpoint);
     }
   }
+  priority_channel_->SetAffinity(priority_cpus_);
   priority_channel_->Start();
 
   // int task_queue_size = prism::GetEnvOrDefault<int>("MLT_TASK_QUEUE_SIZE", 32);
   // packetizer_ = std::make_unique<Packetizer>(this, task_queue_size);
   // packetizer_->Start();
 
-  int udp_port = prism::GetEnvOrDefault<int>("MLT_UDP_PORT", 5555);
-  /// overwrite with command line argument
-  if (listen_port) udp_port = listen_port;
   receiving_channel_ = std::make_unique<ReceivingChannel>(this, udp_port, wq_size);
+  receiving_channel_->set_io_engine(
+      CreateIoEngine(io_engine, MLTGlobal::Get()->MaxSegment(), rx_bufs));
+  receiving_channel_->SetAffinity(receiving_cpus_);
   receiving_channel_->Start();
 
   int rc_queue_size = prism::GetEnvOrDefault<int>("MLT_RC_QUEUE_SIZE", 32);
   reliable_channel_ = std::make_unique<ReliableChannel>(this, rc_queue_size);
+  reliable_channel_->set_io_engine(
+      CreateIoEngine(io_engine, kRcRecvBufSize, kRcRecvBufs));
+  reliable_channel_->SetAffinity(reliable_cpus_);
   reliable_channel_->Start();
 
   int rc_port = prism::GetEnvOrDefault<int>("MLT_RC_PORT", 5555);
@@ -60,7 +81,8 @@ void MLTCommunicator::AddConnection(int dest_comm_id, const std::string& host, i
   MLTGlobal::Get()->AddCommIdAddr(dest_comm_id, addr);
 
   // we only do the real connecting when this_comm_id < other_comm_id
-  if (comm_id_ >= dest_comm_id) {
+  int comm_id = comm_id_.load();
+  if (comm_id >= dest_comm_id) {
     /// wait for connection being accepted
     bool connected = false;
     while (!connected) {
@@ -69,6 +91,10 @@ void MLTCommunicator::AddConnection(int dest_comm_id, const std::string& host, i
       Unlock();
       std::this_thread::sleep_for(std::chrono::milliseconds(5));
     }
+    Lock();
+    ConnMeta* conn_meta = id_conn_[dest_comm_id].get();
+    Unlock();
+    conn_meta->segment = MLTGlobal::Get()->PayloadOfMtu(ProbeMtu(dest_comm_id));
     return;
   }
 
@@ -80,6 +106,7 @@ void MLTCommunicator::AddConnection(int dest_comm_id, const std::string& host, i
   }
   conn_meta = id_conn_[dest_comm_id].get();
   Unlock();
+  conn_meta->segment = MLTGlobal::Get()->PayloadOfMtu(ProbeMtu(dest_comm_id));
 
   // establish rd endpoint and connect and set non blocking
   int rc_tos = prism::GetEnvOrDefault<int>("MLT_RC_TOS", 0xfe);
@@ -87,7 +114,7 @@ void MLTCommunicator::AddConnection(int dest_comm_id, const std::string& host, i
   auto endpoint = std::make_shared<RdEndpoint>(rc_tos, conn_meta);
   // note: this call may block
   endpoint->Connect();
-  CHECK_EQ(sizeof(comm_id_), endpoint->sock().Send(&comm_id_, sizeof(comm_id_)));
+  CHECK_EQ(sizeof(comm_id), endpoint->sock().Send(&comm_id, sizeof(comm_id)));
   endpoint->OnConnected();
 
   /// send notication to add endpoint
@@ -109,6 +136,28 @@ void MLTCommunicator::AddConnection(int dest_comm_id, const std::string& host, i
   }
 }
 
+int MLTCommunicator::ProbeMtu(int dest_comm_id) {
+  int max_mtu = MLTGlobal::Get()->MaxMtu();
+  if (prism::GetEnvOrDefault<int>("MLT_MTU_PROBE", 1) == 0) {
+    return MLTGlobal::Get()->Mtu();
+  }
+  /// a connected UDP socket with DF set sees the MTU of the route to the
+  /// peer, lowered by the ICMP fragmentation-needed messages on the path
+  UdpSocket sock;
+  sock.Create();
+  sock.SetMtuDiscover(IP_PMTUDISC_DO);
+  const SockAddr& addr = MLTGlobal::Get()->AddrFromCommId(dest_comm_id);
+  if (!sock.Connect(addr)) {
+    PLOG(WARNING) << "cannot probe the path MTU to " << dest_comm_id;
+    sock.Close();
+    return MLTGlobal::Get()->Mtu();
+  }
+  int mtu = std::min(sock.GetPathMtu(), max_mtu);
+  sock.Close();
+  LOG(INFO) << "path MTU to " << dest_comm_id << ": " << mtu;
+  return mtu;
+}
+
 void MLTCommunicator::RemoveConnection(int dest_comm_id) {
   {
     Lock();
@@ -137,17 +186,28 @@ void MLTCommunicator::RemoveConnection(int dest_comm_id) {
 
 /// because meta data are usually small messages, so we use copy here
 void MLTCommunicator::SendMetaAsync(int dest, Buffer* buffer) {
-  auto new_buffer = std::make_unique<Buffer>(
-      buffer->msg_length() + GetOutBufferSize<UserDataHeader>());
+  auto new_buffer = NewMetaBuffer(buffer->msg_length());
+  /// copy data
+  memcpy(MetaPayload(new_buffer.get()), buffer->ptr(), buffer->msg_length());
+  SendMetaAsync(dest, std::move(new_buffer));
+}
 
-  new_buffer->set_msg_length(new_buffer->size());
-  /// fill header field
-  UserDataHeader* hdr = GetOutHeader<UserDataHeader>(new_buffer.get());
+void MLTCommunicator::SendMetaAsync(int dest, std::unique_ptr<Buffer> buffer) {
+  /// fill header field, the length prefix is written by the reliable channel
+  UserDataHeader* hdr = GetOutHeader<UserDataHeader>(buffer.get());
   hdr->type = SignalType::kUserData;
-  /// copy data
-  memcpy(hdr->payload, buffer->ptr(), buffer->msg_length());
+  reliable_channel_->Enqueue(dest, std::move(buffer));
+}
+
+std::unique_ptr<Buffer> MLTCommunicator::NewMetaBuffer(size_t size) {
+  auto buffer =
+      std::make_unique<Buffer>(size + GetOutBufferSize<UserDataHeader>());
+  buffer->set_msg_length(buffer->size());
+  return buffer;
+}
 
-  reliable_channel_->Enqueue(dest, std::move(new_buffer));
+char* MLTCommunicator::MetaPayload(Buffer* buffer) {
+  return GetOutHeader<UserDataHeader>(buffer)->payload;
 }
 
 void MLTCommunicator::RecvMeta(int* dest, Buffer* buffer) {
@@ -163,25 +223,101 @@ void MLTCommunicator::RecvMeta(int* dest, Buffer* buffer) {
   // delete new_buffer;
 }
 
+bool MLTCommunicator::TryRecvMeta(int* dest, std::unique_ptr<Buffer>* buffer) {
+  std::tuple<int, std::unique_ptr<Buffer>> tup;
+  if (!meta_queue_.TryPop(&tup)) return false;
+  *dest = std::get<0>(tup);
+  *buffer = std::move(std::get<1>(tup));
+  return true;
+}
+
+void MLTCommunicator::SendLayoutAsync(int dest,
+                                      std::unique_ptr<Buffer> buffer) {
+  UserDataHeader* hdr = GetOutHeader<UserDataHeader>(buffer.get());
+  hdr->type = SignalType::kFusionLayout;
+  reliable_channel_->Enqueue(dest, std::move(buffer));
+}
+
+bool MLTCommunicator::TryRecvLayout(int* dest,
+                                    std::unique_ptr<Buffer>* buffer) {
+  std::tuple<int, std::unique_ptr<Buffer>> tup;
+  if (!layout_queue_.TryPop(&tup)) return false;
+  *dest = std::get<0>(tup);
+  *buffer = std::move(std::get<1>(tup));
+  return true;
+}
+
 void MLTCommunicator::PostSend(int dest, const LtMessage& msg,
                                PktPrioFunc* prio_func) {
   // CHECK_NOTNULL(id_conn_[dest])->
+  Lock();
+  ConnMeta* conn_meta = CHECK_NOTNULL(id_conn_[dest]).get();
+  Unlock();
+  uint16_t handle = conn_meta->AcquireFlowHandle();
+  uint32_t segment = conn_meta->segment;
+
   /// 1. flow start notification
   auto buffer = std::make_unique<Buffer>(GetOutBufferSize<FlowStart>());
   FlowStart* hdr = GetOutHeader<FlowStart>(buffer.get());
   hdr->type = SignalType::kFlowStart;
   hdr->msg_id = msg.msg_id;
   hdr->flow_size = msg.size;
-  hdr->max_seq_num = priority_channel_->packetizer()->GetMaxSeqNum(msg.size);
+  hdr->max_seq_num =
+      priority_channel_->packetizer()->GetMaxSeqNum(msg.size, segment);
+  hdr->handle = handle;
+  hdr->segment = segment;
   buffer->set_msg_length(buffer->size());
   reliable_channel_->Enqueue(dest, std::move(buffer));
 
   /// 2. give message to packetizer
-  priority_channel_->Enqueue(dest, msg, prio_func);
+  priority_channel_->Enqueue(dest, msg, handle, segment, prio_func);
 
   /// 3. flow finish notification
 }
 
+void MLTCommunicator::PostSendMulti(const std::vector<int>& dests,
+                                    const LtMessage& msg,
+                                    PktPrioFunc* prio_func) {
+  CHECK(!dests.empty()) << "no dest for message " << msg.msg_id;
+  std::vector<ConnMeta*> conn_metas;
+  Lock();
+  for (int dest : dests) {
+    conn_metas.push_back(CHECK_NOTNULL(id_conn_[dest]).get());
+  }
+  Unlock();
+  /// the packets are the same for all the dests, so they are cut to the
+  /// smallest path MTU
+  uint32_t segment = conn_metas[0]->segment;
+  for (ConnMeta* conn_meta : conn_metas) {
+    segment = std::min(segment, conn_meta->segment);
+  }
+  uint32_t max_seq_num =
+      priority_channel_->packetizer()->GetMaxSeqNum(msg.size, segment);
+  /// packetized once, on the priority channel thread as the dests send
+  auto shared_flow =
+      std::make_shared<SharedFlow>(msg, segment, comm_id(), prio_func);
+  /// the priority channel serves the connections round-robin, one packet
+  /// each, so the dests are interleaved packet by packet
+  for (size_t i = 0; i < dests.size(); i++) {
+    int dest = dests[i];
+    uint16_t handle = conn_metas[i]->AcquireFlowHandle();
+
+    auto buffer = std::make_unique<Buffer>(GetOutBufferSize<FlowStart>());
+    FlowStart* hdr = GetOutHeader<FlowStart>(buffer.get());
+    hdr->type = SignalType::kFlowStart;
+    hdr->msg_id = msg.msg_id;
+    hdr->flow_size = msg.size;
+    hdr->max_seq_num = max_seq_num;
+    hdr->handle = handle;
+    hdr->segment = segment;
+    buffer->set_msg_length(buffer->size());
+    reliable_channel_->Enqueue(dest, std::move(buffer));
+
+    priority_channel_->Enqueue(dest, msg, handle, segment,
+                               nullptr, shared_flow);
+  }
+}
+
 void MLTCommunicator::PostRecv(int dest, const LtMessage& msg,
                                double loss_ratio) {
   /// Attention: concurrently access of id_conn_
@@ -189,5 +325,29 @@ void MLTCommunicator::PostRecv(int dest, const LtMessage& msg,
   ConnMeta* conn_meta = CHECK_NOTNULL(id_conn_[dest]).get();
   Unlock();
 
-  receiving_channel_->Enqueue(conn_meta, msg, loss_ratio);
-}
\ No newline at end of file
+  receiving_channel_->Enqueue(
+      {conn_meta, msg, loss_ratio,
+       std::chrono::steady_clock::time_point::max(), GapFill::kStale});
+}
+
+void MLTCommunicator::PostRecv(int dest, const LtMessage& msg,
+                               double loss_ratio, long deadline_us,
+                               GapFill gap_fill) {
+  Lock();
+  ConnMeta* conn_meta = CHECK_NOTNULL(id_conn_[dest]).get();
+  Unlock();
+
+  auto deadline = std::chrono::steady_clock::now() +
+                  std::chrono::microseconds(deadline_us);
+  receiving_channel_->Enqueue({conn_meta, msg, loss_ratio, deadline, gap_fill});
+}
+
+double MLTCommunicator::RxLossRate(int src) {
+  Lock();
+  auto it = id_conn_.find(src);
+  double rate = it != id_conn_.end() && it->second
+                    ? it->second->rx_loss_rate.load()
+                    : 0;
+  Unlock();
+  return rate;
+}
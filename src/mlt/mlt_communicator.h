@@ -17,6 +17,7 @@
 #include "receiving_channel.h"
 #include "completion.h"
 
+#include <atomic>
 #include <vector>
 #include <unordered_map>
 
@@ -28,12 +29,26 @@ class MLTCommunicator {
   friend class RdEndpoint;
   friend class ReliableChannel;
   friend class PriorityChannel;
+  /*! \brief: comm id of a peer that does not know its own id yet */
+  static constexpr int kUnassignedCommId = -1;
+
   MLTCommunicator(int comm_id, int meta_queue_size = 32)
-      : comm_id_{comm_id}, meta_queue_{meta_queue_size} {}
+      : comm_id_{comm_id}, meta_queue_{meta_queue_size},
+        layout_queue_{meta_queue_size} {}
 
   // initialize the resources, start the threads
   void Start(int listen_port = 0);
 
+  // pin the channel threads to the cpus, must be called before Start,
+  // an empty list leaves the thread unpinned
+  void SetThreadAffinity(const std::vector<int>& priority_cpus,
+                         const std::vector<int>& receiving_cpus,
+                         const std::vector<int>& reliable_cpus) {
+    priority_cpus_ = priority_cpus;
+    receiving_cpus_ = receiving_cpus;
+    reliable_cpus_ = reliable_cpus;
+  }
+
   void Finalize();
 
   void AddConnection(int dest_comm_id, const std::string& host, int port);
@@ -45,23 +60,81 @@ class MLTCommunicator {
   // meta + key + len, these data goes to the reliable channel
   void SendMetaAsync(int dest, Buffer* buffer);
 
+  // like above, but it takes the buffer instead of copying it, the buffer
+  // comes from NewMetaBuffer with the payload at MetaPayload. a buffer of at
+  // least MLT_RC_ZEROCOPY_BYTES is sent by MSG_ZEROCOPY and released once the
+  // kernel is done with its pages
+  void SendMetaAsync(int dest, std::unique_ptr<Buffer> buffer);
+
+  // a buffer for size bytes of payload with room for the headers in front
+  static std::unique_ptr<Buffer> NewMetaBuffer(size_t size);
+
+  static char* MetaPayload(Buffer* buffer);
+
   // this a blocking call, the buffer is created by mlt and released by user
   void RecvMeta(int* dest, Buffer* buffer);
 
+  // non-blocking version of RecvMeta, it hands over the received buffer
+  // without copying, the payload starts after the UserDataHeader
+  bool TryRecvMeta(int* dest, std::unique_ptr<Buffer>* buffer);
+
+  // the layouts of fused flows go through the reliable channel like metas,
+  // but are queued apart from them for TensorFusion. the buffer comes from
+  // NewMetaBuffer
+  void SendLayoutAsync(int dest, std::unique_ptr<Buffer> buffer);
+
+  // non-blocking, like TryRecvMeta
+  bool TryRecvLayout(int* dest, std::unique_ptr<Buffer>* buffer);
+
   void PostSend(int dest, const LtMessage& msg, PktPrioFunc* prio_func);
 
+  // send the same message to all dests, e.g. a server returning the
+  // aggregated tensor to its workers. it is packetized once, cut to the
+  // smallest segment of the dests, into a SharedFlow the dests hold by
+  // reference count. each dest has its own FlowStart, flow handle, send
+  // cursor and retransmissions, and gets its own kSend completion with
+  // msg.msg_id
+  void PostSendMulti(const std::vector<int>& dests, const LtMessage& msg,
+                     PktPrioFunc* prio_func);
+
   void PostRecv(int dest, const LtMessage& msg, double loss_ratio);
 
+  // like PostRecv, but the flow completes deadline_us after posting with
+  // whatever has arrived by then. the sender is told to stop, and the kRecv
+  // completion carries the exact received ranges, which may be none at all,
+  // so check bytes_received. gap_fill chooses what the missing bytes hold
+  void PostRecv(int dest, const LtMessage& msg, double loss_ratio,
+                long deadline_us, GapFill gap_fill = GapFill::kStale);
+
   void SetCompletionQueue(CompletionQueue* cq) { cq_ = cq; }
 
-  int comm_id() const { return comm_id_; }
+  // the share of the flows from src missing at the end of their first pass,
+  // a moving average, 0 if unknown
+  double RxLossRate(int src);
+
+  int comm_id() const { return comm_id_.load(); }
+
+  // a communicator started with kUnassignedCommId may only connect actively,
+  // it must set its comm id before adding connections to peers other than
+  // those it already connected to
+  void set_comm_id(int comm_id) { comm_id_.store(comm_id); }
 
   inline void Lock() { mu_.lock(); }
   inline void Unlock() { mu_.unlock(); }
 
  private:
+  /// the MTU of the path to a peer, capped by MLT_MAX_MTU
+  int ProbeMtu(int dest_comm_id);
+
   /*! \brief: communicator id or rank, inherit from upper layer framework */
-  int comm_id_;
+  std::atomic<int> comm_id_;
+  /*! \brief: the cpus of each channel thread */
+  std::vector<int> priority_cpus_;
+  std::vector<int> receiving_cpus_;
+  std::vector<int> reliable_cpus_;
+  /*! \brief: local comm ids given to peers connecting with kUnassignedCommId,
+   * only accessed by the reliable channel */
+  int anonymous_comm_id_{kUnassignedCommId};
   /*! \brief: meta data of all connections, not thread-safe, hash table is
    * faster than lock, so don't worry */
   std::unordered_map<int, std::unique_ptr<ConnMeta>> id_conn_;
@@ -79,6 +152,8 @@ class MLTCommunicator {
   // TODO(cjr): avoid frequently malloc and free
   // comm_id/dest, buffer
   SpscQueue<std::tuple<int, std::unique_ptr<Buffer>>> meta_queue_;
+  // comm_id/dest, buffer of the fusion layouts
+  SpscQueue<std::tuple<int, std::unique_ptr<Buffer>>> layout_queue_;
   std::mutex mu_;
 };
 
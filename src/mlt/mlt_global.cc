@@ -1,5 +1,7 @@
 #include "mlt_global.h"
 
+#include <algorithm>
+
 void MLTGlobal::Init() {
   /// initialize these variables
   /// 1. get model name
@@ -24,8 +26,25 @@ int MLTGlobal::Mtu() {
   return mtu;
 }
 
+int MLTGlobal::MaxMtu() {
+  if (max_mtu == 0) {
+    max_mtu = std::max(prism::GetEnvOrDefault<int>("MLT_MAX_MTU", 9000), Mtu());
+  }
+  return max_mtu;
+}
+
 int MLTGlobal::MaxSegment() {
-  return Mtu() - 28;
+  return MaxMtu() - 28;
+}
+
+int MLTGlobal::PacketHeaderSize() {
+  if (packet_header_size == 0) {
+    packet_header_size =
+        prism::GetEnvOrDefault<int>("MLT_COMPACT_HEADER", 1) != 0
+            ? kCompactGradHeader
+            : kGradPacketHeader;
+  }
+  return packet_header_size;
 }
 
 int MLTGlobal::NumQueues() {
@@ -20,8 +20,20 @@ struct MLTGlobal {
   int MaxPrio();
   void AddCommIdAddr(int comm_id, const SockAddr& addr);
   const SockAddr& AddrFromCommId(int comm_id) const;
+  /// the MTU of a connection whose path MTU has not been probed
   int Mtu();
+  /// the largest MTU a probe may find, which sizes the receive buffers
+  int MaxMtu();
+  /// the largest datagram
   int MaxSegment();
+  /// the wire header of the gradient packets, compact unless
+  /// MLT_COMPACT_HEADER=0, all the peers must agree
+  int PacketHeaderSize();
+  bool CompactHeader() { return PacketHeaderSize() == kCompactGradHeader; }
+  /// the gradient bytes carried by a full packet of the given MTU
+  int PayloadOfMtu(int mtu) { return mtu - 28 - PacketHeaderSize(); }
+  /// the gradient bytes carried by a full packet of an unprobed connection
+  int MaxPayload() { return PayloadOfMtu(Mtu()); }
   int NumLayers() const { return num_layers; }
   int NumQueues();
   int Bdp();
@@ -29,11 +41,16 @@ struct MLTGlobal {
   double InitialSendingRate();
   uint64_t RateMonitorIntervalUs();
   size_t ConnectionBacklogSize();
+  /// the cpus of the numa node of the nic, buffers are placed on this node
+  void SetLocalCpus(const std::vector<int>& cpus) { local_cpus = cpus; }
+  const std::vector<int>& LocalCpus() const { return local_cpus; }
 
   std::vector<SockAddr> id_addr;
 
   std::string model_name;
   int mtu;
+  int max_mtu;
+  int packet_header_size;
   int num_queues;
   int num_layers;
   // bandwidth delay product
@@ -42,6 +59,7 @@ struct MLTGlobal {
   double init_send_rate;
   uint64_t rate_monitor_interval_us;
   size_t conn_backlog_size;
+  std::vector<int> local_cpus;
 
  private:
   MLTGlobal() {}
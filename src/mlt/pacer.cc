@@ -0,0 +1,112 @@
+#include "pacer.h"
+
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <string.h>
+#include <vector>
+
+namespace {
+
+bool SameHost(const struct sockaddr* a, const struct sockaddr* b) {
+  if (a->sa_family != b->sa_family) return false;
+  if (a->sa_family == AF_INET) {
+    return reinterpret_cast<const sockaddr_in*>(a)->sin_addr.s_addr ==
+           reinterpret_cast<const sockaddr_in*>(b)->sin_addr.s_addr;
+  }
+  if (a->sa_family == AF_INET6) {
+    return !memcmp(&reinterpret_cast<const sockaddr_in6*>(a)->sin6_addr,
+                   &reinterpret_cast<const sockaddr_in6*>(b)->sin6_addr,
+                   sizeof(struct in6_addr));
+  }
+  return false;
+}
+
+/// the interface owning the source address the kernel picks for peer, 0 if
+/// there is no route
+int EgressIfindex(const SockAddr& peer) {
+  UdpSocket sock;
+  sock.Create(peer.addr.sa_family);
+  SockAddr local;
+  bool routed = sock.Connect(peer) &&
+                !getsockname(sock, &local.addr, &local.addrlen);
+  sock.Close();
+  if (!routed) return 0;
+
+  struct ifaddrs* ifas;
+  if (getifaddrs(&ifas)) return 0;
+  int ifindex = 0;
+  for (struct ifaddrs* ifa = ifas; ifa; ifa = ifa->ifa_next) {
+    if (ifa->ifa_addr && SameHost(ifa->ifa_addr, &local.addr)) {
+      ifindex = if_nametoindex(ifa->ifa_name);
+      break;
+    }
+  }
+  freeifaddrs(ifas);
+  return ifindex;
+}
+
+/// dump the qdiscs through rtnetlink, including the children of mq
+bool HasFqQdisc(int ifindex) {
+  int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (fd < 0) return false;
+
+  struct {
+    struct nlmsghdr nlh;
+    struct tcmsg tcm;
+  } req;
+  memset(&req, 0, sizeof(req));
+  req.nlh.nlmsg_len = sizeof(req);
+  req.nlh.nlmsg_type = RTM_GETQDISC;
+  req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  req.nlh.nlmsg_seq = 1;
+  req.tcm.tcm_family = AF_UNSPEC;
+  if (send(fd, &req, sizeof(req), 0) < 0) {
+    close(fd);
+    return false;
+  }
+
+  bool found = false, done = false;
+  std::vector<char> buf(32768);
+  while (!done) {
+    int len = recv(fd, buf.data(), buf.size(), 0);
+    if (len <= 0) break;
+    auto nlh = reinterpret_cast<struct nlmsghdr*>(buf.data());
+    for (; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+      if (nlh->nlmsg_type == NLMSG_DONE || nlh->nlmsg_type == NLMSG_ERROR) {
+        done = true;
+        break;
+      }
+      if (nlh->nlmsg_type != RTM_NEWQDISC) continue;
+      auto tcm = reinterpret_cast<struct tcmsg*>(NLMSG_DATA(nlh));
+      if (tcm->tcm_ifindex != ifindex) continue;
+      int attrlen = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*tcm));
+      for (auto rta = TCA_RTA(tcm); RTA_OK(rta, attrlen);
+           rta = RTA_NEXT(rta, attrlen)) {
+        if (rta->rta_type == TCA_KIND &&
+            !strcmp(static_cast<char*>(RTA_DATA(rta)), "fq")) {
+          found = true;
+        }
+      }
+    }
+  }
+  close(fd);
+  return found;
+}
+
+}  // namespace
+
+PacingMode ParsePacingMode(const std::string& name) {
+  if (name == "user") return PacingMode::kUser;
+  if (name == "txtime") return PacingMode::kTxTime;
+  if (name == "rate") return PacingMode::kMaxRate;
+  LOG(FATAL) << "unknown pacing mode: " << name;
+  return PacingMode::kUser;
+}
+
+bool FqOnPath(const SockAddr& peer) {
+  int ifindex = EgressIfindex(peer);
+  return ifindex > 0 && HasFqQdisc(ifindex);
+}
@@ -0,0 +1,60 @@
+#ifndef PACER_H_
+#define PACER_H_
+
+#include "socket.h"
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+
+/**
+ * who spaces the packets of a connection by its sending rate
+ * kUser: the tx thread holds a packet until the rate meter allows it
+ * kTxTime: each packet carries its earliest departure in a SCM_TXTIME cmsg
+ * kMaxRate: the connected sockets of the peer have SO_MAX_PACING_RATE
+ * both the kernel modes need the fq qdisc on the egress interface
+ */
+enum class PacingMode { kUser, kTxTime, kMaxRate };
+
+// "user", "txtime" or "rate"
+PacingMode ParsePacingMode(const std::string& name);
+
+inline uint64_t MonotonicNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// whether the fq qdisc is on the interface the packets to peer leave from,
+// without it the kernel sends the packets of a paced socket at once
+bool FqOnPath(const SockAddr& peer);
+
+/**
+ * TxClock hands out the departure times of the packets of a connection paced
+ * by the kernel, spaced by the sending rate. It refuses the departures more
+ * than the horizon ahead, so that the tx thread stays little ahead of the
+ * qdisc and a new rate soon takes effect.
+ */
+class TxClock {
+ public:
+  explicit TxClock(uint64_t horizon_ns = 0) : horizon_ns_{horizon_ns} {}
+
+  /// the departure of a packet of bytes at rate bytes/s, 0 if it should wait
+  inline uint64_t Reserve(size_t bytes, double rate, uint64_t now_ns) {
+    if (rate <= 0) return 0;
+    if (next_ns_ < now_ns) {
+      next_ns_ = now_ns;
+    } else if (next_ns_ > now_ns + horizon_ns_) {
+      return 0;
+    }
+    uint64_t departure = next_ns_;
+    next_ns_ += static_cast<uint64_t>(bytes * 1e9 / rate);
+    return departure;
+  }
+
+ private:
+  uint64_t next_ns_{0};
+  uint64_t horizon_ns_;
+};
+
+#endif  // PACER_H_
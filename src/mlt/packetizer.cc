@@ -5,17 +5,13 @@
 #include "buffer.h"
 #include "priority_channel.h"
 
-uint32_t Packetizer::GetMaxSeqNum(size_t size) {
-  size_t bound = MLTGlobal::Get()->MaxSegment() - kGradPacketHeader;
-  return (size + bound - 1) / bound - 1;   // number of packets - 1
+uint32_t Packetizer::GetMaxSeqNum(size_t size, size_t segment) {
+  return (size + segment - 1) / segment - 1;   // number of packets - 1
 }
 
 void Packetizer::RoutePacket(const GradPacket& pkt, bool is_finished) {
-  UdpEndpoint* endpoint =
-      priority_channel_
-          ->prio_endpoints_[priority_channel_->prio_mapping_[pkt.tos]]
-          .get();
-  endpoint->tx_queue().push(pkt);
+  UdpEndpoint* endpoint = priority_channel_->TxEndpoint(pkt.dst_comm_id, pkt.tos);
+  endpoint->tx_queue().push_back(pkt);
 
   DLOG(TRACE) << "sending pkt: " << pkt.DebugString();
 
@@ -33,7 +29,7 @@ void Packetizer::RoutePacket(const GradPacket& pkt, bool is_finished) {
 
 void Packetizer::PartitionAndRoute(int dest, const LtMessage& msg, PktPrioFunc* prio_func) {
   auto size = msg.size;
-  size_t bound = MLTGlobal::Get()->MaxSegment() - kGradPacketHeader;
+  size_t bound = MLTGlobal::Get()->MaxPayload();
   size_t accumulated = 0;
   uint32_t seq = 0;
   auto start = std::chrono::high_resolution_clock::now();
@@ -49,6 +45,8 @@ void Packetizer::PartitionAndRoute(int dest, const LtMessage& msg, PktPrioFunc*
     pkt.src_comm_id = comm_->comm_id();
     pkt.is_last = (accumulated + pkt.len - kGradPacketHeader == size) ? 1 : 0;
     pkt.grad_ptr = reinterpret_cast<uint64_t>(msg.buf) + accumulated;
+    pkt.handle = 0;
+    pkt.txtime = 0;
     // pkt.tos = (*prio_func)(pkt);
     pkt.tos = rand() % 256;
     // auto end1 = std::chrono::high_resolution_clock::now();
@@ -64,7 +62,7 @@ void Packetizer::PartitionAndRoute(int dest, const LtMessage& msg, PktPrioFunc*
 
 size_t Packetizer::GetBytes(const LtMessageExt& msg_ext) {
   auto size = msg_ext.size;
-  size_t bound = MLTGlobal::Get()->MaxSegment() - kGradPacketHeader;
+  size_t bound = msg_ext.segment;
   size_t accumulated = msg_ext.bytes_sent;
   return ((size - accumulated) > bound ? bound : (size - accumulated)) +
          kGradPacketHeader;
@@ -73,7 +71,7 @@ size_t Packetizer::GetBytes(const LtMessageExt& msg_ext) {
 void Packetizer::PartitionOne(GradPacket* grad_pkt, int dest,
                               LtMessageExt& msg_ext, PktPrioFunc* prio_func) {
   auto size = msg_ext.size;
-  size_t bound = MLTGlobal::Get()->MaxSegment() - kGradPacketHeader;
+  size_t bound = msg_ext.segment;
   size_t& accumulated = msg_ext.bytes_sent;
   uint32_t seq = accumulated / bound;
 
@@ -87,6 +85,7 @@ void Packetizer::PartitionOne(GradPacket* grad_pkt, int dest,
   pkt.src_comm_id = comm_->comm_id();
   pkt.is_last = (accumulated + pkt.len - kGradPacketHeader == size) ? 1 : 0;
   pkt.grad_ptr = reinterpret_cast<uint64_t>(msg_ext.buf) + accumulated;
+  pkt.handle = msg_ext.handle;
   pkt.tos = (*prio_func)(pkt);
   // LOG(TRACE) << pkt.DebugString();
   accumulated += pkt.len - kGradPacketHeader;
@@ -96,7 +95,7 @@ void Packetizer::PartitionOneBySeq(GradPacket* grad_pkt, int dest,
                                    const LtMessageExt& msg,
                                    PktPrioFunc* prio_func, int seq) {
   auto size = msg.size;
-  size_t bound = MLTGlobal::Get()->MaxSegment() - kGradPacketHeader;
+  size_t bound = msg.segment;
   size_t offset = bound * seq;
 
   GradPacket& pkt = *grad_pkt;
@@ -109,6 +108,23 @@ void Packetizer::PartitionOneBySeq(GradPacket* grad_pkt, int dest,
   pkt.src_comm_id = comm_->comm_id();
   pkt.is_last = (offset + pkt.len - kGradPacketHeader == size) ? 1 : 0;
   pkt.grad_ptr = reinterpret_cast<uint64_t>(msg.buf) + offset;
+  pkt.handle = msg.handle;
   pkt.tos = (*prio_func)(pkt);
   // LOG(TRACE) << "retarnsmit:" << pkt.DebugString();
-}
\ No newline at end of file
+}
+void Packetizer::PartitionOne(GradPacket* grad_pkt, int dest,
+                              LtMessageExt& msg_ext, SharedFlow* shared_flow) {
+  uint32_t seq = msg_ext.bytes_sent / msg_ext.segment;
+  *grad_pkt = shared_flow->Packet(seq);
+  grad_pkt->dst_comm_id = dest;
+  grad_pkt->handle = msg_ext.handle;
+  msg_ext.bytes_sent += grad_pkt->len - kGradPacketHeader;
+}
+
+void Packetizer::PartitionOneBySeq(GradPacket* grad_pkt, int dest,
+                                   const LtMessageExt& msg,
+                                   SharedFlow* shared_flow, int seq) {
+  *grad_pkt = shared_flow->Packet(seq);
+  grad_pkt->dst_comm_id = dest;
+  grad_pkt->handle = msg.handle;
+}
@@ -3,6 +3,7 @@
 
 #include "ltmessage.h"
 #include "prio_func.h"
+#include "shared_flow.h"
 #include "spsc_queue.h"
 #include "thread_proto.h"
 #include "meter.h"
@@ -19,7 +20,8 @@ class Packetizer {
       : comm_{comm}, priority_channel_{priority_channel} {}
   virtual ~Packetizer() noexcept {}
 
-  uint32_t GetMaxSeqNum(size_t size);
+  /// \param segment the gradient bytes of a full packet
+  uint32_t GetMaxSeqNum(size_t size, size_t segment);
 
   void PartitionAndRoute(int dest, const LtMessage& msg, PktPrioFunc* prio_func);
 
@@ -30,6 +32,14 @@ class Packetizer {
                          const LtMessageExt& msg, PktPrioFunc* prio_func,
                          int seq);
 
+  /// the same from the packets shared by the dests of a multicast flow
+  void PartitionOne(GradPacket* grad_pkt, int dest, LtMessageExt& msg_ext,
+                    SharedFlow* shared_flow);
+
+  void PartitionOneBySeq(GradPacket* grad_pkt, int dest,
+                         const LtMessageExt& msg, SharedFlow* shared_flow,
+                         int seq);
+
   size_t GetBytes(const LtMessageExt& msg_ext);
 
   /**
@@ -68,4 +68,16 @@ struct DefaultPktPrioFunc : public PktPrioFunc {
   }
 };
 
+// all packets of a flow share one class selector, 0 is the lowest priority
+struct ClassPktPrioFunc : public PktPrioFunc {
+  int dscp;
+
+  explicit ClassPktPrioFunc(int prio_class) : dscp{prio_class * 8} {
+    CHECK(0 <= prio_class && prio_class < 8)
+        << "invalid priority class: " << prio_class;
+  }
+
+  int operator()(GradPacket& pkt) override { return dscp << 2; }
+};
+
 #endif  // PRIO_FUNC_H_
\ No newline at end of file
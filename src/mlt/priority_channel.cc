@@ -13,9 +13,37 @@ void PriorityChannel::AddEndpoint(UdpEndpoint* endpoint) {
   prio_endpoints_.emplace_back(endpoint);
 }
 
-void PriorityChannel::Enqueue(int dest, const LtMessage& msg, PktPrioFunc* prio_func) {
+UdpEndpoint* PriorityChannel::TxEndpoint(int dest, int tos) {
+  size_t index = prio_mapping_[tos];
+  auto it = conn_endpoints_.find(dest);
+  if (it == conn_endpoints_.end()) return prio_endpoints_[index].get();
+  auto& endpoint = it->second[index];
+  if (!endpoint) {
+    const SockAddr& addr = MLTGlobal::Get()->AddrFromCommId(dest);
+    endpoint = std::make_unique<UdpEndpoint>(tos, addr);
+    epoll_helper_.EpollCtl(EPOLL_CTL_ADD, endpoint->fd(), &endpoint->event());
+    endpoint->set_prio_channel(this);
+    ConnMeta* conn_meta = FindConnMetaById(dest);
+    if (conn_meta->pacing == PacingMode::kTxTime && !endpoint->EnableTxTime()) {
+      LOG(WARNING) << "SO_TXTIME unsupported, fall back to the user pacing for "
+                   << dest;
+      conn_meta->pacing = PacingMode::kUser;
+    }
+    if (conn_meta->pacing == PacingMode::kMaxRate) {
+      endpoint->sock().SetMaxPacingRate(conn_meta->paced_rate);
+    }
+  }
+  return endpoint.get();
+}
+
+void PriorityChannel::Enqueue(int dest, const LtMessage& msg, uint16_t handle,
+                              uint32_t segment, PktPrioFunc* prio_func,
+                              std::shared_ptr<SharedFlow> shared_flow) {
   auto ltmsg_ext = std::make_unique<LtMessageExt>(msg);
-  sr_queue_.Push({dest, std::move(ltmsg_ext), prio_func});
+  ltmsg_ext->handle = handle;
+  ltmsg_ext->segment = segment;
+  sr_queue_.Push(
+      {dest, std::move(ltmsg_ext), prio_func, std::move(shared_flow)});
 }
 
 void PriorityChannel::Notify(
@@ -49,7 +77,10 @@ void PriorityChannel::Run() {
       }
 
       if (ev.events & EPOLLERR) {
-        LOG(WARNING) << "EPOLLERR, endpoint tos: " << endpoint->tos();
+        /// clear it, or a connected socket keeps reporting its ICMP error
+        int err = endpoint->sock().TakeError();
+        LOG(WARNING) << "EPOLLERR, endpoint tos: " << endpoint->tos()
+                     << ", error: " << strerror(err);
         // endpoint->OnError();
       }
     }
@@ -58,12 +89,13 @@ void PriorityChannel::Run() {
     /// poll send requests
     decltype(sr_queue_)::value_type sr;
     while (sr_queue_.TryPop(&sr)) {
-      auto [dest, ltmsg_ext, prio_func] = std::move(sr);
+      auto [dest, ltmsg_ext, prio_func, shared_flow] = std::move(sr);
       ConnMeta* conn_meta = FindConnMetaById(dest);
       int msg_id = ltmsg_ext->msg_id;
       CHECK(conn_meta->sending_msgs.count(msg_id) == 0)
           << "msg_id: " << msg_id << " is sending";
-      conn_meta->sending_msgs[msg_id] = {std::move(ltmsg_ext), prio_func};
+      conn_meta->sending_msgs[msg_id] = {std::move(ltmsg_ext), prio_func,
+                                         std::move(shared_flow)};
       DLOG(TRACE) << "pop a send request, dest: " << dest << " msg_id: " << msg_id;
     }
     /// round-robin, for each connection pull one packet from one message
@@ -78,6 +110,8 @@ void PriorityChannel::Run() {
     if (total_len > 0)
     DLOG(DEBUG) << prism::FormatString("total_len: %ld, duration: %.3fus",
                                       total_len, (end - start).count() / 1e3);
+    /// the datagrams the engine held back, e.g. delayed by MLT_IMPAIR_*
+    io_engine_->Flush();
     /// handle notifications
     PollNotification();
   }
@@ -102,16 +136,20 @@ size_t PriorityChannel::PollSendingMessages() {
     auto& tup = *send_request;
     LtMessageExt& ltmsg_ext = *std::get<0>(tup);
     PktPrioFunc* prio_func = std::get<1>(tup);
+    SharedFlow* shared_flow = std::get<2>(tup).get();
 
     /// sending rate throttle
     size_t nbytes = packetizer_->GetBytes(ltmsg_ext);
     auto& tx_meter = conn_meta->tx_meter;
-    if (tx_meter.TryBytesPerSecond(nbytes) >
-        conn_meta->sending_rate.load()) {
-      continue;
-    }
+    uint64_t txtime;
+    if (!Pace(conn_meta, nbytes, &txtime)) continue;
 
-    packetizer_->PartitionOne(&grad_packet, dest, ltmsg_ext, prio_func);
+    if (shared_flow) {
+      packetizer_->PartitionOne(&grad_packet, dest, ltmsg_ext, shared_flow);
+    } else {
+      packetizer_->PartitionOne(&grad_packet, dest, ltmsg_ext, prio_func);
+    }
+    grad_packet.txtime = txtime;
     packetizer_->RoutePacket(grad_packet, grad_packet.is_last ? true : false);
 
     meter_.Add(grad_packet.len);
@@ -156,14 +194,13 @@ size_t PriorityChannel::PollRetransmitRequest() {
     CHECK(it != conn_meta->retransmitting_msgs.end());
     LtMessageExt& ltmsg_ext = *std::get<0>(it->second);
     PktPrioFunc* prio_func = std::get<1>(it->second);
+    SharedFlow* shared_flow = std::get<2>(it->second).get();
 
     /// sending rate throttle
     size_t nbytes = packetizer_->GetBytes(ltmsg_ext);
     auto& tx_meter = conn_meta->tx_meter;
-    if (tx_meter.TryBytesPerSecond(nbytes) >
-        conn_meta->sending_rate.load()) {
-      continue;
-    }
+    uint64_t txtime;
+    if (!Pace(conn_meta, nbytes, &txtime)) continue;
 
     CHECK_LT(state->block_num, hdr->num_blocks);
     Block& block = hdr->blocks[state->block_num];
@@ -179,8 +216,14 @@ size_t PriorityChannel::PollRetransmitRequest() {
                 << ", block_num: " << state->block_num
                 << ", block_num: " << state->block_num
                 << ", hdr->num_blocks: " << hdr->num_blocks;
-    packetizer_->PartitionOneBySeq(&grad_packet, hdr->comm_id, ltmsg_ext,
-                                   prio_func, state->seq_num);
+    if (shared_flow) {
+      packetizer_->PartitionOneBySeq(&grad_packet, hdr->comm_id, ltmsg_ext,
+                                     shared_flow, state->seq_num);
+    } else {
+      packetizer_->PartitionOneBySeq(&grad_packet, hdr->comm_id, ltmsg_ext,
+                                     prio_func, state->seq_num);
+    }
+    grad_packet.txtime = txtime;
     packetizer_->RoutePacket(grad_packet,
                              state->block_num + 1 == hdr->num_blocks &&
                                  state->seq_num + 1 == block.last);
@@ -208,6 +251,50 @@ size_t PriorityChannel::PollRetransmitRequest() {
   return bytes;
 }
 
+PacingMode PriorityChannel::ChoosePacing(ConnMeta* conn_meta) {
+  int dest = conn_meta->dest_comm_id;
+  if (pacing_ == PacingMode::kUser) return PacingMode::kUser;
+  if (!conn_endpoints_.count(dest)) {
+    LOG(WARNING) << "no connected sockets, fall back to the user pacing for "
+                 << dest;
+    return PacingMode::kUser;
+  }
+  if (!FqOnPath(MLTGlobal::Get()->AddrFromCommId(dest))) {
+    LOG(WARNING) << "no fq qdisc, fall back to the user pacing for " << dest;
+    return PacingMode::kUser;
+  }
+  return pacing_;
+}
+
+bool PriorityChannel::Pace(ConnMeta* conn_meta, size_t nbytes,
+                           uint64_t* txtime) {
+  double rate = conn_meta->sending_rate.load();
+  *txtime = 0;
+  if (conn_meta->pacing == PacingMode::kUser) {
+    return conn_meta->tx_meter.TryBytesPerSecond(nbytes) <= rate;
+  }
+  /// the kernel spaces the packets, the clock only keeps the tx thread from
+  /// running far ahead of it
+  uint64_t departure =
+      conn_meta->tx_clock.Reserve(nbytes, rate, MonotonicNs());
+  if (departure == 0) return false;
+  if (conn_meta->pacing == PacingMode::kTxTime) {
+    *txtime = departure;
+  } else if (std::abs(rate - conn_meta->paced_rate) >
+             conn_meta->paced_rate / 16) {
+    /// a setsockopt per packet costs more than the rate moves
+    SetPacingRate(conn_meta, rate);
+  }
+  return true;
+}
+
+void PriorityChannel::SetPacingRate(ConnMeta* conn_meta, double rate) {
+  conn_meta->paced_rate = rate;
+  for (auto& endpoint : conn_endpoints_[conn_meta->dest_comm_id]) {
+    if (endpoint) endpoint->sock().SetMaxPacingRate(rate);
+  }
+}
+
 void PriorityChannel::PollNotification() {
   PriorityChannel::Notification n;
   while (notification_queue_.TryPop(&n)) {
@@ -216,10 +303,26 @@ void PriorityChannel::PollNotification() {
         ConnMeta* conn_meta = n.data.conn;
         conn_meta_map_[conn_meta->dest_comm_id] = conn_metas_.size();
         conn_metas_.emplace_back(conn_meta);
+        if (static_cast<int>(conn_endpoints_.size()) < max_connected_peers_) {
+          conn_endpoints_[conn_meta->dest_comm_id].resize(
+              prio_endpoints_.size());
+        }
+        conn_meta->pacing = ChoosePacing(conn_meta);
+        conn_meta->tx_clock = TxClock(pacing_horizon_ns_);
       } break;
       case Notification::REMOVE_CONNECTION: {
         int comm_id = n.data.conn->dest_comm_id;
         conn_meta_map_.erase(comm_id);
+        auto it = conn_endpoints_.find(comm_id);
+        if (it != conn_endpoints_.end()) {
+          for (auto& endpoint : it->second) {
+            if (!endpoint) continue;
+            epoll_helper_.EpollCtl(EPOLL_CTL_DEL, endpoint->fd(),
+                                   &endpoint->event());
+            io_engine_->RemoveSender(endpoint->fd());
+          }
+          conn_endpoints_.erase(it);
+        }
         conn_metas_.erase(
             std::find(conn_metas_.begin(), conn_metas_.end(), n.data.conn));
         /// this is a dirty handling way
@@ -271,11 +374,13 @@ void PriorityChannel::StopFlow(FlowId flow_id) {
     /// 2. release the holding retransmitting msgs records
     auto it2 = conn_meta->retransmitting_msgs.find(msg_id);
     if (it2 != conn_meta->retransmitting_msgs.end()) {
+      conn_meta->ReleaseFlowHandle(std::get<0>(it2->second)->handle);
       conn_meta->retransmitting_msgs.erase(it2);
       DLOG(TRACE) << "comm_id: " << comm_id << " msg_id: " << msg_id
                   << " removed from retarnsmitting messages";
     }
   } else {
+    conn_meta->ReleaseFlowHandle(std::get<0>(it->second)->handle);
     conn_meta->sending_msgs.erase(it);
     DLOG(TRACE) << "comm_id: " << comm_id << " msg_id: " << msg_id
                 << " removed from sending messages";
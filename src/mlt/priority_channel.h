@@ -3,6 +3,7 @@
 
 #include "epoll_helper.h"
 #include "grad_packet.h"
+#include "io_engine.h"
 #include "socket.h"
 #include "spsc_queue.h"
 #include "thread_proto.h"
@@ -43,6 +44,13 @@ class PriorityChannel : public TerminableThread {
         sr_queue_{queue_size} {
     std::fill(prio_mapping_.begin(), prio_mapping_.end(), -1);
     packetizer_ = std::make_unique<Packetizer>(comm, this);
+    io_engine_.reset(CreateIoEngine(IoEngine::kEpoll, 0, 0));
+    max_connected_peers_ =
+        prism::GetEnvOrDefault<int>("MLT_CONNECTED_UDP_PEERS", 64);
+    pacing_ = ParsePacingMode(
+        prism::GetEnvOrDefault<std::string>("MLT_PACING", "user"));
+    pacing_horizon_ns_ =
+        prism::GetEnvOrDefault<long>("MLT_PACING_HORIZON_US", 1000) * 1000;
   }
 
   virtual ~PriorityChannel() {}
@@ -51,7 +59,9 @@ class PriorityChannel : public TerminableThread {
 
   void AddEndpoint(UdpEndpoint* endpoint);
 
-  void Enqueue(int dest, const LtMessage& msg, PktPrioFunc* prio_func);
+  void Enqueue(int dest, const LtMessage& msg, uint16_t handle,
+               uint32_t segment, PktPrioFunc* prio_func,
+               std::shared_ptr<SharedFlow> shared_flow = nullptr);
 
   void Notify(Notification&& notification);
 
@@ -61,8 +71,17 @@ class PriorityChannel : public TerminableThread {
 
   void StopFlow(FlowId flow_id);
 
+  /// the endpoint sending the packets of tos to dest, connected to dest if it
+  /// is one of the first MLT_CONNECTED_UDP_PEERS connections
+  UdpEndpoint* TxEndpoint(int dest, int tos);
+
   inline Packetizer* packetizer() const { return packetizer_.get(); }
 
+  /// take the engine sending the packets, before Start
+  inline void set_io_engine(IoEngine* io_engine) { io_engine_.reset(io_engine); }
+
+  inline IoEngine* io_engine() const { return io_engine_.get(); }
+
   size_t PollSendingMessages();
 
   size_t PollRetransmitRequest();
@@ -72,16 +91,38 @@ class PriorityChannel : public TerminableThread {
  private:
   ConnMeta* FindConnMetaById(int comm_id);
 
+  /// kernel pacing needs the connected sockets and the fq qdisc, the other
+  /// connections fall back to the user pacing
+  PacingMode ChoosePacing(ConnMeta* conn_meta);
+
+  /// whether a packet of nbytes may leave now, and its txtime if any
+  bool Pace(ConnMeta* conn_meta, size_t nbytes, uint64_t* txtime);
+
+  /// give the sending rate of a connection to its sockets under kMaxRate
+  void SetPacingRate(ConnMeta* conn_meta, double rate);
+
   MLTCommunicator* comm_;
   std::array<ssize_t, kMaxPrio> prio_mapping_;
   /*! \brief: pre-opened UDP sockets for outcoming per-packet QoS */
   std::vector<std::unique_ptr<UdpEndpoint>> prio_endpoints_;
+  /*!
+   * \brief: UDP sockets connected to a destination, indexed like
+   * prio_endpoints_ and opened on its first packet of a tos. the sockets
+   * grow with peers x priorities, so only some destinations have them
+   */
+  std::unordered_map<int, std::vector<std::unique_ptr<UdpEndpoint>>>
+      conn_endpoints_;
+  int max_connected_peers_;
+  /*! \brief: the pacing asked by MLT_PACING, see PacingMode */
+  PacingMode pacing_;
+  uint64_t pacing_horizon_ns_;
   /*! \brief: epoll helper */
   EpollHelper epoll_helper_;
 
   ThreadsafeQueue<Notification> notification_queue_;
 
-  SpscQueue<std::tuple<int, std::unique_ptr<LtMessageExt>, PktPrioFunc*>>
+  SpscQueue<std::tuple<int, std::unique_ptr<LtMessageExt>, PktPrioFunc*,
+                       std::shared_ptr<SharedFlow>>>
       sr_queue_;
 
   std::vector<ConnMeta*> conn_metas_;
@@ -90,6 +131,8 @@ class PriorityChannel : public TerminableThread {
 
   std::unique_ptr<Packetizer> packetizer_;
 
+  std::unique_ptr<IoEngine> io_engine_;
+
   Meter meter_;
 };
 
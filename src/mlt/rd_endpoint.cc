@@ -5,6 +5,9 @@
 #include "completion.h"
 #include "mlt_communicator.h"
 
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <poll.h>
 #include <chrono>
 #include <thread>
 #include <algorithm>
@@ -16,6 +19,7 @@ RdEndpoint::RdEndpoint(int tos, ConnMeta* conn_meta)
 
   event_.events = EPOLLIN | EPOLLOUT | EPOLLERR;
   event_.data.ptr = this;
+  zerocopy_bytes_ = prism::GetEnvOrDefault<long>("MLT_RC_ZEROCOPY_BYTES", 0);
 }
 
 RdEndpoint::RdEndpoint(int tos, TcpSocket new_sock, ConnMeta* conn_meta)
@@ -24,6 +28,7 @@ RdEndpoint::RdEndpoint(int tos, TcpSocket new_sock, ConnMeta* conn_meta)
 
   event_.events = EPOLLIN | EPOLLOUT | EPOLLERR;
   event_.data.ptr = this;
+  zerocopy_bytes_ = prism::GetEnvOrDefault<long>("MLT_RC_ZEROCOPY_BYTES", 0);
 }
 
 RdEndpoint::~RdEndpoint() {
@@ -42,14 +47,24 @@ void RdEndpoint::Disconnect() {
   set_dead(true);
 }
 
+void RdEndpoint::EnableZeroCopy() {
+  if (zerocopy_bytes_ && !sock_.SetZeroCopy()) {
+    LOG(WARNING) << "SO_ZEROCOPY failed, errno = " << sock_.GetLastError()
+                 << ", copying the messages to comm_id " << comm_id();
+    zerocopy_bytes_ = 0;
+  }
+}
+
 void RdEndpoint::OnAccepted() {
   sock_.SetNonBlock(true);
+  EnableZeroCopy();
   LOG(INFO) << "reliable channel from comm_id " << comm_id() << " accepted";
   // change state to connected
 }
 
 void RdEndpoint::OnConnected() {
   sock_.SetNonBlock(true);
+  EnableZeroCopy();
   LOG(INFO) << "reliable channel to comm_id " << comm_id() << " connected";
   // change state to connected
 }
@@ -70,7 +85,17 @@ void RdEndpoint::OnSendReady() {
       DLOG(TRACE) << "send " << kSignalTypeStr[static_cast<int>(*(int*)(buffer->ptr() + 4))];
     }
 
-    ssize_t nbytes = sock_.Send(buffer->GetRemainBuffer(), buffer->GetRemainSize());
+    int flags = 0;
+    if (zerocopy_bytes_ && buffer->msg_length() >= zerocopy_bytes_) {
+      flags = MSG_ZEROCOPY;
+    }
+    ssize_t nbytes =
+        sock_.Send(buffer->GetRemainBuffer(), buffer->GetRemainSize(), flags);
+    if (nbytes == -1 && flags && sock_.GetLastError() == ENOBUFS) {
+      /// too many pages pinned for the socket, copy this piece
+      flags = 0;
+      nbytes = sock_.Send(buffer->GetRemainBuffer(), buffer->GetRemainSize());
+    }
     // if (buffer->GetRemainBuffer() == buffer->ptr())
     //   DLOG(TRACE) << "send " << cnt++ << " " << nbytes << " "
     //              << *reinterpret_cast<uint32_t*>(buffer->ptr());
@@ -79,11 +104,96 @@ void RdEndpoint::OnSendReady() {
       // cannot send anymore
       break;
     }
+    if (flags) {
+      zc_front_ = true;
+      zc_front_last_ = zc_next_++;
+    }
     buffer->MarkHandled(nbytes);
     if (buffer->IsClear()) {
-      tx_queue_.pop();
+      PopTxQueue();
+    }
+  }
+}
+
+void RdEndpoint::PopTxQueue() {
+  if (zc_front_) {
+    zc_pending_.emplace_back(zc_front_last_, std::move(tx_queue_.front()));
+    zc_front_ = false;
+  }
+  tx_queue_.pop();
+}
+
+bool RdEndpoint::OnErrQueue() {
+  if (!zerocopy_bytes_ && zc_pending_.empty()) return false;
+  for (;;) {
+    char control[128];
+    struct msghdr msg = {};
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (sock_.RecvMsg(&msg, MSG_ERRQUEUE) < 0) {
+      CHECK(sock_.LastErrorWouldBlock()) << "errno = " << sock_.GetLastError();
+      break;
+    }
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+          !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+        continue;
+      }
+      struct sock_extended_err serr;
+      memcpy(&serr, CMSG_DATA(cmsg), sizeof(serr));
+      if (serr.ee_errno != 0 || serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+      if ((serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && !zc_copied_) {
+        /// e.g. over loopback, the pages were pinned for nothing
+        LOG(INFO) << "the kernel copied the MSG_ZEROCOPY sends to comm_id "
+                  << comm_id();
+        zc_copied_ = true;
+      }
+      CompleteZeroCopy(serr.ee_info, serr.ee_data);
     }
   }
+  return sock_.TakeError() == 0;
+}
+
+void RdEndpoint::CompleteZeroCopy(uint32_t lo, uint32_t hi) {
+  /// TCP completes the sends in order nearly always, keep the others aside
+  if (lo != zc_done_) {
+    zc_ranges_[lo] = hi;
+    return;
+  }
+  zc_done_ = hi + 1;
+  for (auto it = zc_ranges_.find(zc_done_); it != zc_ranges_.end();
+       it = zc_ranges_.find(zc_done_)) {
+    zc_done_ = it->second + 1;
+    zc_ranges_.erase(it);
+  }
+  while (!zc_pending_.empty() &&
+         static_cast<int32_t>(zc_pending_.front().first - zc_done_) < 0) {
+    zc_pending_.pop_front();
+  }
+}
+
+void RdEndpoint::WaitZeroCopy(int timeout_ms) {
+  auto end = std::chrono::steady_clock::now() +
+             std::chrono::milliseconds(timeout_ms);
+  while (!zc_pending_.empty()) {
+    int remain = std::chrono::duration_cast<std::chrono::milliseconds>(
+                     end - std::chrono::steady_clock::now())
+                     .count();
+    if (remain <= 0) {
+      /// the kernel may still read them, better leak than send garbage
+      LOG(WARNING) << zc_pending_.size()
+                   << " MSG_ZEROCOPY buffers not completed, comm_id "
+                   << comm_id();
+      for (auto& pending : zc_pending_) pending.second.release();
+      zc_pending_.clear();
+      return;
+    }
+    struct pollfd pfd = {sock_, 0, 0};
+    if (poll(&pfd, 1, remain) > 0) OnErrQueue();
+  }
 }
 
 void RdEndpoint::OnRecvReady() {
@@ -149,6 +259,29 @@ void RdEndpoint::OnRecvReady() {
   }
 }
 
+void RdEndpoint::OnRecvData(const char* data, size_t size) {
+  while (size > 0) {
+    if (!rx_msg_) {
+      /// the length prefix may be split between two pieces as well
+      size_t n = std::min(size, sizeof(rx_length_) - rx_length_bytes_);
+      memcpy(reinterpret_cast<char*>(&rx_length_) + rx_length_bytes_, data, n);
+      rx_length_bytes_ += n;
+      data += n;
+      size -= n;
+      if (rx_length_bytes_ < sizeof(rx_length_)) return;
+      rx_length_bytes_ = 0;
+      rx_msg_ = std::make_unique<Buffer>(rx_length_);
+      rx_msg_->set_msg_length(rx_length_);
+    }
+    size_t n = std::min<size_t>(size, rx_msg_->GetRemainSize());
+    memcpy(rx_msg_->GetRemainBuffer(), data, n);
+    rx_msg_->MarkHandled(n);
+    data += n;
+    size -= n;
+    if (rx_msg_->IsClear()) HandleReceivedData(std::move(rx_msg_));
+  }
+}
+
 void RdEndpoint::HandleReceivedData(std::unique_ptr<Buffer> buffer) {
   // dispatch according to type field
   SignalType type = GetTypeFromBuffer(buffer.get());
@@ -159,6 +292,9 @@ void RdEndpoint::HandleReceivedData(std::unique_ptr<Buffer> buffer) {
       LOG(TRACE) << "kUserData, src_comm_id: " << src_comm_id;
       comm_->meta_queue_.Push({src_comm_id, std::move(buffer)});
     } break;
+    case SignalType::kFusionLayout: {
+      comm_->layout_queue_.Push({comm_id(), std::move(buffer)});
+    } break;
     case SignalType::kFlowStart: {
       FlowStart* hdr = GetInHeader<FlowStart>(buffer.get());
       int msg_id = hdr->msg_id;
@@ -170,6 +306,16 @@ void RdEndpoint::HandleReceivedData(std::unique_ptr<Buffer> buffer) {
                  << " src_comm_id: " << comm_id()
                  << " max_seq_num: " << max_seq_num;
 
+      /// the receiving channel learns the segment size of the sender and
+      /// maps the handle of the compact header
+      {
+        ReceivingChannel::Notification n;
+        n.type = ReceivingChannel::Notification::FLOW_START;
+        n.data.flow_start = {msg_id, static_cast<uint16_t>(hdr->handle),
+                             hdr->segment, conn_meta_};
+        comm_->receiving_channel_->Notify(std::move(n));
+      }
+
       /// TODO(cjr): finish this rendezvous later
       /// 1. rendezvous req
 
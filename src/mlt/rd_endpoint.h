@@ -8,6 +8,8 @@
 #include "grad_packet.h"
 #include "conn_meta.h"
 
+#include <deque>
+#include <map>
 #include <queue>
 #include <unordered_map>
 
@@ -37,8 +39,21 @@ class RdEndpoint {
 
   void OnRecvReady();
 
+  /// take a piece of the stream received by the io engine, which may hold
+  /// several messages or a part of one
+  void OnRecvData(const char* data, size_t size);
+
   void OnError();
 
+  /// read the completions of MSG_ZEROCOPY, which raise EPOLLERR too, and
+  /// release the buffers the kernel is done with. false if the socket has an
+  /// error of its own
+  bool OnErrQueue();
+
+  /// wait at most timeout_ms for the kernel to be done with the buffers sent
+  /// by MSG_ZEROCOPY, before closing the socket
+  void WaitZeroCopy(int timeout_ms);
+
   void HandleReceivedData(std::unique_ptr<Buffer> buffer);
 
   static inline void WriteLength(Buffer* buffer) {
@@ -65,6 +80,15 @@ class RdEndpoint {
   inline void set_comm(MLTCommunicator* comm) { comm_ = comm; }
 
  private:
+  void EnableZeroCopy();
+
+  /// the front of tx_queue_ is sent, keep it until its zerocopy sends are
+  /// completed if it had any
+  void PopTxQueue();
+
+  /// the sends numbered lo to hi are completed
+  void CompleteZeroCopy(uint32_t lo, uint32_t hi);
+
   int tos_;
   TcpSocket sock_;
   ConnMeta* conn_meta_;
@@ -72,6 +96,22 @@ class RdEndpoint {
   bool is_dead_ {false};
   TxQueue tx_queue_;
   std::vector<std::unique_ptr<Buffer>> rx_buffers_;
+  /// the message being assembled by OnRecvData and its length prefix
+  std::unique_ptr<Buffer> rx_msg_;
+  uint32_t rx_length_;
+  size_t rx_length_bytes_ {0};
+  /// messages of at least MLT_RC_ZEROCOPY_BYTES go by MSG_ZEROCOPY, 0 never.
+  /// the kernel numbers each such send, the buffers wait in zc_pending_ with
+  /// the number of their last send until the error queue completes it
+  size_t zerocopy_bytes_;
+  uint32_t zc_next_ {0};
+  uint32_t zc_done_ {0};
+  bool zc_front_ {false};
+  uint32_t zc_front_last_;
+  bool zc_copied_ {false};
+  std::deque<std::pair<uint32_t, std::unique_ptr<Buffer>>> zc_pending_;
+  /// the ranges completed out of order, beyond zc_done_
+  std::map<uint32_t, uint32_t> zc_ranges_;
 
   MLTCommunicator* comm_;
 
@@ -6,6 +6,8 @@
 
 ReceivingChannel::ReceivingChannel(MLTCommunicator* comm, int port, int queue_size)
     : comm_{comm}, port_{port}, rr_queue_{queue_size}, notification_queue_{queue_size} {
+  compact_ = MLTGlobal::Get()->CompactHeader();
+  io_engine_.reset(CreateIoEngine(IoEngine::kEpoll, 0, 0));
   AddrInfo ai(port, SOCK_DGRAM);
   sock_.Create(ai);
   sock_.SetReuseAddr(true);
@@ -18,9 +20,8 @@ ReceivingChannel::ReceivingChannel(MLTCommunicator* comm, int port, int queue_si
   // SetSockBuffer();
 }
 
-void ReceivingChannel::Enqueue(ConnMeta* conn_meta, const LtMessage& msg,
-                               double loss_ratio) {
-  rr_queue_.Push({conn_meta, msg, loss_ratio});
+void ReceivingChannel::Enqueue(ReceiveRequest&& request) {
+  rr_queue_.Push(std::move(request));
 }
 
 void ReceivingChannel::Notify(Notification&& notification) {
@@ -33,20 +34,33 @@ void ReceivingChannel::Run() {
 
   Meter meter(1000, "receiving_channel");
 
-  while (!terminated_.load()) {
-    SockAddr client_addr;
-    // TODO(cjr): change to recvmsg, put in backlog buffer first
-    ssize_t nbytes = sock_.RecvFrom(buf, buffer_size, 0, &client_addr);
+  /// the engine receives into its ring, without a syscall per datagram
+  bool engine_receives = io_engine_->HasReceivers();
+  if (engine_receives) io_engine_->AddReceiver(sock_, nullptr, false);
+  IoEngine::RecvCallback on_packet = [this, &meter](void*, const char* buf,
+                                                    ssize_t size) {
+    meter.Add(size);
+    HandleReceive(buf, size);
+  };
 
-    if (nbytes == -1) {
-      CHECK(sock_.LastErrorWouldBlock()) << "errno = " << sock_.GetLastError();
+  while (!terminated_.load()) {
+    if (engine_receives) {
+      io_engine_->PollRecv(on_packet);
     } else {
-      DLOG(TRACE) << "nbytes = " << nbytes;
+      SockAddr client_addr;
+      // TODO(cjr): change to recvmsg, put in backlog buffer first
+      ssize_t nbytes = sock_.RecvFrom(buf, buffer_size, 0, &client_addr);
+
+      if (nbytes == -1) {
+        CHECK(sock_.LastErrorWouldBlock()) << "errno = " << sock_.GetLastError();
+      } else {
+        DLOG(TRACE) << "nbytes = " << nbytes;
 
-      meter.Add(nbytes);
+        meter.Add(nbytes);
 
-      /// handle gradient packets
-      HandleReceive(buf, nbytes);
+        /// handle gradient packets
+        HandleReceive(buf, nbytes);
+      }
     }
 
     /// TODO(cjr): cahnge the polling frequency to optimize performance
@@ -55,18 +69,36 @@ void ReceivingChannel::Run() {
 
     /// poll notification
     PollNotification();
+
+    PollDeadlines();
   }
 
+  if (engine_receives) io_engine_->RemoveReceiver(sock_);
   delete [] buf;
 }
 
+bool ReceivingChannel::ParsePacket(const char* buf, size_t size,
+                                   GradPacket* pkt) {
+  if (compact_) {
+    if (!ParseCompactGradPacket(buf, size, pkt)) {
+      LOG(WARNING) << "unknown packet header version, is MLT_COMPACT_HEADER "
+                      "the same on all the peers?";
+      return false;
+    }
+    pkt->dst_comm_id = comm_->comm_id();
+    return true;
+  }
+  ParseGradPacket(buf, pkt);
+  CHECK_EQ(pkt->dst_comm_id, static_cast<uint16_t>(comm_->comm_id()));
+  return true;
+}
+
 void ReceivingChannel::HandleReceive(const char* buf, size_t size) {
-  GradPacket* pkt = reinterpret_cast<GradPacket*>(const_cast<char*>(buf));
-  pkt->grad_ptr = reinterpret_cast<uint64_t>(buf + kGradPacketHeader);
+  GradPacket grad_pkt;
+  if (!ParsePacket(buf, size, &grad_pkt)) return;
+  GradPacket* pkt = &grad_pkt;
   DLOG(TRACE) << pkt->DebugString();
-  CHECK_EQ(pkt->dst_comm_id, static_cast<uint16_t>(comm_->comm_id()));
   int dest = pkt->src_comm_id;
-  int msg_id = pkt->msg_id;
 
   /// TODO(cjr): what if still receive data after connection has stopped
   comm_->Lock();
@@ -88,21 +120,42 @@ void ReceivingChannel::HandleReceive(const char* buf, size_t size) {
     rx_meter.Clear();
   }
 
+  DeliverPacket(conn_meta, pkt, buf, size);
+}
+
+void ReceivingChannel::DeliverPacket(ConnMeta* conn_meta, GradPacket* pkt,
+                                     const char* buf, size_t size) {
+  int msg_id = pkt->msg_id;
   // lock this comm_->id_conn_[dest].mtx;
   // std::lock_guard<std::mutex> lk(conn_meta->mtx);
   LtMessageExt* lt_msg_ext = nullptr;
-  auto& recv_msgs_map = conn_meta->recv_msgs;
-
-  auto it = recv_msgs_map.find(msg_id);
-  if (it != recv_msgs_map.end()) {
-    lt_msg_ext = it->second.get();
+  if (compact_) {
+    /// the flow is one array index away from the handle
+    uint16_t handle = pkt->handle;
+    if (handle >= conn_meta->rx_flows.size() ||
+        conn_meta->rx_flow_msg_ids[handle] == -1) {
+      /// ahead of its FlowStart, keep it until the handle is known
+      StashEarlyPacket(conn_meta, handle, buf, size);
+      return;
+    }
+    lt_msg_ext = conn_meta->rx_flows[handle];
+    msg_id = conn_meta->rx_flow_msg_ids[handle];
+    pkt->offset = pkt->seq * conn_meta->rx_flow_segments[handle];
   } else {
+    auto& recv_msgs_map = conn_meta->recv_msgs;
+    auto it = recv_msgs_map.find(msg_id);
+    if (it != recv_msgs_map.end()) lt_msg_ext = it->second.get();
+  }
+
+  if (!lt_msg_ext) {
+    /// a late packet of a receive cut by its deadline
+    if (conn_meta->rx_expired.count(msg_id)) return;
     auto& free_list = conn_meta->backlog_free_list;
     auto& vec = conn_meta->backlog_used_map[msg_id];
-    if (!free_list.empty()) {
-      auto& grad_pkt_it = vec.emplace_back(free_list.back());
+    if (!free_list.empty() && size <= conn_meta->backlog_slot) {
+      auto& backlog_pkt = vec.emplace_back(free_list.back(), size);
       free_list.pop_back();
-      memcpy(grad_pkt_it, buf, size);
+      memcpy(backlog_pkt.first, buf, size);
     } else {
       // drop the packet!
     }
@@ -113,22 +166,41 @@ void ReceivingChannel::HandleReceive(const char* buf, size_t size) {
   size_t copied = lt_msg_ext->CopyGradients(pkt);
 
   /// TOD(cjr): pay attention of this copied > 0
-  if (copied > 0 && lt_msg_ext->FinishReceiving() && !lt_msg_ext->stopped) {
-    /// FIXME(cjr): should only execute once
-    lt_msg_ext->stopped = true;
-
-    /// 1. send stop request
-    auto buffer = std::make_unique<Buffer>(GetOutBufferSize<StopRequest>());
-    StopRequest* hdr = GetOutHeader<StopRequest>(buffer.get());
-    hdr->type = SignalType::kStopRequest;
-    hdr->msg_id = msg_id;
-    hdr->comm_id = comm_->comm_id();
-    // hdr->sending_rate = ;
-    buffer->set_msg_length(buffer->size());
-  
-    comm_->reliable_channel_->Enqueue(dest, std::move(buffer));
-    /// 2. submit to completion queue when receiving kStopConfirm
-  }
+  if (copied > 0) StopIfFinished(conn_meta, lt_msg_ext);
+}
+
+void ReceivingChannel::StashEarlyPacket(ConnMeta* conn_meta, uint16_t handle,
+                                        const char* buf, size_t size) {
+  auto& early_pkts = conn_meta->early_pkts;
+  if (early_pkts.empty()) return;
+  /// overwrite the oldest one
+  size_t slot = conn_meta->early_next;
+  conn_meta->early_next = (slot + 1) % early_pkts.size();
+  early_pkts[slot] = {conn_meta->rx_flow_epoch, static_cast<uint32_t>(size),
+                      handle};
+  memcpy(conn_meta->early_buffer.get() + slot * MLTGlobal::Get()->MaxSegment(),
+         buf, size);
+}
+
+void ReceivingChannel::StopIfFinished(ConnMeta* conn_meta,
+                                      LtMessageExt* msg_ext) {
+  if (!msg_ext->FinishReceiving() || msg_ext->stopped) return;
+  msg_ext->stopped = true;
+  SendStopRequest(conn_meta, msg_ext->msg_id);
+}
+
+void ReceivingChannel::SendStopRequest(ConnMeta* conn_meta, int msg_id) {
+  /// 1. send stop request
+  auto buffer = std::make_unique<Buffer>(GetOutBufferSize<StopRequest>());
+  StopRequest* hdr = GetOutHeader<StopRequest>(buffer.get());
+  hdr->type = SignalType::kStopRequest;
+  hdr->msg_id = msg_id;
+  hdr->comm_id = comm_->comm_id();
+  // hdr->sending_rate = ;
+  buffer->set_msg_length(buffer->size());
+
+  comm_->reliable_channel_->Enqueue(conn_meta->dest_comm_id, std::move(buffer));
+  /// 2. submit to completion queue when receiving kStopConfirm
 }
 
 void ReceivingChannel::RequestRateAdjustment(int dest, double rx_speed) {
@@ -142,6 +214,9 @@ void ReceivingChannel::RequestRateAdjustment(int dest, double rx_speed) {
   comm_->reliable_channel_->Enqueue(dest, std::move(buffer));
 }
 
+/// weight of a flow in the loss rate of its connection
+constexpr double kLossRateGain = 0.125;
+
 template <typename T>
 inline typename std::enable_if<std::is_integral<T>::value, T>::type AlignUp(
     size_t alignment, T value) {
@@ -149,39 +224,158 @@ inline typename std::enable_if<std::is_integral<T>::value, T>::type AlignUp(
 }
 
 void ReceivingChannel::PollReceiveRequest() {
-  decltype(rr_queue_)::value_type rr;
+  ReceiveRequest rr;
   while (rr_queue_.TryPop(&rr)) {
-    auto [conn_meta, ltmsg, loss_ratio] = std::move(rr);
-    int key = ltmsg.msg_id;
+    ConnMeta* conn_meta = rr.conn;
+    int key = rr.msg.msg_id;
+    if (conn_meta->rx_expired.count(key)) {
+      /// the previous flow of this msg_id has not stopped yet
+      deferred_receives_[EncodeFlow(conn_meta->dest_comm_id, key)] =
+          std::move(rr);
+      continue;
+    }
+    AddReceive(std::move(rr));
+  }
+}
+
+void ReceivingChannel::AddReceive(ReceiveRequest&& rr) {
+  ConnMeta* conn_meta = rr.conn;
+  const LtMessage& ltmsg = rr.msg;
+  int key = ltmsg.msg_id;
+
+  CHECK_EQ(0, conn_meta->recv_msgs.count(key));
+
+  conn_meta->recv_msgs[key] = std::make_unique<LtMessageExt>(ltmsg);
+
+  LtMessageExt* msg_ext = conn_meta->recv_msgs[key].get();
+
+  msg_ext->bound = AlignUp(
+      sizeof(float), static_cast<size_t>(ltmsg.size * (1 - rr.loss_ratio)));
+  LOG_IF(WARNING, msg_ext->bound == 0) << "message bound is 0";
+  msg_ext->deadline = rr.deadline;
+  msg_ext->gap_fill = rr.gap_fill;
+  if (rr.deadline != std::chrono::steady_clock::time_point::max()) {
+    deadlines_.emplace(rr.deadline, conn_meta->dest_comm_id, key);
+  }
+
+  /// the flow may have started already
+  auto it = conn_meta->rx_flow_handles.find(key);
+  if (it != conn_meta->rx_flow_handles.end()) {
+    conn_meta->rx_flows[it->second] = msg_ext;
+    msg_ext->segment = conn_meta->rx_flow_segments[it->second];
+  }
 
-    CHECK_EQ(0, conn_meta->recv_msgs.count(key));
+  /// copy backlog message into receive request address
+  if (ReplayBacklog(conn_meta, key, msg_ext) > 0) {
+    StopIfFinished(conn_meta, msg_ext);
+  }
+}
 
-    conn_meta->recv_msgs[key] = std::make_unique<LtMessageExt>(ltmsg);
+void ReceivingChannel::PollDeadlines() {
+  if (deadlines_.empty()) return;
+  auto now = std::chrono::steady_clock::now();
+  while (!deadlines_.empty() && std::get<0>(deadlines_.top()) <= now) {
+    auto [deadline, src, msg_id] = deadlines_.top();
+    deadlines_.pop();
+    comm_->Lock();
+    auto it = comm_->id_conn_.find(src);
+    ConnMeta* conn_meta =
+        it != comm_->id_conn_.end() ? it->second.get() : nullptr;
+    comm_->Unlock();
+    if (conn_meta) ExpireReceive(conn_meta, msg_id, deadline);
+  }
+}
 
-    LtMessageExt* msg_ext = conn_meta->recv_msgs[key].get();
+void ReceivingChannel::ExpireReceive(
+    ConnMeta* conn_meta, int msg_id,
+    std::chrono::steady_clock::time_point deadline) {
+  auto it = conn_meta->recv_msgs.find(msg_id);
+  /// completed in time, or a later receive of the same msg_id
+  if (it == conn_meta->recv_msgs.end() || it->second->deadline != deadline) {
+    return;
+  }
+  LtMessageExt* msg_ext = it->second.get();
+  LOG(DEBUG) << "msg " << msg_id << " from " << conn_meta->dest_comm_id
+             << " missed its deadline, received " << msg_ext->bytes_received
+             << " of " << msg_ext->size << " bytes";
+
+  /// 1. tell the sender to stop, unless enough has arrived and it is told,
+  /// or its flow has not started yet
+  bool started = msg_ext->stopped || msg_ext->bytes_received > 0 ||
+                 conn_meta->rx_flow_handles.count(msg_id) > 0;
+  if (!msg_ext->stopped && started) {
+    msg_ext->stopped = true;
+    SendStopRequest(conn_meta, msg_id);
+  }
 
-    /// copy backlog message into receive request address
-    auto it_vec = conn_meta->backlog_used_map.find(key);
-    if (it_vec != conn_meta->backlog_used_map.end() &&
-        !it_vec->second.empty()) {
-      auto& vec = it_vec->second;
-      for (GradPacket* pkt : vec) {
-        msg_ext->CopyGradients(pkt);
-        conn_meta->backlog_free_list.push_back(pkt);
+  /// 2. complete it now, the buffer is not written after this. the handle
+  /// stays until StopConfirm, so that the packets in flight are dropped
+  CompleteReceive(conn_meta, msg_ext);
+  auto it_handle = conn_meta->rx_flow_handles.find(msg_id);
+  if (it_handle != conn_meta->rx_flow_handles.end()) {
+    conn_meta->rx_flows[it_handle->second] = nullptr;
+  }
+  conn_meta->rx_expired[msg_id] = started;
+  conn_meta->recv_msgs.erase(it);
+}
+
+void ReceivingChannel::StopExpiredFlow(ConnMeta* conn_meta, int msg_id) {
+  bool& stop_sent = conn_meta->rx_expired[msg_id];
+  if (stop_sent) return;
+  stop_sent = true;
+  SendStopRequest(conn_meta, msg_id);
+}
+
+void ReceivingChannel::CompleteReceive(ConnMeta* conn_meta,
+                                       LtMessageExt* msg_ext) {
+  Completion comp;
+  comp.msg_id = msg_ext->msg_id;
+  comp.type = CompletionType::kRecv;
+  comp.remote_comm_id = conn_meta->dest_comm_id;
+  comp.bytes_received = msg_ext->bytes_received;
+  if (msg_ext->bytes_received < msg_ext->size) {
+    comp.partial = true;
+    msg_ext->GetReceivedRanges(msg_ext->segment, &comp.recv_ranges);
+    if (msg_ext->gap_fill == GapFill::kZero) {
+      size_t next = 0;
+      for (const auto& r : comp.recv_ranges) {
+        memset(msg_ext->buf + next, 0, r.first - next);
+        next = r.second;
       }
-      vec.clear();
+      memset(msg_ext->buf + next, 0, msg_ext->size - next);
     }
+  }
+  comm_->cq_->Push(comp);
+}
 
-    msg_ext->bound = AlignUp(
-        sizeof(float), static_cast<size_t>(ltmsg.size * (1 - loss_ratio)));
-    LOG_IF(WARNING, msg_ext->bound == 0) << "message bound is 0";
+size_t ReceivingChannel::ReplayBacklog(ConnMeta* conn_meta, int msg_id,
+                                       LtMessageExt* msg_ext) {
+  size_t copied = 0;
+  auto it_vec = conn_meta->backlog_used_map.find(msg_id);
+  if (it_vec == conn_meta->backlog_used_map.end()) return 0;
+  for (auto [raw_pkt, size] : it_vec->second) {
+    GradPacket pkt;
+    if (ParsePacket(reinterpret_cast<const char*>(raw_pkt), size, &pkt)) {
+      if (compact_) pkt.offset = pkt.seq * msg_ext->segment;
+      copied += msg_ext->CopyGradients(&pkt);
+    }
+    conn_meta->backlog_free_list.push_back(raw_pkt);
   }
+  conn_meta->backlog_used_map.erase(it_vec);
+  return copied;
 }
 
 void ReceivingChannel::PollNotification() {
   ReceivingChannel::Notification n;
   while (notification_queue_.TryPop(&n)) {
     switch (n.type) {
+      case Notification::FLOW_START: {
+        ConnMeta* conn_meta = n.data.flow_start.conn;
+        int msg_id = n.data.flow_start.msg_id;
+        uint16_t handle = n.data.flow_start.handle;
+        uint32_t segment = n.data.flow_start.segment;
+        StartFlow(msg_id, handle, segment, conn_meta);
+      } break;
       case Notification::FINISH_FLOW: {
         ConnMeta* conn_meta = n.data.finish_flow.conn;
         int msg_id = n.data.finish_flow.msg_id;
@@ -200,7 +394,55 @@ void ReceivingChannel::PollNotification() {
   }
 }
 
+void ReceivingChannel::StartFlow(int msg_id, uint16_t handle,
+                                 uint32_t segment, ConnMeta* conn_meta) {
+  /// the sender cuts a flow by its path MTU to us, or by a smaller one if
+  /// the flow is multicast, so the backlog slots fit the largest
+  conn_meta->rx_max_segment = std::max(conn_meta->rx_max_segment, segment);
+  conn_meta->CarveBacklog(conn_meta->rx_max_segment +
+                          MLTGlobal::Get()->PacketHeaderSize());
+  auto it = conn_meta->recv_msgs.find(msg_id);
+  LtMessageExt* msg_ext =
+      it != conn_meta->recv_msgs.end() ? it->second.get() : nullptr;
+  if (msg_ext) msg_ext->segment = segment;
+  if (conn_meta->rx_expired.count(msg_id)) StopExpiredFlow(conn_meta, msg_id);
+  if (!compact_) return;
+
+  if (handle >= conn_meta->rx_flows.size()) {
+    conn_meta->rx_flows.resize(handle + 1, nullptr);
+    conn_meta->rx_flow_msg_ids.resize(handle + 1, -1);
+    conn_meta->rx_flow_segments.resize(handle + 1, 0);
+  }
+  conn_meta->rx_flow_msg_ids[handle] = msg_id;
+  conn_meta->rx_flow_segments[handle] = segment;
+  conn_meta->rx_flow_handles[msg_id] = handle;
+  conn_meta->rx_flows[handle] = msg_ext;
+
+  /// deliver the packets that overtook this FlowStart. the sender reuses a
+  /// handle only after all the others, so a packet stashed that many flows
+  /// ago is a late one of the previous flow of this handle
+  uint64_t epoch = ++conn_meta->rx_flow_epoch;
+  size_t slot_size = MLTGlobal::Get()->MaxSegment();
+  auto& early_pkts = conn_meta->early_pkts;
+  for (size_t i = 0; i < early_pkts.size(); i++) {
+    auto& early = early_pkts[i];
+    if (early.size == 0 || early.handle != handle) continue;
+    size_t size = early.size;
+    early.size = 0;
+    if (early.epoch + kMaxFlowHandles / 2 < epoch) continue;
+    const char* raw = conn_meta->early_buffer.get() + i * slot_size;
+    GradPacket pkt;
+    if (ParsePacket(raw, size, &pkt)) DeliverPacket(conn_meta, &pkt, raw, size);
+  }
+}
+
 void ReceivingChannel::FinishFlow(int msg_id, uint32_t max_seq_num, ConnMeta* conn_meta) {
+  /// the receive has completed by its deadline
+  if (conn_meta->rx_expired.count(msg_id)) {
+    StopExpiredFlow(conn_meta, msg_id);
+    return;
+  }
+
   /// 1. check if finish requirement satisfied
   int src_comm_id = conn_meta->dest_comm_id;
   bool finish = false;
@@ -213,6 +455,7 @@ void ReceivingChannel::FinishFlow(int msg_id, uint32_t max_seq_num, ConnMeta* co
     found = true;
     block_mgr = it->second->block_mgr.get();
     finish = it->second->FinishReceiving();
+    SampleLoss(conn_meta, it->second.get());
     LOG(TRACE) << "loss_bound = " << it->second->bound
                 << " received = " << it->second->bytes_received
                 << " src_comm_id = " << conn_meta->dest_comm_id;
@@ -270,20 +513,45 @@ void ReceivingChannel::FinishFlow(int msg_id, uint32_t max_seq_num, ConnMeta* co
   }
 }
 
+void ReceivingChannel::SampleLoss(ConnMeta* conn_meta,
+                                  LtMessageExt* msg_ext) {
+  if (msg_ext->loss_sampled || msg_ext->size == 0) return;
+  msg_ext->loss_sampled = true;
+  double received = std::min(msg_ext->bytes_received, msg_ext->size);
+  double loss = 1 - received / msg_ext->size;
+  double rate = conn_meta->rx_loss_rate.load();
+  conn_meta->rx_loss_rate.store(rate + kLossRateGain * (loss - rate));
+}
+
 void ReceivingChannel::ConfirmStop(int msg_id, ConnMeta* conn_meta) {
-  /// 2. submit to completion queue
+  /// 2. submit to completion queue, unless the deadline did it
   auto& recv_msgs_map = conn_meta->recv_msgs;
-  auto it = recv_msgs_map.find(msg_id);
-  CHECK(it != recv_msgs_map.end());
-  LtMessageExt* lt_msg_ext = it->second.get();
+  bool expired = conn_meta->rx_expired.erase(msg_id) > 0;
+  if (!expired) {
+    auto it = recv_msgs_map.find(msg_id);
+    CHECK(it != recv_msgs_map.end());
+    CompleteReceive(conn_meta, it->second.get());
+    recv_msgs_map.erase(it);
+  }
 
-  Completion comp;
-  comp.msg_id = msg_id;
-  comp.type = CompletionType::kRecv;
-  comp.remote_comm_id = conn_meta->dest_comm_id;
-  comp.bytes_received = lt_msg_ext->bytes_received;
-  comm_->cq_->Push(comp);
+  /// 3. remove entry in the map, a late packet of the handle is dropped
+  auto it_handle = conn_meta->rx_flow_handles.find(msg_id);
+  if (it_handle != conn_meta->rx_flow_handles.end()) {
+    uint16_t handle = it_handle->second;
+    if (conn_meta->rx_flow_msg_ids[handle] == msg_id) {
+      conn_meta->rx_flows[handle] = nullptr;
+      conn_meta->rx_flow_msg_ids[handle] = -1;
+    }
+    conn_meta->rx_flow_handles.erase(it_handle);
+  }
 
-  /// 3. remove entry in the map
-  recv_msgs_map.erase(it);
+  /// 4. the receive of the same msg_id waiting for this flow to stop
+  if (expired) {
+    FlowId flow_id = EncodeFlow(conn_meta->dest_comm_id, msg_id);
+    auto it = deferred_receives_.find(flow_id);
+    if (it != deferred_receives_.end()) {
+      AddReceive(std::move(it->second));
+      deferred_receives_.erase(it);
+    }
+  }
 }
\ No newline at end of file
@@ -3,11 +3,16 @@
 
 #include "epoll_helper.h"
 #include "grad_packet.h"
+#include "io_engine.h"
 #include "socket.h"
 #include "spsc_queue.h"
 #include "thread_proto.h"
 #include "ltmessage.h"
 #include "threadsafe_queue.h"
+
+#include <chrono>
+#include <queue>
+#include <unordered_map>
 // #include "udp_endpoint.h"
 
 class MLTCommunicator;
@@ -21,8 +26,15 @@ class ReceivingChannel : public TerminableThread {
  public:
   struct Notification {
     Notification() = default;
-    enum Type { FINISH_FLOW, CONFIRM_STOP } type;
+    enum Type { FLOW_START, FINISH_FLOW, CONFIRM_STOP } type;
     union {
+      struct {
+        int msg_id;
+        uint16_t handle;
+        uint32_t segment;
+        ConnMeta* conn;
+      } flow_start;  // FLOW_START
+
       struct {
         int msg_id;
         uint32_t max_seq_num;
@@ -36,17 +48,28 @@ class ReceivingChannel : public TerminableThread {
     } data;
   };
 
+  struct ReceiveRequest {
+    ConnMeta* conn;
+    LtMessage msg;
+    double loss_ratio;
+    std::chrono::steady_clock::time_point deadline;
+    GapFill gap_fill;
+  };
+
   ReceivingChannel(MLTCommunicator* comm, int port, int queue_size = 32);
 
   virtual ~ReceivingChannel() {}
 
   virtual void Run();
 
+  /// take the engine receiving the packets, before Start
+  inline void set_io_engine(IoEngine* io_engine) { io_engine_.reset(io_engine); }
+
   void HandleReceive(const char* buf, size_t size);
 
   void RequestRateAdjustment(int dest, double rx_speed);
 
-  void Enqueue(ConnMeta* conn_meta, const LtMessage& msg, double loss_ratio);
+  void Enqueue(ReceiveRequest&& request);
 
   void Notify(Notification&& notification);
 
@@ -58,15 +81,69 @@ class ReceivingChannel : public TerminableThread {
 
   void ConfirmStop(int msg_id, ConnMeta* conn_meta);
 
+  void StartFlow(int msg_id, uint16_t handle, uint32_t segment,
+                 ConnMeta* conn_meta);
+
  private:
+  /// parse a datagram of either header format, false if it should be dropped
+  bool ParsePacket(const char* buf, size_t size, GradPacket* pkt);
+
+  /// find the flow of a packet, copy it there or to the backlog
+  void DeliverPacket(ConnMeta* conn_meta, GradPacket* pkt, const char* buf,
+                     size_t size);
+
+  /// keep a packet whose handle has not been announced by FlowStart yet
+  void StashEarlyPacket(ConnMeta* conn_meta, uint16_t handle, const char* buf,
+                        size_t size);
+
+  /// copy the packets of msg_id that arrived before its receive was posted
+  size_t ReplayBacklog(ConnMeta* conn_meta, int msg_id, LtMessageExt* msg_ext);
+
+  /// send StopRequest once enough of the flow has arrived
+  void StopIfFinished(ConnMeta* conn_meta, LtMessageExt* msg_ext);
+
+  void SendStopRequest(ConnMeta* conn_meta, int msg_id);
+
+  /// stop the flow of an expired receive once it is known to have started,
+  /// a StopRequest ahead of it would not find it at the sender
+  void StopExpiredFlow(ConnMeta* conn_meta, int msg_id);
+
+  /// start receiving into a posted request
+  void AddReceive(ReceiveRequest&& request);
+
+  /// push the kRecv completion, filling the gaps as the request asked
+  void CompleteReceive(ConnMeta* conn_meta, LtMessageExt* msg_ext);
+
+  /// complete the receives whose deadline has passed
+  void PollDeadlines();
+
+  /// count the flow in the loss rate of the connection when its first pass
+  /// is over, retransmissions would hide the loss
+  void SampleLoss(ConnMeta* conn_meta, LtMessageExt* msg_ext);
+
+  void ExpireReceive(ConnMeta* conn_meta, int msg_id,
+                     std::chrono::steady_clock::time_point deadline);
+
   /*! \brief: a pointer to MLTCommunicator to access its data */
   MLTCommunicator* comm_;
   /*! \brief: listening port */
   int port_;
   /*! \brief: socket for receiving messages */
   UdpSocket sock_;
-
-  SpscQueue<std::tuple<ConnMeta*, LtMessage, double>> rr_queue_;
+  /*! \brief: whether the packets carry the compact header */
+  bool compact_;
+  /*! \brief: receives the packets if it can, or the channel does */
+  std::unique_ptr<IoEngine> io_engine_;
+
+  SpscQueue<ReceiveRequest> rr_queue_;
+
+  /// deadline, src comm_id and msg_id, the earliest on top
+  using Deadline = std::tuple<std::chrono::steady_clock::time_point, int, int>;
+  std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline>>
+      deadlines_;
+  /// the receives posted again before the StopConfirm of their expired flow,
+  /// keyed by flow
+  std::unordered_map<FlowId, ReceiveRequest> deferred_receives_;
 
   SpscQueue<Notification> notification_queue_;
 };
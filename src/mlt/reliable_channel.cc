@@ -11,11 +11,16 @@ ReliableChannel::~ReliableChannel() {
 void ReliableChannel::RemoveEndpoint(int dest) {
   auto it = ctrl_endpoints_.find(dest);
   if (it != ctrl_endpoints_.end() && it->second && !it->second->is_dead()) {
+    /// flush what is still queued, e.g. the last message of a barrier
+    while (!it->second->tx_queue().empty()) it->second->OnSendReady();
+    it->second->WaitZeroCopy(kRcZeroCopyWaitMs);
+    io_engine_->RemoveReceiver(it->second->fd());
     it->second->Disconnect();
   }
 }
 
 void ReliableChannel::AddEndpoint(std::shared_ptr<RdEndpoint> endpoint) {
+  if (io_engine_->HasReceivers()) endpoint->event().events &= ~EPOLLIN;
   epoll_helper_.EpollCtl(EPOLL_CTL_ADD, endpoint->fd(), &endpoint->event());
 
   int remote_comm_id = endpoint->comm_id();
@@ -23,6 +28,9 @@ void ReliableChannel::AddEndpoint(std::shared_ptr<RdEndpoint> endpoint) {
   ctrl_endpoints_[remote_comm_id] = endpoint;
 
   endpoint->set_comm(comm_);
+  if (io_engine_->HasReceivers()) {
+    io_engine_->AddReceiver(endpoint->fd(), endpoint.get(), true);
+  }
 }
 
 void ReliableChannel::HandleNewConnection() {
@@ -31,6 +39,12 @@ void ReliableChannel::HandleNewConnection() {
   int rc_tos = prism::GetEnvOrDefault<int>("MLT_RC_TOS", 0xfe);
   int dest;
   CHECK_EQ(sizeof(dest), new_sock.Recv(&dest, sizeof(dest)));
+  if (dest == MLTCommunicator::kUnassignedCommId) {
+    /// the peer does not know its comm id yet, e.g. a node registering itself
+    /// at the scheduler, name the connection with a local negative id
+    dest = --comm_->anonymous_comm_id_;
+    LOG(INFO) << "peer without comm_id, assigned local comm_id " << dest;
+  }
 
   /// construct ConnMeta
   comm_->Lock();
@@ -90,6 +104,24 @@ void ReliableChannel::Run() {
 
   std::queue<std::shared_ptr<RdEndpoint>> dead_eps;
 
+  bool engine_receives = io_engine_->HasReceivers();
+  if (engine_receives) {
+    engine_event_.events = EPOLLIN;
+    engine_event_.data.fd = io_engine_->fd();
+    epoll_helper_.EpollCtl(EPOLL_CTL_ADD, io_engine_->fd(), &engine_event_);
+  }
+  IoEngine::RecvCallback on_data = [](void* ctx, const char* buf,
+                                      ssize_t size) {
+    RdEndpoint* endpoint = static_cast<RdEndpoint*>(ctx);
+    if (size > 0) {
+      endpoint->OnRecvData(buf, size);
+    } else {
+      LOG(WARNING) << "peer " << endpoint->comm_id()
+                   << " has shutdown, disconnecting...";
+      endpoint->Disconnect();
+    }
+  };
+
   while (!terminated_.load()) {
     // Epoll IO
     int nevents = epoll_helper_.EpollWait(&events[0], max_events, timeout_ms);
@@ -101,6 +133,10 @@ void ReliableChannel::Run() {
         HandleNewConnection();
         continue;
       }
+      if (engine_receives && ev.data.fd == io_engine_->fd()) {
+        io_engine_->PollRecv(on_data);
+        continue;
+      }
 
       // data events
       RdEndpoint* endpoint = static_cast<RdEndpoint*>(ev.data.ptr);
@@ -116,7 +152,9 @@ void ReliableChannel::Run() {
       }
 
       if (ev.events & EPOLLERR) {
+        if (endpoint->OnErrQueue()) continue;
         LOG(WARNING) << "EPOLLERR, endpoint comm_id: " << endpoint->comm_id();
+        io_engine_->RemoveReceiver(endpoint->fd());
         endpoint->OnError();
         auto endpoint_ptr = std::move(ctrl_endpoints_[endpoint->comm_id()]);
         dead_eps.push(endpoint_ptr);
@@ -135,6 +173,8 @@ void ReliableChannel::Run() {
       dead_eps.pop();
     }
 
+    /// the endpoints are removed after routing the packets enqueued before
+    std::vector<int> removing;
     ReliableChannel::Notification n;
     while (notification_queue_.TryPop(&n)) {
       switch (n.type) {
@@ -142,7 +182,7 @@ void ReliableChannel::Run() {
           AddEndpoint(n.endpoint);
         } break;
         case Notification::REMOVE_ENDPOINT: {
-          RemoveEndpoint(n.data.dest_comm_id);
+          removing.push_back(n.data.dest_comm_id);
         } break;
         default: {
           LOG(FATAL) << "unknown notification type: "
@@ -152,18 +192,34 @@ void ReliableChannel::Run() {
     }
 
     // pull out packets and routing to corresponding endpoints
-    std::tuple<int, std::unique_ptr<Buffer>> tup;
-    while (tx_queue_.TryPop(&tup)) {
-      int dest = std::get<0>(tup);
-      auto buffer = std::move(std::get<1>(tup));
-      auto it = ctrl_endpoints_.find(dest);
-      
-      /// ensure destination has been established and hasn't died
-      if (it != ctrl_endpoints_.end() && it->second) {
-        RdEndpoint* endpoint = it->second.get();
-        endpoint->WriteLength(buffer.get());
-        endpoint->tx_queue().push(std::move(buffer));
-      }
+    RouteTxQueue();
+
+    for (int dest : removing) RemoveEndpoint(dest);
+  }
+
+  /// flush what was enqueued before termination, e.g. the last message of a
+  /// barrier, it would be lost with the socket otherwise
+  RouteTxQueue();
+  for (auto& kv : ctrl_endpoints_) {
+    RdEndpoint* endpoint = kv.second.get();
+    if (!endpoint || endpoint->is_dead()) continue;
+    while (!endpoint->tx_queue().empty()) endpoint->OnSendReady();
+    endpoint->WaitZeroCopy(kRcZeroCopyWaitMs);
+  }
+}
+
+void ReliableChannel::RouteTxQueue() {
+  std::tuple<int, std::unique_ptr<Buffer>> tup;
+  while (tx_queue_.TryPop(&tup)) {
+    int dest = std::get<0>(tup);
+    auto buffer = std::move(std::get<1>(tup));
+    auto it = ctrl_endpoints_.find(dest);
+
+    /// ensure destination has been established and hasn't died
+    if (it != ctrl_endpoints_.end() && it->second) {
+      RdEndpoint* endpoint = it->second.get();
+      endpoint->WriteLength(buffer.get());
+      endpoint->tx_queue().push(std::move(buffer));
     }
   }
-}
\ No newline at end of file
+}
@@ -3,6 +3,7 @@
 
 #include <unordered_map>
 #include "epoll_helper.h"
+#include "io_engine.h"
 #include "rd_endpoint.h"
 #include "socket.h"
 #include "spsc_queue.h"
@@ -11,6 +12,13 @@
 
 class MLTCommunicator;
 
+/// the receive ring of the io engine, the pieces of the streams are copied
+/// out into the messages at once
+const size_t kRcRecvBufSize = 65536;
+const int kRcRecvBufs = 64;
+/// how long a closing endpoint waits for its MSG_ZEROCOPY completions
+const int kRcZeroCopyWaitMs = 1000;
+
 class ReliableChannel : public TerminableThread {
  public:
   // enum class NotificationType {
@@ -27,7 +35,9 @@ class ReliableChannel : public TerminableThread {
   };
 
   ReliableChannel(MLTCommunicator* comm, int queue_size)
-      : comm_{comm}, epoll_helper_{0} {}
+      : comm_{comm}, epoll_helper_{0} {
+    io_engine_.reset(CreateIoEngine(IoEngine::kEpoll, 0, 0));
+  }
 
   virtual ~ReliableChannel() noexcept;
 
@@ -47,7 +57,12 @@ class ReliableChannel : public TerminableThread {
 
   void Listen(int port);
 
+  /// take the engine receiving the messages, before Start
+  inline void set_io_engine(IoEngine* io_engine) { io_engine_.reset(io_engine); }
+
  private:
+  void RouteTxQueue();
+
   MLTCommunicator* comm_;
   /*! \brief: a listening socket for establishing connection */
   TcpSocket listening_sock_;
@@ -57,6 +72,9 @@ class ReliableChannel : public TerminableThread {
   std::unordered_map<int, std::shared_ptr<RdEndpoint>> ctrl_endpoints_;
   /*! \brief: epoll helper */
   EpollHelper epoll_helper_;
+  /*! \brief: receives the streams if it can, its fd is in the epoll set */
+  std::unique_ptr<IoEngine> io_engine_;
+  struct epoll_event engine_event_;
   // route packet to corresponding endpoint
   // SpscQueue<std::tuple<int, std::unique_ptr<Buffer>>> tx_queue_;
   // accessed by user thread and packetize thread
@@ -0,0 +1,319 @@
+/**
+ * \file ring_bench.cc
+ *
+ * \brief this program measures the ring allreduce of Collective. with -n, it
+ * forks the ranks on the loopback interface of this box, otherwise it runs
+ * one rank of a host file, as test_mlt does.
+ */
+
+#include "mlt_communicator.h"
+#include "collective.h"
+#include "loss_policy.h"
+#include "app_context.h"
+
+#include "string_helper.h"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <fstream>
+#include <set>
+
+#define GREEN_BOLD "\033[1;32m"
+#define ESCAPE_END "\033[0m"
+
+// rank, host_str, port
+struct Node {
+  int rank;
+  int port;
+  std::string host;
+};
+
+class RingBenchApp : AppContext {
+ public:
+  RingBenchApp() {}
+  virtual ~RingBenchApp() {}
+
+  virtual int ParseArgument(int argc, char* argv[]) override;
+
+  virtual void ShowUsage(const char* app) override;
+
+  int Run();
+
+ private:
+  int RunRank(int rank);
+
+  void ParseHostFile();
+
+  std::string host_file_;
+  int my_rank_{-1};
+  /// fork this many ranks on the loopback interface
+  int num_ranks_{0};
+  int base_port_{6200};
+  /// 0 for a flat ring, otherwise the columns of the 2D allreduce
+  int num_cols_{0};
+  size_t data_len_{1048576};
+  int num_iters_{10};
+  double loss_ratio_{0};
+  /// "fixed" or "adaptive", see CreateLossPolicy
+  std::string loss_policy_{"fixed"};
+
+  std::vector<Node> nodes_;
+};
+
+int RingBenchApp::ParseArgument(int argc, char* argv[]) {
+  int err = 0;
+  static struct option long_options[] = {
+      {"help", no_argument, 0, 'h'},             // NOLINT(*)
+      {"host-file", required_argument, 0, 'H'},  // NOLINT(*)
+      {"rank", required_argument, 0, 'r'},       // NOLINT(*)
+      {"num-ranks", required_argument, 0, 'n'},  // NOLINT(*)
+      {"port", required_argument, 0, 'p'},       // NOLINT(*)
+      {"cols", required_argument, 0, 'c'},       // NOLINT(*)
+      {"data-len", required_argument, 0, 'l'},   // NOLINT(*)
+      {"iters", required_argument, 0, 'i'},      // NOLINT(*)
+      {"loss", required_argument, 0, 'L'},       // NOLINT(*)
+      {"policy", required_argument, 0, 'P'},     // NOLINT(*)
+      {0, 0, 0, 0}                               // NOLINT(*)
+  };
+  while (1) {
+    int option_index = 0, c;
+    c = getopt_long(argc, argv, "hH:r:n:p:c:l:i:L:P:", long_options,
+                    &option_index);
+    if (c == -1) break;
+    switch (c) {
+      case 'h': {
+        ShowUsage(argv[0]);
+        exit(0);
+      }
+      case 'H': {
+        host_file_ = std::string(optarg);
+        break;
+      }
+      case 'r': {
+        my_rank_ = atoi(optarg);
+        break;
+      }
+      case 'n': {
+        num_ranks_ = atoi(optarg);
+        break;
+      }
+      case 'p': {
+        base_port_ = atoi(optarg);
+        break;
+      }
+      case 'c': {
+        num_cols_ = atoi(optarg);
+        break;
+      }
+      case 'l': {
+        data_len_ = atol(optarg);
+        break;
+      }
+      case 'i': {
+        num_iters_ = atoi(optarg);
+        break;
+      }
+      case 'L': {
+        loss_ratio_ = atof(optarg);
+        break;
+      }
+      case 'P': {
+        loss_policy_ = std::string(optarg);
+        break;
+      }
+      case '?':
+      default:
+        err = 1;
+        goto out;
+    }
+  }
+  if (optind < argc) {
+    err = 1;
+    goto out;
+  }
+  if (num_ranks_ == 0 && (host_file_.empty() || my_rank_ < 0)) err = 1;
+out:
+  return err;
+}
+
+void RingBenchApp::ShowUsage(const char* app) {
+  fprintf(stdout, "Usage:\n");
+  fprintf(stdout, "  %s -n <ranks>               run all the ranks on this box\n", app);
+  fprintf(stdout, "  %s -H <file> -r <rank>      run one rank of a host file\n", app);
+  fprintf(stdout, "\nOptions:\n");
+  fprintf(stdout, "  -h, --help              display this message\n");
+  fprintf(stdout, "  -H, --host-file=<file>  host file\n");
+  fprintf(stdout, "  -r, --rank=<int>        my rank\n");
+  fprintf(stdout, "  -n, --num-ranks=<int>   fork this many ranks on 127.0.0.1\n");
+  fprintf(stdout, "  -p, --port=<int>        first port of the forked ranks, default 6200\n");
+  fprintf(stdout, "  -c, --cols=<int>        columns of the 2D allreduce, default 0 for a flat ring\n");
+  fprintf(stdout, "  -l, --data-len=<int>    number of floats, default 1048576\n");
+  fprintf(stdout, "  -i, --iters=<int>       iterations, default 10\n");
+  fprintf(stdout, "  -L, --loss=<float>      loss ratio of each flow, default 0\n");
+  fprintf(stdout, "  -P, --policy=<name>     loss policy, 'fixed' or 'adaptive' up to -L, default fixed\n");
+}
+
+int RingBenchApp::Run() {
+  if (num_ranks_ == 0) {
+    ParseHostFile();
+    return RunRank(my_rank_);
+  }
+
+  for (int i = 0; i < num_ranks_; i++) {
+    nodes_.push_back({i, base_port_ + i, "127.0.0.1"});
+  }
+  std::vector<pid_t> children;
+  for (int i = 0; i < num_ranks_; i++) {
+    pid_t pid = fork();
+    PCHECK(pid >= 0) << "fork failed";
+    if (pid == 0) exit(RunRank(i));
+    children.push_back(pid);
+  }
+  int rc = 0;
+  for (pid_t pid : children) {
+    int status;
+    PCHECK(waitpid(pid, &status, 0) == pid);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) rc = 1;
+  }
+  return rc;
+}
+
+int RingBenchApp::RunRank(int rank) {
+  std::vector<int> ranks;
+  for (const Node& node : nodes_) ranks.push_back(node.rank);
+  int n = ranks.size();
+  int pos = std::find(ranks.begin(), ranks.end(), rank) - ranks.begin();
+  CHECK_LT(pos, n) << "could not find rank: " << rank;
+  int cols = num_cols_ > 0 ? num_cols_ : n;
+  CHECK_EQ(n % cols, 0) << n << " ranks do not fit in " << cols << " columns";
+
+  /// 1. start the communicator, only the neighbours are connected
+  MLTGlobal::Get()->Init();
+  auto mlt_comm = std::make_unique<MLTCommunicator>(rank);
+  mlt_comm->Start(nodes_[pos].port);
+
+  /// the whole ring for the barriers, then the rows and the columns
+  int row = pos / cols, col = pos % cols;
+  std::set<int> peers = {
+      (pos + 1) % n, (pos + n - 1) % n,
+      row * cols + (col + 1) % cols, row * cols + (col + cols - 1) % cols,
+      (pos + cols) % n, (pos + n - cols) % n};
+  peers.erase(pos);
+  /// in ascending rank order, so that nobody waits for a connection that
+  /// is not being made
+  std::vector<Node> peer_nodes;
+  for (int p : peers) peer_nodes.push_back(nodes_[p]);
+  std::sort(peer_nodes.begin(), peer_nodes.end(),
+            [](const Node& a, const Node& b) { return a.rank < b.rank; });
+  for (const Node& node : peer_nodes) {
+    mlt_comm->AddConnection(node.rank, node.host, node.port);
+  }
+
+  auto cq = std::make_unique<CompletionQueue>();
+  PktPrioFunc* prio_func = new DefaultPktPrioFunc("ring", 1, 0.5);
+  Collective coll(mlt_comm.get(), cq.get(), prio_func);
+  std::unique_ptr<LossPolicy> policy(
+      CreateLossPolicy(loss_policy_, mlt_comm.get()));
+  coll.set_loss_policy(policy.get());
+
+  /// 2. member i contributes (i + 1) * (j % 13) to element j
+  std::vector<float> input(data_len_), data(data_len_);
+  for (size_t j = 0; j < data_len_; j++) input[j] = (pos + 1) * (j % 13);
+  const float scale = n * (n + 1) / 2;
+
+  std::vector<Collective::Range> partial;
+  double total_us = 0;
+  std::vector<double> iter_times;
+  size_t total_partial = 0;
+  for (int it = -1; it < num_iters_; it++) {  // one warmup iteration
+    data = input;
+    coll.Barrier(ranks);
+    auto start = std::chrono::high_resolution_clock::now();
+    if (num_cols_ > 0) {
+      coll.HierarchicalAllreduce(ranks, cols, data.data(), data_len_,
+                                 loss_ratio_, &partial);
+    } else {
+      coll.RingAllreduce(ranks, data.data(), data_len_, loss_ratio_, &partial);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    if (it < 0) continue;
+    double iter_us = (end - start).count() / 1e3;
+    policy->OnIteration(iter_us);
+    total_us += iter_us;
+    iter_times.push_back(iter_us);
+
+    /// 3. check the elements that are not reported as partial
+    size_t next = 0;
+    auto check = [&](size_t first, size_t last) {
+      for (size_t j = first; j < last; j++) {
+        CHECK_EQ(data[j], scale * (j % 13)) << "rank " << rank << " at " << j;
+      }
+    };
+    for (const auto& r : partial) {
+      check(next, r.first);
+      total_partial += r.second - r.first;
+      next = r.second;
+    }
+    check(next, data_len_);
+  }
+  coll.Barrier(ranks);
+
+  if (pos == 0) {
+    double avg_us = total_us / num_iters_;
+    double bytes = data_len_ * sizeof(float);
+    /// bus bandwidth is what each link carries, 2(n-1)/n of the tensor
+    double alg_bw = bytes / avg_us / 1e3;
+    double bus_bw = alg_bw * 2 * (n - 1) / n;
+    /// what arrived in full, the partial ranges lost
+    double partial_share =
+        static_cast<double>(total_partial) / num_iters_ / data_len_;
+    double goodput = alg_bw * (1 - partial_share);
+    std::sort(iter_times.begin(), iter_times.end());
+    double p99_us = iter_times[std::min(iter_times.size() - 1,
+                                        iter_times.size() * 99 / 100)];
+    LOG(INFO) << GREEN_BOLD << "pass ring allreduce!" << ESCAPE_END
+              << prism::FormatString(
+                     " ranks: %d cols: %d bytes: %.0f latency: %.1fus"
+                     " p99: %.1fus algbw: %.3fGB/s busbw: %.3fGB/s"
+                     " goodput: %.3fGB/s partial: %.4f%% policy: %s",
+                     n, cols, bytes, avg_us, p99_us, alg_bw, bus_bw, goodput,
+                     100.0 * partial_share, loss_policy_.c_str());
+  }
+
+  /// 4. finalize, stop receiving before removing the connections
+  mlt_comm->StopUdpReceiving();
+  for (const Node& node : peer_nodes) mlt_comm->RemoveConnection(node.rank);
+  mlt_comm->Finalize();
+  delete prio_func;
+  return 0;
+}
+
+void RingBenchApp::ParseHostFile() {
+  std::fstream fs(host_file_, std::ios::in);
+  CHECK(fs.is_open()) << "failed to open host file: " << host_file_;
+
+  for (std::string line; std::getline(fs, line); ) {
+    StringHelper::Trim(line, " \n\r\t", line);
+    if (line.empty()) continue;
+    if (line[0] == '#') continue;
+
+    auto pos0 = line.find(',');
+    auto pos1 = line.find_last_of(':');
+    CHECK(pos0 != std::string::npos && pos1 != std::string::npos)
+        << "invalid host line: " << line;
+    nodes_.push_back({std::stoi(line.substr(0, pos0)),
+                      std::stoi(line.substr(pos1 + 1)),
+                      line.substr(pos0 + 1, pos1 - pos0 - 1)});
+  }
+}
+
+int main(int argc, char* argv[]) {
+  RingBenchApp app;
+  if (app.ParseArgument(argc, argv)) {
+    app.ShowUsage(argv[0]);
+    return 1;
+  }
+  return app.Run();
+}
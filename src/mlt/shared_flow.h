@@ -0,0 +1,63 @@
+#ifndef SHARED_FLOW_H_
+#define SHARED_FLOW_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include "grad_packet.h"
+#include "ltmessage.h"
+#include "prio_func.h"
+
+// a message packetized once for all the destinations of
+// MLTCommunicator::PostSendMulti. the dests hold it by reference count, each
+// with its own LtMessageExt for the send cursor and its own retransmissions,
+// and copy a packet from it before stamping their dst_comm_id and handle.
+// only accessed by the priority channel thread
+class SharedFlow {
+ public:
+  /// \param segment the gradient bytes of a full packet, for all the dests
+  SharedFlow(const LtMessage& msg, uint32_t segment, uint16_t src_comm_id,
+             PktPrioFunc* prio_func)
+      : msg_{msg},
+        segment_{segment},
+        src_comm_id_{src_comm_id},
+        prio_func_{prio_func},
+        packets_((msg.size + segment - 1) / segment),
+        built_(packets_.size(), false) {}
+
+  /// the packet of seq, cut and given its priority by the first dest to send it
+  const GradPacket& Packet(uint32_t seq) {
+    GradPacket& pkt = packets_[seq];
+    if (built_[seq]) return pkt;
+    size_t offset = static_cast<size_t>(segment_) * seq;
+    size_t bytes = std::min<size_t>(segment_, msg_.size - offset);
+    pkt.msg_id = msg_.msg_id;
+    pkt.offset = offset;
+    pkt.len = bytes + kGradPacketHeader;
+    pkt.seq = seq;
+    pkt.dst_comm_id = 0;
+    pkt.src_comm_id = src_comm_id_;
+    pkt.is_last = offset + bytes == msg_.size ? 1 : 0;
+    pkt.grad_ptr = reinterpret_cast<uint64_t>(msg_.buf) + offset;
+    pkt.handle = 0;
+    pkt.txtime = 0;
+    pkt.tos = (*prio_func_)(pkt);
+    built_[seq] = true;
+    return pkt;
+  }
+
+  uint32_t segment() const { return segment_; }
+
+  uint32_t num_packets() const { return packets_.size(); }
+
+ private:
+  LtMessage msg_;
+  uint32_t segment_;
+  uint16_t src_comm_id_;
+  PktPrioFunc* prio_func_;
+  // index: seq
+  std::vector<GradPacket> packets_;
+  std::vector<bool> built_;
+};
+
+#endif  // SHARED_FLOW_H_
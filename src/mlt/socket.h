@@ -3,11 +3,13 @@
 
 #include "prism/logging.h"
 #include "prism/utils.h"
+#include <linux/net_tstamp.h>
 #include <netdb.h>
 #include <string>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 
 using SOCKET = int;
 const SOCKET INVALID_SOCKET = -1;
@@ -138,6 +140,15 @@ class Socket {
     PCHECK(!getsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, bufsize, &optlen));
   }
 
+  /// read and clear the pending error, e.g. the ICMP port unreachable seen
+  /// by a connected UDP socket
+  inline int TakeError() {
+    int err = 0;
+    socklen_t optlen = sizeof(err);
+    PCHECK(!getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &optlen));
+    return err;
+  }
+
   inline void SetTos(uint8_t tos) {
     uint8_t val = tos;
     PCHECK(!setsockopt(sockfd, IPPROTO_IP, IP_TOS, &val, sizeof(val)));
@@ -201,6 +212,16 @@ class TcpSocket : public Socket {
   inline ssize_t Recv(void* buf, size_t len, int flags = 0) {
     return recv(sockfd, buf, len, flags);
   }
+
+  inline ssize_t RecvMsg(struct msghdr* msg, int flags) {
+    return recvmsg(sockfd, msg, flags);
+  }
+
+  /// allow the sends with MSG_ZEROCOPY, false if the kernel cannot
+  inline bool SetZeroCopy() {
+    int val = 1;
+    return setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &val, sizeof(val)) == 0;
+  }
 };
 
 class UdpSocket : public Socket {
@@ -240,6 +261,38 @@ class UdpSocket : public Socket {
   inline ssize_t RecvMsg(struct msghdr* msg, int flags) {
     return recvmsg(sockfd, msg, flags);
   }
+
+  /// a connected UDP socket learns the path MTU of its peer
+  inline bool Connect(const SockAddr& addr) {
+    return connect(sockfd, &addr.addr, addr.addrlen) == 0;
+  }
+
+  /// set the DF bit, IP_PMTUDISC_DO or IP_PMTUDISC_PROBE
+  inline void SetMtuDiscover(int mode) {
+    int val = mode;
+    PCHECK(!setsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val)));
+  }
+
+  /// the path MTU known by the kernel, only for a connected socket
+  inline int GetPathMtu() {
+    int mtu = 0;
+    socklen_t optlen = sizeof(mtu);
+    PCHECK(!getsockopt(sockfd, IPPROTO_IP, IP_MTU, &mtu, &optlen));
+    return mtu;
+  }
+
+  /// let the packets carry their earliest departure time on CLOCK_MONOTONIC
+  /// in a SCM_TXTIME cmsg, false if the kernel does not know SO_TXTIME
+  inline bool SetTxTime() {
+    struct sock_txtime val = {CLOCK_MONOTONIC, 0};
+    return setsockopt(sockfd, SOL_SOCKET, SO_TXTIME, &val, sizeof(val)) == 0;
+  }
+
+  /// the rate in bytes per second the fq qdisc paces the socket at
+  inline void SetMaxPacingRate(uint64_t rate) {
+    PCHECK(!setsockopt(sockfd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate,
+                       sizeof(rate)));
+  }
 }; 
 
 #endif  // PE_NETWORK_ENDPOINT_H_
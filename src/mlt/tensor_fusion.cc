@@ -0,0 +1,242 @@
+#include "tensor_fusion.h"
+
+#include "prism/utils.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+/// the fused flows wrap around after this many msg ids
+constexpr int kMaxFusedIds = 1 << 20;
+
+}  // namespace
+
+TensorFusion::TensorFusion(MLTCommunicator* comm, CompletionQueue* cq,
+                           int msg_id_base)
+    : comm_{comm}, cq_{cq}, msg_id_base_{msg_id_base} {
+  threshold_ = prism::GetEnvOrDefault<long>("MLT_FUSION_THRESHOLD", 65536);
+  max_bytes_ = prism::GetEnvOrDefault<long>("MLT_FUSION_BYTES", 1048576);
+  window_us_ = prism::GetEnvOrDefault<long>("MLT_FUSION_WINDOW_US", 1000);
+  comm_->SetCompletionQueue(cq_);
+}
+
+void TensorFusion::PostSend(int dest, const LtMessage& msg,
+                            PktPrioFunc* prio_func) {
+  if (msg.size >= threshold_) {
+    comm_->PostSend(dest, msg, prio_func);
+    return;
+  }
+  Batch& batch = batches_[{dest, prio_func}];
+  if (batch.msgs.empty()) batch.start = Clock::now();
+  batch.msgs.push_back(msg);
+  batch.bytes += msg.size;
+  if (batch.bytes >= max_bytes_) SendBatch(dest, prio_func, &batch);
+}
+
+void TensorFusion::PostRecv(int dest, const LtMessage& msg,
+                            double loss_ratio) {
+  if (msg.size >= threshold_) {
+    comm_->PostRecv(dest, msg, loss_ratio);
+    return;
+  }
+  FlowId key = EncodeFlow(dest, msg.msg_id);
+  CHECK(!pending_recvs_.count(key))
+      << "msg_id " << msg.msg_id << " from " << dest << " already posted";
+  pending_recvs_[key] = {msg, loss_ratio};
+}
+
+void TensorFusion::Flush() {
+  for (auto& kv : batches_) {
+    if (!kv.second.msgs.empty()) {
+      SendBatch(kv.first.first, kv.first.second, &kv.second);
+    }
+  }
+}
+
+void TensorFusion::FlushExpired() {
+  auto now = Clock::now();
+  for (auto& kv : batches_) {
+    Batch& batch = kv.second;
+    if (batch.msgs.empty()) continue;
+    auto waited = std::chrono::duration_cast<std::chrono::microseconds>(
+        now - batch.start);
+    if (waited.count() >= window_us_) {
+      SendBatch(kv.first.first, kv.first.second, &batch);
+    }
+  }
+}
+
+void TensorFusion::SendBatch(int dest, PktPrioFunc* prio_func, Batch* batch) {
+  int msg_id = NextMsgId();
+  FusedSend& fused = sends_[EncodeFlow(dest, msg_id)];
+  fused.buf.resize(batch->bytes);
+  size_t offset = 0;
+  for (const LtMessage& msg : batch->msgs) {
+    memcpy(fused.buf.data() + offset, msg.buf, msg.size);
+    offset += msg.size;
+    fused.parts.emplace_back(msg.msg_id, msg.size);
+  }
+
+  /// fused msg_id, number of parts, then the msg_id and size of each
+  auto buffer = MLTCommunicator::NewMetaBuffer(
+      (2 + 2 * fused.parts.size()) * sizeof(uint32_t));
+  uint32_t* p =
+      reinterpret_cast<uint32_t*>(MLTCommunicator::MetaPayload(buffer.get()));
+  *p++ = msg_id;
+  *p++ = fused.parts.size();
+  for (const Part& part : fused.parts) {
+    *p++ = part.first;
+    *p++ = part.second;
+  }
+  comm_->SendLayoutAsync(dest, std::move(buffer));
+
+  LtMessage msg;
+  msg.msg_id = msg_id;
+  msg.buf = fused.buf.data();
+  msg.size = fused.buf.size();
+  comm_->PostSend(dest, msg, prio_func);
+
+  batch->msgs.clear();
+  batch->bytes = 0;
+}
+
+void TensorFusion::PollMeta() {
+  int src;
+  std::unique_ptr<Buffer> buffer;
+  while (comm_->TryRecvLayout(&src, &buffer)) {
+    UserDataHeader* hdr = GetInHeader<UserDataHeader>(buffer.get());
+    size_t bytes = buffer->msg_length() - sizeof(*hdr);
+    const uint32_t* p = reinterpret_cast<const uint32_t*>(hdr->payload);
+    CHECK_GE(bytes, 2 * sizeof(uint32_t)) << "invalid layout from " << src;
+    int msg_id = p[0];
+    uint32_t num_parts = p[1];
+    CHECK_EQ(bytes, (2 + 2 * num_parts) * sizeof(uint32_t));
+    std::vector<Part> parts;
+    for (uint32_t i = 0; i < num_parts; i++) {
+      parts.emplace_back(p[2 + 2 * i], p[3 + 2 * i]);
+    }
+    layouts_.emplace_back(EncodeFlow(src, msg_id), std::move(parts));
+  }
+}
+
+void TensorFusion::PostLayouts() {
+  for (auto it = layouts_.begin(); it != layouts_.end();) {
+    int src = std::get<0>(DecodeFlow(it->first));
+    const std::vector<Part>& parts = it->second;
+    bool ready = std::all_of(parts.begin(), parts.end(), [&](const Part& p) {
+      return pending_recvs_.count(EncodeFlow(src, p.first)) > 0;
+    });
+    if (!ready) {
+      ++it;
+      continue;
+    }
+
+    /// the fused flow may stop as early as its least tolerant sub-tensor
+    FusedRecv& fused = recvs_[it->first];
+    double loss_ratio = 1.0;
+    size_t bytes = 0;
+    for (const Part& part : parts) {
+      auto jt = pending_recvs_.find(EncodeFlow(src, part.first));
+      CHECK_EQ(jt->second.msg.size, part.second)
+          << "msg_id " << part.first << " from " << src << " size mismatch";
+      fused.msgs.push_back(jt->second.msg);
+      loss_ratio = std::min(loss_ratio, jt->second.loss_ratio);
+      bytes += part.second;
+      pending_recvs_.erase(jt);
+    }
+    fused.buf.resize(bytes);
+
+    LtMessage msg;
+    msg.msg_id = std::get<1>(DecodeFlow(it->first));
+    msg.buf = fused.buf.data();
+    msg.size = bytes;
+    comm_->PostRecv(src, msg, loss_ratio);
+    it = layouts_.erase(it);
+  }
+}
+
+void TensorFusion::SplitSend(const Completion& comp, const FusedSend& fused,
+                             std::deque<Completion>* out) {
+  for (const Part& part : fused.parts) {
+    Completion c;
+    c.msg_id = part.first;
+    c.type = CompletionType::kSend;
+    c.remote_comm_id = comp.remote_comm_id;
+    c.bytes_sent = part.second;
+    out->push_back(std::move(c));
+  }
+}
+
+void TensorFusion::SplitRecv(const Completion& comp, const FusedRecv& fused,
+                             std::deque<Completion>* out) {
+  size_t offset = 0;
+  for (const LtMessage& msg : fused.msgs) {
+    size_t first = offset, last = offset + msg.size;
+    memcpy(msg.buf, fused.buf.data() + first, msg.size);
+
+    Completion c;
+    c.msg_id = msg.msg_id;
+    c.type = CompletionType::kRecv;
+    c.remote_comm_id = comp.remote_comm_id;
+    c.bytes_received = msg.size;
+    if (comp.partial) {
+      /// the ranges of the fused flow within this sub-tensor, relative to it
+      c.bytes_received = 0;
+      for (const auto& r : comp.recv_ranges) {
+        size_t a = std::max(r.first, first);
+        size_t b = std::min(r.second, last);
+        if (a >= b) continue;
+        c.recv_ranges.emplace_back(a - first, b - first);
+        c.bytes_received += b - a;
+      }
+      c.partial = c.bytes_received < msg.size;
+      if (!c.partial) c.recv_ranges.clear();
+    }
+    out->push_back(std::move(c));
+    offset = last;
+  }
+}
+
+int TensorFusion::PollOnce(int max_comps, Completion* comps) {
+  FlushExpired();
+  if (!pending_recvs_.empty()) {
+    PollMeta();
+    PostLayouts();
+  }
+
+  Completion comp;
+  while (static_cast<int>(ready_.size()) < max_comps &&
+         cq_->PollOnce(1, &comp) == 1) {
+    FlowId key = EncodeFlow(comp.remote_comm_id, comp.msg_id);
+    if (comp.type == CompletionType::kSend) {
+      auto it = sends_.find(key);
+      if (it != sends_.end()) {
+        SplitSend(comp, it->second, &ready_);
+        sends_.erase(it);
+        continue;
+      }
+    } else {
+      auto it = recvs_.find(key);
+      if (it != recvs_.end()) {
+        SplitRecv(comp, it->second, &ready_);
+        recvs_.erase(it);
+        continue;
+      }
+    }
+    ready_.push_back(std::move(comp));
+  }
+
+  int n = 0;
+  while (n < max_comps && !ready_.empty()) {
+    comps[n++] = std::move(ready_.front());
+    ready_.pop_front();
+  }
+  return n;
+}
+
+int TensorFusion::NextMsgId() {
+  int msg_id = msg_id_base_ + msg_id_seq_;
+  msg_id_seq_ = (msg_id_seq_ + 1) % kMaxFusedIds;
+  return msg_id;
+}
@@ -0,0 +1,131 @@
+#ifndef TENSOR_FUSION_H_
+#define TENSOR_FUSION_H_
+
+#include "mlt_communicator.h"
+#include "completion.h"
+#include "prio_func.h"
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * TensorFusion packs the small tensors sent to the same destination with the
+ * same priority function into one fused flow, so that a burst of small layers
+ * pays for a single FlowStart, FlowFinish, StopRequest and StopConfirm.
+ *
+ * A tensor smaller than the fusion threshold joins the batch of its
+ * destination and priority function. The batch becomes one flow when it
+ * reaches the fusion size, when its first tensor has waited for the fusion
+ * window, or on Flush. The layout of the flow, the msg_id and size of each
+ * sub-tensor, goes ahead of it through the reliable channel, as a
+ * kFusionLayout that is queued apart from the metas, so that the fusion can
+ * share the communicator with Barrier, MLTVan or user metas. The receiver posts
+ * the fused flow once the layout has arrived and all of its sub-tensors have
+ * been posted, with the smallest loss ratio among them, and splits its
+ * completion into one per sub-tensor, each with its own received ranges.
+ *
+ * Both sides must use the same fusion threshold, the larger tensors go
+ * through the communicator as they are. While receives are outstanding, the
+ * fusion owns the completion queue of the communicator.
+ */
+class TensorFusion {
+ public:
+  /**
+   * \param msg_id_base the fused flows take msg ids from msg_id_base up,
+   * which must not be used by the application
+   */
+  TensorFusion(MLTCommunicator* comm, CompletionQueue* cq, int msg_id_base);
+
+  void PostSend(int dest, const LtMessage& msg, PktPrioFunc* prio_func);
+
+  void PostRecv(int dest, const LtMessage& msg, double loss_ratio);
+
+  /*! \brief: send all the batches now */
+  void Flush();
+
+  /**
+   * \brief: make progress, and poll the completions of the tensors as they
+   * were posted
+   *
+   * \return number of completions
+   */
+  int PollOnce(int max_comps, Completion* comps);
+
+  /*! \brief: the tensors of at least this many bytes are not fused */
+  void set_threshold(size_t threshold) { threshold_ = threshold; }
+
+  /*! \brief: a batch is sent once it has this many bytes */
+  void set_max_bytes(size_t max_bytes) { max_bytes_ = max_bytes; }
+
+  /*! \brief: a batch is sent once its first tensor has waited this long */
+  void set_window_us(long window_us) { window_us_ = window_us; }
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  /// msg_id and size of a sub-tensor
+  using Part = std::pair<uint32_t, uint32_t>;
+
+  struct Batch {
+    std::vector<LtMessage> msgs;
+    size_t bytes = 0;
+    Clock::time_point start;
+  };
+
+  struct FusedSend {
+    std::vector<char> buf;
+    std::vector<Part> parts;
+  };
+
+  struct PendingRecv {
+    LtMessage msg;
+    double loss_ratio;
+  };
+
+  struct FusedRecv {
+    std::vector<char> buf;
+    std::vector<LtMessage> msgs;
+  };
+
+  void SendBatch(int dest, PktPrioFunc* prio_func, Batch* batch);
+
+  void FlushExpired();
+
+  void PollMeta();
+
+  /// post the fused receives whose sub-tensors have all been posted
+  void PostLayouts();
+
+  void SplitSend(const Completion& comp, const FusedSend& fused,
+                 std::deque<Completion>* out);
+
+  void SplitRecv(const Completion& comp, const FusedRecv& fused,
+                 std::deque<Completion>* out);
+
+  int NextMsgId();
+
+  MLTCommunicator* comm_;
+  CompletionQueue* cq_;
+  int msg_id_base_;
+  int msg_id_seq_{0};
+  size_t threshold_;
+  size_t max_bytes_;
+  long window_us_;
+  /*! \brief: the batches being filled, keyed by dest and priority function */
+  std::map<std::pair<int, PktPrioFunc*>, Batch> batches_;
+  /*! \brief: keyed by the flow of the fused msg id */
+  std::unordered_map<FlowId, FusedSend> sends_;
+  /*! \brief: the small receives posted by the user, keyed by flow */
+  std::unordered_map<FlowId, PendingRecv> pending_recvs_;
+  /*! \brief: the layouts received, waiting for their sub-tensors */
+  std::deque<std::pair<FlowId, std::vector<Part>>> layouts_;
+  std::unordered_map<FlowId, FusedRecv> recvs_;
+  /*! \brief: the split completions not polled yet */
+  std::deque<Completion> ready_;
+};
+
+#endif  // TENSOR_FUSION_H_
@@ -0,0 +1,88 @@
+#include "grad_packet.h"
+
+#include "benchmark/benchmark.h"
+
+#include "prism/logging.h"
+#include <vector>
+
+/// a 64MB tensor, the size of a large layer
+const size_t kTensorBytes = 64 << 20;
+/// IP and UDP headers
+const int kIpUdpHeader = 28;
+/// ethernet header, FCS, preamble and inter-frame gap
+const int kEthernetOverhead = 38;
+
+/// the goodput of a flow is the share of the wire bytes carrying gradients
+static void SetGoodputCounters(benchmark::State& state, int mtu,
+                               int header_size) {
+  size_t payload = mtu - kIpUdpHeader - header_size;
+  size_t num_pkts = (kTensorBytes + payload - 1) / payload;
+  size_t wire_bytes =
+      kTensorBytes + num_pkts * (header_size + kIpUdpHeader + kEthernetOverhead);
+  state.counters["pkts"] = num_pkts;
+  state.counters["goodput"] = static_cast<double>(kTensorBytes) / wire_bytes;
+  state.SetBytesProcessed(state.iterations() * kTensorBytes);
+}
+
+/// write and parse the headers of a whole tensor, as the sender and the
+/// receiver do, with the legacy header
+static void BM_LegacyHeader(benchmark::State& state) {
+  int mtu = state.range(0);
+  uint32_t payload = mtu - kIpUdpHeader - kGradPacketHeader;
+  std::vector<char> wire(mtu);
+  for (auto _ : state) {
+    for (size_t offset = 0, seq = 0; offset < kTensorBytes;
+         offset += payload, seq++) {
+      GradPacket pkt;
+      pkt.msg_id = 7;
+      pkt.offset = offset;
+      pkt.seq = seq;
+      pkt.len = std::min<size_t>(payload, kTensorBytes - offset) +
+                kGradPacketHeader;
+      pkt.dst_comm_id = 1;
+      pkt.src_comm_id = 0;
+      pkt.tos = 0;
+      pkt.is_last = offset + payload >= kTensorBytes;
+      memcpy(wire.data(), &pkt, kGradPacketHeader);
+
+      GradPacket parsed;
+      ParseGradPacket(wire.data(), &parsed);
+      benchmark::DoNotOptimize(parsed);
+    }
+  }
+  SetGoodputCounters(state, mtu, kGradPacketHeader);
+}
+
+/// the same with the compact header, whose offset and len are implied
+static void BM_CompactHeader(benchmark::State& state) {
+  int mtu = state.range(0);
+  uint32_t payload = mtu - kIpUdpHeader - kCompactGradHeader;
+  std::vector<char> wire(mtu);
+  for (auto _ : state) {
+    for (size_t offset = 0, seq = 0; offset < kTensorBytes;
+         offset += payload, seq++) {
+      GradPacket pkt;
+      pkt.seq = seq;
+      pkt.src_comm_id = 0;
+      pkt.is_last = offset + payload >= kTensorBytes;
+      pkt.handle = 7;
+      CompactGradHeader hdr;
+      WriteCompactGradHeader(pkt, &hdr);
+      memcpy(wire.data(), &hdr, kCompactGradHeader);
+
+      size_t size = std::min<size_t>(payload, kTensorBytes - offset) +
+                    kCompactGradHeader;
+      GradPacket parsed;
+      CHECK(ParseCompactGradPacket(wire.data(), size, &parsed));
+      parsed.offset = parsed.seq * payload;
+      benchmark::DoNotOptimize(parsed);
+    }
+  }
+  SetGoodputCounters(state, mtu, kCompactGradHeader);
+}
+
+BENCHMARK(BM_LegacyHeader)->Arg(1500)->Arg(9000);
+
+BENCHMARK(BM_CompactHeader)->Arg(1500)->Arg(9000);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,186 @@
+#include "pacer.h"
+#include "socket.h"
+#include "meter.h"
+
+#include "benchmark/benchmark.h"
+
+#include "prism/logging.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+/// the payload of a packet at 1500 MTU
+const size_t kPayload = 1472;
+/// packets per iteration
+const int kPackets = 1000;
+/// the rate monitor interval of MLT, see MLT_RATE_MONITOR_INTERVAL_US
+const uint64_t kMeterIntervalUs = 100;
+/// how far ahead of the qdisc the kernel modes may run
+const uint64_t kHorizonNs = 1000000;
+
+/// a loopback receiver learning the arrival of each packet from the kernel,
+/// so that the gaps do not depend on when the benchmark thread reads them
+struct Loopback {
+  UdpSocket rx, tx;
+  SockAddr addr;
+
+  Loopback() {
+    rx.Create();
+    addr.addr_in.sin_family = AF_INET;
+    addr.addr_in.sin_port = 0;
+    addr.addr_in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.addrlen = sizeof(addr.addr_in);
+    PCHECK(!bind(rx, &addr.addr, addr.addrlen));
+    PCHECK(!getsockname(rx, &addr.addr, &addr.addrlen));
+    int on = 1;
+    PCHECK(!setsockopt(rx, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)));
+    rx.SetNonBlock(true);
+
+    tx.Create();
+    PCHECK(tx.Connect(addr));
+    tx.SetNonBlock(true);
+  }
+
+  ~Loopback() {
+    rx.Close();
+    tx.Close();
+  }
+
+  /// the arrival of every packet waiting in the socket, in ns
+  void Drain(std::vector<int64_t>* arrivals) {
+    char buf[kPayload];
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    for (;;) {
+      struct iovec iov = {buf, sizeof(buf)};
+      struct msghdr msg = {};
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      if (rx.RecvMsg(&msg, 0) < 0) {
+        CHECK(rx.LastErrorWouldBlock()) << "errno = " << rx.GetLastError();
+        return;
+      }
+      struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+      CHECK(cmsg && cmsg->cmsg_type == SCM_TIMESTAMPNS);
+      struct timespec ts;
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      arrivals->push_back(ts.tv_sec * 1000000000LL + ts.tv_nsec);
+    }
+  }
+
+  /// false if the socket buffer is full
+  bool Send(const char* buf, uint64_t txtime) {
+    struct iovec iov = {const_cast<char*>(buf), kPayload};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    char control[CMSG_SPACE(sizeof(uint64_t))];
+    if (txtime) {
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_TXTIME;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+      memcpy(CMSG_DATA(cmsg), &txtime, sizeof(uint64_t));
+    }
+    if (tx.SendMsg(&msg, 0) < 0) {
+      CHECK(tx.LastErrorWouldBlock()) << "errno = " << tx.GetLastError();
+      return false;
+    }
+    return true;
+  }
+};
+
+/// pace kPackets to the loopback at range(0) MB/s as the tx thread does in
+/// the mode, and measure how far the gaps between their arrivals stray from
+/// the ideal one. the kernel modes send at once without the fq qdisc on lo,
+/// the counter fq tells whether it is there
+static void RunPacing(benchmark::State& state, PacingMode mode) {
+  double rate = state.range(0) * 1e6;
+  double ideal_ns = kPayload * 1e9 / rate;
+  Loopback lo;
+  bool fq = FqOnPath(lo.addr);
+  if (mode == PacingMode::kTxTime) CHECK(lo.tx.SetTxTime());
+  if (mode == PacingMode::kMaxRate) lo.tx.SetMaxPacingRate(rate);
+
+  std::vector<char> payload(kPayload);
+  std::vector<double> devs;
+  double gap_sum = 0;
+  for (auto _ : state) {
+    std::vector<int64_t> arrivals;
+    RateMeter tx_meter(kMeterIntervalUs);
+    TxClock tx_clock(kHorizonNs);
+    /// the throttle of PriorityChannel::Pace
+    auto pace = [&](uint64_t* txtime) {
+      *txtime = 0;
+      if (mode == PacingMode::kUser) {
+        if (tx_meter.Elapsed()) tx_meter.Clear();
+        if (tx_meter.TryBytesPerSecond(kPayload) > rate) return false;
+        tx_meter.Update(kPayload);
+        return true;
+      }
+      uint64_t departure = tx_clock.Reserve(kPayload, rate, MonotonicNs());
+      if (mode == PacingMode::kTxTime) *txtime = departure;
+      return departure != 0;
+    };
+
+    uint64_t txtime = 0;
+    bool paced = false;
+    for (int sent = 0; sent < kPackets;) {
+      lo.Drain(&arrivals);
+      if (!paced && !(paced = pace(&txtime))) continue;
+      if (lo.Send(payload.data(), txtime)) {
+        sent++;
+        paced = false;
+      }
+    }
+    /// wait for the packets held by the qdisc, those dropped never arrive
+    uint64_t end = MonotonicNs() + kHorizonNs + 10000000;
+    while (static_cast<int>(arrivals.size()) < kPackets &&
+           MonotonicNs() < end) {
+      lo.Drain(&arrivals);
+    }
+
+    for (size_t i = 1; i < arrivals.size(); i++) {
+      double gap = arrivals[i] - arrivals[i - 1];
+      gap_sum += gap;
+      devs.push_back(std::abs(gap - ideal_ns));
+    }
+  }
+
+  double sq = 0;
+  for (double dev : devs) sq += dev * dev;
+  std::sort(devs.begin(), devs.end());
+  size_t n = std::max<size_t>(devs.size(), 1);
+  state.counters["fq"] = fq;
+  state.counters["ideal_us"] = ideal_ns / 1e3;
+  state.counters["gap_us"] = gap_sum / n / 1e3;
+  state.counters["jitter_us"] = std::sqrt(sq / n) / 1e3;
+  state.counters["p99_us"] =
+      devs.empty() ? 0 : devs[devs.size() * 99 / 100] / 1e3;
+  state.SetBytesProcessed(state.iterations() * kPackets * kPayload);
+}
+
+static void BM_UserPacing(benchmark::State& state) {
+  RunPacing(state, PacingMode::kUser);
+}
+
+static void BM_TxTimePacing(benchmark::State& state) {
+  RunPacing(state, PacingMode::kTxTime);
+}
+
+static void BM_MaxRatePacing(benchmark::State& state) {
+  RunPacing(state, PacingMode::kMaxRate);
+}
+
+BENCHMARK(BM_UserPacing)->Arg(100)->Arg(1000)->Unit(benchmark::kMillisecond);
+
+BENCHMARK(BM_TxTimePacing)->Arg(100)->Arg(1000)->Unit(benchmark::kMillisecond);
+
+BENCHMARK(BM_MaxRatePacing)->Arg(100)->Arg(1000)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,67 @@
+#include "shared_flow.h"
+
+#include "benchmark/benchmark.h"
+
+#include "prism/logging.h"
+#include <vector>
+
+/// a 64MB tensor, the size of a large layer
+const size_t kTensorBytes = 64 << 20;
+/// the payload of a 1500 MTU packet with the compact header
+const uint32_t kSegment = 1500 - 28 - kCompactGradHeader;
+
+/// cut the tensor for each dest on its own, as PostSend to each of them does
+/// through Packetizer::PartitionOne
+static void BM_PerDest(benchmark::State& state) {
+  int num_dests = state.range(0);
+  std::vector<char> tensor(kTensorBytes);
+  LtMessage msg{7, tensor.data(), kTensorBytes};
+  for (auto _ : state) {
+    for (int dest = 1; dest <= num_dests; dest++) {
+      DefaultPktPrioFunc prio_func("layer_1", 1, 0.5);
+      for (size_t offset = 0; offset < msg.size; offset += kSegment) {
+        GradPacket pkt;
+        pkt.msg_id = msg.msg_id;
+        pkt.offset = offset;
+        pkt.len = std::min<size_t>(kSegment, msg.size - offset) +
+                  kGradPacketHeader;
+        pkt.seq = offset / kSegment;
+        pkt.dst_comm_id = dest;
+        pkt.src_comm_id = 0;
+        pkt.is_last = offset + kSegment >= msg.size;
+        pkt.grad_ptr = reinterpret_cast<uint64_t>(msg.buf) + offset;
+        pkt.handle = 3;
+        pkt.tos = prio_func(pkt);
+        benchmark::DoNotOptimize(pkt);
+      }
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * kTensorBytes * num_dests);
+}
+
+/// cut it once into a SharedFlow, which every dest copies its packets from,
+/// as PostSendMulti does
+static void BM_SharedFlow(benchmark::State& state) {
+  int num_dests = state.range(0);
+  std::vector<char> tensor(kTensorBytes);
+  LtMessage msg{7, tensor.data(), kTensorBytes};
+  for (auto _ : state) {
+    DefaultPktPrioFunc prio_func("layer_1", 1, 0.5);
+    SharedFlow flow(msg, kSegment, 0, &prio_func);
+    for (int dest = 1; dest <= num_dests; dest++) {
+      for (uint32_t seq = 0; seq < flow.num_packets(); seq++) {
+        GradPacket pkt = flow.Packet(seq);
+        pkt.dst_comm_id = dest;
+        pkt.handle = 3;
+        benchmark::DoNotOptimize(pkt);
+      }
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * kTensorBytes * num_dests);
+}
+
+BENCHMARK(BM_PerDest)->Arg(1)->Arg(4)->Arg(16);
+
+BENCHMARK(BM_SharedFlow)->Arg(1)->Arg(4)->Arg(16);
+
+BENCHMARK_MAIN();
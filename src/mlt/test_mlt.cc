@@ -7,11 +7,13 @@
 
 #include "mlt_communicator.h"
 #include "app_context.h"
+#include "tensor_fusion.h"
 
 #include "string_helper.h"
 #include "meter.h"
 
 #include <fstream>
+#include <set>
 
 #define GREEN_BOLD "\033[1;32m"
 #define ESCAPE_END "\033[0m"
@@ -29,6 +31,9 @@ enum class TestMode {
   RC_SPEED,
   UDP_SIMPLE,
   UDP_SPEED,
+  UDP_MULTICAST,
+  UDP_FUSION,
+  UDP_DEADLINE,
 };
 
 static const char *g_test_mode_str[] = {
@@ -36,7 +41,10 @@ static const char *g_test_mode_str[] = {
   "rc_correctness",
   "rc_speed",
   "udp_simple",
-  "udp_speed"
+  "udp_speed",
+  "udp_multicast",
+  "udp_fusion",
+  "udp_deadline"
 };
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
@@ -61,6 +69,12 @@ class TestMLTApp : AppContext {
   int RunTestUdpSimple();
 
   int RunTestUdpSpeed();
+
+  int RunTestUdpMulticast();
+
+  int RunTestUdpFusion();
+
+  int RunTestUdpDeadline();
  
   void Barrier(int root);
 
@@ -182,10 +196,10 @@ void TestMLTApp::ShowUsage(const char *app) {
   fprintf(stdout, "  -h, --help              display this message\n");
   fprintf(stdout, "  -H, --host-file=<file>  host file\n");
   fprintf(stdout, "  -r, --rank=<int>        my rank\n");
-  fprintf(stdout, "  -M, --mode=<int>        test mode ('connection', 'rc_correctness', 'rc_speed', 'udp_simple', 'udp_speed')\n");
-  fprintf(stdout, "rc_speed options:\n");
+  fprintf(stdout, "  -M, --mode=<int>        test mode ('connection', 'rc_correctness', 'rc_speed', 'udp_simple', 'udp_speed', 'udp_multicast', 'udp_fusion', 'udp_deadline')\n");
+  fprintf(stdout, "rc_correctness and rc_speed options:\n");
   fprintf(stdout, "  -m, --meta-size=<int>   meta message size\n");
-  fprintf(stdout, "udp_simple options:\n");
+  fprintf(stdout, "udp_simple, udp_multicast, udp_fusion and udp_deadline options:\n");
   fprintf(stdout, "  -l, --data-len=<int>    data length\n");
 }
 
@@ -213,6 +227,15 @@ int TestMLTApp::Run() {
     } break;
     case TestMode::UDP_SPEED: {
 
+    } break;
+    case TestMode::UDP_MULTICAST: {
+      TRY(rc, RunTestUdpMulticast);
+    } break;
+    case TestMode::UDP_FUSION: {
+      TRY(rc, RunTestUdpFusion);
+    } break;
+    case TestMode::UDP_DEADLINE: {
+      TRY(rc, RunTestUdpDeadline);
     } break;
     default: {
       LOG(FATAL) << "unknown mode";
@@ -302,8 +325,47 @@ int TestMLTApp::RunTestConnection() {
 }
 
 int TestMLTApp::RunTestRcCorrectness() {
-  LOG(FATAL) << "implement this";
-  return 1;
+  MLTCommunicator* mlt_comm = mlt_comm_.get();
+  CHECK_GT(meta_size_, 0);
+
+  /// the bytes of the i-th message from src, to catch a reordered or a
+  /// released buffer
+  auto pattern = [](int src, int i, size_t j) {
+    return static_cast<char>(src * 31 + i * 7 + j);
+  };
+  const int num_msgs = 8;
+
+  /// hand the buffers over without copying, with MLT_RC_ZEROCOPY_BYTES they
+  /// go by MSG_ZEROCOPY
+  for (int i = 0; i < num_msgs; i++) {
+    for (const Node& node : nodes_) {
+      if (node.rank == my_rank_) continue;
+      auto buffer = MLTCommunicator::NewMetaBuffer(meta_size_);
+      char* payload = MLTCommunicator::MetaPayload(buffer.get());
+      for (size_t j = 0; j < meta_size_; j++) {
+        payload[j] = pattern(my_rank_, i, j);
+      }
+      mlt_comm->SendMetaAsync(node.rank, std::move(buffer));
+    }
+  }
+
+  std::unordered_map<int, int> recv_cnt;
+  for (size_t n = 0; n < num_msgs * (nodes_.size() - 1);) {
+    int rank;
+    std::unique_ptr<Buffer> buffer;
+    if (!mlt_comm->TryRecvMeta(&rank, &buffer)) continue;
+    CHECK_EQ(buffer->msg_length() - sizeof(UserDataHeader), meta_size_);
+    const char* payload = GetInHeader<UserDataHeader>(buffer.get())->payload;
+    int i = recv_cnt[rank]++;
+    for (size_t j = 0; j < meta_size_; j++) {
+      CHECK_EQ(payload[j], pattern(rank, i, j))
+          << "message " << i << " from rank " << rank << ", byte " << j;
+    }
+    n++;
+  }
+
+  LOG(INFO) << GREEN_BOLD << "pass rc_correctness test!" << ESCAPE_END;
+  return 0;
 }
 
 int TestMLTApp::RunTestRcSpeed() {
@@ -451,6 +513,261 @@ int TestMLTApp::RunTestUdpSimple() {
   return 0;
 }
 
+int TestMLTApp::RunTestUdpMulticast() {
+  MLTCommunicator* mlt_comm = mlt_comm_.get();
+  int root = RootRank();
+
+  auto cq = std::make_unique<CompletionQueue>();
+  mlt_comm->SetCompletionQueue(cq.get());
+
+  std::vector<float> gradients(data_len_);
+  for (size_t i = 0; i < data_len_; i++) gradients[i] = i;
+  LtMessage ltmsg;
+  ltmsg.buf = reinterpret_cast<char*>(gradients.data());
+  ltmsg.size = sizeof(float) * data_len_;
+  ltmsg.msg_id = 7;
+
+  PktPrioFunc* prio_func = new DefaultPktPrioFunc("layer_1", 1, 0.5);
+
+  /// the root sends the same tensor to all the others
+  if (my_rank_ != root) {
+    std::fill(gradients.begin(), gradients.end(), 0);
+    mlt_comm->PostRecv(root, ltmsg, 0);
+  }
+
+  Barrier(root);
+
+  auto start = std::chrono::high_resolution_clock::now();
+  int expected = 1;
+  if (my_rank_ == root) {
+    std::vector<int> dests;
+    for (const Node& node : nodes_) {
+      if (node.rank != root) dests.push_back(node.rank);
+    }
+    mlt_comm->PostSendMulti(dests, ltmsg, prio_func);
+    expected = dests.size();
+  }
+
+  int num_comps = 0;
+  const int max_comps = 32;
+  Completion comps[max_comps];
+  while (num_comps < expected) {
+    int ret = cq->PollOnce(max_comps, comps);
+    num_comps += ret;
+    for (int i = 0; i < ret; i++) {
+      CHECK_EQ(comps[i].msg_id, 7);
+      CHECK(comps[i].type == (my_rank_ == root ? CompletionType::kSend
+                                               : CompletionType::kRecv));
+    }
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+
+  if (my_rank_ != root) {
+    for (size_t i = 0; i < data_len_; i++) {
+      CHECK_EQ(gradients[i], static_cast<float>(i)) << "at " << i;
+    }
+  }
+
+  Barrier(root);
+
+  LOG(INFO) << GREEN_BOLD << "pass udp_multicast test!" << ESCAPE_END
+            << prism::FormatString(" time elapsed: %.3fms",
+                                   (end - start).count() / 1e6);
+
+  delete prio_func;
+  return 0;
+}
+
+int TestMLTApp::RunTestUdpFusion() {
+  MLTCommunicator* mlt_comm = mlt_comm_.get();
+  int root = RootRank();
+
+  auto cq = std::make_unique<CompletionQueue>();
+  TensorFusion fusion(mlt_comm, cq.get(), 1 << 20);
+
+  /// the others send the root many small tensors, which are fused, and one
+  /// of data_len floats, which is fused only if it is small as well
+  const int num_small = 64;
+  auto tensor_len = [&](int i) -> size_t {
+    return i < num_small ? (i % 8 + 1) * 64 : data_len_;
+  };
+  auto value = [](int rank, int i, size_t j) -> float {
+    return rank * 1000 + i * 10 + j % 7;
+  };
+
+  std::vector<int> srcs;
+  for (const Node& node : nodes_) {
+    if (node.rank != root) srcs.push_back(node.rank);
+  }
+  int num_tensors = my_rank_ == root ? srcs.size() * (num_small + 1)
+                                     : num_small + 1;
+  std::vector<std::vector<float>> tensors(num_tensors);
+  PktPrioFunc* prio_func = new DefaultPktPrioFunc("layer_1", 1, 0.5);
+
+  if (my_rank_ == root) {
+    for (size_t k = 0; k < srcs.size(); k++) {
+      for (int i = 0; i <= num_small; i++) {
+        auto& tensor = tensors[k * (num_small + 1) + i];
+        tensor.assign(tensor_len(i), 0);
+        LtMessage ltmsg;
+        ltmsg.msg_id = i;
+        ltmsg.buf = reinterpret_cast<char*>(tensor.data());
+        ltmsg.size = sizeof(float) * tensor.size();
+        fusion.PostRecv(srcs[k], ltmsg, 0);
+      }
+    }
+  }
+
+  Barrier(root);
+
+  auto start = std::chrono::high_resolution_clock::now();
+  if (my_rank_ != root) {
+    for (int i = 0; i <= num_small; i++) {
+      auto& tensor = tensors[i];
+      tensor.resize(tensor_len(i));
+      for (size_t j = 0; j < tensor.size(); j++) {
+        tensor[j] = value(my_rank_, i, j);
+      }
+      LtMessage ltmsg;
+      ltmsg.msg_id = i;
+      ltmsg.buf = reinterpret_cast<char*>(tensor.data());
+      ltmsg.size = sizeof(float) * tensor.size();
+      fusion.PostSend(root, ltmsg, prio_func);
+    }
+    /// the last batch goes when its window expires
+  }
+
+  /// one completion per tensor, as if none was fused
+  std::set<std::pair<int, int>> done;
+  const int max_comps = 32;
+  Completion comps[max_comps];
+  while (static_cast<int>(done.size()) < num_tensors) {
+    int ret = fusion.PollOnce(max_comps, comps);
+    for (int i = 0; i < ret; i++) {
+      CHECK(comps[i].type == (my_rank_ == root ? CompletionType::kRecv
+                                               : CompletionType::kSend));
+      CHECK(!comps[i].partial);
+      CHECK(comps[i].recv_ranges.empty());
+      CHECK(done.emplace(comps[i].remote_comm_id, comps[i].msg_id).second)
+          << "duplicate completion of " << comps[i].msg_id;
+    }
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+
+  if (my_rank_ == root) {
+    for (size_t k = 0; k < srcs.size(); k++) {
+      for (int i = 0; i <= num_small; i++) {
+        const auto& tensor = tensors[k * (num_small + 1) + i];
+        for (size_t j = 0; j < tensor.size(); j++) {
+          CHECK_EQ(tensor[j], value(srcs[k], i, j))
+              << "tensor " << i << " from " << srcs[k] << " at " << j;
+        }
+      }
+    }
+  }
+
+  Barrier(root);
+
+  LOG(INFO) << GREEN_BOLD << "pass udp_fusion test!" << ESCAPE_END
+            << prism::FormatString(" time elapsed: %.3fms",
+                                   (end - start).count() / 1e6);
+
+  delete prio_func;
+  return 0;
+}
+
+int TestMLTApp::RunTestUdpDeadline() {
+  MLTCommunicator* mlt_comm = mlt_comm_.get();
+  int root = RootRank();
+
+  auto cq = std::make_unique<CompletionQueue>();
+  mlt_comm->SetCompletionQueue(cq.get());
+
+  std::vector<float> gradients(data_len_);
+  for (size_t i = 0; i < data_len_; i++) gradients[i] = i % 1000 + 1;
+  LtMessage ltmsg;
+  ltmsg.buf = reinterpret_cast<char*>(gradients.data());
+  ltmsg.size = sizeof(float) * data_len_;
+  ltmsg.msg_id = 7;
+
+  PktPrioFunc* prio_func = new DefaultPktPrioFunc("layer_1", 1, 0.5);
+
+  if (my_rank_ != root) std::fill(gradients.begin(), gradients.end(), -1);
+
+  Barrier(root);
+
+  /// the others give up on the tensor from the root after the deadline, a
+  /// tensor too large for it arrives partially, with its gaps zeroed
+  auto start = std::chrono::high_resolution_clock::now();
+  const long deadline_us = 500000;
+  if (my_rank_ != root) {
+    mlt_comm->PostRecv(root, ltmsg, 0, deadline_us, GapFill::kZero);
+  }
+  int expected = 1;
+  if (my_rank_ == root) {
+    for (const Node& node : nodes_) {
+      if (node.rank != root) mlt_comm->PostSend(node.rank, ltmsg, prio_func);
+    }
+    expected = nodes_.size() - 1;
+  }
+
+  int num_comps = 0;
+  size_t bytes_received = 0;
+  bool partial = false;
+  std::vector<std::pair<size_t, size_t>> recv_ranges;
+  const int max_comps = 32;
+  Completion comps[max_comps];
+  while (num_comps < expected) {
+    int ret = cq->PollOnce(max_comps, comps);
+    num_comps += ret;
+    for (int i = 0; i < ret; i++) {
+      CHECK_EQ(comps[i].msg_id, 7);
+      CHECK(comps[i].type == (my_rank_ == root ? CompletionType::kSend
+                                               : CompletionType::kRecv));
+      if (my_rank_ != root) {
+        bytes_received = comps[i].bytes_received;
+        partial = comps[i].partial;
+        recv_ranges = comps[i].recv_ranges;
+      }
+    }
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+
+  if (my_rank_ != root) {
+    /// the arrived bytes hold the tensor, the others are zero
+    CHECK_EQ(partial, bytes_received < ltmsg.size);
+    if (!partial) recv_ranges.assign(1, {0, ltmsg.size});
+    size_t next = 0, total = 0;
+    for (const auto& r : recv_ranges) {
+      CHECK_EQ(r.first % sizeof(float), 0U);
+      for (size_t i = next / sizeof(float); i < r.first / sizeof(float); i++) {
+        CHECK_EQ(gradients[i], 0) << "at " << i;
+      }
+      for (size_t i = r.first / sizeof(float); i < r.second / sizeof(float);
+           i++) {
+        CHECK_EQ(gradients[i], static_cast<float>(i % 1000 + 1)) << "at " << i;
+      }
+      total += r.second - r.first;
+      next = r.second;
+    }
+    for (size_t i = next / sizeof(float); i < data_len_; i++) {
+      CHECK_EQ(gradients[i], 0) << "at " << i;
+    }
+    CHECK_EQ(total, bytes_received);
+    LOG(INFO) << prism::FormatString("received %zu of %zu bytes", total,
+                                     ltmsg.size);
+  }
+
+  Barrier(root);
+
+  LOG(INFO) << GREEN_BOLD << "pass udp_deadline test!" << ESCAPE_END
+            << prism::FormatString(" time elapsed: %.3fms",
+                                   (end - start).count() / 1e6);
+
+  delete prio_func;
+  return 0;
+}
+
 void TestMLTApp::Barrier(int root) {
   LOG(DEBUG) << "Barrier, root: " << root;
   auto s = std::chrono::high_resolution_clock::now();
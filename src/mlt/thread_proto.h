@@ -4,39 +4,59 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
 
 #include <atomic>
 #include <memory>
 #include <thread>
+#include <vector>
 
 class ThreadProto {
  public:
   virtual ~ThreadProto() noexcept {}
 
   virtual void Start() {
-    this_thread_ = std::make_unique<std::thread>(&ThreadProto::Run, this);
+    this_thread_ = std::make_unique<std::thread>([this]() {
+      /// pin before Run, so what Run allocates lands on the local node
+      if (!cpus_.empty()) PinCurrentThread(cpus_);
+      Run();
+    });
   }
 
   virtual void Join() {  // NOLINT(*)
     if (this_thread_) this_thread_->join();
   }
 
-  void SetAffinity(int index) {
-    return;
-    // uint32_t num_cpus = std::thread::hardware_concurrency();
-    // cpu_set_t cpuset;
-    // CPU_ZERO(&cpuset);
-    // CPU_SET(index % num_cpus, &cpuset);
+  /// the cpus to run on, must be called before Start, empty for no pinning
+  void SetAffinity(const std::vector<int>& cpus) { cpus_ = cpus; }
 
-    // int rc = pthread_setaffinity_np(this_thread_->native_handle(),
-    //                                 sizeof(cpu_set_t), &cpuset);
-    // PCHECK(rc == 0) << "pthread_setaffinity_np failed";
+  static void PinCurrentThread(const std::vector<int>& cpus) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    for (int cpu : cpus) CPU_SET(cpu, &cpuset);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+    if (rc != 0) {
+      LOG(WARNING) << "pthread_setaffinity_np failed: " << strerror(rc);
+    }
+  }
+
+  /// fault in the pages of buf from cpus, so that they are allocated on the
+  /// numa node of cpus rather than of the calling thread
+  static void TouchOnCpus(void* buf, size_t size, const std::vector<int>& cpus) {
+    std::thread toucher([buf, size, &cpus]() {
+      PinCurrentThread(cpus);
+      memset(buf, 0, size);
+    });
+    toucher.join();
   }
 
  protected:
   virtual void Run() = 0;
 
   std::unique_ptr<std::thread> this_thread_;
+  std::vector<int> cpus_;
 };
 
 class TerminableThread : public ThreadProto {
@@ -1,8 +1,13 @@
 #include "udp_endpoint.h"
 #include "mlt_global.h"
+#include "priority_channel.h"
+
+#include <algorithm>
 
 UdpEndpoint::UdpEndpoint(int tos) {
   tos_ = tos;
+  connected_ = false;
+  txtime_ = false;
   sock_.Create();
   sock_.SetNonBlock(true);
   sock_.SetTos(tos);
@@ -11,48 +16,86 @@ UdpEndpoint::UdpEndpoint(int tos) {
   event_.data.ptr = this;
 }
 
+UdpEndpoint::UdpEndpoint(int tos, const SockAddr& peer) : UdpEndpoint(tos) {
+  PCHECK(sock_.Connect(peer)) << "failed to connect the UDP socket";
+  connected_ = true;
+  int sndbuf = prism::GetEnvOrDefault<int>("MLT_CONNECTED_UDP_SNDBUF", 0);
+  if (sndbuf > 0) sock_.SetSendBuffer(sndbuf);
+}
+
 UdpEndpoint::~UdpEndpoint() {
   if (!sock_.IsClosed()) sock_.Close();
 }
 
-// TODO(cjr): poll out all tx elements
-ssize_t UdpEndpoint::OnSendReady() {
-  ssize_t total_len = 0;
-  // auto start = std::chrono::high_resolution_clock::now();
-  while (!tx_queue_.empty()) {
-    GradMessage pkt = tx_queue_.front();
-    tx_queue_.pop();
-    const SockAddr& addr = MLTGlobal::Get()->AddrFromCommId(pkt.dst_comm_id);
-    // ssize_t nbytes = sock_.SendTo(pkt, pkt->len, 0, addr);
+/// the datagrams handed to the engine at once
+const int kTxBatch = 64;
+
+/// the headers of a batch, kept until the engine is done with them
+struct TxBatch {
+  struct msghdr msgs[kTxBatch];
+  struct iovec iovs[kTxBatch][2];
+  CompactGradHeader hdrs[kTxBatch];
+  char controls[kTxBatch][CMSG_SPACE(sizeof(uint64_t))];
+};
 
-    // sendmsg
-    struct msghdr msg;
-    struct iovec iov[2];
+void UdpEndpoint::PrepareMsg(GradPacket& pkt, bool compact, TxBatch* batch,
+                             int i) {
+  struct msghdr& msg = batch->msgs[i];
+  struct iovec* iov = batch->iovs[i];
+  if (compact) {
+    WriteCompactGradHeader(pkt, &batch->hdrs[i]);
+    iov[0].iov_base = reinterpret_cast<void*>(&batch->hdrs[i]);
+    iov[0].iov_len = kCompactGradHeader;
+  } else {
     iov[0].iov_base = reinterpret_cast<void*>(&pkt);
     iov[0].iov_len = kGradPacketHeader;
-    iov[1].iov_base = reinterpret_cast<void*>(pkt.grad_ptr);
-    iov[1].iov_len = pkt.len - kGradPacketHeader;
+  }
+  iov[1].iov_base = reinterpret_cast<void*>(pkt.grad_ptr);
+  iov[1].iov_len = pkt.len - kGradPacketHeader;
 
+  if (connected_) {
+    msg.msg_name = nullptr;
+    msg.msg_namelen = 0;
+  } else {
+    const SockAddr& addr = MLTGlobal::Get()->AddrFromCommId(pkt.dst_comm_id);
     msg.msg_name = reinterpret_cast<void*>(const_cast<struct sockaddr*>(&addr.addr));
     msg.msg_namelen = addr.addrlen;
-    msg.msg_iov = iov;
-    msg.msg_iovlen = 2;
+  }
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  if (txtime_ && pkt.txtime) {
+    msg.msg_control = batch->controls[i];
+    msg.msg_controllen = sizeof(batch->controls[i]);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_TXTIME;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+    memcpy(CMSG_DATA(cmsg), &pkt.txtime, sizeof(uint64_t));
+  } else {
     msg.msg_control = nullptr;
     msg.msg_controllen = 0;
+  }
+  msg.msg_flags = 0;
+}
 
-    ssize_t nbytes = sock_.SendMsg(&msg, 0);
-    if (nbytes == -1) {
-      CHECK(sock_.LastErrorWouldBlock()) << "errno = " << sock_.GetLastError();
-      // cannot send anymore
-      break;
-    }
-    CHECK_EQ(nbytes, pkt.len);
+ssize_t UdpEndpoint::OnSendReady() {
+  static thread_local TxBatch batch;
+  IoEngine* io_engine = prio_channel_->io_engine();
+  ssize_t total_len = 0;
+  bool compact = MLTGlobal::Get()->CompactHeader();
+  while (!tx_queue_.empty()) {
+    int n = std::min<size_t>(tx_queue_.size(), kTxBatch);
+    for (int i = 0; i < n; i++) PrepareMsg(tx_queue_[i], compact, &batch, i);
 
-    total_len += nbytes;
+    /// a packet refused by the peer of a connected socket is done too, the
+    /// peer has gone and it is lost as on an unconnected socket
+    int done = io_engine->SendMsgs(sock_, batch.msgs, n);
+    for (int i = 0; i < done; i++) {
+      total_len += batch.iovs[i][0].iov_len + batch.iovs[i][1].iov_len;
+      tx_queue_.pop_front();
+    }
+    // cannot send anymore
+    if (done < n) break;
   }
-  // auto end = std::chrono::high_resolution_clock::now();
-  // if (total_len > 0)
-  // LOG(DEBUG) << prism::FormatString("total_len: %u, duration: %.3fus",
-  //                                   total_len, (end - start).count() / 1e3);
   return total_len;
-}
\ No newline at end of file
+}
@@ -5,18 +5,24 @@
 #include "grad_packet.h"
 #include "socket.h"
 
-#include <queue>
+#include <deque>
 
 class PriorityChannel;
+struct TxBatch;
 
 class UdpEndpoint {
  public:
-  using TxQueue = std::queue<GradPacket>;
+  using TxQueue = std::deque<GradPacket>;
 
   UdpEndpoint(int tos);
 
+  /// a socket connected to one peer, whose packets need no address, so that
+  /// the kernel does not look up the route and the neighbour for each one
+  UdpEndpoint(int tos, const SockAddr& peer);
+
   ~UdpEndpoint();
 
+  /// hand the queued packets to the io engine of the channel in batches
   ssize_t OnSendReady();
 
   inline int fd() const { return sock_; }
@@ -29,6 +35,11 @@ class UdpEndpoint {
 
   inline int tos() const { return tos_; }
 
+  inline bool connected() const { return connected_; }
+
+  /// send the packets at their txtime, false if the kernel cannot
+  inline bool EnableTxTime() { return txtime_ = sock_.SetTxTime(); }
+
   inline void set_prio_channel(PriorityChannel* prio_channel) {
     prio_channel_ = prio_channel;
   }
@@ -36,7 +47,11 @@ class UdpEndpoint {
   inline TxQueue& tx_queue() { return tx_queue_; }
 
  private:
+  void PrepareMsg(GradPacket& pkt, bool compact, TxBatch* batch, int i);
+
   int tos_;
+  bool connected_;
+  bool txtime_;
   UdpSocket sock_;
   struct epoll_event event_;
   PriorityChannel* prio_channel_;
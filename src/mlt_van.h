@@ -1,655 +1,543 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
 #ifndef PS_MLT_VAN_H_
 #define PS_MLT_VAN_H_
-#define USE_MLT
 #ifdef USE_MLT
-namespace ps {
-    /**
- * \file test_mlt_connection.cc
- * 
- * \brief this program establish connections according a host file
- * then it sends some meta data, and check the correctness of this procedure.
- */
-
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "ps/internal/threadsafe_queue.h"
+#include "ps/internal/van.h"
+#include "./thread_placement.h"
+
+// the MLT sources log through prism/logging.h, which reuses the macro names of
+// dmlc/logging.h. keep the dmlc ones for the rest of this translation unit
+#define PS_MLT_PRAGMA(x) _Pragma(#x)
+#define PS_MLT_LOGGING_MACROS(op)                                            \
+  PS_MLT_PRAGMA(op("CHECK")) PS_MLT_PRAGMA(op("CHECK_EQ"))                   \
+  PS_MLT_PRAGMA(op("CHECK_GE")) PS_MLT_PRAGMA(op("CHECK_GT"))                \
+  PS_MLT_PRAGMA(op("CHECK_LE")) PS_MLT_PRAGMA(op("CHECK_LT"))                \
+  PS_MLT_PRAGMA(op("CHECK_NE")) PS_MLT_PRAGMA(op("CHECK_NOTNULL"))           \
+  PS_MLT_PRAGMA(op("DCHECK")) PS_MLT_PRAGMA(op("DCHECK_EQ"))                 \
+  PS_MLT_PRAGMA(op("DCHECK_GE")) PS_MLT_PRAGMA(op("DCHECK_GT"))              \
+  PS_MLT_PRAGMA(op("DCHECK_LE")) PS_MLT_PRAGMA(op("DCHECK_LT"))              \
+  PS_MLT_PRAGMA(op("DCHECK_NE")) PS_MLT_PRAGMA(op("DFATAL"))                 \
+  PS_MLT_PRAGMA(op("DLOG")) PS_MLT_PRAGMA(op("DLOG_IF"))                     \
+  PS_MLT_PRAGMA(op("LG")) PS_MLT_PRAGMA(op("LOG"))                           \
+  PS_MLT_PRAGMA(op("LOG_DFATAL")) PS_MLT_PRAGMA(op("LOG_ERROR"))             \
+  PS_MLT_PRAGMA(op("LOG_EVERY_N")) PS_MLT_PRAGMA(op("LOG_FATAL"))            \
+  PS_MLT_PRAGMA(op("LOG_IF")) PS_MLT_PRAGMA(op("LOG_INFO"))                  \
+  PS_MLT_PRAGMA(op("LOG_QFATAL")) PS_MLT_PRAGMA(op("LOG_WARNING"))           \
+  PS_MLT_PRAGMA(op("VLOG"))
+// dmlc/base.h of ps-lite is older than the one under src/mlt/include and
+// shares its include guard, so provide what the MLT copy adds
+#ifndef DMLC_IO_USE_LITTLE_ENDIAN
+#define DMLC_IO_USE_LITTLE_ENDIAN 1
+#endif
+#ifndef DMLC_NO_EXCEPTION
+#define DMLC_NO_EXCEPTION noexcept(true)
+#endif
+PS_MLT_LOGGING_MACROS(push_macro)
+// src/mlt/include is passed with -isystem, so prism redefining the macros
+// above is silent
 #include "./mlt/mlt_communicator.h"
-#include "./mlt/app_context.h"
+#include "./mlt/loss_policy.h"
+PS_MLT_LOGGING_MACROS(pop_macro)
+#undef PS_MLT_LOGGING_MACROS
+#undef PS_MLT_PRAGMA
 
-#include "./mlt/string_helper.h"
-#include "./mlt/meter.h"
-#include "ps/internal/van.h"
+namespace ps {
 
-#include <fstream>
-
-#define GREEN_BOLD "\033[1;32m"
-#define ESCAPE_END "\033[0m"
-
-// Message.h:
-// rank -> id       port -> port        host -> hostname
-// rank, host_str, port
-// struct Node {
-//   int rank;
-//   int port;
-//   std::string host;
-// };
-
-enum class TestMode {
-  CONNECTION,
-  RC_CORRECTNESS,
-  RC_SPEED,
-  UDP_SIMPLE,
-  UDP_SPEED,
+/**
+ * \brief the frame a message is sent as over the MLT reliable channel:
+ *
+ *   [MLTMsgHeader][MLTDataDesc] * num_data [packed meta][inlined data]
+ *
+ * data not inlined follows as a loss-tolerant flow identified by msg_id
+ */
+struct MLTMsgHeader {
+  int meta_size;
+  int num_data;
 };
 
-static const char *g_test_mode_str[] = {
-  "connection",
-  "rc_correctness",
-  "rc_speed",
-  "udp_simple",
-  "udp_speed"
+struct MLTDataDesc {
+  uint64_t size;
+  // the flow carrying this data, valid if !is_inline
+  uint32_t msg_id;
+  int is_inline;
+  // the tolerated fraction of lost bytes
+  double loss_ratio;
 };
 
-#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+/**
+ * \brief a received message waiting for its flows to complete
+ */
+struct MLTPendingMsg {
+  Message msg;
+  int num_flows = 0;
+  size_t recv_bytes = 0;
+};
 
-class TestMLTApp : AppContext, public ZMQVan {
+/**
+ * \brief MLT based implementation
+ *
+ * Meta, keys and lens go through the reliable channel, the values of data
+ * messages go through the loss-tolerant UDP flows, marked by the priority and
+ * allowed to lose the fraction of bytes given by the loss ratio of the meta.
+ *
+ * A node gets its MLT comm id once the scheduler assigns its node id, so
+ * before that it registers at the scheduler over a connection the scheduler
+ * names with a local comm id.
+ */
+class MLTVan : public Van {
  public:
-  TestMLTApp() {}
-  virtual ~TestMLTApp() {}
-
-  virtual int ParseArgument(int argc, char* argv[]) override;
-
-  virtual void ShowUsage(const char* app) override;
-
-  int Run();
-
-  int RunTestConnection();
-
-  int RunTestRcCorrectness();
-
-  int RunTestRcSpeed();
+  MLTVan() {}
+  virtual ~MLTVan() {}
 
-  int RunTestUdpSimple();
-
-  int RunTestUdpSpeed();
- 
-  void Barrier(int root);
-
-  /// choose minimal rank as root rank
-  inline int RootRank() {
-    auto it = std::min_element(
-        nodes_.begin(), nodes_.end(),
-        [](const Node& a, const Node& b) { return a.id < b.id; });
-    return it->id;
-  }
-
- private:
-  int Startup();
-
-  int Finalize();
-
-  // Van
-  void Start(int customer_id);
-  void Stop();
-  void Connect(const Node &node);
-  int Bind(const Node &node, int max_retry);
-  int SendMsg(Message &msg);
-  int RecvMsg(Message *msg);
-
-  void ParseHostFile();
-
-  Node ParseNode(const std::string& uri);
+ protected:
+  void Start(int customer_id) override {
+    start_mu_.lock();
+    should_stop_ = false;
+    inline_threshold_ = GetEnv("MLT_INLINE_THRESHOLD", 4096);
+    auto val = Environment::Get()->find("MLT_LOSS_RATIO");
+    default_loss_bound_ = val ? atof(val) : 0;
+    CHECK(default_loss_bound_ >= 0 && default_loss_bound_ < 1)
+        << "invalid MLT_LOSS_RATIO " << default_loss_bound_;
+    PS_VLOG(1) << "MLT_INLINE_THRESHOLD set to " << inline_threshold_
+               << ", MLT_LOSS_RATIO set to " << default_loss_bound_;
+    start_mu_.unlock();
 
-  inline Node FindNode(int rank) {
-    auto it = std::find_if(nodes_.begin(), nodes_.end(),
-                           [&rank](const Node& n) { return n.id == rank; });
-    CHECK(it != nodes_.end()) << "could not find rank: " << rank;
-    return *it;
+    Van::Start(customer_id);
   }
 
-  inline std::string Hello(const Node& node) {
-    return StringHelper::FormatString("Hello, %s:%d!", node.hostname.c_str(), node.port);
+  void Stop() override {
+    PS_VLOG(1) << my_node_.ShortDebugString() << " is stopping";
+    Van::Stop();
+    // join all threads
+    should_stop_ = true;
+    polling_thread_->join();
+    polling_thread_.reset();
+    PS_VLOG(1) << my_node_.ShortDebugString()
+               << " all threads joined and destroyed";
+    loss_policy_.reset();
+    iteration_comm_id_ = Meta::kEmpty;
+    // before remove connections, we must stop receiving first
+    mlt_comm_->StopUdpReceiving();
+    std::lock_guard<std::mutex> lk(mu_);
+    for (const auto& it : comm_ids_) mlt_comm_->RemoveConnection(it.second);
+    mlt_comm_->Finalize();
+    mlt_comm_.reset();
+    comm_ids_.clear();
+    node_ids_.clear();
+    anonymous_comm_ids_.clear();
+    next_msg_ids_.clear();
+    sending_.clear();
+    pending_.clear();
+    inflight_.clear();
   }
 
-  std::string host_file_;
-  int my_rank_;
-  TestMode mode_;
-
-  /// we keep conf_ for compatibility but we do not use it
-
-  std::unique_ptr<MLTCommunicator> mlt_comm_;
-  std::vector<Node> nodes_;
-
-  /// for rc_speed
-  size_t meta_size_;
-  /// for simple udp;
-  size_t data_len_;
-};
-
-int TestMLTApp::ParseArgument(int argc, char *argv[]) {
-  int err = 0;
-  static struct option long_options[] = {
-      {"help", no_argument, 0, 'h'},             // NOLINT(*)
-      {"host-file", required_argument, 0, 'H'},  // NOLINT(*)
-      {"rank", required_argument, 0, 'r'},       // NOLINT(*)
-      {"mode", required_argument, 0, 'M'},       // NOLINT(*)
-      {"meta-size", required_argument, 0, 'm'},  // NOLINT(*)
-      {"data-len", required_argument, 0, 'l'},  // NOLINT(*)
-      {0, 0, 0, 0}                               // NOLINT(*)
-  };
-  while (1) {
-    int option_index = 0, c;
-    c = getopt_long(argc, argv, "hH:r:M:m:l:", long_options, &option_index);
-    if (c == -1) break;
-    switch (c) {
-      case 'h': {
-        ShowUsage(argv[0]);
-        exit(0);
-      }
-      case 'H': {
-        const char* hostfile = optarg;
-        host_file_ = std::string(hostfile);
-        break;
-      }
-      case 'r': {
-        int rank = atoi(optarg);
-        my_rank_ = rank;
-        break;
-      }
-      case 'M': {
-        const std::string mode = std::string(optarg);
-        auto mode_lower = StringHelper::ToLower(mode);
-        bool found = false;
-        for (size_t i = 0; i < ARRAY_SIZE(g_test_mode_str); i++) {
-          if (!strcmp(mode_lower.c_str(), g_test_mode_str[i])) {
-            found = true;
-            mode_ = static_cast<TestMode>(i);
-            break;
-          }
-        }
-        if (!found) err = 2;
-        break;
-      }
-      case 'm': {
-        int meta_size = atoi(optarg);
-        meta_size_ = meta_size;
-        break;
-      }
-      case 'l': {
-        int data_len = atoi(optarg);
-        data_len_ = data_len;
-        break;
-      }
-      case '?':
-      default:
-        err = 1;
-        goto out;
-    }
-  }
-  if (optind < argc) {
-    err = 1;
-    goto out;
-  }
-out:
-  return err;
-}
-
-void TestMLTApp::ShowUsage(const char *app) {
-  fprintf(stdout, "Usage:\n");
-  fprintf(stdout, "  %s           start an agent and establish all-to-all connections\n", app);
-  fprintf(stdout, "\nOptions:\n");
-  fprintf(stdout, "  -h, --help              display this message\n");
-  fprintf(stdout, "  -H, --host-file=<file>  host file\n");
-  fprintf(stdout, "  -r, --rank=<int>        my rank\n");
-  fprintf(stdout, "  -M, --mode=<int>        test mode ('connection', 'rc_correctness', 'rc_speed', 'udp_simple', 'udp_speed')\n");
-  fprintf(stdout, "rc_speed options:\n");
-  fprintf(stdout, "  -m, --meta-size=<int>   meta message size\n");
-  fprintf(stdout, "udp_simple options:\n");
-  fprintf(stdout, "  -l, --data-len=<int>    data length\n");
-}
-
-#define TRY(rc, func, ...)  \
-  do {                      \
-    rc = func(__VA_ARGS__); \
-    if (rc) return rc;      \
-  } while (0)
-
-int TestMLTApp::Run() {
-  int rc;
-  TRY(rc, Startup);
-  switch (mode_) {
-    case TestMode::CONNECTION: {
-      TRY(rc, RunTestConnection);
-    } break;
-    case TestMode::RC_CORRECTNESS: {
-      TRY(rc, RunTestRcCorrectness);
-    } break;
-    case TestMode::RC_SPEED: {
-      TRY(rc, RunTestRcSpeed);
-    } break;
-    case TestMode::UDP_SIMPLE: {
-      TRY(rc, RunTestUdpSimple);
-    } break;
-    case TestMode::UDP_SPEED: {
-
-    } break;
-    default: {
-      LOG(FATAL) << "unknown mode";
+  int Bind(const Node& node, int max_retry) override {
+    // MLT listens on the same port for tcp and udp and aborts if it cannot
+    // bind, so find a port that is free for both first
+    int port = node.port;
+    unsigned seed = static_cast<unsigned>(time(NULL) + port);
+    for (int i = 0; i < max_retry + 1; ++i) {
+      if (IsPortAvailable(port)) break;
+      if (i == max_retry) return -1;
+      port = 10000 + rand_r(&seed) % 40000;
     }
-  }
-  TRY(rc, Finalize);
-  return rc;
-}
-
-int TestMLTApp::Startup() {
-  /// 1. parse host file
-  ParseHostFile();
-
-  Node my_node = FindNode(my_rank_);
-  int my_listen_port = my_node.port; /// including udp and tcp port, and they are same
-
-  /// 3. init mlt global with some parameters
-  MLTGlobal::Get()->Init();
-
-  /// 2. construct communicator and boot it
-  mlt_comm_ = std::make_unique<MLTCommunicator>(my_rank_);
-  MLTCommunicator* mlt_comm = mlt_comm_.get();
-  mlt_comm->Start(my_listen_port);
-
-  return 0;
-}
-
-int TestMLTApp::Finalize() {
-  /// before remove connections, we must stop receiving first
-  mlt_comm_->StopUdpReceiving();
-  /// remove connections and finalize
-  MLTCommunicator* mlt_comm = mlt_comm_.get();
-  for (const Node& node : nodes_) {
-    int rank = node.id;
-    if (rank != my_rank_) mlt_comm->RemoveConnection(rank);
-  }
-  mlt_comm->Finalize();
-  return 0;
-}
-
-void TestMLTApp::Start(int customer_id) override {
-    should_stop_ = false;
-    Van::Start(customer_id);
-    my_rank_ = my_node_.id; // update my_rank_
-    start_mu_.lock();
-    // /// 1. parse host file
-    // ParseHostFile();
 
-    // Node my_node = FindNode(my_rank_);
-    // int my_listen_port = my_node.port; /// including udp and tcp port, and they are same
-
-    /// 3. init mlt global with some parameters
     MLTGlobal::Get()->Init();
+    int comm_id = node.id == Node::kEmpty ? MLTCommunicator::kUnassignedCommId
+                                          : node.id;
+    cq_ = std::unique_ptr<CompletionQueue>(new CompletionQueue());
+    mlt_comm_ = std::unique_ptr<MLTCommunicator>(new MLTCommunicator(comm_id));
+    mlt_comm_->SetCompletionQueue(cq_.get());
+    auto placement = ThreadPlacement::Get();
+    MLTGlobal::Get()->SetLocalCpus(placement->LocalCpus());
+    mlt_comm_->SetThreadAffinity(placement->GetCpus("mlt_priority"),
+                                 placement->GetCpus("mlt_receiving"),
+                                 placement->GetCpus("mlt_reliable"));
+    mlt_comm_->Start(port);
+    auto policy = Environment::Get()->find("MLT_LOSS_POLICY");
+    loss_policy_.reset(
+        CreateLossPolicy(policy ? policy : "fixed", mlt_comm_.get()));
+    // priority 0 keeps the default marking, the others map to a class
+    prio_funcs_.clear();
+    prio_funcs_.emplace_back(new DefaultPktPrioFunc("ps", 0, 0.5));
+    for (int i = 1; i < kNumPrioClasses; ++i) {
+      prio_funcs_.emplace_back(new ClassPktPrioFunc(i));
+    }
 
-    start_mu_.unlock();
-    return;
-}
-
-void TestMLTApp::Stop() override {
-    PS_VLOG(1) << my_node_.ShortDebugString() << " is stopping";
-    Van::Stop();
+    polling_thread_ = std::unique_ptr<std::thread>(
+        new std::thread(&MLTVan::Polling, this));
+    return port;
+  }
 
-    should_stop_ = true;
-    mlt_comm_->StopUdpReceiving();
+  void Connect(const Node& node) override {
+    CHECK_NE(node.id, node.kEmpty);
+    CHECK_NE(node.port, node.kEmpty);
+    CHECK(node.hostname.size());
+    // messages to myself never touch the network, see SendMsg
+    if (node.id == my_node_.id) return;
+    // worker doesn't need to connect to the other workers. same for server
+    if (node.role == my_node_.role) return;
+
+    int comm_id = node.id;
+    if (is_scheduler_) {
+      // nodes register before knowing their ids, so the connection is already
+      // there under a local comm id, see HandleMeta
+      std::string addr = node.hostname + ":" + std::to_string(node.port);
+      std::lock_guard<std::mutex> lk(mu_);
+      auto it = anonymous_comm_ids_.find(addr);
+      if (it == anonymous_comm_ids_.end()) {
+        CHECK(comm_ids_.count(node.id)) << "no connection from " << addr;
+        return;
+      }
+      comm_id = it->second;
+      anonymous_comm_ids_.erase(it);
+      comm_ids_[node.id] = comm_id;
+      node_ids_[comm_id] = node.id;
+      return;
+    }
 
-    MLTCommunicator* mlt_comm = mlt_comm_.get();
-    for (const Node& node : nodes_) {
-        int rank = node.id;
-        if (rank != my_rank_) mlt_comm->RemoveConnection(rank);
+    mu_.lock();
+    bool connected = comm_ids_.count(node.id);
+    mu_.unlock();
+    if (connected) return;
+    if (my_node_.id != Node::kEmpty && mlt_comm_->comm_id() != my_node_.id) {
+      mlt_comm_->set_comm_id(my_node_.id);
     }
-    mlt_comm->Finalize();
-    return;
-}
-
-int Bind(const Node &node, int max_retry) override {
-    // Node my_node = FindNode(my_rank_);
-    MLTCommunicator* mlt_comm = mlt_comm_.get();
-
-    mlt_comm_ = std::make_unique<MLTCommunicator>(my_rank_);
-    MLTCommunicator* mlt_comm = mlt_comm_.get();
-    mlt_comm->Start(my_node_.port);
-    return 0;
-}
-
-void Connect(const Node &node) override {
-    // Node my_node = FindNode(my_rank_);
-    MLTCommunicator* mlt_comm = mlt_comm_.get();
-
-    int rank = node.id;
-    if (rank == my_rank_) continue;
-    mlt_comm->AddConnection(rank, node.hostname, node.port);
-    nodes_.push_back(node); // Copy connection list in mlt_val
-}
-
-int SendMsg(Message &msg) override {
-    if (!is_worker_) ; // if is not worker
-    /// 5. say "Hello, host:port!" and check
-    // Node my_node = FindNode(my_rank_);
-    MLTCommunicator* mlt_comm = mlt_comm_.get();
-
-    // First send metadata
+    // note: this call blocks until the connection is established
+    mlt_comm_->AddConnection(comm_id, node.hostname, node.port);
     std::lock_guard<std::mutex> lk(mu_);
+    comm_ids_[node.id] = comm_id;
+    node_ids_[comm_id] = node.id;
+  }
 
-    int rank = msg.meta.recver;
-    CHECK_NE(rank, Meta::kEmpty);
-
-    return PktSendMsg(rank, msg);
-}
-
-int PktSendMsg(int rank, Message &msg) {
-    MLTCommunicator* mlt_comm = mlt_comm_.get();
+  int SendMsg(Message& msg) override {
+    int id = msg.meta.recver;
+    CHECK_NE(id, Meta::kEmpty);
+
+    if (id == my_node_.id) {
+      Message loopback = msg;
+      loopback.meta.sender = my_node_.id;
+      int send_bytes = GetPackMetaLen(msg.meta);
+      for (const auto& d : msg.data) send_bytes += d.size();
+      recv_msgs_.Push({loopback, static_cast<size_t>(send_bytes)});
+      return send_bytes;
+    }
 
-    // send meta
-    int meta_size;
-    char* meta_buf = nullptr;
-    PackMeta(msg.meta, &meta_buf, &meta_size);
-    mlt_comm->SendMetaAsync(rank, meta_buf);
+    // find the connection
+    int comm_id;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      auto it = comm_ids_.find(id);
+      if (it == comm_ids_.end()) {
+        LOG(WARNING) << "there is no connection to node " << id;
+        return -1;
+      }
+      comm_id = it->second;
+    }
 
-    // send data
-    int send_bytes = meta_size;
+    // encoded once, so that the frame fits it whatever the meta format
+    thread_local std::string meta_buf;
+    int meta_size = PackMeta(msg.meta, &meta_buf);
     int n = msg.data.size();
+    std::vector<MLTDataDesc> descs(n);
+    size_t inline_size = 0;
     for (int i = 0; i < n; ++i) {
-        SArray<char>* data = new SArray<char>(msg.data[i]);
-        int data_size = data->size();
-        
-    }
-    // Next send data
-    for (const Node& node : nodes_) {
-        int rank = node.id;
-        if (rank == my_rank_) continue;
-
-        // Send data
-        int n = msg.data.size();
-        for (int i = 0; i < n; i++) {
-            mlt_comm->SendMetaAsync(rank, msg.data->data())
-        }
+      auto& desc = descs[i];
+      desc.size = msg.data[i].size();
+      desc.is_inline = !IsLossTolerant(msg, i);
+      desc.loss_ratio = 0;
+      if (desc.is_inline) {
+        inline_size += desc.size;
+      } else if (msg.meta.loss_ratio > 0) {
+        desc.loss_ratio = msg.meta.loss_ratio;
+      } else if (msg.meta.push && msg.meta.request) {
+        desc.loss_ratio = default_loss_bound_;
+      }
     }
-}
 
-int RecvMsg(Message *msg) override {
-    Node my_node = FindNode(my_rank_);
-    MLTCommunicator* mlt_comm = mlt_comm_.get();
-
-    for (size_t i = 0; i + 1 < nodes_.size(); i++) {
-        
+    size_t frame_size = sizeof(MLTMsgHeader) + n * sizeof(MLTDataDesc) +
+                        meta_size + inline_size;
+    // built in place and handed over, the inlined data is copied only once
+    auto frame = MLTCommunicator::NewMetaBuffer(frame_size);
+    char* frame_ptr = MLTCommunicator::MetaPayload(frame.get());
+    auto hdr = reinterpret_cast<MLTMsgHeader*>(frame_ptr);
+    hdr->num_data = n;
+    char* p = frame_ptr + sizeof(MLTMsgHeader);
+    auto frame_descs = reinterpret_cast<MLTDataDesc*>(p);
+    p += n * sizeof(MLTDataDesc);
+    memcpy(p, meta_buf.data(), meta_size);
+    hdr->meta_size = meta_size;
+    p += meta_size;
+    for (int i = 0; i < n; ++i) {
+      if (!descs[i].is_inline) continue;
+      memcpy(p, msg.data[i].data(), descs[i].size);
+      p += descs[i].size;
     }
-}
-
-int TestMLTApp::RunTestConnection() {
-  /// 5. say "Hello, host:port!" and check
-  Node my_node = FindNode(my_rank_);
-  MLTCommunicator* mlt_comm = mlt_comm_.get();
-  for (const Node& node : nodes_) {
-    int rank = node.rank;
-    if (rank == my_rank_) continue;
-
-    /// prepare buffer
-    std::string greeting = Hello(node);
-    Buffer send_buffer(greeting.c_str(), greeting.size(), greeting.size());
-
-    /// send it
-    mlt_comm->SendMetaAsync(rank, &send_buffer);
-  }
-
-  /// 5.2 receive meta and check
-  std::string expected_greeting = Hello(my_node);
 
-  for (size_t i = 0; i + 1 < nodes_.size(); i++) {
-    int rank;
-    std::string recv_string(expected_greeting.size(), '0');
-    Buffer recv_buffer(recv_string.c_str(), recv_string.size(),
-                       recv_string.size());
-
-    mlt_comm->RecvMeta(&rank, &recv_buffer);
-
-    /// check it
-    auto it = std::find_if(nodes_.begin(), nodes_.end(),
-                           [&rank](auto& n) { return rank == n.rank; });
-    CHECK(it != nodes_.end()) << "receive from unknown rank: " << rank;
-
-    CHECK_EQ(recv_buffer.msg_length(),
-             static_cast<uint32_t>(expected_greeting.size()));
-    CHECK_EQ(recv_string, expected_greeting);
-  }
-
-  LOG(INFO) << GREEN_BOLD << "pass connection test!" << ESCAPE_END;
-  return 0;
-}
-
-int TestMLTApp::RunTestRcCorrectness() {
-  LOG(FATAL) << "implement this";
-  return 1;
-}
-
-int TestMLTApp::RunTestRcSpeed() {
-  Node my_node = FindNode(my_rank_);
-  MLTCommunicator* mlt_comm = mlt_comm_.get();
-
-  CHECK_GT(meta_size_, 0);
-  char* buf = new char[meta_size_];
-  memset(buf, 'a', meta_size_);
-
-  Meter meter(1000, "test_rc_speed");
-  int max_rank = -1;
-  for (const Node& node : nodes_)
-    if (max_rank < node.rank) max_rank = node.rank;
-
-  std::vector<size_t> send_cnt(max_rank + 1);
-  std::vector<size_t> recv_cnt(max_rank + 1);
-
-  const size_t max_gap = 320;  /// max_gap > 0
-  while (1) {
-    /// 1. send meta
-    for (const Node& node : nodes_) {
-      int rank = node.rank;
-      if (rank == my_rank_) continue;
-
-      /// send it
-      if (send_cnt[rank] <= recv_cnt[rank] + max_gap) {
-        /// prepare buffer
-        Buffer send_buffer(buf, meta_size_, meta_size_);
-        mlt_comm->SendMetaAsync(rank, &send_buffer);
-        // printf("Send a message, cnt = %ld\n", send_cnt[rank]); fflush(stdout);
-        send_cnt[rank]++;
-      } else {
-        int n_rank;
-        Buffer recv_buffer(buf, meta_size_, meta_size_);
-
-        mlt_comm->RecvMeta(&n_rank, &recv_buffer);
-        // printf("Recv a message, cnt = %ld\n", recv_cnt[n_rank]); fflush(stdout);
-        //LOG(INFO) << "n_rank: " << n_rank;
-
-        /// check it
-        auto it = std::find_if(nodes_.begin(), nodes_.end(),
-                              [&n_rank](auto& n) { return n_rank == n.rank; });
-        CHECK(it != nodes_.end()) << "receive from unknown rank: " << n_rank;
-
-        CHECK_EQ(recv_buffer.msg_length(), meta_size_);
-        recv_cnt[n_rank]++;
-        meter.Add(meta_size_);
+    // the queues of MLT take one sender at a time, and the flows of a
+    // connection have to be numbered in the order of their frames
+    std::lock_guard<std::mutex> send_lk(send_mu_);
+    uint32_t& next_msg_id = next_msg_ids_[comm_id];
+    for (int i = 0; i < n; ++i) {
+      if (!descs[i].is_inline) descs[i].msg_id = next_msg_id++;
+    }
+    if (n) memcpy(frame_descs, descs.data(), n * sizeof(MLTDataDesc));
+    {
+      // the data is held until the send completes
+      std::lock_guard<std::mutex> lk(mu_);
+      for (int i = 0; i < n; ++i) {
+        if (descs[i].is_inline) continue;
+        sending_[EncodeFlow(comm_id, descs[i].msg_id)] = msg.data[i];
       }
     }
-    // auto start = std::chrono::high_resolution_clock::now();
+    mlt_comm_->SendMetaAsync(comm_id, std::move(frame));
 
-    // auto end = std::chrono::high_resolution_clock::now();
-    // printf("%.3fus\n", (end - start).count() / 1e3);
+    // send the flows
+    int prio_class =
+        std::min(std::max(msg.meta.priority, 0), kNumPrioClasses - 1);
+    int send_bytes = frame_size;
+    for (int i = 0; i < n; ++i) {
+      if (descs[i].is_inline) continue;
+      LtMessage ltmsg;
+      ltmsg.msg_id = descs[i].msg_id;
+      ltmsg.buf = msg.data[i].data();
+      ltmsg.size = descs[i].size;
+      mlt_comm_->PostSend(comm_id, ltmsg, prio_funcs_[prio_class].get());
+      send_bytes += descs[i].size;
+    }
+    return send_bytes;
   }
 
-  delete [] buf;
-  LOG(INFO) << GREEN_BOLD << "pass rc_speed test!" << ESCAPE_END;
-  return 0;
-}
-
-int TestMLTApp::RunTestUdpSimple() {
-  Node my_node = FindNode(my_rank_);
-  MLTCommunicator* mlt_comm = mlt_comm_.get();
-
-  /// 1. create completion queue and bind it to communicator
-  auto cq = std::make_unique<CompletionQueue>();
-  mlt_comm->SetCompletionQueue(cq.get());
-
-  RandomGenerator gen;
-  float* gradients = new float[data_len_];
-  // for (size_t i = 0; i < data_len_; i++)
-  //   gradients[i] = gen.Uniform(-0.1, 0.1);
-  LtMessage ltmsg;
-  ltmsg.buf = reinterpret_cast<char*>(gradients);
-  ltmsg.size = sizeof(float) * data_len_;
-  ltmsg.msg_id = 5;
-
-  float* recv_gradients = new float[data_len_];
-  LtMessage recv_ltmsg;
-  recv_ltmsg.buf = reinterpret_cast<char*>(recv_gradients);
-  recv_ltmsg.size = sizeof(float) * data_len_;
-  recv_ltmsg.msg_id = 5;
-
-  PktPrioFunc* prio_func = new DefaultPktPrioFunc("layer_1", 1, 0.5);
-
-  auto start = std::chrono::high_resolution_clock::now();
-
-  /// send to other nodes and post recv at the same time
-  for (const Node& node : nodes_) {
-    int rank = node.rank;
-    if (rank == my_rank_) continue;
-
-    mlt_comm->PostRecv(rank, recv_ltmsg, 0.1);
+  int RecvMsg(Message* msg) override {
+    std::pair<Message, size_t> recv;
+    recv_msgs_.WaitAndPop(&recv);
+    *msg = std::move(recv.first);
+    return recv.second;
   }
 
-  /// barrier here
-  Barrier(RootRank());
-  Barrier(RootRank());
-
-  /// send to other nodes and post recv at the same time
-  for (const Node& node : nodes_) {
-    int rank = node.rank;
-    if (rank == my_rank_) continue;
+ private:
+  /**
+   * \brief only the values of data messages are worth a loss-tolerant flow
+   */
+  bool IsLossTolerant(const Message& msg, int i) {
+    if (msg.meta.simple_app || !msg.meta.control.empty()) return false;
+    return i == 1 && msg.data[i].size() >= inline_threshold_;
+  }
 
-    mlt_comm->PostSend(rank, ltmsg, prio_func);
+  static bool IsPortAvailable(int port) {
+    for (int type : {SOCK_STREAM, SOCK_DGRAM}) {
+      int sock = socket(AF_INET, type, 0);
+      if (sock < 0) return false;
+      int option = 1;
+      setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+      struct sockaddr_in addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_ANY);
+      addr.sin_port = htons(port);
+      int rc = bind(sock, (struct sockaddr*)&addr, sizeof(addr));
+      close(sock);
+      if (rc != 0) return false;
+    }
+    return true;
   }
 
-  /// poll completions
-  int num_comps = 0;
-  const int max_comps = 32;
-  Completion comps[max_comps];
-  while (num_comps + 2 < 2 * static_cast<int>(nodes_.size())) {
-    int ret = cq->PollOnce(max_comps, comps);
-    num_comps += ret;
-    for (int i = 0; i < ret; i++) {
-      if (comps[i].type == CompletionType::kSend) {
-        LOG(INFO) << "send completion to dest " << comps[i].remote_comm_id;
-        CHECK_EQ(comps[i].msg_id, 5);
-      } else if (comps[i].type == CompletionType::kRecv) {
-        LOG(INFO) << "recv completion, " << comps[i].bytes_received
-                  << " bytes received from dest " << comps[i].remote_comm_id;
-        CHECK_EQ(comps[i].msg_id, 5);
-      } else {
-        LOG(FATAL) << "unknown completion type: " << static_cast<int>(comps[i].type);
+  /**
+   * \brief turn meta frames and completions into messages
+   */
+  void Polling() {
+    ThreadPlacement::Get()->PinCurrentThread("mlt_van_polling");
+    const int max_comps = 32;
+    Completion comps[max_comps];
+    while (!should_stop_) {
+      bool idle = true;
+      int comm_id;
+      std::unique_ptr<Buffer> frame;
+      while (mlt_comm_->TryRecvMeta(&comm_id, &frame)) {
+        HandleMeta(comm_id, frame.get());
+        idle = false;
       }
+      int num_comps = cq_->PollOnce(max_comps, comps);
+      for (int i = 0; i < num_comps; ++i) HandleCompletion(comps[i]);
+      if (num_comps) idle = false;
+      if (idle) std::this_thread::yield();
     }
   }
 
-  // mlt_comm->StopUdpReceiving();
-
-  /// barrier
-  Barrier(RootRank());
-  /// RunTestConnection(); // as an barrier
-
-  auto end = std::chrono::high_resolution_clock::now();
-
-  LOG(INFO) << GREEN_BOLD << "pass udp_simple test!" << ESCAPE_END
-            << prism::FormatString(" time elapsed: %.3fms",
-                                   (end - start).count() / 1e6);
-
-  delete prio_func;
-  delete [] recv_gradients;
-  delete [] gradients;
-  return 0;
-}
-
-void TestMLTApp::Barrier(int root) {
-  LOG(DEBUG) << "Barrier, root: " << root;
-  auto s = std::chrono::high_resolution_clock::now();
+  void HandleMeta(int comm_id, Buffer* frame) {
+    auto user_hdr = GetInHeader<UserDataHeader>(frame);
+    size_t frame_size = frame->msg_length() - sizeof(UserDataHeader);
+    const char* p = user_hdr->payload;
+    auto hdr = reinterpret_cast<const MLTMsgHeader*>(p);
+    auto descs = reinterpret_cast<const MLTDataDesc*>(p + sizeof(MLTMsgHeader));
+    const char* meta_buf = reinterpret_cast<const char*>(descs + hdr->num_data);
+    const char* inline_buf = meta_buf + hdr->meta_size;
+
+    auto pending = std::make_shared<MLTPendingMsg>();
+    Message& msg = pending->msg;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      auto it = node_ids_.find(comm_id);
+      // a negative comm id is a node which does not have an id yet
+      msg.meta.sender = it != node_ids_.end() ? it->second
+                        : comm_id >= 0 ? comm_id : Meta::kEmpty;
+    }
+    msg.meta.recver = my_node_.id;
+    UnpackMeta(meta_buf, hdr->meta_size, &msg.meta);
+    pending->recv_bytes = frame_size;
+
+    if (msg.meta.sender == Meta::kEmpty &&
+        msg.meta.control.cmd == Control::ADD_NODE) {
+      CHECK_EQ(msg.meta.control.node.size(), 1);
+      const Node& node = msg.meta.control.node[0];
+      std::string addr = node.hostname + ":" + std::to_string(node.port);
+      std::lock_guard<std::mutex> lk(mu_);
+      anonymous_comm_ids_[addr] = comm_id;
+    }
 
-  auto send_buffer = std::make_unique<Buffer>(sizeof(int));
-  send_buffer->set_msg_length(sizeof(int));
-  *reinterpret_cast<int*>(send_buffer->ptr()) = my_rank_;
+    bool has_flow = false;
+    for (int i = 0; i < hdr->num_data; ++i) {
+      const auto& desc = descs[i];
+      SArray<char> data;
+      if (desc.is_inline) {
+        data.CopyFrom(inline_buf, desc.size);
+        inline_buf += desc.size;
+      } else {
+        // lost bytes read as zeros
+        data.resize(desc.size, 0);
+        LtMessage ltmsg;
+        ltmsg.msg_id = desc.msg_id;
+        ltmsg.buf = data.data();
+        ltmsg.size = desc.size;
+        // the policy may lose less than the sender allows
+        double loss_ratio = loss_policy_->LossRatio(
+            {comm_id, desc.size, -1, desc.loss_ratio});
+        mlt_comm_->PostRecv(comm_id, ltmsg, loss_ratio);
+        pending_[EncodeFlow(comm_id, desc.msg_id)] = pending;
+        ++pending->num_flows;
+        has_flow = true;
+      }
+      msg.data.push_back(data);
+    }
+    if (has_flow && msg.data[0].size() >= sizeof(Key)) {
+      SArray<Key> keys(msg.data[0]);
+      CountIteration(comm_id, keys[0]);
+    }
 
-  auto recv_buffer = std::make_unique<Buffer>(sizeof(int));
+    // keep the order of messages from a same sender
+    auto& inflight = inflight_[comm_id];
+    inflight.push_back(pending);
+    Deliver(&inflight);
+  }
 
-  if (my_rank_ == root) {
-    std::vector<int> ranks;
-    for (const Node& n: nodes_) {
-      if (n.rank != root) {
-        mlt_comm_->SendMetaAsync(n.rank, send_buffer.get());
-      }
+  void HandleCompletion(const Completion& comp) {
+    FlowId flow = EncodeFlow(comp.remote_comm_id, comp.msg_id);
+    if (comp.type == CompletionType::kSend) {
+      std::lock_guard<std::mutex> lk(mu_);
+      sending_.erase(flow);
+      return;
     }
-    for (const Node& n: nodes_) {
-      if (n.rank != root) {
-        int dest;
-        mlt_comm_->RecvMeta(&dest, recv_buffer.get());
-        FindNode(dest);
-        ranks.push_back(dest);
+    CHECK(comp.type == CompletionType::kRecv)
+        << "unknown completion type: " << static_cast<int>(comp.type);
+    auto it = pending_.find(flow);
+    CHECK(it != pending_.end()) << "unknown flow " << comp.msg_id
+                                << " from comm_id " << comp.remote_comm_id;
+    auto pending = it->second;
+    pending_.erase(it);
+    // the flow carries the values, see IsLossTolerant
+    loss_policy_->OnReceive(comp.remote_comm_id, pending->msg.data[1].size(),
+                            comp.bytes_received);
+    if (comp.partial) {
+      pending->msg.partial = true;
+      for (const auto& r : comp.recv_ranges) {
+        pending->msg.recv_ranges.emplace_back(r.first, r.second);
       }
     }
-    std::sort(ranks.begin(), ranks.end());
-    auto last = std::unique(ranks.begin(), ranks.end());
-    CHECK(last == ranks.end());
-  } else {
-    int dest = -1;
-    mlt_comm_->RecvMeta(&dest, recv_buffer.get());
-    CHECK_EQ(dest, root);
-    mlt_comm_->SendMetaAsync(root, send_buffer.get());
+    pending->recv_bytes += comp.bytes_received;
+    --pending->num_flows;
+    Deliver(&inflight_[comp.remote_comm_id]);
   }
 
-  auto e = std::chrono::high_resolution_clock::now();
-  LOG(INFO) << prism::FormatString("Barrier time: %.3fus\n", (e - s).count() / 1e3);
-}
-
-Node TestMLTApp::ParseNode(
-    const std::string& uri) {
-  auto pos0 = uri.find_last_of(',');
-  CHECK_NE(pos0, std::string::npos);
-  std::string rank_str = uri.substr(0, pos0);
-  int rank = std::stoi(rank_str, &pos0);
-  CHECK_EQ(pos0, rank_str.length());
-
-  auto pos = uri.find_last_of(':');
-  CHECK_NE(pos, std::string::npos);
-
-  std::string host_str = uri.substr(pos0 + 1, pos - pos0 - 1);
-  std::string port_str = uri.substr(pos + 1);
-
-  int port = std::stoi(port_str, &pos);
-  CHECK_EQ(pos, port_str.length());
-
-  return {rank, port, host_str};
-}
-
+  /**
+   * \brief a sender sends each key once per training iteration, so the
+   * flows of the first key of the first message with a flow, from the sender
+   * of that message only, tell the loss policy the iteration time, once for
+   * all the senders
+   */
+  void CountIteration(int comm_id, Key key) {
+    auto now = std::chrono::steady_clock::now();
+    if (iteration_comm_id_ == Meta::kEmpty) {
+      iteration_comm_id_ = comm_id;
+      iteration_key_ = key;
+    } else if (iteration_comm_id_ == comm_id && iteration_key_ == key) {
+      loss_policy_->OnIteration(std::chrono::duration<double, std::micro>(
+                                    now - iteration_start_).count());
+    } else {
+      return;
+    }
+    iteration_start_ = now;
+  }
 
-void TestMLTApp::ParseHostFile() {
-  std::fstream fs(host_file_, std::ios::in);
-  CHECK(fs.is_open()) << "failed to open host file: " << host_file_;
+  void Deliver(std::deque<std::shared_ptr<MLTPendingMsg>>* inflight) {
+    while (!inflight->empty() && inflight->front()->num_flows == 0) {
+      auto& pending = inflight->front();
+      recv_msgs_.Push({std::move(pending->msg), pending->recv_bytes});
+      inflight->pop_front();
+    }
+  }
 
-  for (std::string line; std::getline(fs, line); ) {
-    StringHelper::Trim(line, " \n\r\t", line);
-    if (line.empty()) continue;
-    if (line[0] == '#') continue;
+  std::unique_ptr<MLTCommunicator> mlt_comm_;
+  std::unique_ptr<CompletionQueue> cq_;
+  // the packet marking of each priority class
+  static const int kNumPrioClasses = 8;
+  std::vector<std::unique_ptr<PktPrioFunc>> prio_funcs_;
+  std::unique_ptr<std::thread> polling_thread_;
+  std::atomic<bool> should_stop_{false};
+
+  std::mutex mu_;
+  // node id -> comm id, and the reverse
+  std::unordered_map<int, int> comm_ids_;
+  std::unordered_map<int, int> node_ids_;
+  // ip:port -> comm id of nodes registering at the scheduler
+  std::unordered_map<std::string, int> anonymous_comm_ids_;
+  // flows being sent
+  std::unordered_map<FlowId, SArray<char>> sending_;
+  // serializes the senders, mu_ is only taken to look up and register
+  std::mutex send_mu_;
+  // comm id -> msg id of the next flow, guarded by send_mu_
+  std::unordered_map<int, uint32_t> next_msg_ids_;
+
+  // the loss ratio of pushed values which carry no loss bound
+  double default_loss_bound_ = 0;
+  size_t inline_threshold_ = 4096;
+
+  // only accessed by the polling thread
+  std::unique_ptr<LossPolicy> loss_policy_;
+  // the sender and the key that mark an iteration, and when it came last
+  int iteration_comm_id_ = Meta::kEmpty;
+  Key iteration_key_ = 0;
+  std::chrono::steady_clock::time_point iteration_start_;
+  std::unordered_map<FlowId, std::shared_ptr<MLTPendingMsg>> pending_;
+  std::unordered_map<int, std::deque<std::shared_ptr<MLTPendingMsg>>> inflight_;
+
+  ThreadsafeQueue<std::pair<Message, size_t>> recv_msgs_;
+};
+}  // namespace ps
 
-    nodes_.emplace_back(ParseNode(line));
-  }
-}
-
-
-// int main(int argc, char* argv[]) {
-//   TestMLTApp app;
-//   if (int err; (err = app.ParseArgument(argc, argv))) {
-//     app.ShowUsage(argv[0]);
-//     return err;
-//   }
-//   return app.Run();
-// }
-}
-#endif // USE_MLT
-#endif// PS_MLT_VAN_H_
\ No newline at end of file
+#endif  // USE_MLT
+#endif  // PS_MLT_VAN_H_
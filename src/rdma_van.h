@@ -56,6 +56,9 @@ class RDMAVan : public Van {
     Van::Start(customer_id);
   }
 
+  // the inline buffer of a key is sized once by its first meta
+  int MaxMetaVersion() override { return 0; }
+
   void Stop() override {
     PS_VLOG(1) << my_node_.ShortDebugString() << " is stopping";
     Van::Stop();
@@ -0,0 +1,386 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#include "ps/internal/reduce.h"
+#include <string.h>
+#include <algorithm>
+#include <type_traits>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
+#include "ps/internal/thread_pool.h"
+#include "ps/internal/utils.h"
+
+// the kernels are cloned for each instruction set, the loader picks the
+// widest one the cpu has. elsewhere, e.g. NEON on arm, the compiler
+// vectorizes them for the target
+#if !defined(PS_SIMD_CLONES) && defined(__x86_64__) && defined(__linux__) && \
+    defined(__has_attribute)
+#if __has_attribute(target_clones)
+#define PS_SIMD_CLONES \
+  __attribute__((target_clones("avx512f", "avx2", "default")))
+#endif
+#endif
+#ifndef PS_SIMD_CLONES
+#define PS_SIMD_CLONES
+#endif
+
+namespace ps {
+namespace {
+
+// the elements of a block, whose partial result stays in L1
+const size_t kBlock = 1024;
+// a larger result is written around the cache
+const size_t kStreamBytes = 16 << 20;
+// a thread takes at least this many bytes of the result
+const size_t kGrainBytes = 1 << 20;
+
+struct Sum {
+  template <typename T> T operator()(T a, T b) const { return a + b; }
+};
+
+struct Max {
+  template <typename T> T operator()(T a, T b) const { return a > b ? a : b; }
+};
+
+/** \brief dst = op(dst, src) */
+template <typename T, typename Op>
+PS_SIMD_CLONES void Apply(T* __restrict dst, const T* __restrict src,
+                          size_t n) {
+  Op op;
+  for (size_t i = 0; i < n; ++i) dst[i] = op(dst[i], src[i]);
+}
+
+/** \brief dst = op(a, b) */
+template <typename T, typename Op>
+PS_SIMD_CLONES void Apply2(T* __restrict dst, const T* __restrict a,
+                           const T* __restrict b, size_t n) {
+  Op op;
+  for (size_t i = 0; i < n; ++i) dst[i] = op(a[i], b[i]);
+}
+
+/** \brief dst /= count */
+template <typename T>
+PS_SIMD_CLONES void Scale(T* dst, size_t n, int count) {
+  if (std::is_floating_point<T>::value) {
+    T scale = static_cast<T>(1) / count;
+    for (size_t i = 0; i < n; ++i) dst[i] *= scale;
+  } else {
+    for (size_t i = 0; i < n; ++i) dst[i] /= count;
+  }
+}
+
+/** \brief a bfloat16 is the high half of a float32 */
+PS_SIMD_CLONES void BFloat16ToFloat(float* __restrict dst,
+                                    const uint16_t* __restrict src, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    uint32_t bits = static_cast<uint32_t>(src[i]) << 16;
+    memcpy(dst + i, &bits, 4);
+  }
+}
+
+/** \brief acc = op(acc, src), converting src as it is read */
+template <typename Op>
+PS_SIMD_CLONES void ApplyBFloat16(float* __restrict acc,
+                                  const uint16_t* __restrict src, size_t n) {
+  Op op;
+  for (size_t i = 0; i < n; ++i) {
+    uint32_t bits = static_cast<uint32_t>(src[i]) << 16;
+    float f;
+    memcpy(&f, &bits, 4);
+    acc[i] = op(acc[i], f);
+  }
+}
+
+/** \brief rounds to nearest even, a NaN stays a NaN */
+PS_SIMD_CLONES void FloatToBFloat16(uint16_t* __restrict dst,
+                                    const float* __restrict src, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    uint32_t bits;
+    memcpy(&bits, src + i, 4);
+    uint32_t rounded = bits + 0x7fff + ((bits >> 16) & 1);
+    bool nan = (bits & 0x7fffffff) > 0x7f800000;
+    dst[i] = (nan ? bits | 0x400000 : rounded) >> 16;
+  }
+}
+
+float HalfToFloat(uint16_t h) {
+  uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1f;
+  uint32_t mant = h & 0x3ff;
+  uint32_t bits;
+  if (exp == 0x1f) {
+    bits = sign | 0x7f800000 | (mant << 13);
+  } else if (exp) {
+    bits = sign | ((exp + 112) << 23) | (mant << 13);
+  } else if (mant) {
+    // a subnormal half is a normal float
+    exp = 113;
+    while (!(mant & 0x400)) {
+      mant <<= 1;
+      --exp;
+    }
+    bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+  } else {
+    bits = sign;
+  }
+  float f;
+  memcpy(&f, &bits, 4);
+  return f;
+}
+
+/** \brief rounds to nearest even */
+uint16_t FloatToHalf(float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, 4);
+  uint16_t sign = (bits >> 16) & 0x8000;
+  uint32_t abs = bits & 0x7fffffff;
+  if (abs > 0x7f800000) return sign | 0x7e00;
+  // 65520 and above round to inf
+  if (abs >= 0x477ff000) return sign | 0x7c00;
+  uint32_t h, rem, half;
+  if (abs >= 0x38800000) {
+    h = (abs >> 13) - (112 << 10);
+    rem = abs & 0x1fff;
+    half = 0x1000;
+  } else {
+    // below 2^-25 it rounds to 0
+    if (abs < 0x33000000) return sign;
+    int shift = 126 - (abs >> 23);
+    uint32_t mant = (abs & 0x7fffff) | 0x800000;
+    h = mant >> shift;
+    rem = mant & ((1u << shift) - 1);
+    half = 1u << (shift - 1);
+  }
+  if (rem > half || (rem == half && (h & 1))) ++h;
+  return sign | h;
+}
+
+void HalfToFloatSoft(float* dst, const uint16_t* src, size_t n) {
+  for (size_t i = 0; i < n; ++i) dst[i] = HalfToFloat(src[i]);
+}
+
+void FloatToHalfSoft(uint16_t* dst, const float* src, size_t n) {
+  for (size_t i = 0; i < n; ++i) dst[i] = FloatToHalf(src[i]);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("avx,f16c")))
+void HalfToFloatF16C(float* dst, const uint16_t* src, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+  }
+  HalfToFloatSoft(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx,f16c")))
+void FloatToHalfF16C(uint16_t* dst, const float* src, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src + i),
+                                _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), h);
+  }
+  FloatToHalfSoft(dst + i, src + i, n - i);
+}
+#elif defined(__aarch64__)
+void HalfToFloatNative(float* __restrict dst, const uint16_t* __restrict src,
+                       size_t n) {
+  const __fp16* h = reinterpret_cast<const __fp16*>(src);
+  for (size_t i = 0; i < n; ++i) dst[i] = h[i];
+}
+
+void FloatToHalfNative(uint16_t* __restrict dst, const float* __restrict src,
+                       size_t n) {
+  __fp16* h = reinterpret_cast<__fp16*>(dst);
+  for (size_t i = 0; i < n; ++i) h[i] = src[i];
+}
+#endif
+
+/** \brief the float16 conversions of the cpu */
+struct HalfConversion {
+  void (*to_float)(float*, const uint16_t*, size_t);
+  void (*from_float)(uint16_t*, const float*, size_t);
+
+  HalfConversion() : to_float(HalfToFloatSoft), from_float(FloatToHalfSoft) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("f16c")) {
+      to_float = HalfToFloatF16C;
+      from_float = FloatToHalfF16C;
+    }
+#elif defined(__aarch64__)
+    to_float = HalfToFloatNative;
+    from_float = FloatToHalfNative;
+#endif
+  }
+};
+
+/** \brief copy around the cache, as dst is not read soon */
+void StreamCopy(void* dst, const void* src, size_t bytes) {
+#if defined(__SSE2__)
+  char* d = static_cast<char*>(dst);
+  const char* s = static_cast<const char*>(src);
+  size_t head = std::min((16 - reinterpret_cast<uintptr_t>(d) % 16) % 16, bytes);
+  memcpy(d, s, head);
+  d += head;
+  s += head;
+  bytes -= head;
+  for (; bytes >= 16; bytes -= 16, d += 16, s += 16) {
+    _mm_stream_si128(reinterpret_cast<__m128i*>(d),
+                     _mm_loadu_si128(reinterpret_cast<const __m128i*>(s)));
+  }
+  memcpy(d, s, bytes);
+#else
+  memcpy(dst, src, bytes);
+#endif
+}
+
+/** \brief a reduction, dst is srcs[0] if it is an input */
+struct Job {
+  ReduceOp op;
+  ReduceType type;
+  char* dst;
+  std::vector<const char*> srcs;
+  bool in_place;
+  bool stream;
+};
+
+template <typename T, typename Op>
+void ReduceRange(const Job& job, size_t begin, size_t end) {
+  T* dst = reinterpret_cast<T*>(job.dst);
+  int num_srcs = job.srcs.size();
+  alignas(64) T acc[kBlock];
+  for (size_t b = begin; b < end; b += kBlock) {
+    size_t n = std::min(kBlock, end - b);
+    T* out = job.stream ? acc : dst + b;
+    auto src = [&](int k) {
+      return reinterpret_cast<const T*>(job.srcs[k]) + b;
+    };
+    int k = 1;
+    if (!job.in_place && num_srcs == 1) {
+      memcpy(out, src(0), n * sizeof(T));
+    } else if (!job.in_place) {
+      Apply2<T, Op>(out, src(0), src(1), n);
+      k = 2;
+    }
+    for (; k < num_srcs; ++k) Apply<T, Op>(out, src(k), n);
+    if (job.op == REDUCE_AVERAGE) Scale<T>(out, n, num_srcs);
+    if (job.stream) StreamCopy(dst + b, acc, n * sizeof(T));
+  }
+}
+
+/** \brief a 16-bit float type, reduced in float32 by blocks */
+template <typename Op>
+void ReduceRange16(const Job& job, size_t begin, size_t end) {
+  static HalfConversion half;
+  auto to_float = job.type == REDUCE_FLOAT16 ? half.to_float : BFloat16ToFloat;
+  auto from_float =
+      job.type == REDUCE_FLOAT16 ? half.from_float : FloatToBFloat16;
+  uint16_t* dst = reinterpret_cast<uint16_t*>(job.dst);
+  alignas(64) float acc[kBlock];
+  alignas(64) float in[kBlock];
+  alignas(64) uint16_t out[kBlock];
+  for (size_t b = begin; b < end; b += kBlock) {
+    size_t n = std::min(kBlock, end - b);
+    auto src = [&](int k) {
+      return reinterpret_cast<const uint16_t*>(job.srcs[k]) + b;
+    };
+    to_float(acc, src(0), n);
+    for (size_t k = 1; k < job.srcs.size(); ++k) {
+      if (job.type == REDUCE_BFLOAT16) {
+        ApplyBFloat16<Op>(acc, src(k), n);
+      } else {
+        to_float(in, src(k), n);
+        Apply<float, Op>(acc, in, n);
+      }
+    }
+    if (job.op == REDUCE_AVERAGE) Scale<float>(acc, n, job.srcs.size());
+    if (job.stream) {
+      from_float(out, acc, n);
+      StreamCopy(dst + b, out, n * sizeof(uint16_t));
+    } else {
+      from_float(dst + b, acc, n);
+    }
+  }
+}
+
+template <typename Op>
+void ReduceRange(const Job& job, size_t begin, size_t end) {
+  switch (job.type) {
+    case REDUCE_FLOAT32:
+      return ReduceRange<float, Op>(job, begin, end);
+    case REDUCE_FLOAT64:
+      return ReduceRange<double, Op>(job, begin, end);
+    case REDUCE_FLOAT16:
+    case REDUCE_BFLOAT16:
+      return ReduceRange16<Op>(job, begin, end);
+    case REDUCE_INT32:
+      return ReduceRange<int32_t, Op>(job, begin, end);
+    case REDUCE_INT64:
+      return ReduceRange<int64_t, Op>(job, begin, end);
+  }
+}
+
+}  // namespace
+
+size_t ReduceTypeSize(ReduceType type) {
+  switch (type) {
+    case REDUCE_FLOAT16:
+    case REDUCE_BFLOAT16:
+      return 2;
+    case REDUCE_FLOAT32:
+    case REDUCE_INT32:
+      return 4;
+    case REDUCE_FLOAT64:
+    case REDUCE_INT64:
+      return 8;
+  }
+  LOG(FATAL) << "unknown reduce type " << type;
+  return 0;
+}
+
+void Reduce(ReduceOp op, ReduceType type, void* dst, const void* const* srcs,
+            int num_srcs, size_t len) {
+  CHECK_GT(num_srcs, 0);
+  Job job;
+  job.op = op;
+  job.type = type;
+  job.dst = static_cast<char*>(dst);
+  job.srcs.assign(reinterpret_cast<const char* const*>(srcs),
+                  reinterpret_cast<const char* const*>(srcs) + num_srcs);
+  // the ops are commutative, dst goes first if it is an input
+  auto it = std::find(job.srcs.begin(), job.srcs.end(), job.dst);
+  job.in_place = it != job.srcs.end();
+  if (job.in_place) std::swap(*it, job.srcs[0]);
+  size_t bytes = len * ReduceTypeSize(type);
+  job.stream = !job.in_place && bytes >= kStreamBytes;
+
+  // the parts start at blocks, so that the streamed stores are aligned
+  auto pool = ThreadPool::Get();
+  size_t num_parts = std::max(
+      std::min(static_cast<size_t>(pool->size()), bytes / kGrainBytes),
+      static_cast<size_t>(1));
+  size_t step = (len + num_parts - 1) / num_parts;
+  step = (step + kBlock - 1) / kBlock * kBlock;
+  pool->Run(num_parts, [&](int i) {
+    size_t begin = i * step;
+    size_t end = std::min(len, begin + step);
+    if (begin >= end) return;
+    if (op == REDUCE_MAX) {
+      ReduceRange<Max>(job, begin, end);
+    } else {
+      ReduceRange<Sum>(job, begin, end);
+    }
+#if defined(__SSE2__)
+    if (job.stream) _mm_sfence();
+#endif
+  });
+}
+
+}  // namespace ps
@@ -0,0 +1,225 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_THREAD_PLACEMENT_H_
+#define PS_THREAD_PLACEMENT_H_
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "ps/internal/env.h"
+#include "ps/internal/utils.h"
+#include "dmlc/logging.h"
+namespace ps {
+
+/**
+ * \brief decides which cpus the long running threads of ps-lite and of the
+ * MLT transport run on
+ *
+ * PS_THREAD_PLACEMENT selects the policy:
+ *
+ * - unset or "none": no thread is pinned
+ * - "auto": pin to the numa node of the nic given by DMLC_INTERFACE, counting
+ *   down from its last core, past the cores of the processes of a lower
+ *   PS_LOCAL_RANK on the host. threads sharing a queue get sibling cpus
+ * - an explicit list "role:cpulist;role:cpulist", e.g.
+ *   "van_recv:2;customer:3;mlt_receiving:4-5". roles not listed are not pinned
+ *
+ * the roles are van_recv, customer, zmq_recv, mlt_van_polling, mlt_receiving,
+ * mlt_reliable and mlt_priority. all threads of a same role share its cpus
+ */
+class ThreadPlacement {
+ public:
+  static ThreadPlacement* Get() {
+    static ThreadPlacement inst;
+    return &inst;
+  }
+
+  /**
+   * \brief the cpus of the role, empty if it is not pinned
+   */
+  std::vector<int> GetCpus(const std::string& role) const {
+    auto it = cpus_.find(role);
+    return it == cpus_.end() ? std::vector<int>() : it->second;
+  }
+
+  /**
+   * \brief the cpus of the numa node the nic is attached to, empty if no
+   * thread is pinned
+   */
+  const std::vector<int>& LocalCpus() const { return local_cpus_; }
+
+  /**
+   * \brief pin the calling thread to the cpus of the role
+   */
+  void PinCurrentThread(const std::string& role) {
+    auto cpus = GetCpus(role);
+    if (cpus.empty()) return;
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    for (int cpu : cpus) CPU_SET(cpu, &cpuset);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    if (rc != 0) {
+      LOG(WARNING) << "failed to pin " << role << ": " << strerror(rc);
+    }
+  }
+
+  /**
+   * \brief parse a cpulist such as "0-3,8,10-11"
+   */
+  static std::vector<int> ParseCpuList(const std::string& str) {
+    std::vector<int> cpus;
+    std::stringstream ss(str);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+      if (item.empty()) continue;
+      size_t dash = item.find('-');
+      int first = atoi(item.substr(0, dash).c_str());
+      int last = dash == std::string::npos ? first
+                                           : atoi(item.substr(dash + 1).c_str());
+      for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+    }
+    return cpus;
+  }
+
+ private:
+  ThreadPlacement() {
+    const char* val = Environment::Get()->find("PS_THREAD_PLACEMENT");
+    std::string policy = val ? val : "none";
+    if (policy == "none") return;
+    if (policy == "auto") {
+      PlaceAuto();
+    } else {
+      PlaceExplicit(policy);
+    }
+    Report();
+  }
+
+  static std::string ReadFile(const std::string& path) {
+    std::ifstream fin(path);
+    std::string line;
+    if (fin) std::getline(fin, line);
+    return line;
+  }
+
+  void PlaceExplicit(const std::string& policy) {
+    std::stringstream ss(policy);
+    std::string item;
+    while (std::getline(ss, item, ';')) {
+      if (item.empty()) continue;
+      size_t colon = item.find(':');
+      CHECK_NE(colon, std::string::npos)
+          << "invalid PS_THREAD_PLACEMENT item: " << item;
+      auto cpus = ParseCpuList(item.substr(colon + 1));
+      cpus_[item.substr(0, colon)] = cpus;
+      local_cpus_.insert(local_cpus_.end(), cpus.begin(), cpus.end());
+    }
+    std::sort(local_cpus_.begin(), local_cpus_.end());
+    local_cpus_.erase(std::unique(local_cpus_.begin(), local_cpus_.end()),
+                      local_cpus_.end());
+  }
+
+  void PlaceAuto() {
+    const char* itf = Environment::Get()->find("DMLC_INTERFACE");
+    if (itf) {
+      std::string node = ReadFile(std::string("/sys/class/net/") + itf +
+                                  "/device/numa_node");
+      numa_node_ = node.empty() ? -1 : atoi(node.c_str());
+    }
+    if (numa_node_ >= 0) {
+      local_cpus_ = ParseCpuList(ReadFile("/sys/devices/system/node/node" +
+                                          std::to_string(numa_node_) +
+                                          "/cpulist"));
+    }
+    if (local_cpus_.empty()) {
+      LOG(WARNING) << "cannot find the numa node of interface "
+                   << (itf ? itf : "(unset)")
+                   << ", placing threads on all cpus";
+      numa_node_ = -1;
+      local_cpus_ = ParseCpuList(ReadFile("/sys/devices/system/cpu/online"));
+    }
+    CHECK(!local_cpus_.empty()) << "no cpu to place threads on";
+
+    // the hyper-threads of each core, from the last core down, since the
+    // training framework usually takes the first ones
+    std::vector<std::vector<int>> cores;
+    std::map<int, bool> taken;
+    for (auto it = local_cpus_.rbegin(); it != local_cpus_.rend(); ++it) {
+      if (taken[*it]) continue;
+      auto siblings = ParseCpuList(ReadFile(
+          "/sys/devices/system/cpu/cpu" + std::to_string(*it) +
+          "/topology/thread_siblings_list"));
+      std::vector<int> core;
+      for (int cpu : siblings) {
+        if (taken[cpu] || !std::binary_search(local_cpus_.begin(),
+                                              local_cpus_.end(), cpu)) {
+          continue;
+        }
+        taken[cpu] = true;
+        core.push_back(cpu);
+      }
+      if (core.empty()) core.push_back(*it);
+      taken[*it] = true;
+      cores.push_back(core);
+    }
+
+    // the pairs of threads talking through a queue, sharing a core if it has
+    // two hyper-threads, otherwise on neighbouring cores
+    const std::vector<std::pair<std::string, std::string>> pairs = {
+        {"mlt_receiving", "mlt_van_polling"},
+        {"mlt_reliable", "mlt_priority"},
+        {"van_recv", "customer"},
+    };
+    // each process on the host takes its own cores
+    size_t cores_per_rank = pairs.size() * (cores[0].size() >= 2 ? 1 : 2);
+    int local_rank = GetEnv("PS_LOCAL_RANK", 0);
+    size_t next = local_rank * cores_per_rank;
+    LOG_IF(WARNING, next + cores_per_rank > cores.size())
+        << "PS_LOCAL_RANK " << local_rank << " needs " << cores_per_rank
+        << " cores past " << next << ", there are " << cores.size()
+        << ", so the threads share cores";
+    for (const auto& p : pairs) {
+      const auto& core = cores[next++ % cores.size()];
+      if (core.size() >= 2) {
+        cpus_[p.first] = {core[0]};
+        cpus_[p.second] = {core[1]};
+      } else {
+        cpus_[p.first] = {core[0]};
+        cpus_[p.second] = {cores[next++ % cores.size()][0]};
+      }
+    }
+    // zmq hands the messages it receives to van_recv
+    auto& zmq_recv = cpus_["zmq_recv"];
+    zmq_recv = cpus_["van_recv"];
+    for (int cpu : cpus_["customer"]) {
+      if (zmq_recv[0] != cpu) zmq_recv.push_back(cpu);
+    }
+  }
+
+  void Report() {
+    std::stringstream ss;
+    ss << "thread placement";
+    if (numa_node_ >= 0) ss << " on numa node " << numa_node_;
+    ss << ":";
+    for (const auto& it : cpus_) {
+      ss << " " << it.first << "=";
+      for (size_t i = 0; i < it.second.size(); ++i) {
+        ss << (i ? "," : "") << it.second[i];
+      }
+    }
+    LOG(INFO) << ss.str();
+  }
+
+  int numa_node_ = -1;
+  std::vector<int> local_cpus_;
+  std::map<std::string, std::vector<int>> cpus_;
+};
+
+}  // namespace ps
+#endif  // PS_THREAD_PLACEMENT_H_
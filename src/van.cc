@@ -2,9 +2,12 @@
  *  Copyright (c) 2015 by Contributors
  */
 
+#include <algorithm>
 #include <chrono>
+#include <mutex>
 #include <thread>
 #include <fstream>
+#include <vector>
 #include <string.h>
 #include <sstream>
 
@@ -18,12 +21,11 @@
 #include "./network_utils.h"
 #include "./rdma_van.h"
 #include "./resender.h"
+#include "./thread_placement.h"
 #include "./zmq_van.h"
 #define USE_PROFILING
 
-#ifdef USE_MLT
-  #include "./mlt_van.h"
-#endif // USE_MLT
+#include "./mlt_van.h"
 
 namespace ps {
 
@@ -83,7 +85,7 @@ Van *Van::Create(const std::string &type) {
 
 #ifdef USE_MLT
   } else if (type == "mlt") {
-    return new TestMLTApp();
+    return new MLTVan();
 #endif
 
   } else {
@@ -131,6 +133,7 @@ void Van::ProcessAddNodeCommandAtScheduler(Message *msg, Meta *nodes, Meta *reco
     }
     nodes->control.node.push_back(my_node_);
     nodes->control.cmd = Control::ADD_NODE;
+    nodes->control.barrier_group = std::max(meta_version_offer_, 0);
     Message back;
     back.meta = *nodes;
     for (int r : Postoffice::Get()->GetNodeIDs(kWorkerGroup + kServerGroup)) {
@@ -143,12 +146,15 @@ void Van::ProcessAddNodeCommandAtScheduler(Message *msg, Meta *nodes, Meta *reco
     }
     PS_VLOG(1) << "the scheduler is connected to " << num_workers_ << " workers and "
                << num_servers_ << " servers";
+    // the replies go out in the old format, the nodes switch on them
+    meta_version_ = nodes->control.barrier_group;
     ready_ = true;
   } else if (!recovery_nodes->control.node.empty()) {
     auto dead_nodes = Postoffice::Get()->GetDeadNodes(heartbeat_timeout_);
     std::unordered_set<int> dead_set(dead_nodes.begin(), dead_nodes.end());
     // send back the recovery node
     CHECK_EQ(recovery_nodes->control.node.size(), 1);
+    recovery_nodes->control.barrier_group = meta_version_.load();
     Connect(recovery_nodes->control.node[0]);
     Postoffice::Get()->UpdateHeartbeat(recovery_nodes->control.node[0].id, t);
     Message back;
@@ -177,6 +183,7 @@ void Van::UpdateLocalID(Message* msg, std::unordered_set<int>* deadnodes_set,
     CHECK_EQ(ctrl.node.size(), 1);
     if (static_cast<int>(nodes->control.node.size()) < (int) num_nodes) {
       nodes->control.node.push_back(ctrl.node[0]);
+      meta_version_offer_ = std::min(meta_version_offer_, ctrl.barrier_group);
     } else {
       // some node dies and restarts
       CHECK(ready_.load());
@@ -185,6 +192,10 @@ void Van::UpdateLocalID(Message* msg, std::unordered_set<int>* deadnodes_set,
         if (deadnodes_set->find(node.id) != deadnodes_set->end() &&
             node.role == ctrl.node[0].role) {
           auto &recovery_node = ctrl.node[0];
+          LOG_IF(WARNING, ctrl.barrier_group < meta_version_.load())
+              << "node " << recovery_node.DebugString()
+              << " cannot read the meta format " << meta_version_.load()
+              << " of the others, run all with PS_META_FORMAT=legacy";
           // assign previous node id
           recovery_node.id = node.id;
           recovery_node.is_recovery = true;
@@ -313,7 +324,10 @@ void Van::ProcessAddNodeCommand(Message *msg, Meta *nodes, Meta *recovery_nodes)
       if (!node.is_recovery && node.role == Node::SERVER) ++num_servers_;
       if (!node.is_recovery && node.role == Node::WORKER) ++num_workers_;
     }
-    PS_VLOG(1) << my_node_.ShortDebugString() << " is connected to others";
+    // the scheduler tells the format all nodes can carry
+    meta_version_ = std::max(std::min(ctrl.barrier_group, MaxMetaVersion()), 0);
+    PS_VLOG(1) << my_node_.ShortDebugString() << " is connected to others"
+               << ", meta format " << meta_version_.load();
     ready_ = true;
   }
 }
@@ -328,6 +342,8 @@ void Van::Start(int customer_id) {
     scheduler_.role = Node::SCHEDULER;
     scheduler_.id = kScheduler;
     is_scheduler_ = Postoffice::Get()->is_scheduler();
+    meta_version_ = 0;
+    meta_version_offer_ = MaxMetaVersion();
 
     // get my node info
     if (is_scheduler_) {
@@ -388,6 +404,7 @@ void Van::Start(int customer_id) {
     msg.meta.recver = kScheduler;
     msg.meta.control.cmd = Control::ADD_NODE;
     msg.meta.control.node.push_back(customer_specific_node);
+    msg.meta.control.barrier_group = MaxMetaVersion();
     msg.meta.timestamp = timestamp_++;
     Send(msg);
   }
@@ -459,6 +476,7 @@ int Van::Send(Message &msg) {
 }
 
 void Van::Receiving() {
+  ThreadPlacement::Get()->PinCurrentThread("van_recv");
   Meta nodes;
   Meta recovery_nodes;  // store recovery nodes
   recovery_nodes.control.cmd = Control::ADD_NODE;
@@ -504,22 +522,281 @@ void Van::Receiving() {
   }
 }
 
-int Van::GetPackMetaLen(const Meta &meta) {
+namespace {
+/**
+ * \brief the buffers PackMeta allocates, so that sending a message costs no
+ * new[]. they are returned from the io thread of zmq, hence the lock. the
+ * metas of the data messages fit in a slot, a larger one, e.g. an ADD_NODE
+ * with many nodes, is allocated and freed as before
+ */
+class MetaBufPool {
+ public:
+  static MetaBufPool* Get() {
+    // never destroyed, zmq may still return buffers at exit
+    static MetaBufPool* pool = new MetaBufPool();
+    return pool;
+  }
+
+  char* Alloc(int size) {
+    char* buf = nullptr;
+    if (size <= kSlotSize) {
+      std::lock_guard<std::mutex> lk(mu_);
+      if (!free_.empty()) {
+        buf = free_.back();
+        free_.pop_back();
+      }
+    }
+    if (!buf) {
+      // the first byte tells whether the buffer goes back to the pool
+      buf = new char[std::max(size, kSlotSize) + kHeaderSize];
+      buf[0] = size <= kSlotSize;
+    }
+    return buf + kHeaderSize;
+  }
+
+  void Free(char* data) {
+    char* buf = data - kHeaderSize;
+    if (buf[0]) {
+      std::lock_guard<std::mutex> lk(mu_);
+      if (free_.size() < kMaxFree) {
+        free_.push_back(buf);
+        return;
+      }
+    }
+    delete[] buf;
+  }
+
+ private:
+  static const int kSlotSize = 512;
+  // keeps the meta aligned
+  static const int kHeaderSize = 16;
+  static const size_t kMaxFree = 4096;
+
+  std::mutex mu_;
+  std::vector<char*> free_;
+};
+}  // namespace
+
+void Van::FreeMetaBuf(void *data, void *hint) {
+  MetaBufPool::Get()->Free(static_cast<char*>(data));
+}
+
+namespace {
+// a compact meta of any data message fits, a larger one goes as a RawMeta
+const int kCompactMetaBufSize = 256;
+
+inline char *PutVarint(char *p, uint64_t v) {
+  for (; v >= 0x80; v >>= 7) *p++ = static_cast<char>(v | 0x80);
+  *p++ = static_cast<char>(v);
+  return p;
+}
+
+/** \brief zigzag, so that kEmpty and the small negatives stay short */
+inline char *PutInt(char *p, int64_t v) {
+  return PutVarint(p, (static_cast<uint64_t>(v) << 1) ^
+                          static_cast<uint64_t>(v >> 63));
+}
+
+/** \brief the bytes of the compact meta at most */
+size_t CompactMetaBound(const Meta &meta) {
+  // version, fields, 8 ints, key, addr and loss_ratio
+  size_t bound = 1 + 5 + 8 * 5 + 2 * 10 + sizeof(float);
+  bound += 5 + meta.body.size() + 5 + meta.data_type.size();
+  if (!meta.control.empty()) {
+    bound += 5 + 5 + 10 + 5;
+    for (const auto &n : meta.control.node) {
+      bound += 4 * 5 + 1 + 5 + n.hostname.size();
+    }
+  }
+  return bound;
+}
+
+/** \brief write the compact meta of at most CompactMetaBound bytes */
+char *WriteCompactMeta(const Meta &meta, char *p) {
+  uint32_t fields = 0;
+  if (meta.request) fields |= kMetaRequest;
+  if (meta.push) fields |= kMetaPush;
+  if (meta.simple_app) fields |= kMetaSimpleApp;
+  if (meta.head != Meta::kEmpty) fields |= kMetaHead;
+  if (meta.app_id != Meta::kEmpty) fields |= kMetaAppId;
+  if (meta.customer_id != Meta::kEmpty) fields |= kMetaCustomerId;
+  if (meta.timestamp != Meta::kEmpty) fields |= kMetaTimestamp;
+  if (!meta.body.empty()) fields |= kMetaBody;
+  if (!meta.data_type.empty()) fields |= kMetaDataType;
+  if (!meta.control.empty()) fields |= kMetaControl;
+  if (meta.data_size) fields |= kMetaDataSize;
+  if (meta.key) fields |= kMetaKey;
+  if (meta.addr) fields |= kMetaAddr;
+  if (meta.val_len) fields |= kMetaValLen;
+  if (meta.option) fields |= kMetaOption;
+  if (meta.loss_ratio != 0) fields |= kMetaLossRatio;
+  if (meta.priority) fields |= kMetaPriority;
+
+  *p++ = kCompactMetaVersion;
+  p = PutVarint(p, fields);
+  if (fields & kMetaHead) p = PutInt(p, meta.head);
+  if (fields & kMetaAppId) p = PutInt(p, meta.app_id);
+  if (fields & kMetaCustomerId) p = PutInt(p, meta.customer_id);
+  if (fields & kMetaTimestamp) p = PutInt(p, meta.timestamp);
+  if (fields & kMetaBody) {
+    p = PutVarint(p, meta.body.size());
+    memcpy(p, meta.body.data(), meta.body.size());
+    p += meta.body.size();
+  }
+  if (fields & kMetaDataType) {
+    p = PutVarint(p, meta.data_type.size());
+    for (auto d : meta.data_type) *p++ = static_cast<char>(d);
+  }
+  if (fields & kMetaControl) {
+    const auto &ctrl = meta.control;
+    p = PutVarint(p, ctrl.cmd);
+    p = PutInt(p, ctrl.barrier_group);
+    p = PutVarint(p, ctrl.msg_sig);
+    p = PutVarint(p, ctrl.node.size());
+    for (const auto &n : ctrl.node) {
+      p = PutInt(p, n.role);
+      p = PutInt(p, n.id);
+      p = PutInt(p, n.port);
+      *p++ = n.is_recovery;
+      p = PutInt(p, n.customer_id);
+      p = PutVarint(p, n.hostname.size());
+      memcpy(p, n.hostname.data(), n.hostname.size());
+      p += n.hostname.size();
+    }
+  }
+  if (fields & kMetaDataSize) p = PutInt(p, meta.data_size);
+  if (fields & kMetaKey) p = PutVarint(p, meta.key);
+  if (fields & kMetaAddr) p = PutVarint(p, meta.addr);
+  if (fields & kMetaValLen) p = PutInt(p, meta.val_len);
+  if (fields & kMetaOption) p = PutInt(p, meta.option);
+  if (fields & kMetaLossRatio) {
+    memcpy(p, &meta.loss_ratio, sizeof(float));
+    p += sizeof(float);
+  }
+  if (fields & kMetaPriority) p = PutInt(p, meta.priority);
+  return p;
+}
+
+/**
+ * \brief write the compact meta into buf of kCompactMetaBufSize bytes and
+ * return its size, or 0 if it is not shorter than a RawMeta
+ */
+int EncodeCompactMeta(const Meta &meta, char *buf) {
+  if (CompactMetaBound(meta) > kCompactMetaBufSize) return 0;
+  int size = WriteCompactMeta(meta, buf) - buf;
+  return size < static_cast<int>(sizeof(RawMeta)) ? size : 0;
+}
+
+class CompactReader {
+ public:
+  CompactReader(const char *buf, int size) : p_(buf), end_(buf + size) {}
+
+  uint8_t Byte() {
+    CHECK(p_ < end_) << "truncated meta";
+    return static_cast<uint8_t>(*p_++);
+  }
+
+  const char *Bytes(size_t n) {
+    CHECK_LE(n, static_cast<size_t>(end_ - p_)) << "truncated meta";
+    const char *data = p_;
+    p_ += n;
+    return data;
+  }
+
+  uint64_t Varint() {
+    if (p_ < end_ && static_cast<uint8_t>(*p_) < 0x80) return *p_++;
+    return SlowVarint();
+  }
+
+  int64_t Int() {
+    uint64_t v = Varint();
+    return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+  }
+
+ private:
+  uint64_t SlowVarint() {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      uint8_t b = Byte();
+      v |= static_cast<uint64_t>(b & 0x7f) << shift;
+      if (!(b & 0x80)) return v;
+    }
+    LOG(FATAL) << "malformed varint in meta";
+    return 0;
+  }
+
+  const char *p_;
+  const char *end_;
+};
+
+void ReadCompactMeta(const char *meta_buf, int buf_size, Meta *meta) {
+  CompactReader r(meta_buf, buf_size);
+  int version = r.Byte();
+  CHECK_EQ(version, kCompactMetaVersion) << "unknown meta format";
+  uint32_t fields = r.Varint();
+  meta->request = fields & kMetaRequest;
+  meta->push = fields & kMetaPush;
+  meta->simple_app = fields & kMetaSimpleApp;
+  meta->head = (fields & kMetaHead) ? r.Int() : Meta::kEmpty;
+  meta->app_id = (fields & kMetaAppId) ? r.Int() : Meta::kEmpty;
+  meta->customer_id = (fields & kMetaCustomerId) ? r.Int() : Meta::kEmpty;
+  meta->timestamp = (fields & kMetaTimestamp) ? r.Int() : Meta::kEmpty;
+  meta->body.clear();
+  if (fields & kMetaBody) {
+    size_t n = r.Varint();
+    meta->body.assign(r.Bytes(n), n);
+  }
+  meta->data_type.clear();
+  if (fields & kMetaDataType) {
+    size_t n = r.Varint();
+    meta->data_type.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      meta->data_type[i] = static_cast<DataType>(r.Byte());
+    }
+  }
+  meta->control.cmd = Control::EMPTY;
+  if (fields & kMetaControl) {
+    auto &ctrl = meta->control;
+    ctrl.cmd = static_cast<Control::Command>(r.Varint());
+    ctrl.barrier_group = r.Int();
+    ctrl.msg_sig = r.Varint();
+    size_t num_nodes = r.Varint();
+    for (size_t i = 0; i < num_nodes; ++i) {
+      Node n;
+      n.role = static_cast<Node::Role>(r.Int());
+      n.id = r.Int();
+      n.port = r.Int();
+      n.is_recovery = r.Byte();
+      n.customer_id = r.Int();
+      size_t len = r.Varint();
+      n.hostname.assign(r.Bytes(len), len);
+      ctrl.node.push_back(n);
+    }
+  }
+  meta->data_size = (fields & kMetaDataSize) ? r.Int() : 0;
+  meta->key = (fields & kMetaKey) ? r.Varint() : 0;
+  meta->addr = (fields & kMetaAddr) ? r.Varint() : 0;
+  meta->val_len = (fields & kMetaValLen) ? r.Int() : 0;
+  meta->option = (fields & kMetaOption) ? r.Int() : 0;
+  meta->loss_ratio = 0;
+  if (fields & kMetaLossRatio) {
+    memcpy(&meta->loss_ratio, r.Bytes(sizeof(float)), sizeof(float));
+  }
+  meta->priority = (fields & kMetaPriority) ? r.Int() : 0;
+}
+
+/** \brief the size of the RawMeta of meta */
+int RawMetaLen(const Meta &meta) {
   return sizeof(RawMeta) + meta.body.size() +
          meta.data_type.size() * sizeof(int) +
          meta.control.node.size() * sizeof(RawNode);
 }
 
-void Van::PackMeta(const Meta &meta, char **meta_buf, int *buf_size) {
-  *buf_size = GetPackMetaLen(meta);
-  // allocate buffer only when needed
-  if (*meta_buf == nullptr) {
-    *meta_buf = new char[*buf_size + 1];
-  }
-
-  RawMeta *raw = (RawMeta*)*meta_buf;
+/** \brief write the RawMeta of meta into meta_buf of RawMetaLen bytes */
+void WriteRawMeta(const Meta &meta, char *meta_buf) {
+  RawMeta *raw = (RawMeta*)meta_buf;
   bzero(raw, sizeof(RawMeta));
-  char *raw_body = *meta_buf + sizeof(RawMeta);
+  char *raw_body = meta_buf + sizeof(RawMeta);
   int *raw_data_type = (int*)(raw_body + meta.body.size());
   RawNode *raw_node = (RawNode*)(raw_data_type + meta.data_type.size());
 
@@ -544,7 +821,9 @@ void Van::PackMeta(const Meta &meta, char **meta_buf, int *buf_size) {
   auto ctrl = &(raw->control);
   if (!meta.control.empty()) {
     ctrl->cmd = meta.control.cmd;
-    if (meta.control.cmd == Control::BARRIER) {
+    // ADD_NODE carries the newest meta format the sender can carry
+    if (meta.control.cmd == Control::BARRIER ||
+        meta.control.cmd == Control::ADD_NODE) {
       ctrl->barrier_group = meta.control.barrier_group;
     } else if (meta.control.cmd == Control::ACK) {
       ctrl->msg_sig = meta.control.msg_sig;
@@ -570,9 +849,66 @@ void Van::PackMeta(const Meta &meta, char **meta_buf, int *buf_size) {
   raw->addr = meta.addr;
   raw->val_len = meta.val_len;
   raw->option = meta.option;
+  raw->loss_ratio = meta.loss_ratio;
+  raw->priority = meta.priority;
+}
+}  // namespace
+
+int Van::MaxMetaVersion() {
+  const char *val = Environment::Get()->find("PS_META_FORMAT");
+  if (val && std::string(val) == "legacy") return 0;
+  return kCompactMetaVersion;
+}
+
+int Van::GetPackMetaLen(const Meta &meta) {
+  // the compact meta only when shorter than a RawMeta, which tells them apart
+  if (meta_version_.load(std::memory_order_relaxed) >= kCompactMetaVersion) {
+    char buf[kCompactMetaBufSize];
+    int size = EncodeCompactMeta(meta, buf);
+    if (size) return size;
+  }
+  return RawMetaLen(meta);
+}
+
+void Van::PackMeta(const Meta &meta, char **meta_buf, int *buf_size) {
+  if (meta_version_.load(std::memory_order_relaxed) >= kCompactMetaVersion) {
+    char buf[kCompactMetaBufSize];
+    int size = EncodeCompactMeta(meta, buf);
+    if (size) {
+      *buf_size = size;
+      if (*meta_buf == nullptr) *meta_buf = MetaBufPool::Get()->Alloc(size);
+      memcpy(*meta_buf, buf, size);
+      return;
+    }
+  }
+  *buf_size = RawMetaLen(meta);
+  // allocate buffer only when needed
+  if (*meta_buf == nullptr) {
+    *meta_buf = MetaBufPool::Get()->Alloc(*buf_size);
+  }
+  WriteRawMeta(meta, *meta_buf);
+}
+
+int Van::PackMeta(const Meta &meta, std::string *meta_buf) {
+  if (meta_version_.load(std::memory_order_relaxed) >= kCompactMetaVersion) {
+    char buf[kCompactMetaBufSize];
+    int size = EncodeCompactMeta(meta, buf);
+    if (size) {
+      meta_buf->assign(buf, size);
+      return size;
+    }
+  }
+  int size = RawMetaLen(meta);
+  meta_buf->resize(size);
+  WriteRawMeta(meta, &(*meta_buf)[0]);
+  return size;
 }
 
 void Van::UnpackMeta(const char *meta_buf, int buf_size, Meta *meta) {
+  if (buf_size < static_cast<int>(sizeof(RawMeta))) {
+    ReadCompactMeta(meta_buf, buf_size, meta);
+    return;
+  }
 
   RawMeta *raw = (RawMeta*)meta_buf;
   const char *raw_body = meta_buf + sizeof(RawMeta);
@@ -586,7 +922,8 @@ void Van::UnpackMeta(const char *meta_buf, int buf_size, Meta *meta) {
   meta->request = raw->request;
   meta->push = raw->push;
   meta->simple_app = raw->simple_app;
-  meta->body = std::string(raw_body, raw->body_size);
+  // an empty body stays in the small string buffer
+  meta->body.assign(raw_body, raw->body_size);
   meta->customer_id = raw->customer_id;
   meta->data_type.resize(raw->data_type_size);
   for (int i = 0; i < raw->data_type_size; ++i) {
@@ -595,18 +932,21 @@ void Van::UnpackMeta(const char *meta_buf, int buf_size, Meta *meta) {
 
   auto ctrl = &(raw->control);
   meta->control.cmd = static_cast<Control::Command>(ctrl->cmd);
-  meta->control.barrier_group = ctrl->barrier_group;
-  meta->control.msg_sig = ctrl->msg_sig;
-  for (int i = 0; i < ctrl->node_size; ++i) {
-    const auto &p = raw_node[i];
-    Node n;
-    n.role = static_cast<Node::Role>(p.role);
-    n.port = p.port;
-    n.hostname = p.hostname;
-    n.id = p.id;
-    n.is_recovery = p.is_recovery;
-    n.customer_id = p.customer_id;
-    meta->control.node.push_back(n);
+  // the data messages carry no control, skip decoding it
+  if (ctrl->cmd != Control::EMPTY) {
+    meta->control.barrier_group = ctrl->barrier_group;
+    meta->control.msg_sig = ctrl->msg_sig;
+    for (int i = 0; i < ctrl->node_size; ++i) {
+      const auto &p = raw_node[i];
+      Node n;
+      n.role = static_cast<Node::Role>(p.role);
+      n.port = p.port;
+      n.hostname = p.hostname;
+      n.id = p.id;
+      n.is_recovery = p.is_recovery;
+      n.customer_id = p.customer_id;
+      meta->control.node.push_back(n);
+    }
   }
 
   meta->data_size = raw->data_size;
@@ -614,6 +954,8 @@ void Van::UnpackMeta(const char *meta_buf, int buf_size, Meta *meta) {
   meta->addr = raw->addr;
   meta->val_len = raw->val_len;
   meta->option = raw->option;
+  meta->loss_ratio = raw->loss_ratio;
+  meta->priority = raw->priority;
 }
 
 void Van::Heartbeat() {
@@ -12,8 +12,9 @@
 #include <cmath>
 #include <atomic>
 #include <tuple>
-#include "ps/internal/threadsafe_queue.h"
+#include "ps/internal/mpmc_queue.h"
 #include "ps/internal/van.h"
+#include "./thread_placement.h"
 #if _MSC_VER
 #define rand_r(x) rand()
 #endif
@@ -285,6 +286,7 @@ class ZMQVan : public Van {
   void CallZmqRecvThread(void* socket) {
     CHECK(socket);
     LOG(INFO) << "Start ZMQ recv thread";
+    ThreadPlacement::Get()->PinCurrentThread("zmq_recv");
 
     while (true) {
       ZmqBufferContext *buf_ctx = new ZmqBufferContext();
@@ -343,7 +345,7 @@ class ZMQVan : public Van {
     int n = msg.data.size();
     if (n == 0) tag = 0;
     zmq_msg_t meta_msg;
-    zmq_msg_init_data(&meta_msg, meta_buf, meta_size, FreeData, NULL);
+    zmq_msg_init_data(&meta_msg, meta_buf, meta_size, FreeMetaBuf, NULL);
     while (true) {
       if (zmq_msg_send(&meta_msg, socket, tag) == meta_size) break;
       if (errno == EINTR) continue;
@@ -410,7 +412,7 @@ class ZMQVan : public Van {
   bool is_worker_;
 
   // Recv buffer queue
-  ThreadsafeQueue<ZmqBufferContext> recv_buffers_;
+  MPMCQueue<ZmqBufferContext> recv_buffers_;
 
   std::atomic<bool> should_stop_{false};
 
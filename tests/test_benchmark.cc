@@ -3,6 +3,7 @@
 #include <cstdlib>
 #include <unistd.h>
 #include "ps/ps.h"
+#include "ps/internal/reduce.h"
 
 #define DIVUP(x, y) (((x)+(y)-1)/(y))
 #define ROUNDUP(x, y) (DIVUP((x), (y))*(y))
@@ -31,13 +32,6 @@ void aligned_memory_alloc(void** ptr, size_t size) {
   *ptr = p;
 }
 
-void float_sum(float *dst, float *src, size_t len) {
-  if (len == 0) return;
-  for (size_t i = 0; i < len / (size_t) sizeof(float); ++i) {
-    dst[i] = dst[i] + src[i];
-  }
-}
-
 template <typename Val>
 void EmptyHandler(const KVMeta &req_meta, const KVPairs<Val> &req_data, KVServer<Val> *server) {
   uint64_t key = req_data.keys[0];
@@ -68,7 +62,8 @@ void EmptyHandler(const KVMeta &req_meta, const KVPairs<Val> &req_data, KVServer
     auto recved = reinterpret_cast<char*>(req_data.vals.data());
     // only sum the first 4 bytes
     size_t sum_len = debug_mode_ ? req_data.vals.size() : 0;
-    float_sum((float*) mem_map[key].vals.data(), (float*) recved, sum_len);
+    ReduceSum(REDUCE_FLOAT32, mem_map[key].vals.data(), recved,
+              sum_len / sizeof(float));
 
     if (debug_mode_) {
       LOG(INFO) << "recved tensor! key=" << key << "\t"
@@ -0,0 +1,82 @@
+/**
+ * \brief many threads of a worker push and wait at the same time, each for
+ * its own requests, then one thread keeps more requests in flight than the
+ * tracker of the customer has slots and drains them with WaitAny and Test.
+ * it prints the requests finished per second
+ *
+ * run with: tests/local.sh 1 1 tests/test_concurrent_wait [threads] [iters]
+ */
+#include <chrono>
+#include <cstdlib>
+#include <thread>
+#include "ps/ps.h"
+
+using namespace ps;
+
+void StartServer() {
+  if (!IsServer()) return;
+  auto server = new KVServer<float>(0);
+  server->set_request_handle(KVServerDefaultHandle<float>());
+  RegisterExitCallback([server]() { delete server; });
+}
+
+void RunWorker(int num_threads, int iters) {
+  if (!IsWorker()) return;
+  KVWorker<float> kv(0, 0);
+  // KVServerDefaultHandle keeps one value per key
+  int len = 1;
+
+  auto start = std::chrono::high_resolution_clock::now();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&kv, t, len, iters]() {
+      std::vector<Key> keys = {static_cast<Key>(t)};
+      std::vector<float> vals(len, 1);
+      for (int i = 0; i < iters; ++i) kv.Wait(kv.Push(keys, vals));
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  auto end = std::chrono::high_resolution_clock::now();
+  double sec = std::chrono::duration<double>(end - start).count();
+  LOG(INFO) << num_threads << " threads waiting: "
+            << num_threads * iters / sec << " requests/s";
+
+  // more in flight than the initial slots of the tracker
+  int num_pending = 4096;
+  std::vector<Key> keys = {0};
+  std::vector<float> vals(len, 1);
+  std::vector<int> pending;
+  for (int i = 0; i < num_pending; ++i) pending.push_back(kv.Push(keys, vals));
+  int num_finished = 0;
+  while (!pending.empty()) {
+    int ts = kv.WaitAny(pending);
+    CHECK(kv.Test(ts));
+    for (size_t i = 0; i < pending.size();) {
+      if (kv.Test(pending[i])) {
+        pending[i] = pending.back();
+        pending.pop_back();
+        ++num_finished;
+      } else {
+        ++i;
+      }
+    }
+  }
+  CHECK_EQ(num_finished, num_pending);
+
+  std::vector<float> out;
+  kv.Wait(kv.Pull(keys, &out));
+  CHECK_EQ(out.size(), static_cast<size_t>(len));
+  // the pushes of thread 0 and the ones in flight, and those of other workers
+  CHECK_GE(out[0], static_cast<float>(iters + num_pending));
+  LOG(INFO) << num_pending << " requests in flight drained by WaitAny";
+}
+
+int main(int argc, char *argv[]) {
+  int num_threads = argc > 1 ? atoi(argv[1]) : 64;
+  int iters = argc > 2 ? atoi(argv[2]) : 1000;
+  Start(0);
+  StartServer();
+  RunWorker(num_threads, iters);
+  Finalize(0, true);
+  return 0;
+}
@@ -0,0 +1,89 @@
+/**
+ * \brief a worker pulls keys spread over all servers, into a buffer it sized,
+ * which each server's response is copied into as it arrives, and into an
+ * empty one, filled once all responses are there. it checks both, and a
+ * sized buffer of keys with different lens, and prints the time of a pull
+ * of the first two
+ *
+ * run with: tests/local.sh 2 1 tests/test_kv_pull [keys per server] [vals per key] [iters]
+ */
+#include <chrono>
+#include <cstdlib>
+#include "ps/ps.h"
+
+using namespace ps;
+
+void StartServer() {
+  if (!IsServer()) return;
+  auto server = new KVServer<float>(0);
+  server->set_request_handle(KVServerDefaultHandle<float>());
+  RegisterExitCallback([server]() { delete server; });
+}
+
+/** \brief the microseconds of a pull, into out as given */
+double TimePull(KVWorker<float>* kv, const std::vector<Key>& keys,
+                std::vector<float>* out, bool sized, int iters) {
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < iters; ++i) {
+    if (!sized) out->clear();
+    kv->Wait(kv->Pull(keys, out));
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration<double, std::micro>(end - start).count() / iters;
+}
+
+void RunWorker(int keys_per_server, int k, int iters) {
+  if (!IsWorker()) return;
+  KVWorker<float> kv(0, 0);
+  std::vector<Key> keys, mixed;
+  for (const auto& range : Postoffice::Get()->GetServerKeyRanges()) {
+    for (int i = 0; i < keys_per_server; ++i) keys.push_back(range.begin() + i);
+    mixed.push_back(range.begin() + keys_per_server);
+  }
+  std::vector<float> vals(keys.size() * k);
+  for (size_t i = 0; i < vals.size(); ++i) vals[i] = i / k;
+  std::vector<int> lens(keys.size(), k);
+  kv.Wait(kv.Push(keys, vals, lens));
+  // a key per server, of lens 1, 3, 1, ...
+  std::vector<float> mixed_vals;
+  std::vector<int> mixed_lens(mixed.size());
+  for (size_t i = 0; i < mixed.size(); ++i) {
+    mixed_lens[i] = i % 2 ? 3 : 1;
+    mixed_vals.insert(mixed_vals.end(), mixed_lens[i], i);
+  }
+  kv.Wait(kv.Push(mixed, mixed_vals, mixed_lens));
+  Postoffice::Get()->Barrier(0, kWorkerGroup);
+
+  std::vector<float> sized(vals.size(), -1), empty;
+  kv.Wait(kv.Pull(keys, &sized));
+  kv.Wait(kv.Pull(keys, &empty));
+  CHECK_EQ(empty.size(), vals.size());
+  for (size_t i = 0; i < vals.size(); ++i) {
+    // every worker pushed the same
+    CHECK_EQ(sized[i], vals[i] * NumWorkers());
+    CHECK_EQ(empty[i], sized[i]);
+  }
+  // sized, but not to the same number of values per key
+  std::vector<float> mixed_pull(mixed_vals.size());
+  kv.Wait(kv.Pull(mixed, &mixed_pull));
+  for (size_t i = 0; i < mixed_vals.size(); ++i) {
+    CHECK_EQ(mixed_pull[i], mixed_vals[i] * NumWorkers());
+  }
+
+  LOG(INFO) << keys.size() << " keys of " << k << " values over "
+            << NumServers() << " servers, pull into a sized buffer: "
+            << TimePull(&kv, keys, &sized, true, iters)
+            << " us, into an empty one: "
+            << TimePull(&kv, keys, &empty, false, iters) << " us";
+}
+
+int main(int argc, char *argv[]) {
+  int keys_per_server = argc > 1 ? atoi(argv[1]) : 1000;
+  int k = argc > 2 ? atoi(argv[2]) : 256;
+  int iters = argc > 3 ? atoi(argv[3]) : 100;
+  Start(0);
+  StartServer();
+  RunWorker(keys_per_server, k, iters);
+  Finalize(0, true);
+  return 0;
+}
@@ -0,0 +1,82 @@
+/**
+ * \brief many threads of a worker push to KVServerDefaultHandle run on
+ * PS_KV_SERVER_THREADS handler threads, 4 unless set. each request has keys
+ * of its own thread, which the threads handle concurrently on the shared
+ * store, and every 10th also a key 0 all of them share, so it runs once all
+ * its shards reached it. a pull of its keys after each push sees it, and the
+ * sums at the end count every push
+ *
+ * run with: tests/local.sh 1 2 tests/test_kv_server_threads [threads] [iters]
+ */
+#include <cstdlib>
+#include <thread>
+#include "ps/ps.h"
+
+using namespace ps;
+
+void StartServer() {
+  if (!IsServer()) return;
+  auto server = new KVServer<float>(0);
+  server->set_request_handle(KVServerDefaultHandle<float>());
+  RegisterExitCallback([server]() { delete server; });
+}
+
+/** \brief the keys of a thread, after the shared one if shared */
+std::vector<Key> ThreadKeys(int t, bool shared) {
+  std::vector<Key> keys;
+  if (shared) keys.push_back(0);
+  for (int i = 1; i <= 3; ++i) keys.push_back(static_cast<Key>(3 * t + i));
+  return keys;
+}
+
+/** \brief the pushes of a thread with the shared key */
+int SharedPushes(int iters) { return (iters + 9) / 10; }
+
+void RunWorker(int num_threads, int iters) {
+  if (!IsWorker()) return;
+  KVWorker<float> kv(0, 0);
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; ++t) {
+    threads.emplace_back([&kv, t, iters]() {
+      std::vector<float> out;
+      for (int i = 0; i < iters; ++i) {
+        std::vector<Key> keys = ThreadKeys(t, i % 10 == 0);
+        std::vector<float> vals(keys.size(), 1);
+        kv.Wait(kv.Push(keys, vals));
+        out.clear();
+        kv.Wait(kv.Pull(keys, &out));
+        // the other workers push the same keys
+        for (size_t k = keys.size() - 3; k < keys.size(); ++k) {
+          CHECK_GE(out[k], i + 1) << "key " << keys[k];
+        }
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  Postoffice::Get()->Barrier(0, kWorkerGroup);
+
+  for (int t = 0; t < num_threads; ++t) {
+    std::vector<Key> keys = ThreadKeys(t, true);
+    std::vector<float> out;
+    kv.Wait(kv.Pull(keys, &out));
+    CHECK_EQ(out[0], static_cast<float>(num_threads) * SharedPushes(iters) *
+                         NumWorkers());
+    for (size_t k = 1; k < keys.size(); ++k) {
+      CHECK_EQ(out[k], static_cast<float>(iters) * NumWorkers());
+    }
+  }
+  LOG(INFO) << num_threads << " threads pushed " << iters
+            << " times over the handler threads";
+}
+
+int main(int argc, char *argv[]) {
+  int num_threads = argc > 1 ? atoi(argv[1]) : 16;
+  int iters = argc > 2 ? atoi(argv[2]) : 1000;
+  setenv("PS_KV_SERVER_THREADS", "4", 0);
+  Start(0);
+  StartServer();
+  RunWorker(num_threads, iters);
+  Finalize(0, true);
+  return 0;
+}
@@ -0,0 +1,155 @@
+/**
+ * \brief microbenchmark of the store of KVServerDefaultHandle against the
+ * std::unordered_map it replaced, the ns per key to push and to pull n keys in
+ * batches once they are there, contiguous as a worker slices a range, also
+ * in descending batches, and sampled from random keys. it runs on its own,
+ * without a scheduler
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <random>
+#include <unordered_map>
+#include "ps/ps.h"
+#include "ps/internal/kv_store.h"
+
+using namespace ps;
+
+/** \brief the store before, one value per key in a std::unordered_map */
+class MapStore {
+ public:
+  void Push(const SArray<Key>& keys, const SArray<float>& vals,
+            const SArray<int>& lens) {
+    for (size_t i = 0; i < keys.size(); ++i) store_[keys[i]] += vals[i];
+  }
+
+  void Pull(const SArray<Key>& keys, SArray<float>* vals, SArray<int>* lens) {
+    vals->resize(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) (*vals)[i] = store_[keys[i]];
+  }
+
+ private:
+  std::unordered_map<Key, float> store_;
+};
+
+/** \brief push fill, then log the ns per key to push and to pull batches */
+template <typename Store>
+void Run(const char* name, const std::vector<SArray<Key>>& fill,
+         const std::vector<SArray<Key>>& batches) {
+  Store store;
+  SArray<float> vals(batches[0].size(), 1);
+  SArray<int> lens;
+  for (const auto& keys : fill) store.Push(keys, vals, lens);
+
+  size_t n = 0;
+  for (const auto& keys : batches) n += keys.size();
+  SArray<float> pulled;
+  SArray<int> pulled_lens;
+  auto start = std::chrono::high_resolution_clock::now();
+  for (const auto& keys : batches) store.Push(keys, vals, lens);
+  auto mid = std::chrono::high_resolution_clock::now();
+  for (const auto& keys : batches) {
+    store.Pull(keys, &pulled, &pulled_lens);
+    CHECK_GE(pulled[0], 2);
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  LOG(INFO) << name << ": push "
+            << std::chrono::duration<double, std::nano>(mid - start).count() / n
+            << " ns/key, pull "
+            << std::chrono::duration<double, std::nano>(end - mid).count() / n
+            << " ns/key";
+}
+
+/** \brief values of several lengths, in the dense array and in the hash */
+void CheckLens() {
+  KVStore<float> store;
+  std::vector<Key> keys = {1, 2, 3};
+  std::vector<float> vals = {1, 1, 2, 2, 3, 3};
+  std::vector<int> lens = {2, 2, 2};
+  store.Push(SArray<Key>(keys), SArray<float>(vals), SArray<int>(lens));
+  keys = {2, 10, 20};
+  vals = {1, 1, 4, 4, 4, 5};
+  lens = {2, 3, 1};
+  store.Push(SArray<Key>(keys), SArray<float>(vals), SArray<int>(lens));
+
+  keys = {1, 2, 5, 10, 20};
+  SArray<float> pulled;
+  SArray<int> pulled_lens;
+  store.Pull(SArray<Key>(keys), &pulled, &pulled_lens);
+  std::vector<float> expected = {1, 1, 3, 3, 0, 4, 4, 4, 5};
+  CHECK_EQ(pulled_lens.size(), keys.size());
+  CHECK_EQ(pulled_lens[0], 2);
+  CHECK_EQ(pulled_lens[2], 1);
+  CHECK_EQ(pulled_lens[3], 3);
+  CHECK_EQ(pulled.size(), expected.size());
+  for (size_t i = 0; i < expected.size(); ++i) CHECK_EQ(pulled[i], expected[i]);
+}
+
+/** \brief adjacent ranges pushed down and up, and keys in the headroom */
+void CheckGrowth() {
+  KVStore<float> store;
+  SArray<int> lens;
+  for (Key b = 100; b > 0; --b) {
+    std::vector<Key> keys = {10 * b, 10 * b + 1, 10 * b + 2, 10 * b + 3,
+                             10 * b + 4, 10 * b + 5, 10 * b + 6, 10 * b + 7,
+                             10 * b + 8, 10 * b + 9};
+    store.Push(SArray<Key>(keys), SArray<float>(keys.size(), b), lens);
+  }
+  for (Key key = 1010; key < 2000; ++key) {
+    std::vector<Key> keys = {key};
+    store.Push(SArray<Key>(keys), SArray<float>(1, 1), lens);
+  }
+  // below the dense keys, so in the hash
+  std::vector<Key> keys = {3};
+  store.Push(SArray<Key>(keys), SArray<float>(1, 7), lens);
+  keys = {2, 3, 4, 5, 6, 7, 8, 9};
+  store.Push(SArray<Key>(keys), SArray<float>(keys.size(), 1), lens);
+
+  keys = {2, 3, 9, 10, 555, 1009, 1010, 1999, 2000};
+  std::vector<float> expected = {1, 8, 1, 1, 55, 100, 1, 1, 0};
+  SArray<float> pulled;
+  SArray<int> pulled_lens;
+  store.Pull(SArray<Key>(keys), &pulled, &pulled_lens);
+  CHECK_EQ(pulled.size(), expected.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    CHECK_EQ(pulled[i], expected[i]) << "key " << keys[i];
+  }
+}
+
+int main(int argc, char *argv[]) {
+  CheckLens();
+  CheckGrowth();
+
+  size_t n = argc > 1 ? atoll(argv[1]) : 1000000;
+  size_t batch = argc > 2 ? atoi(argv[2]) : 1000;
+  n = n / batch * batch;
+  LOG(INFO) << n << " keys in batches of " << batch;
+
+  // the batches of a range sliced among workers
+  std::vector<SArray<Key>> batches(n / batch);
+  for (size_t b = 0; b < batches.size(); ++b) {
+    batches[b].resize(batch);
+    for (size_t i = 0; i < batch; ++i) batches[b][i] = b * batch + i;
+  }
+  Run<MapStore>("unordered_map, contiguous keys", batches, batches);
+  Run<KVStore<float>>("KVStore, contiguous keys", batches, batches);
+  std::vector<SArray<Key>> descending(batches.rbegin(), batches.rend());
+  Run<MapStore>("unordered_map, descending batches", descending, descending);
+  Run<KVStore<float>>("KVStore, descending batches", descending, descending);
+
+  // random keys, and batches sampled from them as minibatches of a worker
+  std::mt19937_64 rng(0);
+  std::vector<SArray<Key>> fill(batches.size());
+  for (auto& keys : fill) {
+    keys.resize(batch);
+    for (auto& key : keys) key = rng();
+    std::sort(keys.begin(), keys.end());
+  }
+  for (auto& keys : batches) {
+    for (auto& key : keys) key = fill[rng() % fill.size()][rng() % batch];
+    std::sort(keys.begin(), keys.end());
+  }
+  Run<MapStore>("unordered_map, random keys", fill, batches);
+  Run<KVStore<float>>("KVStore, random keys", fill, batches);
+  return 0;
+}
@@ -0,0 +1,117 @@
+/**
+ * \brief microbenchmark of the meta codec of Van, the ns to pack and unpack
+ * and the bytes of the meta of a push request and of an ADD_NODE control
+ * message, in the RawMeta and the compact format. it checks first that a
+ * default Meta packs round trip. it runs on its own, without a scheduler
+ */
+#include <chrono>
+#include <cstdlib>
+#include "ps/ps.h"
+#include "ps/internal/van.h"
+#include "../src/meta.h"
+
+using namespace ps;
+
+/** \brief exposes PackMeta and UnpackMeta, it never starts */
+class MetaCodec : public Van {
+ public:
+  using Van::PackMeta;
+  using Van::UnpackMeta;
+  using Van::GetPackMetaLen;
+
+  void Release(char *meta_buf) { FreeMetaBuf(meta_buf, nullptr); }
+
+  void set_meta_version(int version) { meta_version_ = version; }
+
+ protected:
+  void Connect(const Node &node) override {}
+  int Bind(const Node &node, int max_retry) override { return 0; }
+  int RecvMsg(Message *msg) override { return 0; }
+  int SendMsg(Message &msg) override { return 0; }
+};
+
+/** \brief pack meta into a buffer of the pool and unpack it into a new
+ * message, as a sender and a receiver do, return the ns per message */
+double PackUnpack(MetaCodec *codec, const Meta &meta, int iters) {
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < iters; ++i) {
+    char *meta_buf = nullptr;
+    int meta_size;
+    codec->PackMeta(meta, &meta_buf, &meta_size);
+    Message msg;
+    codec->UnpackMeta(meta_buf, meta_size, &msg.meta);
+    CHECK_EQ(msg.meta.key, meta.key);
+    CHECK_EQ(msg.meta.timestamp, meta.timestamp);
+    CHECK_EQ(msg.meta.val_len, meta.val_len);
+    CHECK_EQ(msg.meta.data_type.size(), meta.data_type.size());
+    CHECK_EQ(msg.meta.control.node.size(), meta.control.node.size());
+    for (size_t j = 0; j < meta.control.node.size(); ++j) {
+      CHECK_EQ(msg.meta.control.node[j].hostname, meta.control.node[j].hostname);
+    }
+    codec->Release(meta_buf);
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / iters;
+}
+
+int main(int argc, char *argv[]) {
+  int iters = argc > 1 ? atoi(argv[1]) : 1000000;
+  MetaCodec codec;
+
+  Meta push;
+  push.app_id = 0;
+  push.customer_id = 0;
+  push.timestamp = 12345;
+  push.request = true;
+  push.push = true;
+  push.key = 42;
+  push.val_len = 4096;
+  push.data_size = 4096 + 16;
+  push.data_type.push_back(UINT64);
+  push.data_type.push_back(CHAR);
+  push.data_type.push_back(INT32);
+
+  Meta add_node;
+  add_node.control.cmd = Control::ADD_NODE;
+  for (int i = 0; i < 2; ++i) {
+    Node node;
+    node.role = i ? Node::WORKER : Node::SERVER;
+    node.id = 8 + i;
+    node.hostname = "10.0.0.1";
+    node.port = 9000 + i;
+    node.customer_id = 0;
+    add_node.control.node.push_back(node);
+  }
+
+  // the fields KVWorker never sets are 0, and add nothing to the compact meta
+  Meta empty;
+  CHECK_EQ(empty.key, 0U);
+  CHECK_EQ(empty.val_len, 0);
+  CHECK_EQ(empty.option, 0);
+  Meta unkeyed = push;
+  unkeyed.key = 0;
+  unkeyed.val_len = 0;
+  for (int version : {0, kCompactMetaVersion}) {
+    codec.set_meta_version(version);
+    PackUnpack(&codec, empty, 1);
+    PackUnpack(&codec, unkeyed, 1);
+    LOG(INFO) << "meta format " << version << ", default meta: "
+              << codec.GetPackMetaLen(empty) << " bytes, push request of "
+              << "KVWorker: " << codec.GetPackMetaLen(unkeyed) << " bytes";
+  }
+  codec.set_meta_version(kCompactMetaVersion);
+  CHECK_LT(codec.GetPackMetaLen(unkeyed), codec.GetPackMetaLen(push));
+
+  for (int version : {0, kCompactMetaVersion}) {
+    codec.set_meta_version(version);
+    // warm up the pool and the allocator
+    PackUnpack(&codec, push, iters / 10 + 1);
+    LOG(INFO) << "meta format " << version << ", push request: "
+              << codec.GetPackMetaLen(push) << " bytes, "
+              << PackUnpack(&codec, push, iters) << " ns/msg";
+    LOG(INFO) << "meta format " << version << ", ADD_NODE: "
+              << codec.GetPackMetaLen(add_node) << " bytes, "
+              << PackUnpack(&codec, add_node, iters) << " ns/msg";
+  }
+  return 0;
+}
@@ -0,0 +1,99 @@
+/**
+ * \brief checks MPMCQueue with several producers and consumers, then
+ * measures the round trip of a message bounced between two threads through
+ * a pair of queues, for ThreadsafeQueue and MPMCQueue. it runs on its own,
+ * without a scheduler
+ */
+#include <chrono>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include "ps/ps.h"
+#include "ps/internal/mpmc_queue.h"
+#include "ps/internal/threadsafe_queue.h"
+
+using namespace ps;
+
+/** \brief every value arrives once, and in order from each producer */
+void CheckMPMC(int num_producers, int num_consumers, int num_values) {
+  // small enough to be full at times
+  MPMCQueue<int64_t> queue(64);
+  std::vector<std::thread> threads;
+  for (int p = 0; p < num_producers; ++p) {
+    threads.emplace_back([&queue, p, num_values]() {
+      for (int i = 0; i < num_values; ++i) queue.Push((int64_t)p << 32 | i);
+    });
+  }
+  std::vector<std::vector<int>> seen(num_consumers,
+                                     std::vector<int>(num_producers, -1));
+  std::vector<int64_t> counts(num_consumers, 0);
+  for (int c = 0; c < num_consumers; ++c) {
+    threads.emplace_back([&, c]() {
+      int64_t values[8];
+      for (;;) {
+        size_t n = queue.WaitAndPopN(values, 8);
+        int stops = 0;
+        for (size_t i = 0; i < n; ++i) {
+          if (values[i] < 0) {
+            ++stops;
+            continue;
+          }
+          int p = values[i] >> 32;
+          int v = values[i] & 0xffffffff;
+          CHECK_GT(v, seen[c][p]) << "out of order from producer " << p;
+          seen[c][p] = v;
+          ++counts[c];
+        }
+        if (!stops) continue;
+        // the stops of the other consumers go back
+        for (int i = 1; i < stops; ++i) queue.Push(-1);
+        return;
+      }
+    });
+  }
+  for (int p = 0; p < num_producers; ++p) threads[p].join();
+  for (int c = 0; c < num_consumers; ++c) queue.Push(-1);
+  int64_t total = 0;
+  for (int c = 0; c < num_consumers; ++c) {
+    threads[num_producers + c].join();
+    total += counts[c];
+  }
+  CHECK_EQ(total, (int64_t)num_producers * num_values);
+}
+
+/** \brief the ns of a round trip through two queues */
+template <typename Queue>
+double PingPong(int iters) {
+  Queue ping, pong;
+  std::thread echo([&]() {
+    for (int i = 0; i < iters; ++i) {
+      Message msg;
+      ping.WaitAndPop(&msg);
+      pong.Push(std::move(msg));
+    }
+  });
+  Message msg;
+  msg.meta.timestamp = 0;
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < iters; ++i) {
+    ping.Push(std::move(msg));
+    pong.WaitAndPop(&msg);
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  echo.join();
+  return std::chrono::duration<double, std::nano>(end - start).count() / iters;
+}
+
+int main(int argc, char *argv[]) {
+  int iters = argc > 1 ? atoi(argv[1]) : 100000;
+  CheckMPMC(4, 4, iters);
+  CheckMPMC(1, 1, iters);
+  LOG(INFO) << "MPMCQueue passed";
+
+  PingPong<MPMCQueue<Message>>(iters / 10 + 1);
+  LOG(INFO) << "ThreadsafeQueue round trip: "
+            << PingPong<ThreadsafeQueue<Message>>(iters) << " ns";
+  LOG(INFO) << "MPMCQueue round trip: "
+            << PingPong<MPMCQueue<Message>>(iters) << " ns";
+  return 0;
+}
@@ -0,0 +1,124 @@
+/**
+ * \brief checks ParallelSort against std::sort, then times it against the
+ * sort that started a thread at each split and merged serially, for
+ * comparison sorts, keys, and key-value pairs. it runs on its own, without a
+ * scheduler
+ *
+ * run with: tests/test_parallel_sort [threads] [elements ...]
+ * 100M elements take about 3GB
+ */
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <random>
+#include <thread>
+#include "ps/ps.h"
+#include "ps/internal/parallel_sort.h"
+
+using namespace ps;
+
+/** \brief the former ParallelSort */
+template<typename T, class Fn>
+void ThreadSort(T* data, size_t len, size_t grainsize, const Fn& cmp) {
+  if (len <= grainsize) {
+    std::sort(data, data + len, cmp);
+  } else {
+    std::thread thr(ThreadSort<T, Fn>, data, len/2, grainsize, cmp);
+    ThreadSort(data + len/2, len - len/2, grainsize, cmp);
+    thr.join();
+    std::inplace_merge(data, data + len/2, data + len, cmp);
+  }
+}
+
+SArray<Key> RandomKeys(size_t len, Key max) {
+  std::mt19937_64 rng(len);
+  SArray<Key> keys(len);
+  for (auto& k : keys) k = rng() % max;
+  return keys;
+}
+
+void CheckSort(size_t len, int num_threads) {
+  for (Key max : {Key(1000), Key(1) << 40, kMaxKey}) {
+    SArray<Key> keys = RandomKeys(len, max), expected;
+    expected.CopyFrom(keys);
+    std::sort(expected.begin(), expected.end());
+
+    SArray<Key> sorted;
+    sorted.CopyFrom(keys);
+    ParallelSort(&sorted, num_threads);
+    CHECK(std::equal(sorted.begin(), sorted.end(), expected.begin()));
+
+    // decreasing, by a comparison
+    sorted.CopyFrom(keys);
+    ParallelSort(&sorted, num_threads, std::greater<Key>());
+    CHECK(std::equal(sorted.begin(), sorted.end(),
+                     std::reverse_iterator<Key*>(expected.end())));
+
+    // the values follow their keys, in order among equal keys
+    SArray<int> vals(len);
+    for (size_t i = 0; i < len; ++i) vals[i] = i;
+    sorted.CopyFrom(keys);
+    ParallelSort(&sorted, &vals, num_threads);
+    CHECK(std::equal(sorted.begin(), sorted.end(), expected.begin()));
+    for (size_t i = 0; i < len; ++i) {
+      CHECK_EQ(keys[vals[i]], sorted[i]);
+      if (i && sorted[i-1] == sorted[i]) {
+        CHECK_LT(vals[i-1], vals[i]);
+      }
+    }
+  }
+}
+
+/** \brief the milliseconds of fn */
+double Time(const std::function<void()>& fn) {
+  auto start = std::chrono::high_resolution_clock::now();
+  fn();
+  auto end = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+void Benchmark(size_t len, int num_threads) {
+  SArray<Key> keys = RandomKeys(len, kMaxKey), sorted;
+  size_t grainsize = std::max(len / num_threads + 5, (size_t)1024*16);
+  auto cmp = [](Key a, Key b) { return a < b; };
+  sorted.CopyFrom(keys);
+  double threads = Time([&]() {
+      ThreadSort(sorted.data(), len, grainsize, cmp);
+    });
+  sorted.CopyFrom(keys);
+  double merge = Time([&]() { ParallelSort(&sorted, num_threads, cmp); });
+  sorted.CopyFrom(keys);
+  double radix = Time([&]() { ParallelSort(&sorted, num_threads); });
+  LOG(INFO) << len << " keys, thread per split: " << threads
+            << " ms, merge: " << merge << " ms, radix: " << radix << " ms";
+
+  SArray<float> vals(len);
+  std::vector<std::pair<Key, float>> pairs(len);
+  for (size_t i = 0; i < len; ++i) pairs[i] = {keys[i], 0};
+  auto pair_cmp = [](const std::pair<Key, float>& a,
+                     const std::pair<Key, float>& b) {
+    return a.first < b.first;
+  };
+  threads = Time([&]() {
+      ThreadSort(pairs.data(), len, grainsize, pair_cmp);
+    });
+  sorted.CopyFrom(keys);
+  double sort = Time([&]() { ParallelSort(&sorted, &vals, num_threads); });
+  LOG(INFO) << len << " key-value pairs, thread per split: " << threads
+            << " ms, radix: " << sort << " ms";
+}
+
+int main(int argc, char *argv[]) {
+  int num_threads = argc > 1 ? atoi(argv[1]) : std::thread::hardware_concurrency();
+  for (size_t len : {size_t(0), size_t(1), size_t(1000), size_t(100000),
+                     size_t(1000003), size_t(10000019)}) {
+    CheckSort(len, num_threads);
+  }
+  LOG(INFO) << "sorts passed";
+
+  std::vector<size_t> lens;
+  for (int i = 2; i < argc; ++i) lens.push_back(atoll(argv[i]));
+  if (lens.empty()) lens = {1000000, 10000000};
+  for (size_t len : lens) Benchmark(len, num_threads);
+  return 0;
+}
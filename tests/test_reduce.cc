@@ -0,0 +1,125 @@
+/**
+ * \brief checks the reductions of reduce.h, then measures how many GB/s of
+ * input they sum, against the scalar loop of the server of test_benchmark,
+ * on buffers in cache and on buffers beyond it, where a core is bound by the
+ * memory. a server keeps up with a 100Gb nic at 12.5 GB/s. it runs on its
+ * own, without a scheduler, and its timings mean nothing in an ASAN build
+ *
+ * run with: tests/test_reduce [bytes] [iters]
+ */
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <vector>
+#include "ps/ps.h"
+#include "ps/internal/reduce.h"
+
+using namespace ps;
+
+void CheckReduce(size_t len) {
+  std::vector<float> a(len), b(len), c(len), dst(len);
+  for (size_t i = 0; i < len; ++i) {
+    a[i] = i % 100;
+    b[i] = 1;
+    c[i] = i % 7;
+  }
+  const void* srcs[3] = {a.data(), b.data(), c.data()};
+  Reduce(REDUCE_SUM, REDUCE_FLOAT32, dst.data(), srcs, 3, len);
+  for (size_t i = 0; i < len; ++i) CHECK_EQ(dst[i], a[i] + b[i] + c[i]);
+  Reduce(REDUCE_MAX, REDUCE_FLOAT32, dst.data(), srcs, 3, len);
+  for (size_t i = 0; i < len; ++i) {
+    CHECK_EQ(dst[i], std::max(a[i], std::max(b[i], c[i])));
+  }
+  // in place, dst is not the first input
+  std::vector<float> sum = a;
+  const void* in_place[2] = {b.data(), sum.data()};
+  Reduce(REDUCE_AVERAGE, REDUCE_FLOAT32, sum.data(), in_place, 2, len);
+  for (size_t i = 0; i < len; ++i) CHECK_EQ(sum[i], (a[i] + 1) / 2);
+
+  std::vector<int64_t> ints(len, 5), ones(len, 1);
+  ReduceSum(REDUCE_INT64, ints.data(), ones.data(), len);
+  for (size_t i = 0; i < len; ++i) CHECK_EQ(ints[i], 6);
+
+  // small integers are exact in both 16-bit floats. 0x4000 is 2 and 0x3c00
+  // is 1 in float16, 0x4000 and 0x3f80 in bfloat16
+  std::vector<uint16_t> half(len, 0x4000), half_one(len, 0x3c00);
+  ReduceSum(REDUCE_FLOAT16, half.data(), half_one.data(), len);
+  for (size_t i = 0; i < len; ++i) CHECK_EQ(half[i], 0x4200);
+  std::vector<uint16_t> bf(len, 0x4000), bf_one(len, 0x3f80);
+  ReduceSum(REDUCE_BFLOAT16, bf.data(), bf_one.data(), len);
+  for (size_t i = 0; i < len; ++i) CHECK_EQ(bf[i], 0x4040);
+}
+
+void float_sum(float *dst, float *src, size_t len) {
+  for (size_t i = 0; i < len; ++i) dst[i] = dst[i] + src[i];
+}
+
+/** \brief the GB/s of input summed by fn, which sums bytes of input */
+double Measure(size_t bytes, int iters, const std::function<void()>& fn) {
+  fn();
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < iters; ++i) fn();
+  auto end = std::chrono::high_resolution_clock::now();
+  return bytes * iters / std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+void Benchmark(size_t len, int iters) {
+  const int kInputs = 8;
+  std::vector<std::vector<float>> inputs(kInputs, std::vector<float>(len, 1));
+  std::vector<float> dst(len, 0);
+  size_t bytes = len * sizeof(float);
+
+  LOG(INFO) << "dst += src of " << bytes << " bytes, scalar: "
+            << Measure(bytes, iters, [&]() {
+                 float_sum(dst.data(), inputs[0].data(), len);
+               })
+            << " GB/s, ReduceSum: "
+            << Measure(bytes, iters, [&]() {
+                 ReduceSum(REDUCE_FLOAT32, dst.data(), inputs[0].data(), len);
+               })
+            << " GB/s";
+
+  std::vector<const void*> srcs;
+  for (auto& in : inputs) srcs.push_back(in.data());
+  LOG(INFO) << "sum of " << kInputs << " inputs, one at a time: "
+            << Measure(bytes * kInputs, iters, [&]() {
+                 memcpy(dst.data(), inputs[0].data(), bytes);
+                 for (int k = 1; k < kInputs; ++k) {
+                   ReduceSum(REDUCE_FLOAT32, dst.data(), inputs[k].data(), len);
+                 }
+               })
+            << " GB/s, fused: "
+            << Measure(bytes * kInputs, iters, [&]() {
+                 Reduce(REDUCE_SUM, REDUCE_FLOAT32, dst.data(), srcs.data(),
+                        kInputs, len);
+               })
+            << " GB/s";
+
+  // the same bytes as float16 and bfloat16
+  uint16_t* half_dst = reinterpret_cast<uint16_t*>(dst.data());
+  const uint16_t* half_src = reinterpret_cast<uint16_t*>(inputs[0].data());
+  for (auto type : {REDUCE_FLOAT16, REDUCE_BFLOAT16}) {
+    LOG(INFO) << (type == REDUCE_FLOAT16 ? "float16" : "bfloat16")
+              << " dst += src: "
+              << Measure(bytes, iters, [&]() {
+                   ReduceSum(type, half_dst, half_src, len * 2);
+                 })
+              << " GB/s";
+  }
+}
+
+int main(int argc, char *argv[]) {
+  for (size_t len : {1, 1000, 3001, 1 << 20, 5 << 20}) CheckReduce(len);
+  LOG(INFO) << "reductions passed";
+#if defined(__SANITIZE_ADDRESS__)
+  LOG(WARNING) << "built with ASAN, every access is instrumented";
+#endif
+
+  if (argc > 1) {
+    Benchmark(atoll(argv[1]) / sizeof(float), argc > 2 ? atoi(argv[2]) : 10);
+  } else {
+    Benchmark((1 << 20) / sizeof(float), 200);
+    Benchmark((64 << 20) / sizeof(float), 10);
+  }
+  return 0;
+}